@@ -0,0 +1,183 @@
+<?php
+/**
+ * 钩子开销基准：测量一种配置下用户函数和内部函数每次调用的耗时
+ *
+ * 由 bench/run.php 通过 php-cgi 启动（CLI下扩展不安装钩子），配置通过环境变量传入：
+ *   BENCH_CASE    配置名，见 bench_setup()
+ *   BENCH_ITER    每个目标的调用次数（默认200000）
+ *   BENCH_TARGET  只运行一个目标（u0/u5/u50/i0/i5/i50），统计分配次数时使用
+ *
+ * 输出一行JSON：{"case":..., "ns":{"u0":...}, "mem":{"u0":...}}
+ *   ns   每次调用的耗时（纳秒，取多轮中的最小值）
+ *   mem  每次调用后仍未释放的内存（字节），反映请求内累积的span/统计数据
+ */
+
+function bench_u0()
+{
+}
+
+function bench_u5($a, $b, $c, $d, $e)
+{
+}
+
+function bench_u50(...$args)
+{
+}
+
+$case = getenv('BENCH_CASE') ?: 'loaded';
+$iter = (int)(getenv('BENCH_ITER') ?: 200000);
+$only = getenv('BENCH_TARGET') ?: null;
+
+$args5 = [1, 'two', 3.0, [4], null];
+$args50 = array_fill(0, 50, 'x');
+
+// 每个目标：一次循环调用 $n 次
+$targets = [
+    'u0' => function ($n) {
+        for ($i = 0; $i < $n; $i++) {
+            bench_u0();
+        }
+    },
+    'u5' => function ($n) use ($args5) {
+        for ($i = 0; $i < $n; $i++) {
+            bench_u5(...$args5);
+        }
+    },
+    'u50' => function ($n) use ($args50) {
+        for ($i = 0; $i < $n; $i++) {
+            bench_u50(...$args50);
+        }
+    },
+    'i0' => function ($n) {
+        for ($i = 0; $i < $n; $i++) {
+            getmypid();
+        }
+    },
+    'i5' => function ($n) {
+        for ($i = 0; $i < $n; $i++) {
+            max(1, 2, 3, 4, 5);
+        }
+    },
+    'i50' => function ($n) use ($args50) {
+        for ($i = 0; $i < $n; $i++) {
+            max(...$args50);
+        }
+    },
+];
+
+function bench_rules(int $count, bool $internal): array
+{
+    $rules = [];
+    for ($i = 0; $i < $count; $i++) {
+        $rules[] = $internal
+            ? ['module_pattern' => "nomodule{$i}"]
+            : ['file_pattern' => "/nonexistent/{$i}/*"];
+    }
+    return $rules;
+}
+
+// 按配置名设置白名单和回调
+function bench_setup(string $case): void
+{
+    if ($case === 'off' || $case === 'loaded') {
+        return;
+    }
+
+    if (preg_match('/^nomatch-(\d+)$/', $case, $m)) {
+        trace_set_callback_whitelist(bench_rules((int)$m[1], false));
+        trace_set_internal_whitelist(bench_rules((int)$m[1], true));
+        // 有enter回调时钩子才会进入白名单匹配，否则在快速路径直接返回
+        trace_set_callback('function_enter', function () {
+            return null;
+        });
+        return;
+    }
+
+    $user = ['function_pattern' => 'bench_u*'];
+    $internal = ['module_pattern' => 'standard', 'function_pattern' => ['getmypid', 'max']];
+
+    switch ($case) {
+        case 'match':
+            // 命中但没有回调：钩子在快速路径返回
+            trace_set_callback_whitelist([$user]);
+            trace_set_internal_whitelist([$internal]);
+            break;
+
+        case 'match-empty':
+            // 命中，enter回调立即返回，不创建span
+            trace_set_callback_whitelist([$user]);
+            trace_set_internal_whitelist([$internal]);
+            trace_set_callback('function_enter', function () {
+                return null;
+            });
+            break;
+
+        case 'native':
+            trace_set_callback_whitelist([$user + ['operation_name' => '{name}', 'capture_caller' => false]]);
+            trace_set_internal_whitelist([$internal + ['operation_name' => '{function}', 'capture_caller' => false]]);
+            break;
+
+        case 'full':
+            trace_set_callback_whitelist([$user]);
+            trace_set_internal_whitelist([$internal]);
+            trace_set_callback('function_enter', function ($func, $class, $file, $line, $parent, $args) {
+                return ['operation_name' => $func];
+            });
+            trace_set_callback('function_exit', function ($spanId, $duration, $rv) {
+                return null;
+            });
+            break;
+
+        case 'metrics':
+            // 需要 trace.mode=metrics（由run.php传入）
+            trace_set_callback_whitelist([$user]);
+            trace_set_internal_whitelist([$internal]);
+            break;
+
+        default:
+            fwrite(STDERR, "未知配置: {$case}\n");
+            exit(1);
+    }
+}
+
+if ($case !== 'off') {
+    if (!extension_loaded('trace')) {
+        fwrite(STDERR, "trace扩展未加载\n");
+        exit(1);
+    }
+    bench_setup($case);
+}
+
+if ($only !== null) {
+    // 统计分配次数：只运行一个目标，不做预热和多轮
+    $targets[$only]($iter);
+    exit(0);
+}
+
+$result = ['case' => $case, 'iterations' => $iter, 'ns' => [], 'mem' => []];
+
+foreach ($targets as $name => $run) {
+    $run(1000);  // 预热：填充决策缓存、运行时缓存
+    if ($case !== 'off') {
+        trace_reset();
+    }
+
+    $best = PHP_INT_MAX;
+    $mem = 0;
+    for ($round = 0; $round < 5; $round++) {
+        $before = memory_get_usage();
+        $start = hrtime(true);
+        $run($iter);
+        $elapsed = hrtime(true) - $start;
+        $mem = max($mem, memory_get_usage() - $before);
+        $best = min($best, $elapsed);
+        if ($case !== 'off') {
+            trace_reset();  // 释放本轮创建的span，避免多轮累积
+        }
+    }
+
+    $result['ns'][$name] = round($best / $iter, 2);
+    $result['mem'][$name] = round($mem / $iter, 2);
+}
+
+echo json_encode($result), "\n";
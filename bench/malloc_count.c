@@ -0,0 +1,46 @@
+/*
+ * 统计malloc/calloc/realloc调用次数的LD_PRELOAD库（Linux/glibc），由 bench/run.php --allocs 编译和加载
+ *
+ * 配合 USE_ZEND_ALLOC=0 使用：Zend内存管理器关闭后emalloc也经过malloc，才能被统计到
+ * 进程退出时把次数写入 MALLOC_COUNT_OUT 指定的文件
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long malloc_count = 0;
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    __atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor))
+static void malloc_count_report(void)
+{
+    unsigned long count = __atomic_load_n(&malloc_count, __ATOMIC_RELAXED);
+    const char *path = getenv("MALLOC_COUNT_OUT");
+    FILE *fp;
+
+    if (!path || !(fp = fopen(path, "w"))) {
+        return;
+    }
+    fprintf(fp, "%lu\n", count);
+    fclose(fp);
+}
@@ -0,0 +1,265 @@
+<?php
+/**
+ * 钩子开销基准的运行器：每种配置启动一次 php-cgi 运行 bench/bench.php，汇总每次调用的耗时
+ *
+ * 扩展在CLI下不安装钩子，所以用 php-cgi（-n 不加载php.ini，只加载要测的扩展）。
+ *
+ * 用法：
+ *   php bench/run.php --ext=./modules/trace.so
+ *   php bench/run.php --ext=./modules/trace.so --allocs --out=bench.json
+ *   php bench/run.php --ext=./modules/trace.so --baseline=bench.json   # 与上次结果比较，有回退时退出码为1
+ *
+ * 选项：
+ *   --ext=PATH         trace.so路径（必填）
+ *   --php-cgi=PATH     php-cgi可执行文件（默认 php-cgi）
+ *   --iter=N           每个目标的调用次数（默认200000）
+ *   --cases=a,b        只运行这些配置（默认全部，见下方 $cases）
+ *   --allocs           同时统计每次调用的malloc次数（需要cc和glibc，较慢）
+ *   --out=FILE         把结果写成JSON
+ *   --baseline=FILE    与之前 --out 的结果比较额外开销
+ *   --threshold=N      额外开销增加超过N%（且超过2ns）视为回退，默认10
+ */
+
+$cases = [
+    'off'          => '未加载扩展（基线）',
+    'loaded'       => '加载扩展，没有白名单',
+    'nomatch-1'    => '1条不命中的规则',
+    'nomatch-10'   => '10条不命中的规则',
+    'nomatch-100'  => '100条不命中的规则',
+    'nomatch-1000' => '1000条不命中的规则',
+    'match'        => '命中，没有回调',
+    'match-empty'  => '命中，enter回调直接返回',
+    'native'       => '命中，原生span模板',
+    'full'         => '命中，enter+exit回调创建span',
+    'metrics'      => '命中，trace.mode=metrics',
+];
+
+$targets = [
+    'u0'  => '用户函数 0参数',
+    'u5'  => '用户函数 5参数',
+    'u50' => '用户函数 50参数',
+    'i0'  => '内部函数 0参数',
+    'i5'  => '内部函数 5参数',
+    'i50' => '内部函数 50参数',
+];
+
+$opts = [
+    'ext' => null,
+    'php-cgi' => 'php-cgi',
+    'iter' => 200000,
+    'cases' => null,
+    'allocs' => false,
+    'out' => null,
+    'baseline' => null,
+    'threshold' => 10,
+];
+
+foreach (array_slice($argv, 1) as $arg) {
+    if (!preg_match('/^--([a-z-]+)(?:=(.*))?$/', $arg, $m) || !array_key_exists($m[1], $opts)) {
+        fwrite(STDERR, "未知参数: {$arg}\n");
+        exit(2);
+    }
+    $opts[$m[1]] = isset($m[2]) ? $m[2] : true;
+}
+
+if (!$opts['ext'] || !is_file($opts['ext'])) {
+    fwrite(STDERR, "用法: php {$argv[0]} --ext=./modules/trace.so [--php-cgi=php-cgi] [--iter=N] [--cases=a,b] [--allocs] [--out=FILE] [--baseline=FILE]\n");
+    exit(2);
+}
+$ext = realpath($opts['ext']);
+$iter = (int)$opts['iter'];
+
+if ($opts['cases']) {
+    $selected = explode(',', $opts['cases']);
+    foreach ($selected as $name) {
+        if (!isset($cases[$name])) {
+            fwrite(STDERR, "未知配置: {$name}\n");
+            exit(2);
+        }
+    }
+    // 额外开销按off计算，始终运行
+    $cases = array_intersect_key($cases, array_flip(array_unique(array_merge(['off'], $selected))));
+}
+
+$script = __DIR__ . '/bench.php';
+
+// php-cgi 命令行：-n 不读php.ini，-q 不输出响应头
+function bench_command(array $opts, string $ext, string $case): array
+{
+    $cmd = [$opts['php-cgi'], '-n', '-q', '-d', 'memory_limit=-1'];
+    if ($case !== 'off') {
+        array_push($cmd, '-d', "extension={$ext}", '-d', 'trace.max_spans=0', '-d', 'trace.max_memory=0');
+        if ($case === 'metrics') {
+            array_push($cmd, '-d', 'trace.mode=metrics');
+        }
+    }
+    $cmd[] = __DIR__ . '/bench.php';
+    return $cmd;
+}
+
+function bench_exec(array $cmd, array $env, &$stdout, &$stderr): int
+{
+    $proc = proc_open($cmd, [1 => ['pipe', 'w'], 2 => ['pipe', 'w']], $pipes, null, $env + getenv());
+    if (!is_resource($proc)) {
+        $stderr = '无法启动 ' . $cmd[0];
+        return -1;
+    }
+    $stdout = stream_get_contents($pipes[1]);
+    $stderr = stream_get_contents($pipes[2]);
+    fclose($pipes[1]);
+    fclose($pipes[2]);
+    return proc_close($proc);
+}
+
+// 统计分配次数：分别调用N次和2N次，差值除以N即为每次调用的malloc次数（扣除启动和预热）
+function bench_allocs(array $opts, string $ext, string $case, string $target, string $lib): ?float
+{
+    $n = 20000;
+    $counts = [];
+    foreach ([$n, 2 * $n] as $iter) {
+        $out = tempnam(sys_get_temp_dir(), 'trace-malloc');
+        $env = [
+            'BENCH_CASE' => $case,
+            'BENCH_ITER' => (string)$iter,
+            'BENCH_TARGET' => $target,
+            'USE_ZEND_ALLOC' => '0',
+            'LD_PRELOAD' => $lib,
+            'MALLOC_COUNT_OUT' => $out,
+        ];
+        $code = bench_exec(bench_command($opts, $ext, $case), $env, $stdout, $stderr);
+        $count = trim((string)@file_get_contents($out));
+        @unlink($out);
+        if ($code !== 0 || $count === '') {
+            return null;
+        }
+        $counts[] = (int)$count;
+    }
+    return round(($counts[1] - $counts[0]) / $n, 2);
+}
+
+$lib = null;
+if ($opts['allocs']) {
+    $lib = sys_get_temp_dir() . '/trace-malloc-count-' . getmypid() . '.so';
+    $cc = getenv('CC') ?: 'cc';
+    exec(escapeshellarg($cc) . ' -shared -fPIC -O2 -o ' . escapeshellarg($lib) . ' ' . escapeshellarg(__DIR__ . '/malloc_count.c') . ' 2>&1', $output, $code);
+    if ($code !== 0) {
+        fwrite(STDERR, "编译 malloc_count.c 失败：\n" . implode("\n", $output) . "\n");
+        exit(1);
+    }
+}
+
+$results = [];
+foreach ($cases as $case => $desc) {
+    fwrite(STDERR, sprintf("%-14s %s ...\n", $case, $desc));
+
+    $code = bench_exec(bench_command($opts, $ext, $case), ['BENCH_CASE' => $case, 'BENCH_ITER' => (string)$iter], $stdout, $stderr);
+    $lines = array_filter(explode("\n", trim((string)$stdout)));
+    $data = $lines ? json_decode(end($lines), true) : null;
+    if ($code !== 0 || !is_array($data)) {
+        fwrite(STDERR, "  失败（退出码 {$code}）：" . trim($stderr . "\n" . $stdout) . "\n");
+        exit(1);
+    }
+
+    if ($lib) {
+        $data['allocs'] = [];
+        foreach ($targets as $target => $_) {
+            $data['allocs'][$target] = bench_allocs($opts, $ext, $case, $target, $lib);
+        }
+    }
+    $results[$case] = $data;
+}
+
+if ($lib) {
+    @unlink($lib);
+}
+
+// 额外开销 = 该配置耗时 - 未加载扩展时的耗时
+function bench_overhead(array $results, string $case, string $target): float
+{
+    return $results[$case]['ns'][$target] - $results['off']['ns'][$target];
+}
+
+function bench_table(string $title, array $targets, array $rows): void
+{
+    echo "\n{$title}\n\n";
+    echo '| 配置 | ' . implode(' | ', array_keys($targets)) . " |\n";
+    echo '|------|' . str_repeat('------|', count($targets)) . "\n";
+    foreach ($rows as $case => $cells) {
+        echo "| {$case} | " . implode(' | ', $cells) . " |\n";
+    }
+}
+
+$version = trim((string)shell_exec(escapeshellarg($opts['php-cgi']) . ' -n -v 2>/dev/null | head -1'));
+echo "{$version}\n";
+echo "每个目标调用 {$iter} 次，取5轮最小值；括号内为相对未加载扩展的额外开销\n";
+echo "目标：" . implode('，', array_map(function ($k, $v) { return "{$k}={$v}"; }, array_keys($targets), $targets)) . "\n";
+
+$rows = [];
+foreach ($results as $case => $data) {
+    foreach ($targets as $target => $_) {
+        $ns = $data['ns'][$target];
+        $rows[$case][] = $case === 'off'
+            ? sprintf('%.1f', $ns)
+            : sprintf('%.1f (%+.1f)', $ns, bench_overhead($results, $case, $target));
+    }
+}
+bench_table('ns/次调用', $targets, $rows);
+
+$rows = [];
+foreach ($results as $case => $data) {
+    foreach ($targets as $target => $_) {
+        $rows[$case][] = sprintf('%.1f', $data['mem'][$target]);
+    }
+}
+bench_table('请求内累积内存（字节/次调用）', $targets, $rows);
+
+if ($lib) {
+    $rows = [];
+    foreach ($results as $case => $data) {
+        foreach ($targets as $target => $_) {
+            $allocs = $data['allocs'][$target];
+            $rows[$case][] = $allocs === null ? '-' : sprintf('%.2f', $allocs);
+        }
+    }
+    bench_table('malloc次数/次调用（USE_ZEND_ALLOC=0）', $targets, $rows);
+}
+
+if ($opts['out']) {
+    $report = [
+        'php' => $version,
+        'ext' => $ext,
+        'iterations' => $iter,
+        'date' => date('c'),
+        'results' => $results,
+    ];
+    file_put_contents($opts['out'], json_encode($report, JSON_PRETTY_PRINT | JSON_UNESCAPED_UNICODE) . "\n");
+    fwrite(STDERR, "结果已写入 {$opts['out']}\n");
+}
+
+// 与基线比较额外开销，用于升级前的回归检查
+if ($opts['baseline']) {
+    $baseline = json_decode((string)@file_get_contents($opts['baseline']), true);
+    if (!is_array($baseline) || !isset($baseline['results']['off'])) {
+        fwrite(STDERR, "无法读取基线 {$opts['baseline']}\n");
+        exit(2);
+    }
+
+    $regressions = 0;
+    echo "\n与基线比较（{$baseline['date']}，额外开销 ns/次调用）\n\n";
+    foreach ($results as $case => $data) {
+        if ($case === 'off' || !isset($baseline['results'][$case])) {
+            continue;
+        }
+        foreach ($targets as $target => $_) {
+            $now = bench_overhead($results, $case, $target);
+            $before = bench_overhead($baseline['results'], $case, $target);
+            $diff = $now - $before;
+            if ($diff > 2.0 && $diff > abs($before) * $opts['threshold'] / 100) {
+                $regressions++;
+                printf("  回退 %-14s %-4s %8.1f -> %8.1f (%+.1f)\n", $case, $target, $before, $now, $diff);
+            }
+        }
+    }
+    echo $regressions ? "\n共 {$regressions} 项回退\n" : "  没有回退\n";
+    exit($regressions ? 1 : 0);
+}
@@ -2,5 +2,15 @@ PHP_ARG_ENABLE(trace, whether to enable trace support,
 [  --enable-trace           Enable trace support])
 
 if test "$PHP_TRACE" != "no"; then
+  dnl 用于播种SpanID/TraceID生成器，缺失时回退到/dev/urandom
+  AC_CHECK_HEADERS([sys/random.h])
+  AC_CHECK_FUNCS([getrandom])
+
+  dnl shm://导出器的共享内存环，旧版glibc的shm_open在librt中
+  PHP_CHECK_FUNC(shm_open, rt)
+
+  dnl 采样分析器的定时器（Linux），旧版glibc的timer_create同样在librt中
+  PHP_CHECK_FUNC(timer_create, rt)
+
   PHP_NEW_EXTENSION(trace, trace.c, $ext_shared)
 fi
@@ -6,6 +6,20 @@ if (!extension_loaded('trace')) {
     die("错误: trace扩展未加载\n");
 }
 
+// 断言：失败时打印期望值和实际值，最后以非0退出码结束
+$failures = 0;
+function check($label, $actual, $expected) {
+    global $failures;
+    if ($actual === $expected) {
+        echo "  ✓ {$label}\n";
+        return;
+    }
+    $failures++;
+    echo "  ✗ {$label}\n";
+    echo "      期望: " . var_export($expected, true) . "\n";
+    echo "      实际: " . var_export($actual, true) . "\n";
+}
+
 echo "1. TraceID: " . trace_get_trace_id() . "\n\n";
 
 echo "2. 设置白名单:\n";
@@ -164,3 +178,92 @@ foreach ($data['spans'] as $i => $span) {
     }
     echo "\n";
 }
+
+echo "7. SQL指纹（pdo_sqlite）:\n";
+if (!extension_loaded('pdo_sqlite')) {
+    echo "  跳过：pdo_sqlite未加载\n\n";
+} else {
+    // 最近一个数据库span的db.statement
+    function last_db_statement() {
+        $statement = null;
+        foreach (trace_get_spans()['spans'] as $span) {
+            if (isset($span['tags']['db.statement'])) {
+                $statement = $span['tags']['db.statement'];
+            }
+        }
+        return $statement;
+    }
+    
+    $pdo = new PDO('sqlite::memory:');
+    $pdo->exec("CREATE TABLE t (id INTEGER, name TEXT)");
+    
+    $pdo->exec("INSERT INTO t (id, name) VALUES (1, 'a'), (2, 'b'), (3, 'c')");
+    check('多行VALUES合并为一行，保留列数', last_db_statement(), "INSERT INTO t (id, name) VALUES (?, ?)");
+    
+    $pdo->query("SELECT * FROM t WHERE id IN (1, 2, 3)");
+    check('IN列表折叠', last_db_statement(), "SELECT * FROM t WHERE id IN (?+)");
+    
+    $pdo->query("SELECT id FROM t LIMIT 10, 20");
+    check('LIMIT不折叠', last_db_statement(), "SELECT id FROM t LIMIT ?, ?");
+    
+    $pdo->query("SELECT 1, 2");
+    check('SELECT列表不折叠', last_db_statement(), "SELECT ?, ?");
+    
+    $pdo->query("SELECT id /* ids */ FROM t -- 注释\n  WHERE id = 1");
+    check('去掉注释，合并空白', last_db_statement(), "SELECT id FROM t WHERE id = ?");
+    
+    $pdo->query("SELECT id FROM t WHERE name = 'O''Brien' OR name = \"x, y\" OR name IN ('a', 'b')");
+    check('字符串替换为?', last_db_statement(), "SELECT id FROM t WHERE name = ? OR name = ? OR name IN (?+)");
+    
+    $stmt = $pdo->prepare("SELECT name FROM t WHERE id = ? AND name <> 'z'");
+    $stmt->execute([1]);
+    check('预处理语句', last_db_statement(), "SELECT name FROM t WHERE id = ? AND name <> ?");
+    echo "\n";
+}
+
+echo "8. traceparent解析与传递:\n";
+$upstreamTraceId = '4bf92f3577b34da6a3ce929d0e0e4736';
+$upstreamParentId = '00f067aa0ba902b7';
+$valid = "00-{$upstreamTraceId}-{$upstreamParentId}-01";
+
+// 以traceparent开始一个任务，返回 [TraceID, 传给下游的请求头]
+function job_context($traceparent, $tracestate = null) {
+    trace_begin_job('x', $traceparent, $tracestate);
+    $context = [trace_get_trace_id(), trace_get_propagation_headers()];
+    trace_end_job();
+    return $context;
+}
+
+// 无效的traceparent：生成新的TraceID，不沿用上游的parent-id和tracestate
+function check_rejected($label, $traceparent) {
+    global $upstreamTraceId, $upstreamParentId;
+    [$traceId, $headers] = job_context($traceparent, 'congo=t61rcWkgMzE');
+    check("{$label}：生成新的TraceID", (bool)preg_match('/^[0-9a-f]{32}$/', $traceId) && $traceId !== $upstreamTraceId, true);
+    check("{$label}：请求头使用新的TraceID", substr($headers['traceparent'], 3, 32), $traceId);
+    check("{$label}：不沿用上游parent-id", substr($headers['traceparent'], 36, 16) !== $upstreamParentId, true);
+    check("{$label}：不传递tracestate", isset($headers['tracestate']), false);
+}
+
+[$traceId, $headers] = job_context($valid, 'congo=t61rcWkgMzE');
+check('v00：沿用TraceID', $traceId, $upstreamTraceId);
+check('v00：请求头格式', (bool)preg_match("/^00-{$upstreamTraceId}-[0-9a-f]{16}-01\$/", $headers['traceparent']), true);
+check('v00：parent-id为本服务的根span', substr($headers['traceparent'], 36, 16) !== $upstreamParentId, true);
+check('v00：传递tracestate', $headers['tracestate'] ?? null, 'congo=t61rcWkgMzE');
+
+[$traceId, $headers] = job_context("00-{$upstreamTraceId}-{$upstreamParentId}-00");
+check('v00未采样：沿用TraceID', $traceId, $upstreamTraceId);
+check('v00未采样：沿用上游parent-id和采样标记', $headers['traceparent'], "00-{$upstreamTraceId}-{$upstreamParentId}-00");
+
+[$traceId, $headers] = job_context("cc-{$upstreamTraceId}-{$upstreamParentId}-01-what-the-future-will-be-like");
+check('未来版本带后缀：沿用TraceID', $traceId, $upstreamTraceId);
+check('未来版本带后缀：按00版本传递', substr($headers['traceparent'], 0, 36), "00-{$upstreamTraceId}-");
+
+check_rejected('大写十六进制', strtoupper($valid));
+check_rejected('版本ff', "ff-{$upstreamTraceId}-{$upstreamParentId}-01");
+check_rejected('全0 TraceID', "00-00000000000000000000000000000000-{$upstreamParentId}-01");
+check_rejected('全0 parent-id', "00-{$upstreamTraceId}-0000000000000000-01");
+check_rejected('v00超长', "{$valid}-extra");
+echo "\n";
+
+echo $failures ? "{$failures} 项检查失败\n" : "全部检查通过\n";
+exit($failures ? 1 : 0);
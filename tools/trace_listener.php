@@ -0,0 +1,156 @@
+<?php
+/**
+ * 本地采集端替身：接收 trace.exporter 发出的NDJSON并打印，用于调试导出器
+ *
+ * 用法：
+ *   php tools/trace_listener.php udp://127.0.0.1:9411
+ *   php tools/trace_listener.php unixgram:///tmp/trace.sock
+ *   php tools/trace_listener.php unix:///tmp/trace.sock
+ *
+ * 选项：
+ *   --raw     原样输出每一行，不做格式化
+ *   --slow=N  每收到一批数据后暂停N毫秒，模拟采集端背压（观察phpinfo中的Dropped计数）
+ */
+
+$target = null;
+$raw = false;
+$slowMs = 0;
+
+foreach (array_slice($argv, 1) as $arg) {
+    if ($arg === '--raw') {
+        $raw = true;
+    } elseif (strncmp($arg, '--slow=', 7) === 0) {
+        $slowMs = (int)substr($arg, 7);
+    } else {
+        $target = $arg;
+    }
+}
+
+if ($target === null) {
+    fwrite(STDERR, "用法: php {$argv[0]} <udp://host:port|unixgram:///path|unix:///path> [--raw] [--slow=N]\n");
+    exit(1);
+}
+
+$isStream = strncmp($target, 'unix://', 7) === 0;
+$isDatagram = !$isStream;
+
+if (strncmp($target, 'unix', 4) === 0) {
+    $path = substr($target, strpos($target, '://') + 3);
+    if (file_exists($path)) {
+        unlink($path);
+    }
+}
+
+$flags = $isDatagram ? STREAM_SERVER_BIND : (STREAM_SERVER_BIND | STREAM_SERVER_LISTEN);
+$server = stream_socket_server($target, $errno, $errstr, $flags);
+if (!$server) {
+    fwrite(STDERR, "监听 {$target} 失败: {$errstr} ({$errno})\n");
+    exit(1);
+}
+
+if (isset($path)) {
+    // 让php-fpm的worker用户也能写入
+    chmod($path, 0666);
+}
+
+fwrite(STDERR, "正在监听 {$target}\n");
+
+$stats = ['batches' => 0, 'spans' => 0, 'bytes' => 0, 'invalid' => 0];
+
+$handleLine = function (string $line) use ($raw, &$stats) {
+    if ($line === '') {
+        return;
+    }
+    $stats['spans']++;
+
+    if ($raw) {
+        echo $line, "\n";
+        return;
+    }
+
+    $span = json_decode($line, true);
+    if (!is_array($span)) {
+        $stats['invalid']++;
+        echo "⚠️  无效行: ", substr($line, 0, 200), "\n";
+        return;
+    }
+
+    printf(
+        "%s %s %-40s %10.3fms%s\n",
+        substr($span['trace_id'] ?? '-', 0, 8),
+        $span['span_id'] ?? '-',
+        $span['name'] ?? '-',
+        ($span['duration_ns'] ?? 0) / 1e6,
+        isset($span['parent_id']) ? '' : '  (root)'
+    );
+};
+
+$handleBatch = function (string $data) use ($handleLine, $slowMs, &$stats) {
+    $stats['batches']++;
+    $stats['bytes'] += strlen($data);
+    foreach (explode("\n", $data) as $line) {
+        $handleLine($line);
+    }
+    if ($slowMs > 0) {
+        usleep($slowMs * 1000);
+    }
+};
+
+if (function_exists('pcntl_signal')) {
+    pcntl_async_signals(true);
+    pcntl_signal(SIGINT, function () use (&$stats) {
+        fwrite(STDERR, sprintf(
+            "\n共收到 %d 批，%d 个span，%d 字节，%d 行无效\n",
+            $stats['batches'], $stats['spans'], $stats['bytes'], $stats['invalid']
+        ));
+        exit(0);
+    });
+}
+
+if ($isDatagram) {
+    while (true) {
+        $data = stream_socket_recvfrom($server, 65536);
+        if ($data !== false && $data !== '') {
+            $handleBatch($data);
+        }
+    }
+}
+
+// 流式：每个worker一条连接，按行切分
+$clients = [];
+$buffers = [];
+while (true) {
+    $read = array_merge([$server], $clients);
+    $write = $except = null;
+    if (stream_select($read, $write, $except, null) === false) {
+        continue;
+    }
+    foreach ($read as $sock) {
+        if ($sock === $server) {
+            $client = stream_socket_accept($server);
+            if ($client) {
+                stream_set_blocking($client, false);
+                $clients[(int)$client] = $client;
+                $buffers[(int)$client] = '';
+            }
+            continue;
+        }
+
+        $id = (int)$sock;
+        $data = fread($sock, 65536);
+        if ($data === '' || $data === false) {
+            if (feof($sock)) {
+                fclose($sock);
+                unset($clients[$id], $buffers[$id]);
+            }
+            continue;
+        }
+
+        $buffers[$id] .= $data;
+        $pos = strrpos($buffers[$id], "\n");
+        if ($pos !== false) {
+            $handleBatch(substr($buffers[$id], 0, $pos));
+            $buffers[$id] = substr($buffers[$id], $pos + 1);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+<?php
+/**
+ * 共享内存环的消费进程：从 trace.exporter = shm://name 的环中批量取出trace，转发到本地采集端
+ *
+ * 用法：
+ *   php tools/trace_ring_drain.php shm://php-trace udp://127.0.0.1:9411
+ *   php tools/trace_ring_drain.php shm://php-trace unix:///var/run/trace-agent.sock
+ *   php tools/trace_ring_drain.php shm://php-trace -          # 输出到stdout
+ *
+ * 选项：
+ *   --batch=N     每批最多取出N字节（默认1MB，udp目标会再按 --datagram 拆包）
+ *   --datagram=N  udp/unixgram单包最大字节数（默认65000）
+ *   --idle=N      环为空时休眠N毫秒（默认50）
+ */
+
+$ring = null;
+$target = null;
+$batch = 1 << 20;
+$datagram = 65000;
+$idleMs = 50;
+
+foreach (array_slice($argv, 1) as $arg) {
+    if (strncmp($arg, '--batch=', 8) === 0) {
+        $batch = (int)substr($arg, 8);
+    } elseif (strncmp($arg, '--datagram=', 11) === 0) {
+        $datagram = (int)substr($arg, 11);
+    } elseif (strncmp($arg, '--idle=', 7) === 0) {
+        $idleMs = (int)substr($arg, 7);
+    } elseif ($ring === null) {
+        $ring = $arg;
+    } else {
+        $target = $arg;
+    }
+}
+
+if ($ring === null || $target === null) {
+    fwrite(STDERR, "用法: php {$argv[0]} shm://name <udp://host:port|unixgram:///path|unix:///path|-> [--batch=N] [--datagram=N] [--idle=N]\n");
+    exit(1);
+}
+
+$isDatagram = strncmp($target, 'udp://', 6) === 0 || strncmp($target, 'unixgram://', 11) === 0;
+$out = null;
+
+$connect = function () use ($target, &$out) {
+    if ($target === '-') {
+        $out = STDOUT;
+        return true;
+    }
+    $out = @stream_socket_client($target, $errno, $errstr, 1);
+    if (!$out) {
+        fwrite(STDERR, "连接 {$target} 失败: {$errstr} ({$errno})\n");
+        return false;
+    }
+    return true;
+};
+
+// 按行边界拆成不超过 $datagram 的数据报
+$send = function (string $data) use ($isDatagram, $datagram, &$out) {
+    if (!$isDatagram) {
+        return fwrite($out, $data) === strlen($data);
+    }
+    $ok = true;
+    while ($data !== '') {
+        $chunk = $data;
+        if (strlen($chunk) > $datagram) {
+            $pos = strrpos(substr($chunk, 0, $datagram), "\n");
+            $chunk = substr($chunk, 0, $pos === false ? $datagram : $pos + 1);
+        }
+        $data = (string)substr($data, strlen($chunk));
+        $ok = (@fwrite($out, $chunk) === strlen($chunk)) && $ok;
+    }
+    return $ok;
+};
+
+$stats = ['batches' => 0, 'bytes' => 0, 'failed' => 0];
+if (function_exists('pcntl_signal')) {
+    pcntl_async_signals(true);
+    $stop = function () use (&$stats) {
+        fwrite(STDERR, sprintf("\n共转发 %d 批，%d 字节，%d 批发送失败\n", $stats['batches'], $stats['bytes'], $stats['failed']));
+        exit(0);
+    };
+    pcntl_signal(SIGINT, $stop);
+    pcntl_signal(SIGTERM, $stop);
+}
+
+while (true) {
+    if (!$out && !$connect()) {
+        sleep(1);
+        continue;
+    }
+
+    $data = trace_ring_consume($batch, $ring);
+    if ($data === false) {
+        // FPM还没启动，或者环被其他消费进程占用
+        sleep(1);
+        continue;
+    }
+    if ($data === '') {
+        usleep($idleMs * 1000);
+        continue;
+    }
+
+    $stats['batches']++;
+    $stats['bytes'] += strlen($data);
+    if (!$send($data)) {
+        // 数据已经从环中取出，发送失败只能丢弃；流式连接断开时重连
+        $stats['failed']++;
+        if (!$isDatagram && $target !== '-') {
+            fclose($out);
+            $out = null;
+        }
+    }
+}
@@ -6,42 +6,413 @@
 #include "php_ini.h"
 #include "ext/standard/info.h"
 #include "SAPI.h"
+#include "zend_smart_str.h"
+#include "zend_interfaces.h"
+#include "zend_exceptions.h"
+#include "zend_sort.h"
+#include "ext/json/php_json.h"
 #include <sys/time.h>
+#include <time.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <limits.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
+
+#if PHP_VERSION_ID >= 80000
+#include "zend_observer.h"
+#define TRACE_HAVE_OBSERVER 1
+#else
+#define TRACE_HAVE_OBSERVER 0
+#endif
+
+#if PHP_VERSION_ID >= 80300
+#include "zend_hrtime.h"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define TRACE_HAVE_TSC 1
+#else
+#define TRACE_HAVE_TSC 0
+#endif
+
+// 采样分析器依赖timer_create和实时信号；信号处理函数中无法定位ZTS的线程本地EG，只支持NTS
+#if defined(HAVE_TIMER_CREATE) && !defined(ZTS) && defined(SIGRTMIN)
+#define TRACE_HAVE_PROFILER 1
+#else
+#define TRACE_HAVE_PROFILER 0
+#endif
 
 #define PHP_TRACE_VERSION "2.0.0"
 
 // Span结构体
 typedef struct _trace_span {
-    zend_string *span_id;
-    zend_string *parent_id;
+    uint64_t span_id;
+    uint64_t parent_id;  // 0表示没有父span
     zend_string *operation_name;
-    double start_time;
-    double end_time;
-    zend_array *tags;  // 新增：支持tags
-    zend_array *logs;
+    uint64_t start_ns;  // 单调时钟（纳秒），导出时通过请求的墙上时间锚点换算
+    uint64_t end_ns;    // 0表示未结束
+    uint64_t child_ns;  // 已结束的子调用耗时之和，子span结束时累加；自身耗时 = 耗时 - child_ns
+    zend_array *tags;  // 第一次写入时才创建
+    zend_array *logs;  // 第一次写入时才创建
     struct _trace_span *parent;
+    zend_uchar flags;
 } trace_span_t;
 
+// span标记
+#define TRACE_SPAN_NATIVE  0x01  // 由原生模板创建，不调用用户回调
+#define TRACE_SPAN_OVERFLOW 0x02 // 超出预算后同一操作的聚合span
+#define TRACE_SPAN_METRICS  0x04 // 指标模式的占位span，只用于和钩子配对
+#define TRACE_SPAN_FOLDED   0x08 // 连续相同的缓存命令合并成的span
+
+// 超出预算后按操作聚合：同一操作的后续调用只累计次数和耗时
+#define TRACE_OVERFLOW_MAX_OPS 256               // 聚合span的种类上限，超过后全部归入一个
+#define TRACE_OVERFLOW_CATCH_ALL "trace.overflow"
+
+typedef struct _trace_overflow {
+    trace_span_t *span;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+} trace_overflow_t;
+
+// 正在执行的被聚合调用（按调用顺序入栈出栈）
+typedef struct _trace_overflow_frame {
+    uint64_t start_ns;
+    trace_overflow_t *agg;
+} trace_overflow_frame_t;
+
+// 缓存命令的原生span：上一条命令（连续相同的命令合并到它）和进行中的multi/pipeline
+typedef struct _trace_cache_last {
+    trace_span_t *span;
+    const void *hook;          // trace_cache_hook_t
+    uint32_t object;           // 对象handle
+    uint32_t generation;
+    uint32_t span_count;       // 创建时的span_count，之后又创建了span就不再合并
+    zend_string *prefix;       // key前缀，没有时为NULL
+    uint64_t count;
+    uint64_t hits;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+} trace_cache_last_t;
+
+typedef struct _trace_cache_batch {
+    trace_span_t *span;
+    uint32_t object;
+    uint32_t generation;
+    uint64_t commands;
+    uint64_t keys;
+} trace_cache_batch_t;
+
+// 扩展自身开销的计数：请求级，RSHUTDOWN时累加到worker级（字段都是uint64_t，按数组累加）
+typedef struct _trace_stats {
+    uint64_t hook_calls;        // 钩子被调用的次数（含快速路径直接返回）
+    uint64_t decision_lookups;  // 查询跟踪决策的次数
+    uint64_t rule_evaluations;  // 完整匹配白名单的次数（决策缓存未命中）
+    uint64_t rule_hits;         // 命中白名单的查询数
+    uint64_t callbacks;         // 用户回调调用次数
+    uint64_t spans_created;
+    uint64_t spans_discarded;   // 尾部采样丢弃的trace中的span
+    uint64_t calls_aggregated;  // 超出预算后被聚合的调用
+    uint64_t tags_dropped;
+    uint64_t logs_dropped;
+    uint64_t bytes;             // 计入预算的内存（估算）
+    uint64_t match_ns;          // 白名单匹配
+    uint64_t args_ns;           // 参数复制
+    uint64_t callback_ns;       // 用户回调（含回调中调用 TraceFrame::getArgs() 的时间）
+    uint64_t span_ns;           // span创建
+} trace_stats_t;
+
+// 指标模式的耗时直方图：对数-线性分桶（HDR风格），每个2的幂区间再等分为4个子桶，相对误差不超过25%
+#define TRACE_HIST_SUB_BITS  2
+#define TRACE_HIST_SUB_COUNT (1 << TRACE_HIST_SUB_BITS)
+#define TRACE_HIST_MAX_EXP   36  // 2^37ns（约137秒）以上的耗时计入最后一个桶
+#define TRACE_HIST_BUCKETS   ((TRACE_HIST_MAX_EXP - TRACE_HIST_SUB_BITS + 2) * TRACE_HIST_SUB_COUNT)
+
+// 指标模式下每个函数一条记录，第一次调用时分配，之后每次调用只做计数
+typedef struct _trace_func_stats {
+    zend_string *name;
+    uint64_t calls;
+    uint64_t inclusive_ns;  // 含子调用
+    uint64_t exclusive_ns;  // 扣除被跟踪的子调用
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint32_t inclusive_hist[TRACE_HIST_BUCKETS];
+    uint32_t exclusive_hist[TRACE_HIST_BUCKETS];
+} trace_func_stats_t;
+
+// 正在执行的被统计调用；子调用结束时把耗时累加到父调用的child_ns
+typedef struct _trace_metrics_frame {
+    trace_func_stats_t *stats;
+    uint64_t start_ns;
+    uint64_t child_ns;
+} trace_metrics_frame_t;
+
+// span存储：按块从请求级内存分配，块串成链表，同时作为按创建顺序遍历的向量
+// 请求结束或 trace_reset() 时整块释放
+#define TRACE_SPAN_CHUNK_SIZE 256
+
+typedef struct _trace_span_chunk {
+    struct _trace_span_chunk *next;
+    uint32_t used;
+    trace_span_t spans[TRACE_SPAN_CHUNK_SIZE];
+} trace_span_chunk_t;
+
+// 按创建顺序遍历所有span
+#define TRACE_FOREACH_SPAN(span) do { \
+        trace_span_chunk_t *_chunk; \
+        uint32_t _i; \
+        for (_chunk = TRACE_G(span_chunks); _chunk; _chunk = _chunk->next) { \
+            for (_i = 0; _i < _chunk->used; _i++) { \
+                span = &_chunk->spans[_i];
+
+#define TRACE_FOREACH_SPAN_END() \
+            } \
+        } \
+    } while (0)
+
+// Observer模式下一次被跟踪调用的记录
+typedef struct _trace_observer_frame {
+    zend_execute_data *execute_data;
+    trace_span_t *span;
+} trace_observer_frame_t;
+
+// 白名单编译
+// 规则在 trace_set_callback_whitelist() / trace_set_internal_whitelist() 时编译一次：
+// - "! " 反向前缀预先拆分，正向/反向模式分开存放
+// - 每个模式按形态分类（字面量/前缀/后缀/包含/通配），正向模式按代价从低到高排序
+// - 规则按"锚点"建立索引：精确函数名 -> 哈希，精确类名 -> 哈希，
+//   文件/模块的字面量或前缀 -> 前缀树，其余规则放入通用列表
+// 查找时只需对函数名、类名各做一次哈希查找、沿文件路径走一次前缀树，
+// 再加上通用列表中的规则，代价接近 O(名称长度) 而不是 O(规则数 × 模式数)
+
+#define TRACE_PATTERN_LITERAL   0  // "abc"
+#define TRACE_PATTERN_PREFIX    1  // "abc*"
+#define TRACE_PATTERN_SUFFIX    2  // "*abc"
+#define TRACE_PATTERN_CONTAINS  3  // "*abc*"
+#define TRACE_PATTERN_GLOB      4  // 中间带 * 的一般通配
+#define TRACE_PATTERN_ANY       5  // "*"
+
+// 规则字段
+#define TRACE_FIELD_LOCATION    0  // file_pattern（用户函数）/ module_pattern（内部函数）
+#define TRACE_FIELD_CLASS       1  // class_pattern
+#define TRACE_FIELD_FUNCTION    2  // function_pattern
+#define TRACE_FIELD_COUNT       3
+
+typedef struct _trace_pattern {
+    zend_uchar kind;
+    zend_string *text;  // 去掉 "! " 和首尾 * 之后的文本（GLOB保留完整模式）
+} trace_pattern_t;
+
+// 单个字段的模式集合：正向模式全部匹配 且 反向模式全不匹配
+typedef struct _trace_pattern_set {
+    zend_bool present;  // 规则中是否设置了该字段
+    uint32_t positive_count;
+    uint32_t negative_count;
+    trace_pattern_t *positive;
+    trace_pattern_t *negative;
+} trace_pattern_set_t;
+
+// 原生span模板占位符
+#define TRACE_TEMPLATE_LITERAL   0
+#define TRACE_TEMPLATE_CLASS     1  // {class}
+#define TRACE_TEMPLATE_FUNCTION  2  // {function}
+#define TRACE_TEMPLATE_NAME      3  // {name}：有类时为 Class::function，否则为 function
+#define TRACE_TEMPLATE_FILE      4  // {file}：函数定义所在文件
+#define TRACE_TEMPLATE_MODULE    5  // {module}：内部函数所属扩展
+
+typedef struct _trace_template_segment {
+    zend_uchar kind;
+    zend_string *literal;
+} trace_template_segment_t;
+
+// 原生span模板：规则带 operation_name 时，span完全在C中创建，不调用用户回调
+typedef struct _trace_span_template {
+    uint32_t segment_count;
+    trace_template_segment_t *segments;
+    HashTable *tags;            // 静态tags
+    zend_bool capture_caller;   // 是否记录 caller.file / caller.line
+} trace_span_template_t;
+
+// 参数采集策略
+#define TRACE_ARGS_ALL      0  // 全部参数（默认）
+#define TRACE_ARGS_NONE     1  // 不采集
+#define TRACE_ARGS_SCALARS  2  // 只采集标量，数组/对象等以null占位
+
+typedef struct _trace_rule {
+    uint32_t index;  // 规则在原数组中的顺序
+    trace_pattern_set_t fields[TRACE_FIELD_COUNT];
+    trace_span_template_t *span_template;
+    zend_uchar args_policy;
+    uint32_t args_limit;     // 只采集前N个参数，0表示不限
+    uint32_t args_max_len;   // 字符串参数截断到N字节，0表示不截断
+} trace_rule_t;
+
+// 规则下标列表
+typedef struct _trace_rule_list {
+    uint32_t count;
+    uint32_t size;
+    uint32_t *items;
+} trace_rule_list_t;
+
+// 文件/模块前缀树节点（first-child / next-sibling）
+typedef struct _trace_trie_node {
+    unsigned char ch;
+    struct _trace_trie_node *child;
+    struct _trace_trie_node *sibling;
+    trace_rule_list_t prefix_rules;  // 前缀在此结束的规则
+    trace_rule_list_t exact_rules;   // 字面量在此结束的规则
+} trace_trie_node_t;
+
+typedef struct _trace_whitelist {
+    uint32_t rule_count;
+    uint32_t native_rule_count;  // 带原生模板的规则数
+    trace_rule_t *rules;
+    HashTable function_index;       // 精确函数名 -> trace_rule_list_t*
+    HashTable class_index;          // 精确类名 -> trace_rule_list_t*
+    trace_trie_node_t location_trie;
+    trace_rule_list_t generic_rules;
+} trace_whitelist_t;
+
+// 函数的跟踪决策（决策缓存的值）
+typedef struct _trace_func_decision {
+    trace_rule_t *rule;            // 命中的规则
+    zend_string *operation_name;   // 原生模板按函数预先渲染好的span名（无模板时为NULL）
+} trace_func_decision_t;
+
 // 全局变量
 ZEND_BEGIN_MODULE_GLOBALS(trace)
     zend_bool enabled;
     zend_bool debug_enabled;  // 新增：debug开关
     zend_string *debug_log_path;  // 新增：debug日志路径
-    zend_string *trace_id;
+    uint64_t trace_id_hi;   // 128位TraceID，0表示未初始化
+    uint64_t trace_id_lo;
+    zend_string *trace_id_str;  // TraceID的十六进制形式（读取时才生成）
     zend_string *service_name;
     trace_span_t *current_span;
     trace_span_t *root_span;
-    zend_array *all_spans;
-    zend_long span_counter;
+    trace_span_chunk_t *span_chunks;       // span存储块链表（第一个块）
+    trace_span_chunk_t *span_chunks_tail;  // 当前分配的块
+    trace_span_chunk_t *span_chunk_pool;   // 释放后留待复用的块（trace_reset()/trace_end_job() 之间复用，请求结束时释放）
+    uint32_t span_chunk_pool_count;
+    uint32_t span_count;
+    uint32_t span_generation;              // 每次释放spans时递增，TraceSpan/TraceSpanIterator据此判断是否失效
+    // 请求级预算：超出后新的调用按操作聚合，新的tag/log丢弃
+    zend_long max_spans;                   // trace.max_spans
+    zend_long max_tags_per_span;           // trace.max_tags_per_span
+    zend_long max_logs_per_span;           // trace.max_logs_per_span
+    zend_long max_memory;                  // trace.max_memory：计入跟踪的字节数上限（估算）
+    size_t memory_used;
+    HashTable *overflow_ops;               // zend_function* 或操作名 -> trace_overflow_t
+    trace_overflow_frame_t *overflow_stack;
+    uint32_t overflow_depth;
+    uint32_t overflow_size;
+    uint64_t overflow_calls;               // 被聚合的调用数
+    uint64_t dropped_tags;
+    uint64_t dropped_logs;
+    // 指标模式：按函数聚合调用次数和耗时，不创建span
+    char *mode;                            // trace.mode：spans / metrics
+    zend_bool metrics_mode;                // RINIT时根据 trace.mode 决定
+    HashTable *function_stats;             // zend_function* 或函数名 -> trace_func_stats_t
+    trace_metrics_frame_t *metrics_stack;
+    uint32_t metrics_depth;
+    uint32_t metrics_size;
+    // 采样分析器：定时器按固定间隔中断，在安全点记录调用栈，与白名单无关
+    zend_bool profiler;                    // trace.profiler
+    zend_long profiler_interval_us;        // trace.profiler_interval_us
+    char *profiler_clock;                  // trace.profiler_clock：cpu / wall
+    zend_long profiler_buffer;             // trace.profiler_buffer：样本缓冲区字节数
+    uint32_t *profiler_samples;            // 依次存放 [深度, 帧ID（叶子在前）...]，请求开始时一次分配
+    uint32_t profiler_used;
+    uint32_t profiler_size;
+    uint32_t profiler_sample_count;
+    uint32_t profiler_dropped;             // 缓冲区满后丢弃的样本数
+    HashTable *profiler_frame_ids;         // opcodes / zend_function* / 名称 -> 帧ID
+    zend_string **profiler_frames;         // 帧ID -> 名称
+    uint32_t profiler_frame_count;
+    uint32_t profiler_frame_size;
+    trace_stats_t stats;                   // 本请求
+    trace_stats_t worker_stats;            // 本worker已结束的请求之和
+    uint64_t worker_requests;
+    zend_bool sampled;         // 当前请求是否被采样（RINIT时决定）
+    zend_bool sampling_honor_upstream;  // 是否沿用上游traceparent的采样标记
+    uint64_t upstream_parent_id;        // 上游traceparent中的parent-id，0表示没有
+    zend_string *tracestate;            // 上游tracestate，原样向下游传递
+    double sample_rate;        // trace.sample_rate
+    zend_long rate_limit;      // trace.rate_limit：每个worker每秒最多采样的trace数，0不限
+    double rate_tokens;        // 令牌桶（跨请求保留）
+    uint64_t rate_last_ns;     // 令牌桶上次补充的时间
+    // 尾部采样：请求结束时按延迟、错误等决定是否保留已采样的trace
+    zend_bool tail_sampling;       // trace.tail_sampling
+    zend_long tail_latency_ms;     // 根span耗时超过该值时保留，0关闭
+    zend_bool tail_keep_errors;    // 有错误（error tag、未捕获异常/致命错误、HTTP 5xx）时保留
+    char *tail_routes;             // 命中这些路由（逗号分隔的通配符）时保留
+    double tail_base_rate;         // 其余请求的保留比例
+    double tail_roll;              // 本请求的随机数（每请求只取一次，多次判定结果一致），<0表示未取
+    zend_bool tail_keep;           // RSHUTDOWN时的判定结果，导出前使用
+    // 导出器：RSHUTDOWN时把保留的trace写入本地采集端socket
+    char *exporter;                    // trace.exporter：udp://host:port、unixgram:///path、unix:///path、shm://name
+    zend_long exporter_max_datagram;   // 数据报（udp/unixgram）单个包的最大字节数
+    zend_long ring_size;               // shm://name 模式下共享内存环的数据区大小
+    int exporter_fd;                   // 持久连接，同一个worker跨请求复用，-1表示未连接
+    int exporter_socktype;             // SOCK_DGRAM / SOCK_STREAM
+    pid_t exporter_pid;                // 建立连接的进程，fork后重新连接
+    uint64_t exporter_retry_ns;        // 连接失败后，早于该时间不再重试
+    char *exporter_pending;            // 流式socket上次没写完的数据（持久内存）
+    size_t exporter_pending_len;
+    uint64_t exporter_sent_traces;     // worker级计数
+    uint64_t exporter_sent_bytes;
+    uint64_t exporter_dropped_traces;
+    uint64_t exporter_dropped_bytes;
+    uint64_t prng_state[4];  // xoshiro256** 状态
+    pid_t prng_pid;          // 播种时的进程ID，fork后重新播种
     zend_bool in_trace_callback;  // 重入保护标志：防止在回调中再次触发追踪
     // 请求级回调（每个请求独立，避免FPM进程复用时相互影响）
     zval function_enter_callback;
     zval function_exit_callback;
+    zval frame_enter_callback;    // 接收TraceFrame对象的enter回调
+    zval frame_object;            // 请求内复用的TraceFrame对象
     zval curl_callback;
+    zend_bool curl_enabled;       // trace.curl：curl_exec/curl_multi 原生埋点
+    zend_bool curl_propagate;     // trace.curl_propagate：向出站请求注入traceparent
+    zend_array *curl_handles;     // curl句柄状态（请求级），按对象handle
+    zend_bool curl_injecting;     // 注入请求头时调用curl_setopt，不记录为用户设置
+    zend_bool db_enabled;         // trace.db：PDO/mysqli 原生埋点
+    zend_long db_fingerprint_cache;  // SQL指纹缓存的最大条数（worker级）
+    zend_array *db_fingerprints;  // SQL → 指纹（持久内存，worker内跨请求复用）
+    zend_array *mysqli_stmt_sql;  // mysqli_stmt的SQL（请求级），按对象handle
+    zend_bool cache_enabled;      // trace.cache：phpredis/memcached 原生埋点
+    trace_cache_last_t cache_last;
+    trace_cache_batch_t cache_batch;
     zval db_callback;
-    zval trace_whitelist;           // 用户函数白名单（file_pattern）
-    zval internal_trace_whitelist;  // 内部函数白名单（module_pattern）
+    trace_whitelist_t *trace_whitelist;           // 用户函数白名单（file_pattern，已编译）
+    trace_whitelist_t *internal_trace_whitelist;  // 内部函数白名单（module_pattern，已编译）
+    zend_array *trace_decision_cache;           // 用户函数跟踪决策缓存（请求级）
+    zend_array *internal_trace_decision_cache;  // 内部函数跟踪决策缓存（请求级）
+    char *hook_mode;                            // 钩子后端：observer / execute_ex
+    char *clock_source;                         // 时钟：monotonic / tsc
+    uint64_t clock_wall_anchor_ns;              // RINIT时的墙上时间（纳秒）
+    uint64_t clock_mono_anchor_ns;              // 同一时刻的单调时钟（纳秒）
+    trace_observer_frame_t *observer_frames;    // Observer模式的调用栈
+    uint32_t observer_frame_count;
+    uint32_t observer_frame_size;
+    zend_array *observer_unobserved;            // 未挂载处理器的函数（白名单变化时补挂）
+    zend_bool cli_enabled;                      // trace.cli_enabled：CLI下也安装函数调用钩子
+    zend_bool job_active;                       // trace_begin_job() 之后、trace_end_job() 之前
+    trace_func_decision_t trampoline_decision;  // trampoline不缓存，决策放在这里
 ZEND_END_MODULE_GLOBALS(trace)
 
 #ifdef ZTS
@@ -56,6 +427,19 @@ ZEND_DECLARE_MODULE_GLOBALS(trace)
 void (*original_zend_execute_ex)(zend_execute_data *execute_data) = NULL;
 void (*original_zend_execute_internal)(zend_execute_data *execute_data, zval *return_value) = NULL;
 
+// 是否使用Observer后端（模块级，MINIT时根据 trace.hook_mode 决定）
+static int trace_use_observer = 0;
+
+// TraceFrame类
+zend_class_entry *trace_frame_ce = NULL;
+static zend_object_handlers trace_frame_handlers;
+
+// TraceSpan / TraceSpanIterator类
+zend_class_entry *trace_span_ce = NULL;
+zend_class_entry *trace_span_iterator_ce = NULL;
+static zend_object_handlers trace_span_handlers;
+static zend_object_handlers trace_span_iterator_handlers;
+
 // 参数信息
 ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_get_trace_id, 0, 0, 0)
 ZEND_END_ARG_INFO()
@@ -84,11 +468,84 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_reset, 0, 0, 0)
     ZEND_ARG_INFO(0, trace_id)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_begin_job, 0, 0, 1)
+    ZEND_ARG_INFO(0, name)
+    ZEND_ARG_INFO(0, traceparent)
+    ZEND_ARG_INFO(0, tracestate)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_end_job, 0, 0, 0)
+    ZEND_ARG_INFO(0, failed)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_add_tag, 0, 0, 2)
     ZEND_ARG_INFO(0, key)
     ZEND_ARG_INFO(0, value)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_is_sampled, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_tail_sample, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_export, 0, 0, 0)
+    ZEND_ARG_INFO(0, format)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_export_folded, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_profiler_folded, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_ring_consume, 0, 0, 0)
+    ZEND_ARG_INFO(0, max_bytes)
+    ZEND_ARG_INFO(0, name)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_get_propagation_headers, 0, 0, 0)
+    ZEND_ARG_INFO(0, as_list)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_frame_void, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_frame_get_arg, 0, 0, 1)
+    ZEND_ARG_INFO(0, position)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_span_get_tag, 0, 0, 1)
+    ZEND_ARG_INFO(0, key)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_spans, 0, 0, 0)
+    ZEND_ARG_INFO(0, filters)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_get_stats, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_trace_get_function_stats, 0, 0, 0)
+    ZEND_ARG_INFO(0, with_histogram)
+ZEND_END_ARG_INFO()
+
+// Iterator/Countable的方法需要声明与接口一致的返回类型
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_trace_span_iterator_current, 0, 0, IS_MIXED, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_trace_span_iterator_key, 0, 0, IS_MIXED, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_trace_span_iterator_void, 0, 0, IS_VOID, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_trace_span_iterator_valid, 0, 0, _IS_BOOL, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_WITH_RETURN_TYPE_INFO_EX(arginfo_trace_span_iterator_count, 0, 0, IS_LONG, 0)
+ZEND_END_ARG_INFO()
+
 // Debug日志函数（默认开启，只记录关键信息）
 void trace_debug_log(const char *format, ...)
 {
@@ -112,908 +569,6525 @@ void trace_debug_log(const char *format, ...)
     }
 }
 
-// 工具函数
-double trace_get_microtime(void)
+// 时钟
+// span时间统一存为单调时钟的纳秒整数，不受NTP调整影响
+// 每个请求在RINIT时取一次墙上时间锚点，导出时再换算为绝对时间
+// trace.clock=tsc 时直接读取TSC，按MINIT时校准的频率换算为纳秒（需要invariant TSC）
+static int trace_clock_tsc = 0;
+static double trace_tsc_ns_per_tick = 0.0;
+static uint64_t trace_tsc_base_tick = 0;
+static uint64_t trace_tsc_base_ns = 0;
+
+static zend_always_inline uint64_t trace_monotonic_ns(void)
+{
+#if PHP_VERSION_ID >= 80300
+    return (uint64_t)zend_hrtime();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static zend_always_inline uint64_t trace_now_ns(void)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+#if TRACE_HAVE_TSC
+    if (trace_clock_tsc) {
+        return trace_tsc_base_ns + (uint64_t)((double)(__rdtsc() - trace_tsc_base_tick) * trace_tsc_ns_per_tick);
+    }
+#endif
+    return trace_monotonic_ns();
 }
 
-void trace_generate_ids(void)
+// 校准TSC频率（MINIT时调用一次），失败时保持使用单调时钟
+static void trace_clock_calibrate_tsc(void)
 {
-    char trace_id_str[33];
-    snprintf(trace_id_str, sizeof(trace_id_str), "%016lx%016lx", 
-             (unsigned long)time(NULL), (unsigned long)getpid());
+#if TRACE_HAVE_TSC
+    unsigned int eax, ebx, ecx, edx;
+    
+    // CPUID 0x80000007 EDX bit 8：invariant TSC，频率恒定且不受节能状态影响
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1U << 8))) {
+        trace_debug_log("[CLOCK] CPU不支持invariant TSC，使用单调时钟");
+        return;
+    }
     
-    if (TRACE_G(trace_id)) {
-        zend_string_release(TRACE_G(trace_id));
+    struct timespec wait = {0, 10 * 1000 * 1000};  // 10ms
+    uint64_t start_ns = trace_monotonic_ns();
+    uint64_t start_tick = __rdtsc();
+    nanosleep(&wait, NULL);
+    uint64_t end_ns = trace_monotonic_ns();
+    uint64_t end_tick = __rdtsc();
+    
+    if (end_tick <= start_tick || end_ns <= start_ns) {
+        return;
     }
-    TRACE_G(trace_id) = zend_string_init(trace_id_str, strlen(trace_id_str), 0);
+    
+    trace_tsc_ns_per_tick = (double)(end_ns - start_ns) / (double)(end_tick - start_tick);
+    trace_tsc_base_tick = end_tick;
+    trace_tsc_base_ns = end_ns;
+    trace_clock_tsc = 1;
+#else
+    trace_debug_log("[CLOCK] 当前平台不支持TSC，使用单调时钟");
+#endif
 }
 
-zend_string* trace_generate_span_id(void)
+// 记录请求的墙上时间锚点
+static void trace_clock_anchor(void)
 {
-    char span_id_str[17];
-    snprintf(span_id_str, sizeof(span_id_str), "%016lx", 
-             (unsigned long)(time(NULL) + (++TRACE_G(span_counter))));
-    return zend_string_init(span_id_str, strlen(span_id_str), 0);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    TRACE_G(clock_mono_anchor_ns) = trace_now_ns();
+    TRACE_G(clock_wall_anchor_ns) = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
-trace_span_t* trace_create_span(const char *operation_name, trace_span_t *parent)
+// 单调时间换算为墙上时间（秒）
+double trace_ns_to_wall(uint64_t ns)
 {
-    trace_span_t *span = emalloc(sizeof(trace_span_t));
-    
-    span->span_id = trace_generate_span_id();
-    span->parent_id = parent ? zend_string_copy(parent->span_id) : NULL;
-    span->operation_name = zend_string_init(operation_name, strlen(operation_name), 0);
-    span->start_time = trace_get_microtime();
-    span->end_time = 0.0;
-    span->parent = parent;
+    int64_t offset = (int64_t)(ns - TRACE_G(clock_mono_anchor_ns));
+    return (double)((int64_t)TRACE_G(clock_wall_anchor_ns) + offset) / 1000000000.0;
+}
+
+// 当前墙上时间（秒），用于log时间戳
+double trace_get_microtime(void)
+{
+    return trace_ns_to_wall(trace_now_ns());
+}
+
+// ID生成
+// TraceID(128位)和SpanID(64位)以整数保存，由 xoshiro256** 生成
+// 每个进程用系统随机源播种一次；FPM子进程从master fork出来后状态相同，RINIT时发现pid变化就重新播种
+// 十六进制字符串只在导出或通过PHP API读取时生成
+static zend_always_inline uint64_t trace_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t trace_splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// 从系统随机源读取种子，不可用时退化为时间、pid和地址的混合
+void trace_prng_seed(uint64_t state[4])
+{
+    uint64_t seed[4] = {0, 0, 0, 0};
+    size_t filled = 0;
     
-    // 调试：只记录异常情况（parent为空但root_span存在）
-    if (!parent && TRACE_G(root_span)) {
-        trace_debug_log("[SPAN_CREATE] ⚠️ 创建无父级span: %s (current_span=%p, root_span=%p)",
-                       operation_name,
-                       TRACE_G(current_span),
-                       TRACE_G(root_span));
+#ifdef HAVE_GETRANDOM
+    ssize_t n = getrandom(seed, sizeof(seed), GRND_NONBLOCK);
+    if (n == (ssize_t)sizeof(seed)) {
+        filled = sizeof(seed);
+    }
+#endif
+    if (filled < sizeof(seed)) {
+        int fd = open("/dev/urandom", O_RDONLY);
+        if (fd >= 0) {
+            if (read(fd, seed, sizeof(seed)) == (ssize_t)sizeof(seed)) {
+                filled = sizeof(seed);
+            }
+            close(fd);
+        }
     }
     
-    // 初始化tags
-    ALLOC_HASHTABLE(span->tags);
-    zend_hash_init(span->tags, 0, NULL, ZVAL_PTR_DTOR, 0);
+    // 再经过splitmix64扩散，同时保证状态不全为0
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t mix = seed[0] ^ ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^
+                   ((uint64_t)getpid() << 16) ^ (uint64_t)(uintptr_t)state;
+    int i;
+    for (i = 0; i < 4; i++) {
+        state[i] = trace_splitmix64(&mix) ^ (filled ? seed[i] : 0);
+    }
+    if ((state[0] | state[1] | state[2] | state[3]) == 0) {
+        state[0] = 0x9e3779b97f4a7c15ULL;
+    }
+}
+
+static zend_always_inline uint64_t trace_prng_next(void)
+{
+    uint64_t *st = TRACE_G(prng_state);
+    uint64_t result = trace_rotl(st[1] * 5, 7) * 9;
+    uint64_t t = st[1] << 17;
     
-    // 初始化logs
-    ALLOC_HASHTABLE(span->logs);
-    zend_hash_init(span->logs, 0, NULL, ZVAL_PTR_DTOR, 0);
+    st[2] ^= st[0];
+    st[3] ^= st[1];
+    st[1] ^= st[2];
+    st[0] ^= st[3];
+    st[2] ^= t;
+    st[3] = trace_rotl(st[3], 45);
     
-    if (TRACE_G(all_spans)) {
-        zval span_zval;
-        /* 将span指针存储到zval中，以便可以将其添加到all_spans哈希表中 */
-        ZVAL_PTR(&span_zval, span);
-        zend_hash_next_index_insert(TRACE_G(all_spans), &span_zval);
+    return result;
+}
+
+// 生成非0的随机ID（0保留表示"无"）
+uint64_t trace_random_id(void)
+{
+    uint64_t id;
+    do {
+        id = trace_prng_next();
+    } while (id == 0);
+    return id;
+}
+
+// 64位整数格式化为16个十六进制字符（不写结尾的\0）
+static zend_always_inline void trace_format_hex64(char *buf, uint64_t value)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    for (i = 15; i >= 0; i--) {
+        buf[i] = hex[value & 0xf];
+        value >>= 4;
     }
-    
-    return span;
 }
 
-void trace_finish_span(trace_span_t *span)
+// SpanID的十六进制字符串
+zend_string *trace_span_id_str(uint64_t span_id)
 {
-    if (span && span->end_time == 0.0) {
-        span->end_time = trace_get_microtime();
+    zend_string *str = zend_string_alloc(16, 0);
+    trace_format_hex64(ZSTR_VAL(str), span_id);
+    ZSTR_VAL(str)[16] = '\0';
+    return str;
+}
+
+// TraceID的十六进制字符串（缓存到请求结束或TraceID变化），未初始化时返回NULL
+zend_string *trace_get_trace_id_str(void)
+{
+    if (!TRACE_G(trace_id_hi) && !TRACE_G(trace_id_lo)) {
+        return NULL;
+    }
+    if (!TRACE_G(trace_id_str)) {
+        zend_string *str = zend_string_alloc(32, 0);
+        trace_format_hex64(ZSTR_VAL(str), TRACE_G(trace_id_hi));
+        trace_format_hex64(ZSTR_VAL(str) + 16, TRACE_G(trace_id_lo));
+        ZSTR_VAL(str)[32] = '\0';
+        TRACE_G(trace_id_str) = str;
     }
+    return TRACE_G(trace_id_str);
 }
 
-void trace_call_user_callback(zval *callback, int argc, zval *argv, zval *retval)
+// 设置TraceID（hi和lo同时为0表示清空）
+void trace_set_trace_id(uint64_t hi, uint64_t lo)
 {
-    if (Z_ISUNDEF_P(callback)) {
-        trace_debug_log("[ERROR] 回调未定义");
-        return;
+    TRACE_G(trace_id_hi) = hi;
+    TRACE_G(trace_id_lo) = lo;
+    if (TRACE_G(trace_id_str)) {
+        zend_string_release(TRACE_G(trace_id_str));
+        TRACE_G(trace_id_str) = NULL;
     }
+}
+
+// 解析最多32位的十六进制TraceID（不足32位时左侧补0），全0或含非十六进制字符时失败
+int trace_parse_trace_id(const char *str, size_t len, uint64_t *hi, uint64_t *lo)
+{
+    uint64_t h = 0, l = 0;
+    size_t i;
     
-    // 检查回调是否可调用
-    if (!zend_is_callable(callback, 0, NULL)) {
-        return;
+    if (len == 0 || len > 32) {
+        return FAILURE;
     }
-    
-    // ⚠️ 设置重入保护标志，防止回调中的函数调用再次触发追踪
-    TRACE_G(in_trace_callback) = 1;
-    
-    // 调用用户函数
-    call_user_function(CG(function_table), NULL, callback, retval, argc, argv);
-    
-    // ⚠️ 清除重入保护标志
-    TRACE_G(in_trace_callback) = 0;
-    
-    // 清除可能的异常，避免影响后续执行
-    if (EG(exception)) {
-        zend_clear_exception();
+    for (i = 0; i < len; i++) {
+        char c = str[i];
+        uint64_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return FAILURE;
+        }
+        h = (h << 4) | (l >> 60);
+        l = (l << 4) | digit;
+    }
+    if (h == 0 && l == 0) {
+        return FAILURE;
     }
+    *hi = h;
+    *lo = l;
+    return SUCCESS;
 }
 
-// 简单的通配符匹配函数（支持 * 通配符）
-// 例如: "App\\Controller\\*" 匹配 "App\\Controller\\UserController"
-//      "/app/*/test.php" 匹配 "/app/controllers/test.php"
-//      "*" 匹配任何字符串
-int trace_wildcard_match(const char *str, const char *pattern)
+void trace_generate_ids(void)
 {
-    if (!pattern || strcmp(pattern, "*") == 0) {
-        return 1;  // 没有pattern或pattern是*，匹配所有
+    uint64_t hi = trace_prng_next();
+    trace_set_trace_id(hi, trace_random_id());
+}
+
+// W3C Trace Context
+// traceparent: {version:2}-{trace-id:32}-{parent-id:16}-{flags:2}，全部为小写十六进制
+#define TRACE_TRACEPARENT_LEN 55
+#define TRACE_TRACESTATE_MAX_LEN 512
+
+// "00-{trace_id}-{parent_id}-{flags}"，写入 TRACE_TRACEPARENT_LEN 个字符
+static void trace_format_traceparent(char *out, uint64_t parent_id)
+{
+    memcpy(out, "00-", 3);
+    trace_format_hex64(out + 3, TRACE_G(trace_id_hi));
+    trace_format_hex64(out + 19, TRACE_G(trace_id_lo));
+    out[35] = '-';
+    trace_format_hex64(out + 36, parent_id);
+    out[52] = '-';
+    out[53] = '0';
+    out[54] = TRACE_G(sampled) ? '1' : '0';
+}
+
+// 解析定长十六进制，成功返回SUCCESS
+static int trace_parse_hex64(const char *str, size_t len, uint64_t *out)
+{
+    uint64_t value = 0;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        char c = str[i];
+        if (c >= '0' && c <= '9') {
+            value = (value << 4) | (uint64_t)(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value = (value << 4) | (uint64_t)(c - 'a' + 10);
+        } else {
+            return FAILURE;
+        }
     }
+    *out = value;
+    return SUCCESS;
+}
+
+// 解析traceparent，返回采样标记（1/0），无效时返回-1
+int trace_parse_traceparent(const char *header, size_t len, uint64_t *trace_hi, uint64_t *trace_lo, uint64_t *parent_id)
+{
+    uint64_t version, flags;
     
-    if (!str) {
-        return 0;  // 没有str，不匹配
+    if (len < TRACE_TRACEPARENT_LEN ||
+        header[2] != '-' || header[35] != '-' || header[52] != '-' ||
+        trace_parse_hex64(header, 2, &version) == FAILURE || version == 0xff ||
+        trace_parse_hex64(header + 3, 16, trace_hi) == FAILURE ||
+        trace_parse_hex64(header + 19, 16, trace_lo) == FAILURE ||
+        trace_parse_hex64(header + 36, 16, parent_id) == FAILURE ||
+        trace_parse_hex64(header + 53, 2, &flags) == FAILURE) {
+        return -1;
     }
     
-    const char *s = str;
-    const char *p = pattern;
-    const char *star_pos = NULL;
-    const char *match_pos = NULL;
-    
-    while (*s) {
-        if (*p == '*') {
-            // 遇到 *，记录位置
-            star_pos = p++;
-            match_pos = s;
-        } else if (*p == *s) {
-            // 字符匹配，继续
-            p++;
-            s++;
-        } else if (star_pos) {
-            // 不匹配，回溯到上一个 *
-            p = star_pos + 1;
-            s = ++match_pos;
-        } else {
-            // 不匹配且没有 * 可以回溯
-            return 0;
-        }
+    // 版本00必须正好55个字符；更高版本允许在后面追加字段
+    if ((version == 0 && len != TRACE_TRACEPARENT_LEN) ||
+        (len > TRACE_TRACEPARENT_LEN && header[TRACE_TRACEPARENT_LEN] != '-')) {
+        return -1;
     }
     
-    // 处理pattern末尾的 *
-    while (*p == '*') {
-        p++;
+    if ((*trace_hi == 0 && *trace_lo == 0) || *parent_id == 0) {
+        return -1;
     }
     
-    // 如果pattern也结束了，则匹配成功
-    return *p == '\0';
+    return (int)(flags & 0x01);
 }
 
-// 检查字符串是否匹配模式数组
-// patterns 是一个数组，每项都需要匹配（AND关系）
-// 如果pattern以 "! " 开头，表示反向匹配（不应该匹配）
-// 返回：1=匹配，0=不匹配
-int trace_match_patterns(const char *str, zval *patterns)
+// 从SAPI读取上游的traceparent/tracestate（不经过$_SERVER）
+// 有效时设置TraceID和上游parent-id，返回上游采样标记，否则返回-1
+static int trace_apply_trace_context(const char *traceparent, size_t traceparent_len,
+                                     const char *tracestate, size_t tracestate_len)
 {
-    if (!patterns) {
-        return 1;  // 没有pattern，匹配所有
+    uint64_t trace_hi, trace_lo, parent_id;
+    int upstream_sampled = trace_parse_traceparent(traceparent, traceparent_len, &trace_hi, &trace_lo, &parent_id);
+    
+    if (upstream_sampled < 0) {
+        // 请求头由客户端控制，不能让它决定是否写文件
+        if (TRACE_G(debug_enabled)) {
+            trace_debug_log("[PROPAGATION] 忽略无效的traceparent");
+        }
+        return -1;
     }
     
-    // 如果是字符串，转换为单元素数组处理
-    if (Z_TYPE_P(patterns) == IS_STRING) {
-        const char *pattern = Z_STRVAL_P(patterns);
-        int is_negative = (strlen(pattern) > 2 && pattern[0] == '!' && pattern[1] == ' ');
-        const char *actual_pattern = is_negative ? pattern + 2 : pattern;
-        int match_result = trace_wildcard_match(str, actual_pattern);
-        return is_negative ? !match_result : match_result;
-    }
-    
-    // 如果是数组，所有pattern都需要匹配（AND关系）
-    if (Z_TYPE_P(patterns) == IS_ARRAY) {
-        zval *pattern_item;
-        ZEND_HASH_FOREACH_VAL(Z_ARR_P(patterns), pattern_item) {
-            if (Z_TYPE_P(pattern_item) != IS_STRING) {
-                continue;
-            }
-            
-            const char *pattern = Z_STRVAL_P(pattern_item);
-            int is_negative = (strlen(pattern) > 2 && pattern[0] == '!' && pattern[1] == ' ');
-            const char *actual_pattern = is_negative ? pattern + 2 : pattern;
-            int match_result = trace_wildcard_match(str, actual_pattern);
-            
-            // 正向匹配：需要匹配
-            // 反向匹配：不应该匹配
-            if (is_negative) {
-                if (match_result) {
-                    return 0;  // 反向匹配成功（不应该匹配但匹配了），整体失败
-                }
-            } else {
-                if (!match_result) {
-                    return 0;  // 正向匹配失败，整体失败
-                }
-            }
-        } ZEND_HASH_FOREACH_END();
-        return 1;  // 所有pattern都通过
+    trace_set_trace_id(trace_hi, trace_lo);
+    TRACE_G(upstream_parent_id) = parent_id;
+    
+    if (tracestate && tracestate_len > 0 && tracestate_len <= TRACE_TRACESTATE_MAX_LEN) {
+        TRACE_G(tracestate) = zend_string_init(tracestate, tracestate_len, 0);
     }
     
-    return 1;  // 其他类型，默认匹配
+    return upstream_sampled;
 }
 
-// 判断是否应该跟踪函数
-// 白名单格式：[
-//   [
-//     'file_pattern' => ['/app/*', '! */vendor/*'],  // 在/app/下 且 不在vendor下
-//     'class_pattern' => ['App\\*'],
-//     'function_pattern' => ['handle*', '! *Internal']
-//   ]
-// ]
-// 多个规则之间是 OR 关系（符合任意一个即可）
-// 每个规则内部的条件是 AND 关系（都要符合）
-// 每个字段的多个pattern也是 AND 关系（都要符合）
-// 判断是否应该跟踪用户函数（PHP代码）
-int trace_should_trace_function(zend_execute_data *execute_data)
+static int trace_ingest_trace_context(void)
 {
-    if (!execute_data || !execute_data->func) {
-        return 0;
+    char *traceparent = sapi_getenv("HTTP_TRACEPARENT", sizeof("HTTP_TRACEPARENT") - 1);
+    char *tracestate;
+    int upstream_sampled;
+    
+    if (!traceparent) {
+        return -1;
     }
     
-    // 只处理用户函数
-    if (execute_data->func->type != ZEND_USER_FUNCTION) {
-        return 0;
+    tracestate = sapi_getenv("HTTP_TRACESTATE", sizeof("HTTP_TRACESTATE") - 1);
+    upstream_sampled = trace_apply_trace_context(traceparent, strlen(traceparent),
+                                                 tracestate, tracestate ? strlen(tracestate) : 0);
+    efree(traceparent);
+    if (tracestate) {
+        efree(tracestate);
     }
     
-    // 始终跳过trace扩展自身的函数，避免无限递归
-    if (execute_data->func->common.function_name &&
-        strncmp(ZSTR_VAL(execute_data->func->common.function_name), "trace_", 6) == 0) {
+    return upstream_sampled;
+}
+
+// 清空上游上下文
+static void trace_clear_trace_context(void)
+{
+    TRACE_G(upstream_parent_id) = 0;
+    if (TRACE_G(tracestate)) {
+        zend_string_release(TRACE_G(tracestate));
+        TRACE_G(tracestate) = NULL;
+    }
+}
+
+// 头部采样
+// 在请求开始时决定是否跟踪，未采样的请求不创建span、不调用回调，只保留TraceID用于日志关联
+// upstream_sampled: 上游传来的采样标记，1/0，-1表示没有
+#define TRACE_SAMPLE_UNKNOWN (-1)
+
+// 尾部采样
+// 返回1保留、0丢弃；未开启尾部采样时，已采样的请求全部保留
+int trace_wildcard_match(const char *str, const char *pattern);
+
+#define TRACE_ERROR_MASK (E_ERROR | E_CORE_ERROR | E_COMPILE_ERROR | E_USER_ERROR | E_RECOVERABLE_ERROR | E_PARSE)
+
+// 请求路径是否命中 trace.tail_routes
+static int trace_tail_route_match(const char *uri)
+{
+    if (!uri || !TRACE_G(tail_routes) || !*TRACE_G(tail_routes)) {
+        return 0;
+    }
+    
+    char *routes = estrdup(TRACE_G(tail_routes));
+    char *cursor = routes;
+    int matched = 0;
+    
+    while (cursor && !matched) {
+        char *next = strchr(cursor, ',');
+        if (next) {
+            *next++ = '\0';
+        }
+        // 去掉两端空白
+        while (*cursor == ' ' || *cursor == '\t') {
+            cursor++;
+        }
+        char *end = cursor + strlen(cursor);
+        while (end > cursor && (end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = '\0';
+        }
+        if (*cursor && trace_wildcard_match(uri, cursor)) {
+            matched = 1;
+        }
+        cursor = next;
+    }
+    
+    efree(routes);
+    return matched;
+}
+
+// 带error tag（值为真）的span
+static int trace_span_has_error(trace_span_t *span)
+{
+    if (span->tags) {
+        zval *error = zend_hash_str_find(span->tags, "error", sizeof("error") - 1);
+        if (error && zend_is_true(error)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 是否有span带有error tag
+static int trace_tail_has_error_span(void)
+{
+    trace_span_t *span;
+    TRACE_FOREACH_SPAN(span) {
+        if (trace_span_has_error(span)) {
+            return 1;
+        }
+    } TRACE_FOREACH_SPAN_END();
+    return 0;
+}
+
+int trace_tail_evaluate(void)
+{
+    if (!TRACE_G(enabled) || !TRACE_G(sampled) || !TRACE_G(root_span)) {
+        return 0;
+    }
+    if (!TRACE_G(tail_sampling)) {
+        return 1;
+    }
+    
+    // 延迟：根span未结束时按当前时间计算
+    if (TRACE_G(tail_latency_ms) > 0) {
+        trace_span_t *root = TRACE_G(root_span);
+        uint64_t end_ns = root->end_ns ? root->end_ns : trace_now_ns();
+        if (end_ns - root->start_ns >= (uint64_t)TRACE_G(tail_latency_ms) * 1000000ULL) {
+            return 1;
+        }
+    }
+    
+    if (TRACE_G(tail_keep_errors)) {
+        if ((PG(last_error_type) & TRACE_ERROR_MASK) || SG(sapi_headers).http_response_code >= 500) {
+            return 1;
+        }
+        if (trace_tail_has_error_span()) {
+            return 1;
+        }
+    }
+    
+    if (trace_tail_route_match(SG(request_info).request_uri)) {
+        return 1;
+    }
+    
+    if (TRACE_G(tail_base_rate) <= 0.0) {
+        return 0;
+    }
+    if (TRACE_G(tail_roll) < 0.0) {
+        TRACE_G(tail_roll) = (double)(trace_prng_next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+    return TRACE_G(tail_roll) < TRACE_G(tail_base_rate);
+}
+
+// 从令牌桶取一个令牌（每个worker一个桶，容量为一秒的配额）
+static int trace_rate_limit_take(void)
+{
+    if (TRACE_G(rate_limit) <= 0) {
+        return 1;
+    }
+    
+    double limit = (double)TRACE_G(rate_limit);
+    uint64_t now = trace_now_ns();
+    
+    if (TRACE_G(rate_last_ns) == 0) {
+        TRACE_G(rate_tokens) = limit;
+    } else if (now > TRACE_G(rate_last_ns)) {
+        TRACE_G(rate_tokens) += (double)(now - TRACE_G(rate_last_ns)) * limit / 1000000000.0;
+        if (TRACE_G(rate_tokens) > limit) {
+            TRACE_G(rate_tokens) = limit;
+        }
+    }
+    TRACE_G(rate_last_ns) = now;
+    
+    if (TRACE_G(rate_tokens) < 1.0) {
+        return 0;
+    }
+    TRACE_G(rate_tokens) -= 1.0;
+    return 1;
+}
+
+int trace_sample_decide(int upstream_sampled)
+{
+    if (upstream_sampled != TRACE_SAMPLE_UNKNOWN && TRACE_G(sampling_honor_upstream)) {
+        return upstream_sampled;
+    }
+    
+    double rate = TRACE_G(sample_rate);
+    if (rate <= 0.0) {
+        return 0;
+    }
+    // 取53位随机数映射到[0, 1)
+    if (rate < 1.0 && (double)(trace_prng_next() >> 11) * (1.0 / 9007199254740992.0) >= rate) {
+        return 0;
+    }
+    
+    return trace_rate_limit_take();
+}
+
+// 从span存储块中分配一个span
+static trace_span_t *trace_span_alloc(void)
+{
+    trace_span_chunk_t *chunk = TRACE_G(span_chunks_tail);
+    
+    if (!chunk || chunk->used == TRACE_SPAN_CHUNK_SIZE) {
+        if (TRACE_G(span_chunk_pool)) {
+            chunk = TRACE_G(span_chunk_pool);
+            TRACE_G(span_chunk_pool) = chunk->next;
+            TRACE_G(span_chunk_pool_count)--;
+        } else {
+            chunk = emalloc(sizeof(trace_span_chunk_t));
+        }
+        chunk->next = NULL;
+        chunk->used = 0;
+        if (TRACE_G(span_chunks_tail)) {
+            TRACE_G(span_chunks_tail)->next = chunk;
+        } else {
+            TRACE_G(span_chunks) = chunk;
+        }
+        TRACE_G(span_chunks_tail) = chunk;
+    }
+    
+    TRACE_G(span_count)++;
+    return &chunk->spans[chunk->used++];
+}
+
+// 复用池最多保留的块数：够一个trace用满预算即可，不限制span数时保留64块
+static zend_always_inline uint32_t trace_span_pool_max(void)
+{
+    return TRACE_G(max_spans) > 0 ? (uint32_t)(TRACE_G(max_spans) / TRACE_SPAN_CHUNK_SIZE) + 1 : 64;
+}
+
+// 释放所有span（请求结束、trace_reset()、trace_end_job() 时调用）
+// 存储块放回复用池，聚合表清空后保留，下一个trace不需要重新分配
+void trace_spans_free(void)
+{
+    trace_span_chunk_t *chunk = TRACE_G(span_chunks);
+    uint32_t pool_max = trace_span_pool_max();
+    
+    while (chunk) {
+        trace_span_chunk_t *next = chunk->next;
+        uint32_t i;
+        for (i = 0; i < chunk->used; i++) {
+            trace_span_t *span = &chunk->spans[i];
+            zend_string_release(span->operation_name);
+            // TraceSpan::getTags()/getLogs() 返回的是同一个数组，可能还被PHP代码持有
+            if (span->tags) {
+                zend_array_release(span->tags);
+            }
+            if (span->logs) {
+                zend_array_release(span->logs);
+            }
+        }
+        if (TRACE_G(span_chunk_pool_count) < pool_max) {
+            chunk->next = TRACE_G(span_chunk_pool);
+            TRACE_G(span_chunk_pool) = chunk;
+            TRACE_G(span_chunk_pool_count)++;
+        } else {
+            efree(chunk);
+        }
+        chunk = next;
+    }
+    
+    TRACE_G(span_chunks) = NULL;
+    TRACE_G(span_chunks_tail) = NULL;
+    TRACE_G(span_count) = 0;
+    TRACE_G(span_generation)++;
+    TRACE_G(current_span) = NULL;
+    TRACE_G(root_span) = NULL;
+    
+    // 聚合span随spans一起释放
+    if (TRACE_G(overflow_ops)) {
+        zend_hash_clean(TRACE_G(overflow_ops));
+    }
+    TRACE_G(overflow_depth) = 0;
+    TRACE_G(stats).calls_aggregated += TRACE_G(overflow_calls);
+    TRACE_G(stats).tags_dropped += TRACE_G(dropped_tags);
+    TRACE_G(stats).logs_dropped += TRACE_G(dropped_logs);
+    TRACE_G(stats).bytes += TRACE_G(memory_used);
+    TRACE_G(memory_used) = 0;
+    TRACE_G(overflow_calls) = 0;
+    TRACE_G(dropped_tags) = 0;
+    TRACE_G(dropped_logs) = 0;
+}
+
+// 请求结束时释放复用池和聚合表
+static void trace_span_pool_free(void)
+{
+    while (TRACE_G(span_chunk_pool)) {
+        trace_span_chunk_t *next = TRACE_G(span_chunk_pool)->next;
+        efree(TRACE_G(span_chunk_pool));
+        TRACE_G(span_chunk_pool) = next;
+    }
+    TRACE_G(span_chunk_pool_count) = 0;
+    
+    if (TRACE_G(overflow_ops)) {
+        zend_hash_destroy(TRACE_G(overflow_ops));
+        FREE_HASHTABLE(TRACE_G(overflow_ops));
+        TRACE_G(overflow_ops) = NULL;
+    }
+    if (TRACE_G(overflow_stack)) {
+        efree(TRACE_G(overflow_stack));
+        TRACE_G(overflow_stack) = NULL;
+    }
+    TRACE_G(overflow_size) = 0;
+}
+
+// 取span的tags/logs用于写入：第一次写入时创建，被PHP代码持有时先分离（写时复制）
+static zend_always_inline HashTable *trace_span_tags(trace_span_t *span)
+{
+    if (!span->tags) {
+        span->tags = zend_new_array(0);
+    } else if (GC_REFCOUNT(span->tags) > 1) {
+        GC_DELREF(span->tags);
+        span->tags = zend_array_dup(span->tags);
+    }
+    return span->tags;
+}
+
+static zend_always_inline HashTable *trace_span_logs(trace_span_t *span)
+{
+    if (!span->logs) {
+        span->logs = zend_new_array(0);
+    } else if (GC_REFCOUNT(span->logs) > 1) {
+        GC_DELREF(span->logs);
+        span->logs = zend_array_dup(span->logs);
+    }
+    return span->logs;
+}
+
+// 预算
+// 内存按估算值计入：span结构体、tag/log的bucket和字符串；共享的字符串也按新分配计算
+static zend_always_inline int trace_memory_exhausted(void)
+{
+    return TRACE_G(max_memory) > 0 && TRACE_G(memory_used) >= (size_t)TRACE_G(max_memory);
+}
+
+static zend_always_inline int trace_budget_exhausted(void)
+{
+    return (TRACE_G(max_spans) > 0 && TRACE_G(span_count) >= (zend_ulong)TRACE_G(max_spans))
+        || trace_memory_exhausted();
+}
+
+static size_t trace_zval_cost(zval *value)
+{
+    ZVAL_DEREF(value);
+    switch (Z_TYPE_P(value)) {
+        case IS_STRING:
+            return ZSTR_IS_INTERNED(Z_STR_P(value)) ? 0 : _ZSTR_STRUCT_SIZE(Z_STRLEN_P(value));
+        case IS_ARRAY:
+            return sizeof(HashTable) + zend_hash_num_elements(Z_ARRVAL_P(value)) * sizeof(Bucket);
+        default:
+            return 0;
+    }
+}
+
+// 能否再给span添加一个新的tag/log（更新已有的tag不受限制）
+static zend_always_inline int trace_span_tag_room(trace_span_t *span)
+{
+    if (trace_memory_exhausted()) {
+        return 0;
+    }
+    return TRACE_G(max_tags_per_span) <= 0 || !span->tags
+        || zend_hash_num_elements(span->tags) < (uint32_t)TRACE_G(max_tags_per_span);
+}
+
+static zend_always_inline int trace_span_log_room(trace_span_t *span)
+{
+    if (trace_memory_exhausted()) {
+        return 0;
+    }
+    return TRACE_G(max_logs_per_span) <= 0 || !span->logs
+        || zend_hash_num_elements(span->logs) < (uint32_t)TRACE_G(max_logs_per_span);
+}
+
+// 添加或更新一个tag，超出上限时丢弃并计数，返回是否写入
+static int trace_span_set_tag(trace_span_t *span, zend_string *key, zval *value, int overwrite)
+{
+    HashTable *tags = trace_span_tags(span);
+    zval copy;
+    
+    if (zend_hash_find(tags, key)) {
+        if (overwrite) {
+            ZVAL_COPY(&copy, value);
+            zend_hash_update(tags, key, &copy);
+        }
+        return overwrite;
+    }
+    if (!trace_span_tag_room(span)) {
+        TRACE_G(dropped_tags)++;
+        return 0;
+    }
+    ZVAL_COPY(&copy, value);
+    zend_hash_add_new(tags, key, &copy);
+    TRACE_G(memory_used) += sizeof(Bucket) + trace_zval_cost(value);
+    return 1;
+}
+
+// 同上，键为C字符串，value的所有权转移给span；已有的tag直接覆盖（原生埋点写tag用）
+static int trace_span_set_tag_str(trace_span_t *span, const char *key, size_t key_len, zval *value)
+{
+    HashTable *tags = trace_span_tags(span);
+    zval *old = zend_hash_str_find(tags, key, key_len);
+    
+    if (old) {
+        TRACE_G(memory_used) += trace_zval_cost(value);
+        zval_ptr_dtor(old);
+        ZVAL_COPY_VALUE(old, value);
+        return 1;
+    }
+    if (!trace_span_tag_room(span)) {
+        TRACE_G(dropped_tags)++;
+        zval_ptr_dtor(value);
+        return 0;
+    }
+    TRACE_G(memory_used) += sizeof(Bucket) + trace_zval_cost(value);
+    zend_hash_str_add_new(tags, key, key_len, value);
+    return 1;
+}
+
+#define TRACE_SPAN_SET_TAG(span, key, value) trace_span_set_tag_str(span, key, sizeof(key) - 1, value)
+
+// 原生埋点标记span出错：尾部采样按error tag保留trace，不受tag上限限制，只计入内存
+static void trace_span_set_error(trace_span_t *span)
+{
+    HashTable *tags = trace_span_tags(span);
+    zval tag;
+    
+    if (!zend_hash_str_exists(tags, "error", sizeof("error") - 1)) {
+        TRACE_G(memory_used) += sizeof(Bucket);
+    }
+    ZVAL_TRUE(&tag);
+    zend_hash_str_update(tags, "error", sizeof("error") - 1, &tag);
+}
+
+// 追加一条log（log_entry的所有权转移给span），超出上限时释放并计数
+static int trace_span_add_log(trace_span_t *span, zval *log_entry)
+{
+    if (!trace_span_log_room(span)) {
+        TRACE_G(dropped_logs)++;
+        zval_ptr_dtor(log_entry);
+        return 0;
+    }
+    TRACE_G(memory_used) += sizeof(Bucket) + trace_zval_cost(log_entry);
+    zval *message = zend_hash_str_find(Z_ARRVAL_P(log_entry), "message", sizeof("message") - 1);
+    if (message) {
+        TRACE_G(memory_used) += trace_zval_cost(message);
+    }
+    zend_hash_next_index_insert(trace_span_logs(span), log_entry);
+    return 1;
+}
+
+trace_span_t* trace_create_span_ex(zend_string *operation_name, trace_span_t *parent)
+{
+    uint64_t begin_ns = trace_now_ns();
+    trace_span_t *span = trace_span_alloc();
+    
+    span->span_id = trace_random_id();
+    span->parent_id = parent ? parent->span_id : 0;
+    span->operation_name = zend_string_copy(operation_name);
+    span->end_ns = 0;
+    span->child_ns = 0;
+    span->parent = parent;
+    span->flags = 0;
+    span->tags = NULL;
+    span->logs = NULL;
+    TRACE_G(memory_used) += sizeof(trace_span_t)
+        + (ZSTR_IS_INTERNED(operation_name) ? 0 : _ZSTR_STRUCT_SIZE(ZSTR_LEN(operation_name)));
+    // 开始时间最后读取，同时作为span创建耗时的结束时间
+    span->start_ns = trace_now_ns();
+    TRACE_G(stats).span_ns += span->start_ns - begin_ns;
+    TRACE_G(stats).spans_created++;
+    
+    // 调试：只记录异常情况（parent为空但root_span存在）
+    if (!parent && TRACE_G(root_span)) {
+        trace_debug_log("[SPAN_CREATE] ⚠️ 创建无父级span: %s (current_span=%p, root_span=%p)",
+                       ZSTR_VAL(operation_name),
+                       TRACE_G(current_span),
+                       TRACE_G(root_span));
+    }
+    
+    return span;
+}
+
+trace_span_t* trace_create_span(const char *operation_name, trace_span_t *parent)
+{
+    zend_string *name = zend_string_init(operation_name, strlen(operation_name), 0);
+    trace_span_t *span = trace_create_span_ex(name, parent);
+    zend_string_release(name);
+    return span;
+}
+
+void trace_finish_span(trace_span_t *span)
+{
+    if (span && span->end_ns == 0) {
+        span->end_ns = trace_now_ns();
+        if (span->parent) {
+            span->parent->child_ns += span->end_ns - span->start_ns;
+        }
+    }
+}
+
+// 未结束的span按当前时间计算耗时
+static zend_always_inline uint64_t trace_span_duration_ns(trace_span_t *span, uint64_t now)
+{
+    return (span->end_ns ? span->end_ns : now) - span->start_ns;
+}
+
+// span实际占用的时间：聚合span的时间范围覆盖多次调用，取各次调用耗时之和
+static uint64_t trace_span_busy_ns(trace_span_t *span, uint64_t now)
+{
+    if ((span->flags & TRACE_SPAN_OVERFLOW) && span->tags) {
+        zval *total = zend_hash_str_find(span->tags, "overflow.total_ns", sizeof("overflow.total_ns") - 1);
+        if (total && Z_TYPE_P(total) == IS_LONG) {
+            return (uint64_t)Z_LVAL_P(total);
+        }
+    }
+    if ((span->flags & TRACE_SPAN_FOLDED) && span->tags) {
+        zval *total = zend_hash_str_find(span->tags, "cache.total_ns", sizeof("cache.total_ns") - 1);
+        if (total && Z_TYPE_P(total) == IS_LONG) {
+            return (uint64_t)Z_LVAL_P(total);
+        }
+    }
+    return trace_span_duration_ns(span, now);
+}
+
+// 自身耗时（扣除子span）
+static uint64_t trace_span_self_ns(trace_span_t *span, uint64_t now)
+{
+    uint64_t busy = trace_span_busy_ns(span, now);
+    return busy > span->child_ns ? busy - span->child_ns : 0;
+}
+
+void trace_call_user_callback(zval *callback, int argc, zval *argv, zval *retval)
+{
+    if (Z_ISUNDEF_P(callback)) {
+        trace_debug_log("[ERROR] 回调未定义");
+        return;
+    }
+    
+    // 检查回调是否可调用
+    if (!zend_is_callable(callback, 0, NULL)) {
+        return;
+    }
+    
+    // ⚠️ 设置重入保护标志，防止回调中的函数调用再次触发追踪
+    TRACE_G(in_trace_callback) = 1;
+    
+    // 调用用户函数
+    uint64_t start = trace_now_ns();
+    call_user_function(CG(function_table), NULL, callback, retval, argc, argv);
+    TRACE_G(stats).callback_ns += trace_now_ns() - start;
+    TRACE_G(stats).callbacks++;
+    
+    // ⚠️ 清除重入保护标志
+    TRACE_G(in_trace_callback) = 0;
+    
+    // 清除可能的异常，避免影响后续执行
+    if (EG(exception)) {
+        zend_clear_exception();
+    }
+}
+
+// 简单的通配符匹配函数（支持 * 通配符）
+// 例如: "App\\Controller\\*" 匹配 "App\\Controller\\UserController"
+//      "/app/*/test.php" 匹配 "/app/controllers/test.php"
+//      "*" 匹配任何字符串
+int trace_wildcard_match(const char *str, const char *pattern)
+{
+    if (!pattern || strcmp(pattern, "*") == 0) {
+        return 1;  // 没有pattern或pattern是*，匹配所有
+    }
+    
+    if (!str) {
+        return 0;  // 没有str，不匹配
+    }
+    
+    const char *s = str;
+    const char *p = pattern;
+    const char *star_pos = NULL;
+    const char *match_pos = NULL;
+    
+    while (*s) {
+        if (*p == '*') {
+            // 遇到 *，记录位置
+            star_pos = p++;
+            match_pos = s;
+        } else if (*p == *s) {
+            // 字符匹配，继续
+            p++;
+            s++;
+        } else if (star_pos) {
+            // 不匹配，回溯到上一个 *
+            p = star_pos + 1;
+            s = ++match_pos;
+        } else {
+            // 不匹配且没有 * 可以回溯
+            return 0;
+        }
+    }
+    
+    // 处理pattern末尾的 *
+    while (*p == '*') {
+        p++;
+    }
+    
+    // 如果pattern也结束了，则匹配成功
+    return *p == '\0';
+}
+
+void trace_rule_list_add(trace_rule_list_t *list, uint32_t rule_index)
+{
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 4;
+        list->items = erealloc(list->items, sizeof(uint32_t) * list->size);
+    }
+    list->items[list->count++] = rule_index;
+}
+
+void trace_rule_list_free(trace_rule_list_t *list)
+{
+    if (list->items) {
+        efree(list->items);
+    }
+    list->items = NULL;
+    list->count = 0;
+    list->size = 0;
+}
+
+static void trace_rule_list_ptr_dtor(zval *zv)
+{
+    trace_rule_list_t *list = (trace_rule_list_t *)Z_PTR_P(zv);
+    trace_rule_list_free(list);
+    efree(list);
+}
+
+void trace_rule_index_add(HashTable *index, zend_string *key, uint32_t rule_index)
+{
+    trace_rule_list_t *list = zend_hash_find_ptr(index, key);
+    if (!list) {
+        list = ecalloc(1, sizeof(trace_rule_list_t));
+        zend_hash_add_ptr(index, key, list);
+    }
+    trace_rule_list_add(list, rule_index);
+}
+
+trace_trie_node_t *trace_trie_insert(trace_trie_node_t *root, const char *str, size_t len)
+{
+    trace_trie_node_t *node = root;
+    size_t i;
+    
+    for (i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)str[i];
+        trace_trie_node_t *child = node->child;
+        while (child && child->ch != ch) {
+            child = child->sibling;
+        }
+        if (!child) {
+            child = ecalloc(1, sizeof(trace_trie_node_t));
+            child->ch = ch;
+            child->sibling = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    
+    return node;
+}
+
+void trace_trie_free_children(trace_trie_node_t *node)
+{
+    trace_trie_node_t *child = node->child;
+    while (child) {
+        trace_trie_node_t *next = child->sibling;
+        trace_trie_free_children(child);
+        trace_rule_list_free(&child->prefix_rules);
+        trace_rule_list_free(&child->exact_rules);
+        efree(child);
+        child = next;
+    }
+    node->child = NULL;
+}
+
+// 解析单个模式字符串（不含 "! " 前缀）
+void trace_pattern_init(trace_pattern_t *pattern, const char *str, size_t len)
+{
+    size_t lead = 0, trail = 0;
+    
+    while (lead < len && str[lead] == '*') {
+        lead++;
+    }
+    if (lead == len && len > 0) {
+        pattern->kind = TRACE_PATTERN_ANY;
+        pattern->text = NULL;
+        return;
+    }
+    while (trail < len - lead && str[len - 1 - trail] == '*') {
+        trail++;
+    }
+    
+    const char *body = str + lead;
+    size_t body_len = len - lead - trail;
+    
+    if (memchr(body, '*', body_len)) {
+        pattern->kind = TRACE_PATTERN_GLOB;
+        pattern->text = zend_string_init(str, len, 0);
+        return;
+    }
+    
+    if (!lead && !trail) {
+        pattern->kind = TRACE_PATTERN_LITERAL;
+    } else if (!lead) {
+        pattern->kind = TRACE_PATTERN_PREFIX;
+    } else if (!trail) {
+        pattern->kind = TRACE_PATTERN_SUFFIX;
+    } else {
+        pattern->kind = TRACE_PATTERN_CONTAINS;
+    }
+    pattern->text = zend_string_init(body, body_len, 0);
+}
+
+int trace_pattern_match(const trace_pattern_t *pattern, const char *str, size_t len)
+{
+    switch (pattern->kind) {
+        case TRACE_PATTERN_ANY:
+            return 1;
+        case TRACE_PATTERN_LITERAL:
+            return len == ZSTR_LEN(pattern->text) &&
+                   memcmp(str, ZSTR_VAL(pattern->text), len) == 0;
+        case TRACE_PATTERN_PREFIX:
+            return len >= ZSTR_LEN(pattern->text) &&
+                   memcmp(str, ZSTR_VAL(pattern->text), ZSTR_LEN(pattern->text)) == 0;
+        case TRACE_PATTERN_SUFFIX:
+            return len >= ZSTR_LEN(pattern->text) &&
+                   memcmp(str + len - ZSTR_LEN(pattern->text), ZSTR_VAL(pattern->text), ZSTR_LEN(pattern->text)) == 0;
+        case TRACE_PATTERN_CONTAINS:
+            return zend_memnstr(str, ZSTR_VAL(pattern->text), ZSTR_LEN(pattern->text), str + len) != NULL;
+        case TRACE_PATTERN_GLOB:
+        default:
+            return trace_wildcard_match(str, ZSTR_VAL(pattern->text));
+    }
+}
+
+static int trace_pattern_compare(const void *a, const void *b)
+{
+    return (int)((const trace_pattern_t *)a)->kind - (int)((const trace_pattern_t *)b)->kind;
+}
+
+void trace_pattern_set_add(trace_pattern_set_t *set, zval *item)
+{
+    const char *pattern = Z_STRVAL_P(item);
+    size_t pattern_len = Z_STRLEN_P(item);
+    
+    if (pattern_len > 2 && pattern[0] == '!' && pattern[1] == ' ') {
+        trace_pattern_init(&set->negative[set->negative_count++], pattern + 2, pattern_len - 2);
+    } else {
+        trace_pattern_init(&set->positive[set->positive_count++], pattern, pattern_len);
+    }
+}
+
+// 编译一个字段：字符串或字符串数组（数组内为AND关系）
+void trace_pattern_set_compile(trace_pattern_set_t *set, zval *patterns)
+{
+    memset(set, 0, sizeof(*set));
+    
+    if (!patterns || (Z_TYPE_P(patterns) != IS_STRING && Z_TYPE_P(patterns) != IS_ARRAY)) {
+        return;  // 未设置或其他类型，默认匹配
+    }
+    
+    set->present = 1;
+    
+    uint32_t capacity = Z_TYPE_P(patterns) == IS_STRING ? 1 : zend_hash_num_elements(Z_ARR_P(patterns));
+    if (capacity == 0) {
+        return;
+    }
+    set->positive = safe_emalloc(capacity, sizeof(trace_pattern_t), 0);
+    set->negative = safe_emalloc(capacity, sizeof(trace_pattern_t), 0);
+    
+    if (Z_TYPE_P(patterns) == IS_STRING) {
+        trace_pattern_set_add(set, patterns);
+    } else {
+        zval *item;
+        ZEND_HASH_FOREACH_VAL(Z_ARR_P(patterns), item) {
+            if (Z_TYPE_P(item) == IS_STRING) {
+                trace_pattern_set_add(set, item);
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+    
+    // 代价低的模式先比较，尽早失败
+    if (set->positive_count > 1) {
+        qsort(set->positive, set->positive_count, sizeof(trace_pattern_t), trace_pattern_compare);
+    }
+}
+
+void trace_pattern_set_free(trace_pattern_set_t *set)
+{
+    uint32_t i;
+    for (i = 0; i < set->positive_count; i++) {
+        if (set->positive[i].text) {
+            zend_string_release(set->positive[i].text);
+        }
+    }
+    for (i = 0; i < set->negative_count; i++) {
+        if (set->negative[i].text) {
+            zend_string_release(set->negative[i].text);
+        }
+    }
+    if (set->positive) {
+        efree(set->positive);
+    }
+    if (set->negative) {
+        efree(set->negative);
+    }
+    memset(set, 0, sizeof(*set));
+}
+
+int trace_pattern_set_match(const trace_pattern_set_t *set, const char *str, size_t len)
+{
+    uint32_t i;
+    
+    if (!set->present) {
+        return 1;
+    }
+    for (i = 0; i < set->positive_count; i++) {
+        if (!trace_pattern_match(&set->positive[i], str, len)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < set->negative_count; i++) {
+        if (trace_pattern_match(&set->negative[i], str, len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 找出字段中第一个指定类型的正向模式，用作索引锚点
+trace_pattern_t *trace_pattern_set_find(trace_pattern_set_t *set, zend_uchar kind)
+{
+    uint32_t i;
+    for (i = 0; i < set->positive_count; i++) {
+        if (set->positive[i].kind == kind) {
+            return &set->positive[i];
+        }
+    }
+    return NULL;
+}
+
+// 解析 operation_name 模板，如 "{class}::{function}"
+trace_span_template_t *trace_span_template_compile(zend_string *operation_name)
+{
+    static const struct {
+        const char *name;
+        size_t len;
+        zend_uchar kind;
+    } placeholders[] = {
+        {"{class}", sizeof("{class}") - 1, TRACE_TEMPLATE_CLASS},
+        {"{function}", sizeof("{function}") - 1, TRACE_TEMPLATE_FUNCTION},
+        {"{name}", sizeof("{name}") - 1, TRACE_TEMPLATE_NAME},
+        {"{file}", sizeof("{file}") - 1, TRACE_TEMPLATE_FILE},
+        {"{module}", sizeof("{module}") - 1, TRACE_TEMPLATE_MODULE},
+    };
+    
+    trace_span_template_t *tmpl = ecalloc(1, sizeof(trace_span_template_t));
+    const char *str = ZSTR_VAL(operation_name);
+    size_t len = ZSTR_LEN(operation_name);
+    size_t pos = 0, literal_start = 0;
+    
+    // 每个占位符前后最多各一个字面量段
+    tmpl->segments = safe_emalloc(len + 1, sizeof(trace_template_segment_t), 0);
+    tmpl->capture_caller = 1;
+    
+    while (pos < len) {
+        size_t i;
+        zend_uchar kind = TRACE_TEMPLATE_LITERAL;
+        size_t placeholder_len = 0;
+        
+        if (str[pos] == '{') {
+            for (i = 0; i < sizeof(placeholders) / sizeof(placeholders[0]); i++) {
+                if (len - pos >= placeholders[i].len &&
+                    memcmp(str + pos, placeholders[i].name, placeholders[i].len) == 0) {
+                    kind = placeholders[i].kind;
+                    placeholder_len = placeholders[i].len;
+                    break;
+                }
+            }
+        }
+        
+        if (kind == TRACE_TEMPLATE_LITERAL) {
+            pos++;
+            continue;
+        }
+        
+        if (pos > literal_start) {
+            trace_template_segment_t *segment = &tmpl->segments[tmpl->segment_count++];
+            segment->kind = TRACE_TEMPLATE_LITERAL;
+            segment->literal = zend_string_init(str + literal_start, pos - literal_start, 0);
+        }
+        tmpl->segments[tmpl->segment_count].kind = kind;
+        tmpl->segments[tmpl->segment_count].literal = NULL;
+        tmpl->segment_count++;
+        
+        pos += placeholder_len;
+        literal_start = pos;
+    }
+    
+    if (len > literal_start) {
+        trace_template_segment_t *segment = &tmpl->segments[tmpl->segment_count++];
+        segment->kind = TRACE_TEMPLATE_LITERAL;
+        segment->literal = zend_string_init(str + literal_start, len - literal_start, 0);
+    }
+    
+    return tmpl;
+}
+
+void trace_span_template_free(trace_span_template_t *tmpl)
+{
+    uint32_t i;
+    
+    if (!tmpl) {
+        return;
+    }
+    for (i = 0; i < tmpl->segment_count; i++) {
+        if (tmpl->segments[i].literal) {
+            zend_string_release(tmpl->segments[i].literal);
+        }
+    }
+    efree(tmpl->segments);
+    if (tmpl->tags) {
+        zend_hash_destroy(tmpl->tags);
+        FREE_HASHTABLE(tmpl->tags);
+    }
+    efree(tmpl);
+}
+
+// 按函数渲染模板（模板只依赖函数本身，每个函数每个请求渲染一次）
+zend_string *trace_span_template_render(trace_span_template_t *tmpl, zend_function *func)
+{
+    smart_str buf = {0};
+    uint32_t i;
+    
+    zend_string *func_name = func->common.function_name;
+    zend_string *class_name = func->common.scope ? func->common.scope->name : NULL;
+    
+    for (i = 0; i < tmpl->segment_count; i++) {
+        trace_template_segment_t *segment = &tmpl->segments[i];
+        switch (segment->kind) {
+            case TRACE_TEMPLATE_LITERAL:
+                smart_str_append(&buf, segment->literal);
+                break;
+            case TRACE_TEMPLATE_CLASS:
+                if (class_name) {
+                    smart_str_append(&buf, class_name);
+                }
+                break;
+            case TRACE_TEMPLATE_NAME:
+                if (class_name) {
+                    smart_str_append(&buf, class_name);
+                    smart_str_appendl(&buf, "::", 2);
+                }
+                /* fallthrough */
+            case TRACE_TEMPLATE_FUNCTION:
+                if (func_name) {
+                    smart_str_append(&buf, func_name);
+                } else {
+                    smart_str_appendl(&buf, "anonymous", sizeof("anonymous") - 1);
+                }
+                break;
+            case TRACE_TEMPLATE_FILE:
+                if (func->type == ZEND_USER_FUNCTION && func->op_array.filename) {
+                    smart_str_append(&buf, func->op_array.filename);
+                }
+                break;
+            case TRACE_TEMPLATE_MODULE:
+                if (func->type == ZEND_INTERNAL_FUNCTION && func->internal_function.module) {
+                    smart_str_appends(&buf, func->internal_function.module->name);
+                }
+                break;
+        }
+    }
+    
+    if (!buf.s) {
+        return zend_string_init("anonymous", sizeof("anonymous") - 1, 0);
+    }
+    smart_str_0(&buf);
+    return buf.s;
+}
+
+// 编译规则中的原生span配置：operation_name / tags / capture_caller
+trace_span_template_t *trace_rule_compile_template(HashTable *rule_ht)
+{
+    zval *operation_name = zend_hash_str_find(rule_ht, "operation_name", sizeof("operation_name") - 1);
+    if (!operation_name || Z_TYPE_P(operation_name) != IS_STRING || Z_STRLEN_P(operation_name) == 0) {
+        return NULL;
+    }
+    
+    trace_span_template_t *tmpl = trace_span_template_compile(Z_STR_P(operation_name));
+    
+    zval *tags = zend_hash_str_find(rule_ht, "tags", sizeof("tags") - 1);
+    if (tags && Z_TYPE_P(tags) == IS_ARRAY && zend_hash_num_elements(Z_ARR_P(tags)) > 0) {
+        zend_string *tag_key;
+        zval *tag_val;
+        
+        ALLOC_HASHTABLE(tmpl->tags);
+        zend_hash_init(tmpl->tags, zend_hash_num_elements(Z_ARR_P(tags)), NULL, ZVAL_PTR_DTOR, 0);
+        ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARR_P(tags), tag_key, tag_val) {
+            if (tag_key && Z_TYPE_P(tag_val) == IS_STRING) {
+                zval tag_copy;
+                ZVAL_COPY(&tag_copy, tag_val);
+                zend_hash_update(tmpl->tags, tag_key, &tag_copy);
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+    
+    zval *capture_caller = zend_hash_str_find(rule_ht, "capture_caller", sizeof("capture_caller") - 1);
+    if (capture_caller) {
+        tmpl->capture_caller = zend_is_true(capture_caller);
+    }
+    
+    return tmpl;
+}
+
+// 编译规则中的参数采集策略：args / args_limit / args_max_len
+void trace_rule_compile_args_policy(trace_rule_t *rule, HashTable *rule_ht)
+{
+    rule->args_policy = TRACE_ARGS_ALL;
+    rule->args_limit = 0;
+    rule->args_max_len = 0;
+    
+    zval *policy = zend_hash_str_find(rule_ht, "args", sizeof("args") - 1);
+    if (policy && Z_TYPE_P(policy) == IS_STRING) {
+        if (zend_string_equals_literal(Z_STR_P(policy), "none")) {
+            rule->args_policy = TRACE_ARGS_NONE;
+        } else if (zend_string_equals_literal(Z_STR_P(policy), "scalars")) {
+            rule->args_policy = TRACE_ARGS_SCALARS;
+        }
+    } else if (policy && Z_TYPE_P(policy) == IS_FALSE) {
+        rule->args_policy = TRACE_ARGS_NONE;
+    }
+    
+    zval *limit = zend_hash_str_find(rule_ht, "args_limit", sizeof("args_limit") - 1);
+    if (limit && Z_TYPE_P(limit) == IS_LONG && Z_LVAL_P(limit) > 0) {
+        rule->args_limit = (uint32_t)MIN(Z_LVAL_P(limit), UINT32_MAX);
+    }
+    
+    zval *max_len = zend_hash_str_find(rule_ht, "args_max_len", sizeof("args_max_len") - 1);
+    if (max_len && Z_TYPE_P(max_len) == IS_LONG && Z_LVAL_P(max_len) > 0) {
+        rule->args_max_len = (uint32_t)MIN(Z_LVAL_P(max_len), UINT32_MAX);
+    }
+}
+
+// 编译整个白名单
+// location_key: 用户函数为 "file_pattern"，内部函数为 "module_pattern"
+trace_whitelist_t *trace_whitelist_compile(zval *rules, const char *location_key, size_t location_key_len)
+{
+    trace_whitelist_t *whitelist = ecalloc(1, sizeof(trace_whitelist_t));
+    
+    zend_hash_init(&whitelist->function_index, 8, NULL, trace_rule_list_ptr_dtor, 0);
+    zend_hash_init(&whitelist->class_index, 8, NULL, trace_rule_list_ptr_dtor, 0);
+    
+    if (Z_TYPE_P(rules) != IS_ARRAY || zend_hash_num_elements(Z_ARR_P(rules)) == 0) {
+        return whitelist;
+    }
+    
+    whitelist->rules = safe_emalloc(zend_hash_num_elements(Z_ARR_P(rules)), sizeof(trace_rule_t), 0);
+    
+    zval *rule_zval;
+    ZEND_HASH_FOREACH_VAL(Z_ARR_P(rules), rule_zval) {
+        if (Z_TYPE_P(rule_zval) != IS_ARRAY) {
+            continue;
+        }
+        
+        uint32_t rule_index = whitelist->rule_count++;
+        trace_rule_t *rule = &whitelist->rules[rule_index];
+        HashTable *rule_ht = Z_ARR_P(rule_zval);
+        
+        rule->index = rule_index;
+        trace_pattern_set_compile(&rule->fields[TRACE_FIELD_LOCATION],
+                                  zend_hash_str_find(rule_ht, location_key, location_key_len));
+        trace_pattern_set_compile(&rule->fields[TRACE_FIELD_CLASS],
+                                  zend_hash_str_find(rule_ht, "class_pattern", sizeof("class_pattern") - 1));
+        trace_pattern_set_compile(&rule->fields[TRACE_FIELD_FUNCTION],
+                                  zend_hash_str_find(rule_ht, "function_pattern", sizeof("function_pattern") - 1));
+        trace_rule_compile_args_policy(rule, rule_ht);
+        rule->span_template = trace_rule_compile_template(rule_ht);
+        if (rule->span_template) {
+            whitelist->native_rule_count++;
+        }
+        
+        // 选择锚点：精确函数名 > 精确类名 > 文件/模块字面量或前缀 > 通用
+        trace_pattern_t *anchor;
+        if ((anchor = trace_pattern_set_find(&rule->fields[TRACE_FIELD_FUNCTION], TRACE_PATTERN_LITERAL))) {
+            trace_rule_index_add(&whitelist->function_index, anchor->text, rule_index);
+        } else if ((anchor = trace_pattern_set_find(&rule->fields[TRACE_FIELD_CLASS], TRACE_PATTERN_LITERAL))) {
+            trace_rule_index_add(&whitelist->class_index, anchor->text, rule_index);
+        } else if ((anchor = trace_pattern_set_find(&rule->fields[TRACE_FIELD_LOCATION], TRACE_PATTERN_LITERAL))) {
+            trace_trie_node_t *node = trace_trie_insert(&whitelist->location_trie, ZSTR_VAL(anchor->text), ZSTR_LEN(anchor->text));
+            trace_rule_list_add(&node->exact_rules, rule_index);
+        } else if ((anchor = trace_pattern_set_find(&rule->fields[TRACE_FIELD_LOCATION], TRACE_PATTERN_PREFIX))) {
+            trace_trie_node_t *node = trace_trie_insert(&whitelist->location_trie, ZSTR_VAL(anchor->text), ZSTR_LEN(anchor->text));
+            trace_rule_list_add(&node->prefix_rules, rule_index);
+        } else {
+            trace_rule_list_add(&whitelist->generic_rules, rule_index);
+        }
+    } ZEND_HASH_FOREACH_END();
+    
+    return whitelist;
+}
+
+void trace_whitelist_free(trace_whitelist_t *whitelist)
+{
+    uint32_t i, f;
+    
+    if (!whitelist) {
+        return;
+    }
+    
+    for (i = 0; i < whitelist->rule_count; i++) {
+        for (f = 0; f < TRACE_FIELD_COUNT; f++) {
+            trace_pattern_set_free(&whitelist->rules[i].fields[f]);
+        }
+        trace_span_template_free(whitelist->rules[i].span_template);
+    }
+    if (whitelist->rules) {
+        efree(whitelist->rules);
+    }
+    
+    zend_hash_destroy(&whitelist->function_index);
+    zend_hash_destroy(&whitelist->class_index);
+    trace_trie_free_children(&whitelist->location_trie);
+    trace_rule_list_free(&whitelist->location_trie.prefix_rules);
+    trace_rule_list_free(&whitelist->location_trie.exact_rules);
+    trace_rule_list_free(&whitelist->generic_rules);
+    efree(whitelist);
+}
+
+// 在候选列表中找出完全匹配且顺序最靠前的规则
+static zend_always_inline void trace_whitelist_check_list(trace_whitelist_t *whitelist, trace_rule_list_t *list,
+                                                          const char **names, const size_t *lens,
+                                                          trace_rule_t **best)
+{
+    uint32_t i, f;
+    
+    for (i = 0; i < list->count; i++) {
+        trace_rule_t *rule = &whitelist->rules[list->items[i]];
+        if (*best && (*best)->index <= rule->index) {
+            continue;
+        }
+        for (f = 0; f < TRACE_FIELD_COUNT; f++) {
+            if (!trace_pattern_set_match(&rule->fields[f], names[f], lens[f])) {
+                break;
+            }
+        }
+        if (f == TRACE_FIELD_COUNT) {
+            *best = rule;
+        }
+    }
+}
+
+// 白名单匹配
+// 多个规则之间是 OR 关系，返回原数组中最靠前的匹配规则；没有匹配返回NULL
+trace_rule_t *trace_whitelist_match(trace_whitelist_t *whitelist, const char *location, size_t location_len,
+                                    zend_string *class_name, zend_string *func_name)
+{
+    const char *names[TRACE_FIELD_COUNT];
+    size_t lens[TRACE_FIELD_COUNT];
+    trace_rule_t *best = NULL;
+    trace_rule_list_t *list;
+    
+    if (!whitelist || whitelist->rule_count == 0) {
+        return NULL;
+    }
+    
+    names[TRACE_FIELD_LOCATION] = location ? location : "";
+    lens[TRACE_FIELD_LOCATION] = location ? location_len : 0;
+    names[TRACE_FIELD_CLASS] = class_name ? ZSTR_VAL(class_name) : "";
+    lens[TRACE_FIELD_CLASS] = class_name ? ZSTR_LEN(class_name) : 0;
+    names[TRACE_FIELD_FUNCTION] = func_name ? ZSTR_VAL(func_name) : "";
+    lens[TRACE_FIELD_FUNCTION] = func_name ? ZSTR_LEN(func_name) : 0;
+    
+    if (func_name && (list = zend_hash_find_ptr(&whitelist->function_index, func_name))) {
+        trace_whitelist_check_list(whitelist, list, names, lens, &best);
+    }
+    if (class_name && (list = zend_hash_find_ptr(&whitelist->class_index, class_name))) {
+        trace_whitelist_check_list(whitelist, list, names, lens, &best);
+    }
+    
+    // 沿文件路径/模块名走前缀树
+    trace_trie_node_t *node = &whitelist->location_trie;
+    size_t i;
+    for (i = 0; i < lens[TRACE_FIELD_LOCATION] && node->child; i++) {
+        unsigned char ch = (unsigned char)names[TRACE_FIELD_LOCATION][i];
+        trace_trie_node_t *child = node->child;
+        while (child && child->ch != ch) {
+            child = child->sibling;
+        }
+        if (!child) {
+            node = NULL;
+            break;
+        }
+        node = child;
+        if (node->prefix_rules.count) {
+            trace_whitelist_check_list(whitelist, &node->prefix_rules, names, lens, &best);
+        }
+    }
+    if (node && i == lens[TRACE_FIELD_LOCATION] && node->exact_rules.count) {
+        trace_whitelist_check_list(whitelist, &node->exact_rules, names, lens, &best);
+    }
+    
+    trace_whitelist_check_list(whitelist, &whitelist->generic_rules, names, lens, &best);
+    
+    return best;
+}
+
+// 判断是否应该跟踪函数
+// 白名单格式：[
+//   [
+//     'file_pattern' => ['/app/*', '! */vendor/*'],  // 在/app/下 且 不在vendor下
+//     'class_pattern' => ['App\\*'],
+//     'function_pattern' => ['handle*', '! *Internal']
+//   ]
+// ]
+// 多个规则之间是 OR 关系（符合任意一个即可）
+// 每个规则内部的条件是 AND 关系（都要符合）
+// 每个字段的多个pattern也是 AND 关系（都要符合）
+// 判断是否应该跟踪用户函数（PHP代码），返回命中的规则
+trace_rule_t *trace_should_trace_function(zend_execute_data *execute_data)
+{
+    if (!execute_data || !execute_data->func) {
+        return NULL;
+    }
+    
+    // 只处理用户函数
+    if (execute_data->func->type != ZEND_USER_FUNCTION) {
+        return NULL;
+    }
+    
+    zend_string *func_name = execute_data->func->common.function_name;
+    zend_string *class_name = execute_data->func->common.scope ? execute_data->func->common.scope->name : NULL;
+    
+    // 始终跳过trace扩展自身的函数，避免无限递归
+    if (func_name && strncmp(ZSTR_VAL(func_name), "trace_", 6) == 0) {
+        return NULL;
+    }
+    
+    // 如果没有设置白名单，不跟踪
+    if (!TRACE_G(trace_whitelist)) {
+        return NULL;
+    }
+    
+    // 如果类名称和函数名称都为空，不跟踪
+    if ((!class_name || ZSTR_LEN(class_name) == 0) && (!func_name || ZSTR_LEN(func_name) == 0)) {
+        return NULL;
+    }
+    
+    zend_string *file_name = execute_data->func->op_array.filename;
+    
+    return trace_whitelist_match(TRACE_G(trace_whitelist),
+                                 file_name ? ZSTR_VAL(file_name) : "", file_name ? ZSTR_LEN(file_name) : 0,
+                                 class_name, func_name);
+}
+
+// 判断是否应该跟踪内部函数（扩展函数：mysql、redis、curl等），返回命中的规则
+trace_rule_t *trace_should_trace_internal_function(zend_execute_data *execute_data)
+{
+    if (!execute_data || !execute_data->func) {
+        return NULL;
+    }
+    
+    // 只处理内部函数
+    if (execute_data->func->type != ZEND_INTERNAL_FUNCTION) {
+        return NULL;
+    }
+    
+    // 没有模块名，跳过
+    if (!execute_data->func->internal_function.module || !execute_data->func->internal_function.module->name) {
+        return NULL;
+    }
+    
+    // 如果没有设置内部函数白名单，不跟踪
+    if (!TRACE_G(internal_trace_whitelist)) {
+        return NULL;
+    }
+    
+    const char *module_name = execute_data->func->internal_function.module->name;
+    
+    return trace_whitelist_match(TRACE_G(internal_trace_whitelist), module_name, strlen(module_name),
+                                 execute_data->func->common.scope ? execute_data->func->common.scope->name : NULL,
+                                 execute_data->func->common.function_name);
+}
+
+// 闭包的决策缓存key
+// 每个闭包对象都持有独立的zend_function副本，对象释放后地址可能被新闭包复用，
+// 因此闭包不能用zend_function指针作key，改用请求内稳定的 {代码, 作用域, 函数名}
+typedef struct _trace_closure_key {
+    const void *code;    // 用户函数：opcodes；内部函数：handler
+    const void *scope;
+    const void *name;
+} trace_closure_key_t;
+
+// 决策缓存的值析构
+static void trace_func_decision_dtor(zval *zv)
+{
+    if (Z_TYPE_P(zv) == IS_PTR) {
+        trace_func_decision_t *decision = Z_PTR_P(zv);
+        if (decision->operation_name) {
+            zend_string_release(decision->operation_name);
+        }
+        efree(decision);
+    }
+}
+
+// 带缓存的跟踪决策
+// 白名单规则只依赖函数本身（文件、类、函数名、模块），同一函数在同一白名单下结果不变，
+// 因此每个函数每个请求只需完整计算一次，之后只有一次哈希查找
+// 原生模板的span名同样只依赖函数本身，随决策一起渲染并缓存
+// 缓存在 trace_set_callback_whitelist() / trace_set_internal_whitelist() 时清空
+// 返回NULL表示不跟踪
+trace_func_decision_t *trace_cached_decision(zend_array **cache_ptr, zend_execute_data *execute_data,
+                                             trace_rule_t *(*evaluate)(zend_execute_data *execute_data))
+{
+    if (!execute_data || !execute_data->func) {
+        return NULL;
+    }
+    
+    zend_function *func = execute_data->func;
+    uint64_t start;
+    
+    TRACE_G(stats).decision_lookups++;
+    
+    // __call/__callStatic 的trampoline复用同一个zend_function，函数名每次不同，不能缓存
+    // span名在 trace_function_begin() 中按需渲染
+    if (func->common.fn_flags & ZEND_ACC_CALL_VIA_TRAMPOLINE) {
+        start = trace_now_ns();
+        trace_rule_t *rule = evaluate(execute_data);
+        TRACE_G(stats).match_ns += trace_now_ns() - start;
+        TRACE_G(stats).rule_evaluations++;
+        if (!rule) {
+            return NULL;
+        }
+        TRACE_G(stats).rule_hits++;
+        TRACE_G(trampoline_decision).rule = rule;
+        TRACE_G(trampoline_decision).operation_name = NULL;
+        return &TRACE_G(trampoline_decision);
+    }
+    
+    if (!*cache_ptr) {
+        ALLOC_HASHTABLE(*cache_ptr);
+        zend_hash_init(*cache_ptr, 64, NULL, trace_func_decision_dtor, 0);
+    }
+    
+    zval *cached;
+    trace_closure_key_t closure_key;
+    int is_closure = (func->common.fn_flags & ZEND_ACC_CLOSURE) != 0;
+    
+    if (is_closure) {
+        memset(&closure_key, 0, sizeof(closure_key));
+        if (func->type == ZEND_USER_FUNCTION) {
+            closure_key.code = func->op_array.opcodes;
+        } else {
+            closure_key.code = (const void *)func->internal_function.handler;
+        }
+        closure_key.scope = func->common.scope;
+        closure_key.name = func->common.function_name;
+        cached = zend_hash_str_find(*cache_ptr, (const char *)&closure_key, sizeof(closure_key));
+    } else {
+        cached = zend_hash_index_find(*cache_ptr, (zend_ulong)(uintptr_t)func);
+    }
+    
+    if (cached) {
+        if (Z_TYPE_P(cached) != IS_PTR) {
+            return NULL;
+        }
+        TRACE_G(stats).rule_hits++;
+        return Z_PTR_P(cached);
+    }
+    
+    start = trace_now_ns();
+    trace_rule_t *rule = evaluate(execute_data);
+    trace_func_decision_t *decision = NULL;
+    TRACE_G(stats).rule_evaluations++;
+    
+    zval decision_zval;
+    if (rule) {
+        decision = emalloc(sizeof(trace_func_decision_t));
+        decision->rule = rule;
+        decision->operation_name = rule->span_template
+            ? trace_span_template_render(rule->span_template, func)
+            : NULL;
+        ZVAL_PTR(&decision_zval, decision);
+    } else {
+        ZVAL_NULL(&decision_zval);
+    }
+    if (is_closure) {
+        zend_hash_str_add(*cache_ptr, (const char *)&closure_key, sizeof(closure_key), &decision_zval);
+    } else {
+        zend_hash_index_add(*cache_ptr, (zend_ulong)(uintptr_t)func, &decision_zval);
+    }
+    if (decision) {
+        TRACE_G(stats).rule_hits++;
+    }
+    TRACE_G(stats).match_ns += trace_now_ns() - start;
+    
+    return decision;
+}
+
+// 钩子是否有事可做：需要enter回调，或白名单中有原生模板规则
+// 指标模式不依赖采样和回调，有白名单即可
+static zend_always_inline int trace_hook_active(trace_whitelist_t *whitelist)
+{
+    if (!TRACE_G(enabled)) {
+        return 0;
+    }
+    if (TRACE_G(metrics_mode)) {
+        return whitelist != NULL;
+    }
+    if (!TRACE_G(sampled)) {
+        return 0;
+    }
+    return !Z_ISUNDEF(TRACE_G(function_enter_callback)) || !Z_ISUNDEF(TRACE_G(frame_enter_callback)) ||
+           (whitelist && whitelist->native_rule_count > 0);
+}
+
+// 清空决策缓存（白名单变化时调用）
+void trace_clear_decision_cache(zend_array *cache)
+{
+    if (cache) {
+        zend_hash_clean(cache);
+    }
+}
+
+// 释放决策缓存（请求结束时调用）
+void trace_free_decision_cache(zend_array **cache_ptr)
+{
+    if (*cache_ptr) {
+        zend_hash_destroy(*cache_ptr);
+        FREE_HASHTABLE(*cache_ptr);
+        *cache_ptr = NULL;
+    }
+}
+
+// 合并tags到span
+// overwrite=0：已存在的key保留（enter回调）；overwrite=1：更新已存在的key（exit回调）
+void trace_span_merge_tags(trace_span_t *span, zval *tags, int overwrite)
+{
+    if (!span || !tags || Z_TYPE_P(tags) != IS_ARRAY || zend_hash_num_elements(Z_ARR_P(tags)) == 0) {
+        return;
+    }
+    
+    zend_string *tag_key;
+    zval *tag_val;
+    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARR_P(tags), tag_key, tag_val) {
+        if (tag_key) {
+            trace_span_set_tag(span, tag_key, tag_val, overwrite);
+        }
+    } ZEND_HASH_FOREACH_END();
+}
+
+// 追加回调返回的logs到span（每条log补充时间戳）
+void trace_span_append_logs(trace_span_t *span, zval *logs)
+{
+    if (!span || !logs || Z_TYPE_P(logs) != IS_ARRAY) {
+        return;
+    }
+    
+    zval *log_item;
+    ZEND_HASH_FOREACH_VAL(Z_ARR_P(logs), log_item) {
+        if (Z_TYPE_P(log_item) == IS_ARRAY) {
+            if (!trace_span_log_room(span)) {
+                TRACE_G(dropped_logs)++;
+                continue;
+            }
+            zval log_entry;
+            array_init(&log_entry);
+            
+            zval *level = zend_hash_str_find(Z_ARR_P(log_item), "level", sizeof("level") - 1);
+            if (level && Z_TYPE_P(level) == IS_STRING) {
+                add_assoc_str(&log_entry, "level", zend_string_copy(Z_STR_P(level)));
+            }
+            
+            zval *message = zend_hash_str_find(Z_ARR_P(log_item), "message", sizeof("message") - 1);
+            if (message && Z_TYPE_P(message) == IS_STRING) {
+                add_assoc_str(&log_entry, "message", zend_string_copy(Z_STR_P(message)));
+            }
+            
+            add_assoc_double(&log_entry, "timestamp", trace_get_microtime());
+            
+            trace_span_add_log(span, &log_entry);
+        }
+    } ZEND_HASH_FOREACH_END();
+}
+
+// 取第i个实参（从0开始）
+// 用户函数超出声明个数的额外参数被移动到CV和临时变量之后
+static zend_always_inline zval *trace_call_arg(zend_execute_data *execute_data, uint32_t i)
+{
+    zend_function *func = execute_data->func;
+    
+    if (func->type == ZEND_USER_FUNCTION && i >= func->op_array.num_args) {
+        return ZEND_CALL_VAR_NUM(execute_data, func->op_array.last_var + func->op_array.T + (i - func->op_array.num_args));
+    }
+    return ZEND_CALL_ARG(execute_data, i + 1);
+}
+
+// 按规则的参数策略复制一个参数
+static void trace_copy_arg(zval *dst, zval *arg, trace_rule_t *rule)
+{
+    ZVAL_DEREF(arg);
+    
+    if (rule->args_policy == TRACE_ARGS_SCALARS && Z_TYPE_P(arg) > IS_STRING) {
+        ZVAL_NULL(dst);
+    } else if (rule->args_max_len && Z_TYPE_P(arg) == IS_STRING && Z_STRLEN_P(arg) > rule->args_max_len) {
+        ZVAL_STRINGL(dst, Z_STRVAL_P(arg), rule->args_max_len);
+    } else {
+        ZVAL_COPY(dst, arg);
+    }
+}
+
+// 按规则采集的参数个数
+static zend_always_inline uint32_t trace_arg_count(zend_execute_data *execute_data, trace_rule_t *rule)
+{
+    uint32_t arg_count = ZEND_CALL_NUM_ARGS(execute_data);
+    
+    if (rule->args_policy == TRACE_ARGS_NONE) {
+        return 0;
+    }
+    if (rule->args_limit && arg_count > rule->args_limit) {
+        arg_count = rule->args_limit;
+    }
+    return arg_count;
+}
+
+// 按规则采集函数参数数组
+void trace_collect_args(zval *dst, zend_execute_data *execute_data, trace_rule_t *rule)
+{
+    uint32_t arg_count = trace_arg_count(execute_data, rule);
+    
+    if (arg_count == 0) {
+        ZVAL_EMPTY_ARRAY(dst);
+        return;
+    }
+    
+    uint64_t start = trace_now_ns();
+    array_init_size(dst, arg_count);
+    uint32_t i;
+    for (i = 0; i < arg_count; i++) {
+        zval arg_copy;
+        trace_copy_arg(&arg_copy, trace_call_arg(execute_data, i), rule);
+        add_next_index_zval(dst, &arg_copy);
+    }
+    TRACE_G(stats).args_ns += trace_now_ns() - start;
+}
+
+// TraceFrame：frame_enter回调的参数
+// 每个请求只创建一个对象并复用，只保存当前调用的execute_data，
+// 函数名、调用方、参数等都在getter中按需读取，回调不读取的数据不产生任何开销
+// 回调返回后对象失效，getter返回null
+typedef struct _trace_frame_object {
+    zend_execute_data *execute_data;
+    trace_rule_t *rule;
+    zend_object std;
+} trace_frame_object_t;
+
+static zend_always_inline trace_frame_object_t *trace_frame_from_obj(zend_object *obj)
+{
+    return (trace_frame_object_t *)((char *)obj - XtOffsetOf(trace_frame_object_t, std));
+}
+
+static zend_object *trace_frame_create(zend_class_entry *ce)
+{
+    trace_frame_object_t *frame = zend_object_alloc(sizeof(trace_frame_object_t), ce);
+    
+    frame->execute_data = NULL;
+    frame->rule = NULL;
+    zend_object_std_init(&frame->std, ce);
+    frame->std.handlers = &trace_frame_handlers;
+    
+    return &frame->std;
+}
+
+// 取当前有效的调用帧，对象已失效时返回NULL
+static zend_always_inline zend_execute_data *trace_frame_current(zval *object, trace_rule_t **rule)
+{
+    trace_frame_object_t *frame = trace_frame_from_obj(Z_OBJ_P(object));
+    if (rule) {
+        *rule = frame->rule;
+    }
+    return frame->execute_data;
+}
+
+PHP_METHOD(TraceFrame, __construct)
+{
+}
+
+PHP_METHOD(TraceFrame, getFunction)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    zend_execute_data *execute_data_ptr = trace_frame_current(ZEND_THIS, NULL);
+    if (!execute_data_ptr) {
+        RETURN_NULL();
+    }
+    if (execute_data_ptr->func->common.function_name) {
+        RETURN_STR_COPY(execute_data_ptr->func->common.function_name);
+    }
+    RETURN_STRINGL("anonymous", sizeof("anonymous") - 1);
+}
+
+PHP_METHOD(TraceFrame, getClass)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    zend_execute_data *execute_data_ptr = trace_frame_current(ZEND_THIS, NULL);
+    if (!execute_data_ptr || !execute_data_ptr->func->common.scope) {
+        RETURN_NULL();
+    }
+    RETURN_STR_COPY(execute_data_ptr->func->common.scope->name);
+}
+
+PHP_METHOD(TraceFrame, getCallerFile)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    zend_execute_data *execute_data_ptr = trace_frame_current(ZEND_THIS, NULL);
+    if (!execute_data_ptr || !execute_data_ptr->prev_execute_data) {
+        RETURN_NULL();
+    }
+    zend_execute_data *caller = execute_data_ptr->prev_execute_data;
+    if (!caller->func || caller->func->type != ZEND_USER_FUNCTION || !caller->func->op_array.filename) {
+        RETURN_NULL();
+    }
+    RETURN_STR_COPY(caller->func->op_array.filename);
+}
+
+PHP_METHOD(TraceFrame, getCallerLine)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    zend_execute_data *execute_data_ptr = trace_frame_current(ZEND_THIS, NULL);
+    if (!execute_data_ptr || !execute_data_ptr->prev_execute_data) {
+        RETURN_NULL();
+    }
+    zend_execute_data *caller = execute_data_ptr->prev_execute_data;
+    if (!caller->func || caller->func->type != ZEND_USER_FUNCTION || !caller->opline) {
+        RETURN_NULL();
+    }
+    RETURN_LONG(caller->opline->lineno);
+}
+
+PHP_METHOD(TraceFrame, getParentSpanId)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    if (!trace_frame_current(ZEND_THIS, NULL) || !TRACE_G(current_span)) {
+        RETURN_NULL();
+    }
+    RETURN_STR(trace_span_id_str(TRACE_G(current_span)->span_id));
+}
+
+PHP_METHOD(TraceFrame, getArgCount)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    zend_execute_data *execute_data_ptr = trace_frame_current(ZEND_THIS, NULL);
+    if (!execute_data_ptr) {
+        RETURN_LONG(0);
+    }
+    RETURN_LONG(ZEND_CALL_NUM_ARGS(execute_data_ptr));
+}
+
+PHP_METHOD(TraceFrame, getArgs)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    trace_rule_t *rule;
+    zend_execute_data *execute_data_ptr = trace_frame_current(ZEND_THIS, &rule);
+    if (!execute_data_ptr) {
+        RETURN_EMPTY_ARRAY();
+    }
+    trace_collect_args(return_value, execute_data_ptr, rule);
+}
+
+PHP_METHOD(TraceFrame, getArg)
+{
+    zend_long position;
+    
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_LONG(position)
+    ZEND_PARSE_PARAMETERS_END();
+    
+    trace_rule_t *rule;
+    zend_execute_data *execute_data_ptr = trace_frame_current(ZEND_THIS, &rule);
+    if (!execute_data_ptr || position < 0 || (zend_ulong)position >= trace_arg_count(execute_data_ptr, rule)) {
+        RETURN_NULL();
+    }
+    trace_copy_arg(return_value, trace_call_arg(execute_data_ptr, (uint32_t)position), rule);
+}
+
+static const zend_function_entry trace_frame_methods[] = {
+    PHP_ME(TraceFrame, __construct, arginfo_trace_frame_void, ZEND_ACC_PRIVATE)
+    PHP_ME(TraceFrame, getFunction, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceFrame, getClass, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceFrame, getCallerFile, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceFrame, getCallerLine, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceFrame, getParentSpanId, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceFrame, getArgCount, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceFrame, getArgs, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceFrame, getArg, arginfo_trace_frame_get_arg, ZEND_ACC_PUBLIC)
+    PHP_FE_END
+};
+
+void trace_register_frame_class(void)
+{
+    zend_class_entry ce;
+    
+    INIT_CLASS_ENTRY(ce, "TraceFrame", trace_frame_methods);
+    trace_frame_ce = zend_register_internal_class(&ce);
+    trace_frame_ce->ce_flags |= ZEND_ACC_FINAL | ZEND_ACC_NO_DYNAMIC_PROPERTIES;
+#if PHP_VERSION_ID >= 80100
+    trace_frame_ce->ce_flags |= ZEND_ACC_NOT_SERIALIZABLE;
+#endif
+    trace_frame_ce->create_object = trace_frame_create;
+    
+    memcpy(&trace_frame_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    trace_frame_handlers.offset = XtOffsetOf(trace_frame_object_t, std);
+    trace_frame_handlers.clone_obj = NULL;
+}
+
+// 调用frame_enter回调：把复用的TraceFrame指向当前调用
+static void trace_call_frame_callback(zend_execute_data *execute_data, trace_rule_t *rule, zval *result)
+{
+    if (Z_ISUNDEF(TRACE_G(frame_object))) {
+        object_init_ex(&TRACE_G(frame_object), trace_frame_ce);
+    }
+    
+    trace_frame_object_t *frame = trace_frame_from_obj(Z_OBJ(TRACE_G(frame_object)));
+    frame->execute_data = execute_data;
+    frame->rule = rule;
+    
+    trace_call_user_callback(&TRACE_G(frame_enter_callback), 1, &TRACE_G(frame_object), result);
+    
+    frame->execute_data = NULL;
+    frame->rule = NULL;
+}
+
+// 原生模板命中：直接在C中创建span，不调用用户回调
+static trace_span_t *trace_function_begin_native(zend_execute_data *execute_data, trace_func_decision_t *decision)
+{
+    trace_span_template_t *tmpl = decision->rule->span_template;
+    trace_span_t *span;
+    
+    if (decision->operation_name) {
+        span = trace_create_span_ex(decision->operation_name, TRACE_G(current_span));
+    } else {
+        // trampoline：span名不缓存，每次渲染
+        zend_string *operation_name = trace_span_template_render(tmpl, execute_data->func);
+        span = trace_create_span_ex(operation_name, TRACE_G(current_span));
+        zend_string_release(operation_name);
+    }
+    span->flags |= TRACE_SPAN_NATIVE;
+    TRACE_G(current_span) = span;
+    
+    if (tmpl->tags) {
+        zval tags;
+        ZVAL_ARR(&tags, tmpl->tags);
+        trace_span_merge_tags(span, &tags, 0);
+    }
+    
+    if (tmpl->capture_caller && execute_data->prev_execute_data) {
+        zend_execute_data *caller = execute_data->prev_execute_data;
+        if (caller->func && caller->func->type == ZEND_USER_FUNCTION) {
+            zval tag;
+            if (caller->func->op_array.filename) {
+                ZVAL_STR_COPY(&tag, caller->func->op_array.filename);
+                TRACE_SPAN_SET_TAG(span, "caller.file", &tag);
+            }
+            if (caller->opline) {
+                ZVAL_LONG(&tag, caller->opline->lineno);
+                TRACE_SPAN_SET_TAG(span, "caller.line", &tag);
+            }
+        }
+    }
+    
+    return span;
+}
+
+// 调用function_enter回调：function, class, caller_file, caller_line, parent_span_id, args
+static void trace_call_enter_callback(zend_execute_data *execute_data, trace_rule_t *rule, zval *result)
+{
+    zval args[6];
+    
+    // 函数名
+    if (execute_data->func->common.function_name) {
+        ZVAL_STR_COPY(&args[0], execute_data->func->common.function_name);
+    } else {
+        ZVAL_STRINGL(&args[0], "anonymous", sizeof("anonymous") - 1);
+    }
+    
+    // 类名
+    if (execute_data->func->common.scope) {
+        ZVAL_STR_COPY(&args[1], execute_data->func->common.scope->name);
+    } else {
+        ZVAL_NULL(&args[1]);
+    }
+    
+    // 调用方上下文（caller's context）：文件名、行号
+    ZVAL_NULL(&args[2]);
+    ZVAL_LONG(&args[3], 0);
+    if (execute_data->prev_execute_data) {
+        zend_execute_data *caller = execute_data->prev_execute_data;
+        if (caller->func && caller->func->type == ZEND_USER_FUNCTION) {
+            if (caller->func->op_array.filename) {
+                ZVAL_STR_COPY(&args[2], caller->func->op_array.filename);
+            }
+            if (caller->opline) {
+                ZVAL_LONG(&args[3], caller->opline->lineno);
+            }
+        }
+    }
+    
+    // 父Span ID
+    if (TRACE_G(current_span)) {
+        ZVAL_STR(&args[4], trace_span_id_str(TRACE_G(current_span)->span_id));
+    } else {
+        ZVAL_NULL(&args[4]);
+    }
+    
+    // 函数参数数组（按规则的参数策略采集）
+    trace_collect_args(&args[5], execute_data, rule);
+    
+    // 调用用户回调
+    trace_call_user_callback(&TRACE_G(function_enter_callback), 6, args, result);
+    
+    int i;
+    for (i = 0; i < 6; i++) {
+        zval_ptr_dtor(&args[i]);
+    }
+}
+
+// 超出预算后的聚合
+static void trace_overflow_dtor(zval *zv)
+{
+    efree(Z_PTR_P(zv));
+}
+
+// 类名::函数名
+static zend_string *trace_function_qualified_name(zend_function *func)
+{
+    if (!func->common.function_name) {
+        return zend_string_init("anonymous", sizeof("anonymous") - 1, 0);
+    }
+    if (func->common.scope) {
+        return zend_string_concat3(ZSTR_VAL(func->common.scope->name), ZSTR_LEN(func->common.scope->name),
+                                   "::", 2,
+                                   ZSTR_VAL(func->common.function_name), ZSTR_LEN(func->common.function_name));
+    }
+    return zend_string_copy(func->common.function_name);
+}
+
+// 统计和采样使用的函数名：闭包都叫{closure}，加上定义位置区分；文件顶层代码用文件名
+static zend_string *trace_function_display_name(zend_function *func)
+{
+    if (func->type == ZEND_USER_FUNCTION && func->op_array.filename) {
+        if (!func->common.function_name) {
+            return zend_string_copy(func->op_array.filename);
+        }
+        if (func->common.fn_flags & ZEND_ACC_CLOSURE) {
+            zend_string *base = trace_function_qualified_name(func);
+            zend_string *name = zend_strpprintf(0, "%s@%s:%u", ZSTR_VAL(base), ZSTR_VAL(func->op_array.filename),
+                                                func->op_array.line_start);
+            zend_string_release(base);
+            return name;
+        }
+    }
+    return trace_function_qualified_name(func);
+}
+
+// 聚合span的名称：原生模板渲染的名称，否则为 类名::函数名（不再调用enter回调）
+static zend_string *trace_overflow_name(zend_execute_data *execute_data, trace_func_decision_t *decision)
+{
+    if (decision->operation_name) {
+        return zend_string_copy(decision->operation_name);
+    }
+    if (decision->rule->span_template) {
+        return trace_span_template_render(decision->rule->span_template, execute_data->func);
+    }
+    return trace_function_qualified_name(execute_data->func);
+}
+
+// 超出预算后的调用：计入该操作的聚合span（第一次时创建），不改变current_span
+static trace_span_t *trace_overflow_begin(zend_execute_data *execute_data, trace_func_decision_t *decision)
+{
+    zend_function *func = execute_data->func;
+    // trampoline共用同一个zend_function，只能按名称区分
+    int by_name = (func->common.fn_flags & ZEND_ACC_CALL_VIA_TRAMPOLINE) != 0;
+    zend_string *name = NULL;
+    trace_overflow_t *agg;
+    
+    if (!TRACE_G(overflow_ops)) {
+        ALLOC_HASHTABLE(TRACE_G(overflow_ops));
+        zend_hash_init(TRACE_G(overflow_ops), 8, NULL, trace_overflow_dtor, 0);
+    }
+    
+    if (by_name) {
+        name = trace_overflow_name(execute_data, decision);
+        agg = zend_hash_find_ptr(TRACE_G(overflow_ops), name);
+    } else {
+        agg = zend_hash_index_find_ptr(TRACE_G(overflow_ops), (zend_ulong)(uintptr_t)func);
+    }
+    
+    if (!agg && zend_hash_num_elements(TRACE_G(overflow_ops)) >= TRACE_OVERFLOW_MAX_OPS) {
+        // 操作种类太多，之后新出现的操作全部归入一个span
+        if (name) {
+            zend_string_release(name);
+        }
+        name = zend_string_init(TRACE_OVERFLOW_CATCH_ALL, sizeof(TRACE_OVERFLOW_CATCH_ALL) - 1, 0);
+        by_name = 1;
+        agg = zend_hash_find_ptr(TRACE_G(overflow_ops), name);
+    }
+    
+    if (!agg) {
+        if (!name) {
+            name = trace_overflow_name(execute_data, decision);
+        }
+        agg = emalloc(sizeof(trace_overflow_t));
+        agg->span = trace_create_span_ex(name, TRACE_G(current_span));
+        agg->span->flags |= TRACE_SPAN_NATIVE | TRACE_SPAN_OVERFLOW;
+        agg->count = 0;
+        agg->total_ns = 0;
+        agg->min_ns = UINT64_MAX;
+        agg->max_ns = 0;
+        
+        zval flag;
+        ZVAL_TRUE(&flag);
+        TRACE_SPAN_SET_TAG(agg->span, "trace.overflow", &flag);
+        // overflow.* 统计是聚合span的内容本身，不受每个span的tag上限限制，只计入内存
+        TRACE_G(memory_used) += 4 * sizeof(Bucket);
+        
+        if (by_name) {
+            zend_hash_add_new_ptr(TRACE_G(overflow_ops), name, agg);
+        } else {
+            zend_hash_index_add_new_ptr(TRACE_G(overflow_ops), (zend_ulong)(uintptr_t)func, agg);
+        }
+    }
+    if (name) {
+        zend_string_release(name);
+    }
+    
+    if (TRACE_G(overflow_depth) == TRACE_G(overflow_size)) {
+        TRACE_G(overflow_size) = TRACE_G(overflow_size) ? TRACE_G(overflow_size) * 2 : 16;
+        TRACE_G(overflow_stack) = erealloc(TRACE_G(overflow_stack),
+                                           sizeof(trace_overflow_frame_t) * TRACE_G(overflow_size));
+    }
+    trace_overflow_frame_t *frame = &TRACE_G(overflow_stack)[TRACE_G(overflow_depth)++];
+    frame->agg = agg;
+    frame->start_ns = trace_now_ns();
+    
+    return agg->span;
+}
+
+static void trace_overflow_end(trace_span_t *span)
+{
+    if (TRACE_G(overflow_depth) == 0 || TRACE_G(overflow_stack)[TRACE_G(overflow_depth) - 1].agg->span != span) {
+        return;
+    }
+    
+    trace_overflow_frame_t *frame = &TRACE_G(overflow_stack)[--TRACE_G(overflow_depth)];
+    trace_overflow_t *agg = frame->agg;
+    uint64_t now = trace_now_ns();
+    uint64_t duration = now - frame->start_ns;
+    
+    agg->count++;
+    agg->total_ns += duration;
+    if (duration < agg->min_ns) {
+        agg->min_ns = duration;
+    }
+    if (duration > agg->max_ns) {
+        agg->max_ns = duration;
+    }
+    TRACE_G(overflow_calls)++;
+    
+    // 耗时计入调用方：外层的被聚合调用，否则是当前span
+    if (TRACE_G(overflow_depth) > 0) {
+        TRACE_G(overflow_stack)[TRACE_G(overflow_depth) - 1].agg->span->child_ns += duration;
+    } else if (TRACE_G(current_span)) {
+        TRACE_G(current_span)->child_ns += duration;
+    }
+    
+    // 聚合span覆盖第一次到最后一次调用的时间范围，统计值写在tags中
+    span->end_ns = now;
+    HashTable *tags = trace_span_tags(span);
+    zval value;
+    ZVAL_LONG(&value, (zend_long)agg->count);
+    zend_hash_str_update(tags, "overflow.count", sizeof("overflow.count") - 1, &value);
+    ZVAL_LONG(&value, (zend_long)agg->total_ns);
+    zend_hash_str_update(tags, "overflow.total_ns", sizeof("overflow.total_ns") - 1, &value);
+    ZVAL_LONG(&value, (zend_long)agg->min_ns);
+    zend_hash_str_update(tags, "overflow.min_ns", sizeof("overflow.min_ns") - 1, &value);
+    ZVAL_LONG(&value, (zend_long)agg->max_ns);
+    zend_hash_str_update(tags, "overflow.max_ns", sizeof("overflow.max_ns") - 1, &value);
+}
+
+// 自身开销统计
+#define TRACE_STATS_FIELD(name) { #name, sizeof(#name) - 1, XtOffsetOf(trace_stats_t, name) }
+static const struct {
+    const char *name;
+    size_t len;
+    size_t offset;
+} trace_stats_fields[] = {
+    TRACE_STATS_FIELD(hook_calls),
+    TRACE_STATS_FIELD(decision_lookups),
+    TRACE_STATS_FIELD(rule_evaluations),
+    TRACE_STATS_FIELD(rule_hits),
+    TRACE_STATS_FIELD(callbacks),
+    TRACE_STATS_FIELD(spans_created),
+    TRACE_STATS_FIELD(spans_discarded),
+    TRACE_STATS_FIELD(calls_aggregated),
+    TRACE_STATS_FIELD(tags_dropped),
+    TRACE_STATS_FIELD(logs_dropped),
+    TRACE_STATS_FIELD(bytes),
+    TRACE_STATS_FIELD(match_ns),
+    TRACE_STATS_FIELD(args_ns),
+    TRACE_STATS_FIELD(callback_ns),
+    TRACE_STATS_FIELD(span_ns),
+};
+#undef TRACE_STATS_FIELD
+
+static void trace_stats_add(trace_stats_t *dst, const trace_stats_t *src)
+{
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    size_t i;
+    for (i = 0; i < sizeof(trace_stats_t) / sizeof(uint64_t); i++) {
+        d[i] += s[i];
+    }
+}
+
+// 本请求到目前为止的统计：加上当前trace还未计入的预算计数
+static void trace_stats_current(trace_stats_t *out)
+{
+    *out = TRACE_G(stats);
+    out->calls_aggregated += TRACE_G(overflow_calls);
+    out->tags_dropped += TRACE_G(dropped_tags);
+    out->logs_dropped += TRACE_G(dropped_logs);
+    out->bytes += TRACE_G(memory_used);
+}
+
+static void trace_stats_to_array(zval *dst, const trace_stats_t *stats)
+{
+    size_t i;
+    
+    array_init_size(dst, sizeof(trace_stats_fields) / sizeof(trace_stats_fields[0]) + 1);
+    for (i = 0; i < sizeof(trace_stats_fields) / sizeof(trace_stats_fields[0]); i++) {
+        uint64_t value = *(const uint64_t *)((const char *)stats + trace_stats_fields[i].offset);
+        add_assoc_long_ex(dst, trace_stats_fields[i].name, trace_stats_fields[i].len, (zend_long)value);
+    }
+    add_assoc_long(dst, "overhead_ns", (zend_long)(stats->match_ns + stats->args_ns + stats->callback_ns + stats->span_ns));
+}
+
+// 指标模式
+// 钩子需要一个非NULL的span与退出配对，所有调用共用这个只读的占位span
+static trace_span_t trace_metrics_marker = { .flags = TRACE_SPAN_NATIVE | TRACE_SPAN_METRICS };
+
+static void trace_func_stats_dtor(zval *zv)
+{
+    trace_func_stats_t *stats = Z_PTR_P(zv);
+    zend_string_release(stats->name);
+    efree(stats);
+}
+
+static zend_always_inline uint32_t trace_hist_index(uint64_t value)
+{
+    if (value < TRACE_HIST_SUB_COUNT) {
+        return (uint32_t)value;
+    }
+    uint32_t exp = 63 - (uint32_t)__builtin_clzll(value);
+    if (exp > TRACE_HIST_MAX_EXP) {
+        return TRACE_HIST_BUCKETS - 1;
+    }
+    uint32_t sub = (uint32_t)(value >> (exp - TRACE_HIST_SUB_BITS)) & (TRACE_HIST_SUB_COUNT - 1);
+    return (exp - TRACE_HIST_SUB_BITS + 1) * TRACE_HIST_SUB_COUNT + sub;
+}
+
+// 桶的下界（纳秒）
+static uint64_t trace_hist_lower(uint32_t index)
+{
+    if (index < TRACE_HIST_SUB_COUNT) {
+        return index;
+    }
+    uint32_t exp = index / TRACE_HIST_SUB_COUNT + TRACE_HIST_SUB_BITS - 1;
+    uint64_t sub = index % TRACE_HIST_SUB_COUNT;
+    return (TRACE_HIST_SUB_COUNT + sub) << (exp - TRACE_HIST_SUB_BITS);
+}
+
+// 从直方图估算分位数：取命中桶的中点，并限制在 [min, max] 内
+static uint64_t trace_hist_percentile(const uint32_t *hist, uint64_t total, double q, uint64_t min_ns, uint64_t max_ns)
+{
+    uint64_t rank = (uint64_t)(q * (double)total);
+    uint64_t seen = 0;
+    uint32_t i;
+    
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            break;
+        }
+    }
+    if (i >= TRACE_HIST_BUCKETS - 1) {
+        return max_ns;
+    }
+    uint64_t lower = trace_hist_lower(i);
+    uint64_t value = lower + (trace_hist_lower(i + 1) - lower) / 2;
+    if (value < min_ns) {
+        return min_ns;
+    }
+    return value > max_ns ? max_ns : value;
+}
+
+// 取函数的统计记录（第一次调用时创建），按zend_function*查找，trampoline按名称
+static trace_func_stats_t *trace_func_stats_get(zend_function *func)
+{
+    int by_name = (func->common.fn_flags & ZEND_ACC_CALL_VIA_TRAMPOLINE) != 0;
+    zend_string *name = NULL;
+    trace_func_stats_t *stats;
+    
+    if (!TRACE_G(function_stats)) {
+        ALLOC_HASHTABLE(TRACE_G(function_stats));
+        zend_hash_init(TRACE_G(function_stats), 64, NULL, trace_func_stats_dtor, 0);
+    }
+    
+    if (by_name) {
+        name = trace_function_qualified_name(func);
+        stats = zend_hash_find_ptr(TRACE_G(function_stats), name);
+    } else {
+        stats = zend_hash_index_find_ptr(TRACE_G(function_stats), (zend_ulong)(uintptr_t)func);
+    }
+    if (stats) {
+        if (name) {
+            zend_string_release(name);
+        }
+        return stats;
+    }
+    
+    stats = ecalloc(1, sizeof(trace_func_stats_t));
+    stats->name = name ? name : trace_function_display_name(func);
+    stats->min_ns = UINT64_MAX;
+    if (by_name) {
+        zend_hash_add_new_ptr(TRACE_G(function_stats), stats->name, stats);
+    } else {
+        zend_hash_index_add_new_ptr(TRACE_G(function_stats), (zend_ulong)(uintptr_t)func, stats);
+    }
+    return stats;
+}
+
+static trace_span_t *trace_metrics_begin(zend_execute_data *execute_data)
+{
+    if (TRACE_G(metrics_depth) == TRACE_G(metrics_size)) {
+        TRACE_G(metrics_size) = TRACE_G(metrics_size) ? TRACE_G(metrics_size) * 2 : 64;
+        TRACE_G(metrics_stack) = erealloc(TRACE_G(metrics_stack),
+                                          sizeof(trace_metrics_frame_t) * TRACE_G(metrics_size));
+    }
+    trace_metrics_frame_t *frame = &TRACE_G(metrics_stack)[TRACE_G(metrics_depth)++];
+    frame->stats = trace_func_stats_get(execute_data->func);
+    frame->child_ns = 0;
+    frame->start_ns = trace_now_ns();
+    
+    return &trace_metrics_marker;
+}
+
+static void trace_metrics_end(void)
+{
+    uint64_t now = trace_now_ns();
+    
+    if (TRACE_G(metrics_depth) == 0) {
+        return;
+    }
+    
+    trace_metrics_frame_t *frame = &TRACE_G(metrics_stack)[--TRACE_G(metrics_depth)];
+    trace_func_stats_t *stats = frame->stats;
+    uint64_t inclusive = now - frame->start_ns;
+    uint64_t exclusive = inclusive > frame->child_ns ? inclusive - frame->child_ns : 0;
+    
+    stats->calls++;
+    stats->inclusive_ns += inclusive;
+    stats->exclusive_ns += exclusive;
+    if (inclusive < stats->min_ns) {
+        stats->min_ns = inclusive;
+    }
+    if (inclusive > stats->max_ns) {
+        stats->max_ns = inclusive;
+    }
+    stats->inclusive_hist[trace_hist_index(inclusive)]++;
+    stats->exclusive_hist[trace_hist_index(exclusive)]++;
+    
+    if (TRACE_G(metrics_depth) > 0) {
+        TRACE_G(metrics_stack)[TRACE_G(metrics_depth) - 1].child_ns += inclusive;
+    }
+}
+
+static void trace_metrics_free(void)
+{
+    if (TRACE_G(function_stats)) {
+        zend_hash_destroy(TRACE_G(function_stats));
+        FREE_HASHTABLE(TRACE_G(function_stats));
+        TRACE_G(function_stats) = NULL;
+    }
+    if (TRACE_G(metrics_stack)) {
+        efree(TRACE_G(metrics_stack));
+        TRACE_G(metrics_stack) = NULL;
+    }
+    TRACE_G(metrics_depth) = 0;
+    TRACE_G(metrics_size) = 0;
+}
+
+// 被跟踪函数进入：规则带原生模板时直接创建span，否则调用enter回调，根据返回值创建span并压栈
+// 返回创建的span；回调没有返回operation_name时返回NULL（不创建span）
+trace_span_t *trace_function_begin(zend_execute_data *execute_data, trace_func_decision_t *decision)
+{
+    trace_span_t *span = NULL;
+    
+    // 指标模式：只计数，不创建span也不调用回调
+    if (TRACE_G(metrics_mode)) {
+        return trace_metrics_begin(execute_data);
+    }
+    
+    // 超出span数或内存预算：不再调用回调，按操作聚合
+    if (trace_budget_exhausted()) {
+        return trace_overflow_begin(execute_data, decision);
+    }
+    
+    if (decision->rule->span_template) {
+        return trace_function_begin_native(execute_data, decision);
+    }
+    
+    zval callback_result;
+    ZVAL_UNDEF(&callback_result);
+    
+    if (!Z_ISUNDEF(TRACE_G(frame_enter_callback))) {
+        // 优先使用frame_enter回调：不构造参数数组
+        trace_call_frame_callback(execute_data, decision->rule, &callback_result);
+    } else if (!Z_ISUNDEF(TRACE_G(function_enter_callback))) {
+        trace_call_enter_callback(execute_data, decision->rule, &callback_result);
+    } else {
+        return NULL;
+    }
+    
+    // 根据回调返回值创建span
+    if (Z_TYPE(callback_result) == IS_ARRAY) {
+        zval *operation_name = zend_hash_str_find(Z_ARR(callback_result), "operation_name", sizeof("operation_name") - 1);
+        if (operation_name && Z_TYPE_P(operation_name) == IS_STRING && Z_STRLEN_P(operation_name) > 0) {
+            span = trace_create_span_ex(Z_STR_P(operation_name), TRACE_G(current_span));
+            if (span) {
+                TRACE_G(current_span) = span;
+                
+                // 处理callback返回的tags和logs
+                trace_span_merge_tags(span, zend_hash_str_find(Z_ARR(callback_result), "tags", sizeof("tags") - 1), 0);
+                trace_span_append_logs(span, zend_hash_str_find(Z_ARR(callback_result), "logs", sizeof("logs") - 1));
+            }
+        }
+    }
+    
+    // 清理回调返回值
+    if (!Z_ISUNDEF(callback_result)) {
+        zval_dtor(&callback_result);
+    }
+    
+    return span;
+}
+
+// 被跟踪函数退出：完成span、恢复父span、调用exit回调
+void trace_function_end(trace_span_t *span, zval *return_value)
+{
+    if (span->flags & TRACE_SPAN_METRICS) {
+        trace_metrics_end();
+        return;
+    }
+    if (span->flags & TRACE_SPAN_OVERFLOW) {
+        trace_overflow_end(span);
+        return;
+    }
+    
+    // 完成span
+    trace_finish_span(span);
+    
+    // 恢复父span
+    TRACE_G(current_span) = span->parent;
+    
+    // 调用exit回调（原生span不调用）
+    if ((span->flags & TRACE_SPAN_NATIVE) || Z_ISUNDEF(TRACE_G(function_exit_callback))) {
+        return;
+    }
+    
+    zval exit_args[3];
+    
+    // span_id
+    ZVAL_STR(&exit_args[0], trace_span_id_str(span->span_id));
+    
+    // duration (执行时长)
+    ZVAL_DOUBLE(&exit_args[1], (double)(span->end_ns - span->start_ns) / 1000000000.0);
+    
+    // 函数返回值
+    if (return_value && !Z_ISUNDEF_P(return_value)) {
+        ZVAL_COPY(&exit_args[2], return_value);
+    } else {
+        ZVAL_NULL(&exit_args[2]);
+    }
+    
+    zval exit_result;
+    ZVAL_UNDEF(&exit_result);
+    trace_call_user_callback(&TRACE_G(function_exit_callback), 3, exit_args, &exit_result);
+    
+    // 处理exit回调返回的tags和logs，合并到span
+    if (Z_TYPE(exit_result) == IS_ARRAY) {
+        trace_span_merge_tags(span, zend_hash_str_find(Z_ARR(exit_result), "tags", sizeof("tags") - 1), 1);
+        trace_span_append_logs(span, zend_hash_str_find(Z_ARR(exit_result), "logs", sizeof("logs") - 1));
+    }
+    
+    // 清理
+    int j;
+    for (j = 0; j < 3; j++) {
+        zval_dtor(&exit_args[j]);
+    }
+    if (!Z_ISUNDEF(exit_result)) {
+        zval_dtor(&exit_result);
+    }
+}
+
+// 原生埋点：替换扩展函数/方法的处理器
+// MINIT时在函数表中找到目标，把 internal_function.handler 换成自己的，原处理器保存在表中；
+// 目标扩展未加载时跳过。与白名单无关，不经过通用钩子
+typedef struct _trace_handler_hook {
+    const char *class_name;     // 方法所属的类（小写），函数为NULL
+    const char *function_name;  // 小写
+    zif_handler replacement;
+    zif_handler original;       // 安装成功后非NULL
+} trace_handler_hook_t;
+
+static zend_function *trace_handler_hook_find(const trace_handler_hook_t *hook)
+{
+    HashTable *table = CG(function_table);
+    zend_function *func;
+    
+    if (hook->class_name) {
+        zend_class_entry *ce = zend_hash_str_find_ptr(CG(class_table), hook->class_name, strlen(hook->class_name));
+        if (!ce) {
+            return NULL;
+        }
+        table = &ce->function_table;
+    }
+    func = zend_hash_str_find_ptr(table, hook->function_name, strlen(hook->function_name));
+    return func && func->type == ZEND_INTERNAL_FUNCTION ? func : NULL;
+}
+
+static zend_function *trace_handler_hook_install(trace_handler_hook_t *hook)
+{
+    zend_function *func = trace_handler_hook_find(hook);
+    if (func) {
+        hook->original = func->internal_function.handler;
+        func->internal_function.handler = hook->replacement;
+    }
+    return func;
+}
+
+static void trace_handler_hooks_install(trace_handler_hook_t *hooks)
+{
+    for (; hooks->function_name; hooks++) {
+        trace_handler_hook_install(hooks);
+    }
+}
+
+static void trace_handler_hooks_restore(trace_handler_hook_t *hooks)
+{
+    for (; hooks->function_name; hooks++) {
+        zend_function *func;
+        if (hooks->original && (func = trace_handler_hook_find(hooks)) != NULL) {
+            func->internal_function.handler = hooks->original;
+        }
+        hooks->original = NULL;
+    }
+}
+
+// 原生埋点是否创建span：与通用钩子一样只在采样的请求中，超出预算后不再创建
+static zend_always_inline int trace_native_span_active(void)
+{
+    return TRACE_G(enabled) && TRACE_G(sampled) && !TRACE_G(metrics_mode)
+        && !TRACE_G(in_trace_callback) && !trace_budget_exhausted();
+}
+
+// curl
+// curl_exec：span包住整个调用；curl_multi：span从curl_multi_add_handle到curl_multi_remove_handle
+// 发送前把traceparent/tracestate合并进句柄的CURLOPT_HTTPHEADER。curl没有追加请求头的接口，
+// 所以记录用户通过curl_setopt/curl_setopt_array设置的请求头，注入时与它们合并后整体重新设置
+#define TRACE_CURLOPT_HTTPHEADER 10023  // CURLOPTTYPE_OBJECTPOINT + 23
+
+enum {
+    TRACE_HOOK_CURL_INIT,
+    TRACE_HOOK_CURL_SETOPT,
+    TRACE_HOOK_CURL_SETOPT_ARRAY,
+    TRACE_HOOK_CURL_RESET,
+    TRACE_HOOK_CURL_COPY_HANDLE,
+    TRACE_HOOK_CURL_EXEC,
+    TRACE_HOOK_CURL_MULTI_ADD_HANDLE,
+    TRACE_HOOK_CURL_MULTI_REMOVE_HANDLE,
+    TRACE_HOOK_CURL_COUNT
+};
+
+// 每个curl句柄的状态（按对象handle，请求级）
+typedef struct _trace_curl_handle {
+    zval headers;            // 用户设置的CURLOPT_HTTPHEADER，没有设置时为UNDEF
+    trace_span_t *span;      // curl_multi中进行中的span
+    uint32_t generation;     // span所属的span_generation，trace_reset()后失效
+} trace_curl_handle_t;
+
+static zend_function *trace_curl_getinfo_fn = NULL;
+static zend_function *trace_curl_errno_fn = NULL;
+static zend_function *trace_curl_error_fn = NULL;
+static zend_function *trace_curl_setopt_fn = NULL;
+
+static void trace_curl_handle_dtor(zval *zv)
+{
+    trace_curl_handle_t *state = Z_PTR_P(zv);
+    zval_ptr_dtor(&state->headers);
+    efree(state);
+}
+
+static trace_curl_handle_t *trace_curl_handle(zval *ch, int create)
+{
+    trace_curl_handle_t *state;
+    
+    if (!TRACE_G(curl_handles)) {
+        if (!create) {
+            return NULL;
+        }
+        ALLOC_HASHTABLE(TRACE_G(curl_handles));
+        zend_hash_init(TRACE_G(curl_handles), 8, NULL, trace_curl_handle_dtor, 0);
+    }
+    state = zend_hash_index_find_ptr(TRACE_G(curl_handles), Z_OBJ_HANDLE_P(ch));
+    if (!state && create) {
+        state = emalloc(sizeof(trace_curl_handle_t));
+        ZVAL_UNDEF(&state->headers);
+        state->span = NULL;
+        state->generation = 0;
+        zend_hash_index_add_new_ptr(TRACE_G(curl_handles), Z_OBJ_HANDLE_P(ch), state);
+    }
+    return state;
+}
+
+static void trace_curl_handle_forget(zval *ch)
+{
+    if (TRACE_G(curl_handles)) {
+        zend_hash_index_del(TRACE_G(curl_handles), Z_OBJ_HANDLE_P(ch));
+    }
+}
+
+static void trace_curl_remember_headers(zval *ch, zval *headers)
+{
+    trace_curl_handle_t *state = trace_curl_handle(ch, 1);
+    zval_ptr_dtor(&state->headers);
+    ZVAL_COPY(&state->headers, headers);
+}
+
+static int trace_curl_is_propagation_header(zval *line)
+{
+    return Z_TYPE_P(line) == IS_STRING
+        && ((Z_STRLEN_P(line) > sizeof("traceparent:") - 1
+             && strncasecmp(Z_STRVAL_P(line), "traceparent:", sizeof("traceparent:") - 1) == 0)
+            || (Z_STRLEN_P(line) > sizeof("tracestate:") - 1
+             && strncasecmp(Z_STRVAL_P(line), "tracestate:", sizeof("tracestate:") - 1) == 0));
+}
+
+// 把traceparent（parent-id为出站span）合并进句柄的请求头
+static void trace_curl_inject(zval *ch, uint64_t parent_id)
+{
+    trace_curl_handle_t *state = trace_curl_handle(ch, 0);
+    char line[sizeof("traceparent: ") - 1 + TRACE_TRACEPARENT_LEN];
+    zval args[3], retval, *entry;
+    
+    if (!trace_curl_setopt_fn || (!TRACE_G(trace_id_hi) && !TRACE_G(trace_id_lo))) {
+        return;
+    }
+    
+    array_init(&args[2]);
+    if (state && Z_TYPE(state->headers) == IS_ARRAY) {
+        ZEND_HASH_FOREACH_VAL(Z_ARRVAL(state->headers), entry) {
+            if (!trace_curl_is_propagation_header(entry)) {
+                Z_TRY_ADDREF_P(entry);
+                add_next_index_zval(&args[2], entry);
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+    memcpy(line, "traceparent: ", sizeof("traceparent: ") - 1);
+    trace_format_traceparent(line + sizeof("traceparent: ") - 1, parent_id);
+    add_next_index_stringl(&args[2], line, sizeof(line));
+    if (TRACE_G(tracestate)) {
+        add_next_index_str(&args[2], zend_string_concat2("tracestate: ", sizeof("tracestate: ") - 1,
+                                                         ZSTR_VAL(TRACE_G(tracestate)), ZSTR_LEN(TRACE_G(tracestate))));
+    }
+    
+    ZVAL_COPY_VALUE(&args[0], ch);
+    ZVAL_LONG(&args[1], TRACE_CURLOPT_HTTPHEADER);
+    TRACE_G(curl_injecting) = 1;
+    zend_call_known_function(trace_curl_setopt_fn, NULL, NULL, &retval, 3, args, NULL);
+    TRACE_G(curl_injecting) = 0;
+    zval_ptr_dtor(&retval);
+    zval_ptr_dtor(&args[2]);
+}
+
+// 出站请求开始：创建span（采样时）并注入请求头；未采样时仍然传递TraceID
+static trace_span_t *trace_curl_begin(zval *ch)
+{
+    trace_span_t *span = NULL;
+    uint64_t parent_id;
+    
+    if (!TRACE_G(enabled) || !TRACE_G(curl_enabled) || TRACE_G(in_trace_callback)) {
+        return NULL;
+    }
+    if (trace_native_span_active()) {
+        span = trace_create_span_ex(ZSTR_EMPTY_ALLOC(), TRACE_G(current_span));
+        span->flags |= TRACE_SPAN_NATIVE;
+        parent_id = span->span_id;
+    } else if (TRACE_G(current_span)) {
+        parent_id = TRACE_G(current_span)->span_id;
+    } else {
+        parent_id = TRACE_G(upstream_parent_id) ? TRACE_G(upstream_parent_id) : trace_random_id();
+    }
+    if (TRACE_G(curl_propagate)) {
+        trace_curl_inject(ch, parent_id);
+    }
+    return span;
+}
+
+static zval *trace_curl_call(zend_function *fn, zval *ch, zval *retval)
+{
+    ZVAL_UNDEF(retval);
+    if (fn) {
+        zend_call_known_function(fn, NULL, NULL, retval, 1, ch, NULL);
+    }
+    return retval;
+}
+
+// curl_getinfo的耗时（微秒整数字段，旧版本回退到秒），返回纳秒
+static uint64_t trace_curl_info_ns(HashTable *info, const char *name, size_t name_len)
+{
+    char key[64];
+    zval *value;
+    
+    snprintf(key, sizeof(key), "%s_us", name);
+    value = zend_hash_str_find(info, key, name_len + 3);
+    if (value && Z_TYPE_P(value) == IS_LONG) {
+        return Z_LVAL_P(value) > 0 ? (uint64_t)Z_LVAL_P(value) * 1000 : 0;
+    }
+    value = zend_hash_str_find(info, name, name_len);
+    if (value && Z_TYPE_P(value) == IS_DOUBLE && Z_DVAL_P(value) > 0) {
+        return (uint64_t)(Z_DVAL_P(value) * 1000000000.0);
+    }
+    return 0;
+}
+
+#define TRACE_CURL_INFO_NS(info, name) trace_curl_info_ns(info, name, sizeof(name) - 1)
+
+static void trace_curl_set_tag_long(trace_span_t *span, const char *key, size_t key_len, zend_long value)
+{
+    zval zv;
+    ZVAL_LONG(&zv, value);
+    trace_span_set_tag_str(span, key, key_len, &zv);
+}
+
+#define TRACE_CURL_TAG_LONG(span, key, value) trace_curl_set_tag_long(span, key, sizeof(key) - 1, (zend_long)(value))
+
+// 出站请求结束：从curl_getinfo取URL、状态码和各阶段耗时写入span，再调用curl回调补充tags
+static void trace_curl_end(trace_span_t *span, zval *ch)
+{
+    zval info, result, *value;
+    zend_string *name;
+    
+    trace_finish_span(span);
+    
+    trace_curl_call(trace_curl_getinfo_fn, ch, &info);
+    if (Z_TYPE(info) == IS_ARRAY) {
+        HashTable *ht = Z_ARRVAL(info);
+        zval tag;
+        
+        // span名：http {host}；URL去掉查询串，避免把签名、token写进trace
+        value = zend_hash_str_find(ht, "url", sizeof("url") - 1);
+        if (value && Z_TYPE_P(value) == IS_STRING) {
+            const char *url = Z_STRVAL_P(value);
+            const char *query = memchr(url, '?', Z_STRLEN_P(value));
+            const char *host = strstr(url, "://");
+            size_t host_len;
+            
+            ZVAL_STRINGL(&tag, url, query ? (size_t)(query - url) : Z_STRLEN_P(value));
+            TRACE_SPAN_SET_TAG(span, "http.url", &tag);
+            
+            host = host ? host + 3 : url;
+            host_len = strcspn(host, "/?#");
+            name = zend_strpprintf(0, "http %.*s", (int)host_len, host);
+        } else {
+            name = zend_string_init("http", sizeof("http") - 1, 0);
+        }
+        zend_string_release(span->operation_name);
+        span->operation_name = name;
+        
+        value = zend_hash_str_find(ht, "http_code", sizeof("http_code") - 1);
+        if (value && Z_TYPE_P(value) == IS_LONG && Z_LVAL_P(value) > 0) {
+            TRACE_CURL_TAG_LONG(span, "http.status_code", Z_LVAL_P(value));
+            if (Z_LVAL_P(value) >= 500) {
+                trace_span_set_error(span);
+            }
+        }
+        value = zend_hash_str_find(ht, "primary_ip", sizeof("primary_ip") - 1);
+        if (value && Z_TYPE_P(value) == IS_STRING && Z_STRLEN_P(value) > 0) {
+            ZVAL_STR_COPY(&tag, Z_STR_P(value));
+            TRACE_SPAN_SET_TAG(span, "net.peer.ip", &tag);
+        }
+        value = zend_hash_str_find(ht, "primary_port", sizeof("primary_port") - 1);
+        if (value && Z_TYPE_P(value) == IS_LONG && Z_LVAL_P(value) > 0) {
+            TRACE_CURL_TAG_LONG(span, "net.peer.port", Z_LVAL_P(value));
+        }
+        value = zend_hash_str_find(ht, "size_download", sizeof("size_download") - 1);
+        if (value && (Z_TYPE_P(value) == IS_DOUBLE || Z_TYPE_P(value) == IS_LONG)) {
+            TRACE_CURL_TAG_LONG(span, "http.response_size", zval_get_long(value));
+        }
+        value = zend_hash_str_find(ht, "redirect_count", sizeof("redirect_count") - 1);
+        if (value && Z_TYPE_P(value) == IS_LONG && Z_LVAL_P(value) > 0) {
+            TRACE_CURL_TAG_LONG(span, "http.redirect_count", Z_LVAL_P(value));
+        }
+        
+        // curl的时间都从传输开始累计：DNS → TCP连接 → TLS握手 → 发送 → 首字节
+        uint64_t dns = TRACE_CURL_INFO_NS(ht, "namelookup_time");
+        uint64_t connect = TRACE_CURL_INFO_NS(ht, "connect_time");
+        uint64_t tls = TRACE_CURL_INFO_NS(ht, "appconnect_time");
+        uint64_t pretransfer = TRACE_CURL_INFO_NS(ht, "pretransfer_time");
+        uint64_t ttfb = TRACE_CURL_INFO_NS(ht, "starttransfer_time");
+        TRACE_CURL_TAG_LONG(span, "http.dns_ns", dns);
+        TRACE_CURL_TAG_LONG(span, "http.connect_ns", connect > dns ? connect - dns : 0);
+        TRACE_CURL_TAG_LONG(span, "http.tls_ns", tls > connect ? tls - connect : 0);
+        TRACE_CURL_TAG_LONG(span, "http.ttfb_ns", ttfb);
+        TRACE_CURL_TAG_LONG(span, "http.server_ns", ttfb > pretransfer ? ttfb - pretransfer : 0);
+        TRACE_CURL_TAG_LONG(span, "http.total_ns", TRACE_CURL_INFO_NS(ht, "total_time"));
+    } else {
+        zend_string_release(span->operation_name);
+        span->operation_name = zend_string_init("http", sizeof("http") - 1, 0);
+    }
+    TRACE_G(memory_used) += _ZSTR_STRUCT_SIZE(ZSTR_LEN(span->operation_name));
+    
+    trace_curl_call(trace_curl_errno_fn, ch, &result);
+    if (Z_TYPE(result) == IS_LONG && Z_LVAL(result) != 0) {
+        zval tag;
+        TRACE_CURL_TAG_LONG(span, "curl.errno", Z_LVAL(result));
+        trace_curl_call(trace_curl_error_fn, ch, &tag);
+        if (Z_TYPE(tag) == IS_STRING) {
+            TRACE_SPAN_SET_TAG(span, "curl.error", &tag);
+        } else {
+            zval_ptr_dtor(&tag);
+        }
+        trace_span_set_error(span);
+    }
+    zval_ptr_dtor(&result);
+    
+    // curl回调只用于补充：function($ch, array $info, string $spanId): ?array，返回的数组合并为tags
+    if (!Z_ISUNDEF(TRACE_G(curl_callback))) {
+        zval args[3];
+        ZVAL_COPY(&args[0], ch);
+        if (Z_TYPE(info) == IS_ARRAY) {
+            ZVAL_COPY(&args[1], &info);
+        } else {
+            ZVAL_EMPTY_ARRAY(&args[1]);
+        }
+        ZVAL_STR(&args[2], trace_span_id_str(span->span_id));
+        ZVAL_UNDEF(&result);
+        trace_call_user_callback(&TRACE_G(curl_callback), 3, args, &result);
+        if (Z_TYPE(result) == IS_ARRAY) {
+            trace_span_merge_tags(span, &result, 1);
+        }
+        zval_ptr_dtor(&result);
+        zval_ptr_dtor(&args[0]);
+        zval_ptr_dtor(&args[1]);
+        zval_ptr_dtor(&args[2]);
+    }
+    zval_ptr_dtor(&info);
+}
+
+static trace_handler_hook_t trace_curl_hooks[TRACE_HOOK_CURL_COUNT + 1];
+
+#define TRACE_CURL_ORIGINAL(id) trace_curl_hooks[id].original(INTERNAL_FUNCTION_PARAM_PASSTHRU)
+
+// 第n个参数（从1开始）是对象时返回，否则NULL
+static zend_always_inline zval *trace_object_arg(zend_execute_data *execute_data, uint32_t n)
+{
+    if (ZEND_CALL_NUM_ARGS(execute_data) < n) {
+        return NULL;
+    }
+    zval *arg = ZEND_CALL_ARG(execute_data, n);
+    ZVAL_DEREF(arg);
+    return Z_TYPE_P(arg) == IS_OBJECT ? arg : NULL;
+}
+
+static void trace_curl_init_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_INIT);
+    // 对象handle会被复用，新句柄不能继承之前句柄的状态
+    if (Z_TYPE_P(return_value) == IS_OBJECT) {
+        trace_curl_handle_forget(return_value);
+    }
+}
+
+static void trace_curl_setopt_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *ch = trace_object_arg(execute_data, 1);
+    
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_SETOPT);
+    if (ch && !TRACE_G(curl_injecting) && Z_TYPE_P(return_value) == IS_TRUE && ZEND_CALL_NUM_ARGS(execute_data) >= 3) {
+        zval *option = ZEND_CALL_ARG(execute_data, 2);
+        zval *value = ZEND_CALL_ARG(execute_data, 3);
+        ZVAL_DEREF(option);
+        ZVAL_DEREF(value);
+        if (Z_TYPE_P(option) == IS_LONG && Z_LVAL_P(option) == TRACE_CURLOPT_HTTPHEADER) {
+            trace_curl_remember_headers(ch, value);
+        }
+    }
+}
+
+static void trace_curl_setopt_array_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *ch = trace_object_arg(execute_data, 1);
+    
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_SETOPT_ARRAY);
+    if (ch && Z_TYPE_P(return_value) == IS_TRUE && ZEND_CALL_NUM_ARGS(execute_data) >= 2) {
+        zval *options = ZEND_CALL_ARG(execute_data, 2);
+        zval *value;
+        ZVAL_DEREF(options);
+        if (Z_TYPE_P(options) == IS_ARRAY
+            && (value = zend_hash_index_find(Z_ARRVAL_P(options), TRACE_CURLOPT_HTTPHEADER)) != NULL) {
+            ZVAL_DEREF(value);
+            trace_curl_remember_headers(ch, value);
+        }
+    }
+}
+
+static void trace_curl_reset_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *ch = trace_object_arg(execute_data, 1);
+    
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_RESET);
+    if (ch) {
+        trace_curl_handle_forget(ch);
+    }
+}
+
+static void trace_curl_copy_handle_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *ch = trace_object_arg(execute_data, 1);
+    
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_COPY_HANDLE);
+    if (ch && Z_TYPE_P(return_value) == IS_OBJECT) {
+        trace_curl_handle_t *source = trace_curl_handle(ch, 0);
+        trace_curl_handle_forget(return_value);
+        if (source && !Z_ISUNDEF(source->headers)) {
+            trace_curl_remember_headers(return_value, &source->headers);
+        }
+    }
+}
+
+static void trace_curl_exec_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *ch = trace_object_arg(execute_data, 1);
+    trace_span_t *span = ch ? trace_curl_begin(ch) : NULL;
+    
+    if (!span) {
+        TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_EXEC);
+        return;
+    }
+    
+    // 写回调等PHP代码中创建的span挂在出站span下
+    trace_span_t *parent = TRACE_G(current_span);
+    uint32_t generation = TRACE_G(span_generation);
+    TRACE_G(current_span) = span;
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_EXEC);
+    
+    // 回调中调用了trace_reset()时span已被释放
+    if (generation == TRACE_G(span_generation)) {
+        TRACE_G(current_span) = parent;
+        trace_curl_end(span, ch);
+    }
+}
+
+static void trace_curl_multi_add_handle_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *ch = trace_object_arg(execute_data, 2);
+    
+    if (ch) {
+        trace_span_t *span = trace_curl_begin(ch);
+        if (span) {
+            trace_curl_handle_t *state = trace_curl_handle(ch, 1);
+            state->span = span;
+            state->generation = TRACE_G(span_generation);
+        }
+    }
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_MULTI_ADD_HANDLE);
+}
+
+static void trace_curl_multi_remove_handle_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *ch = trace_object_arg(execute_data, 2);
+    trace_curl_handle_t *state = ch ? trace_curl_handle(ch, 0) : NULL;
+    
+    if (state && state->span) {
+        trace_span_t *span = state->span;
+        state->span = NULL;
+        if (state->generation == TRACE_G(span_generation)) {
+            trace_curl_end(span, ch);
+        }
+    }
+    TRACE_CURL_ORIGINAL(TRACE_HOOK_CURL_MULTI_REMOVE_HANDLE);
+}
+
+static trace_handler_hook_t trace_curl_hooks[TRACE_HOOK_CURL_COUNT + 1] = {
+    [TRACE_HOOK_CURL_INIT]                = { NULL, "curl_init", trace_curl_init_handler, NULL },
+    [TRACE_HOOK_CURL_SETOPT]              = { NULL, "curl_setopt", trace_curl_setopt_handler, NULL },
+    [TRACE_HOOK_CURL_SETOPT_ARRAY]        = { NULL, "curl_setopt_array", trace_curl_setopt_array_handler, NULL },
+    [TRACE_HOOK_CURL_RESET]               = { NULL, "curl_reset", trace_curl_reset_handler, NULL },
+    [TRACE_HOOK_CURL_COPY_HANDLE]         = { NULL, "curl_copy_handle", trace_curl_copy_handle_handler, NULL },
+    [TRACE_HOOK_CURL_EXEC]                = { NULL, "curl_exec", trace_curl_exec_handler, NULL },
+    [TRACE_HOOK_CURL_MULTI_ADD_HANDLE]    = { NULL, "curl_multi_add_handle", trace_curl_multi_add_handle_handler, NULL },
+    [TRACE_HOOK_CURL_MULTI_REMOVE_HANDLE] = { NULL, "curl_multi_remove_handle", trace_curl_multi_remove_handle_handler, NULL },
+    { NULL, NULL, NULL, NULL }
+};
+
+static void trace_curl_hooks_install(void)
+{
+    if (!zend_hash_str_exists(&module_registry, "curl", sizeof("curl") - 1)) {
+        return;
+    }
+    trace_curl_getinfo_fn = zend_hash_str_find_ptr(CG(function_table), "curl_getinfo", sizeof("curl_getinfo") - 1);
+    trace_curl_errno_fn = zend_hash_str_find_ptr(CG(function_table), "curl_errno", sizeof("curl_errno") - 1);
+    trace_curl_error_fn = zend_hash_str_find_ptr(CG(function_table), "curl_error", sizeof("curl_error") - 1);
+    trace_curl_setopt_fn = zend_hash_str_find_ptr(CG(function_table), "curl_setopt", sizeof("curl_setopt") - 1);
+    trace_handler_hooks_install(trace_curl_hooks);
+}
+
+static void trace_curl_free(void)
+{
+    if (TRACE_G(curl_handles)) {
+        zend_hash_destroy(TRACE_G(curl_handles));
+        FREE_HASHTABLE(TRACE_G(curl_handles));
+        TRACE_G(curl_handles) = NULL;
+    }
+    TRACE_G(curl_injecting) = 0;
+}
+
+// 数据库（PDO / mysqli）
+// span包住查询调用，tags记录SQL指纹、行数和错误；SQL指纹按语句在worker内缓存，
+// 同一条SQL再次执行只需一次哈希查找。预处理语句的SQL：PDOStatement取queryString，
+// mysqli_stmt在prepare时按对象handle记录
+enum {
+    TRACE_HOOK_PDO_QUERY,
+    TRACE_HOOK_PDO_EXEC,
+    TRACE_HOOK_PDO_PREPARE,
+    TRACE_HOOK_PDO_STMT_EXECUTE,
+    TRACE_HOOK_MYSQLI_QUERY,
+    TRACE_HOOK_MYSQLI_QUERY_METHOD,
+    TRACE_HOOK_MYSQLI_PREPARE,
+    TRACE_HOOK_MYSQLI_PREPARE_METHOD,
+    TRACE_HOOK_MYSQLI_STMT_PREPARE,
+    TRACE_HOOK_MYSQLI_STMT_PREPARE_METHOD,
+    TRACE_HOOK_MYSQLI_STMT_EXECUTE,
+    TRACE_HOOK_MYSQLI_STMT_EXECUTE_METHOD,
+    TRACE_HOOK_MYSQLI_STMT_INIT,
+    TRACE_HOOK_MYSQLI_STMT_INIT_METHOD,
+    TRACE_HOOK_MYSQLI_STMT_CONSTRUCT,
+    TRACE_HOOK_DB_COUNT
+};
+
+#define TRACE_SQL_FINGERPRINT_MAX_SQL 4096  // 更长的SQL（如批量INSERT）每次重新计算，不缓存
+
+typedef struct _trace_sql_fingerprint {
+    zend_string *sql;          // 持久内存
+    zend_string *fingerprint;  // 持久内存
+} trace_sql_fingerprint_t;
+
+static zend_function *trace_mysqli_affected_rows_fn = NULL;
+static zend_function *trace_mysqli_errno_fn = NULL;
+static zend_function *trace_mysqli_error_fn = NULL;
+static zend_function *trace_mysqli_stmt_affected_rows_fn = NULL;
+static zend_function *trace_mysqli_stmt_errno_fn = NULL;
+static zend_function *trace_mysqli_stmt_error_fn = NULL;
+
+static zend_always_inline int trace_sql_ident_char(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+        || c == '_' || c == '$' || c >= 0x80;
+}
+
+// 括号组的种类：只有IN列表里的"?, ?"折叠，只有VALUES的行合并，其他逗号列表（LIMIT 10, 20、SELECT 1, 2）保持原样
+#define TRACE_SQL_GROUP_MAX 32
+
+enum {
+    TRACE_SQL_GROUP_OTHER,
+    TRACE_SQL_GROUP_IN,    // IN (...)：值列表，长度不影响指纹
+    TRACE_SQL_GROUP_ROW    // VALUES (...), (...)：列数保留，相同的行合并
+};
+
+// 刚写出的标识符是否为IN/VALUES，决定紧随其后的括号组的种类
+static int trace_sql_keyword(const char *word, size_t len)
+{
+    if (len == 2 && strncasecmp(word, "in", 2) == 0) {
+        return TRACE_SQL_GROUP_IN;
+    }
+    if ((len == 6 && strncasecmp(word, "values", 6) == 0) || (len == 5 && strncasecmp(word, "value", 5) == 0)) {
+        return TRACE_SQL_GROUP_ROW;
+    }
+    return TRACE_SQL_GROUP_OTHER;
+}
+
+// 写入一个"?"；在IN列表中紧跟在"?, "之后时折叠为"?+"，IN列表的长度不影响指纹
+static size_t trace_sql_placeholder(char *out, size_t n, int in_list)
+{
+    size_t m = n;
+    if (!in_list) {
+        out[n] = '?';
+        return n + 1;
+    }
+    if (m && out[m - 1] == ' ') m--;
+    if (m && out[m - 1] == ',') {
+        m--;
+        if (m && out[m - 1] == ' ') m--;
+        if (m >= 2 && out[m - 1] == '+' && out[m - 2] == '?') {
+            return m;
+        }
+        if (m && out[m - 1] == '?') {
+            out[m] = '+';
+            return m + 1;
+        }
+    }
+    out[n] = '?';
+    return n + 1;
+}
+
+// out以")"结尾：与前一个相同的括号组之间只隔着逗号时去掉这一组，"VALUES (?, ?), (?, ?)" → "VALUES (?, ?)"
+static size_t trace_sql_collapse_group(char *out, size_t n)
+{
+    size_t open = n - 1, glen, m;
+    
+    while (open > 0 && out[open] != '(') open--;
+    if (out[open] != '(') {
+        return n;
+    }
+    glen = n - open;
+    if (!memchr(out + open, '?', glen)) {
+        return n;
+    }
+    m = open;
+    if (m && out[m - 1] == ' ') m--;
+    if (!m || out[m - 1] != ',') {
+        return n;
+    }
+    m--;
+    if (m && out[m - 1] == ' ') m--;
+    if (m < glen || memcmp(out + m - glen, out + open, glen) != 0) {
+        return n;
+    }
+    return m;
+}
+
+// SQL指纹：一次扫描，字符串和数字字面量替换为?，去掉注释，连续空白合并为一个空格
+// 结果不会比原SQL长
+static zend_string *trace_sql_fingerprint(const char *sql, size_t len, int persistent)
+{
+    zend_string *result = zend_string_alloc(len, persistent);
+    char *out = ZSTR_VAL(result);
+    const char *p = sql, *end = sql + len;
+    size_t n = 0;
+    int space = 0;
+    unsigned char groups[TRACE_SQL_GROUP_MAX];
+    int depth = 0;
+    int values_depth = -1;  // VALUES关键字所在的括号深度，行之间只有逗号
+    int keyword = TRACE_SQL_GROUP_OTHER;
+    
+#define TRACE_SQL_GROUP(d) ((d) > 0 && (d) <= TRACE_SQL_GROUP_MAX ? groups[(d) - 1] : TRACE_SQL_GROUP_OTHER)
+#define TRACE_SQL_IN_LIST (TRACE_SQL_GROUP(depth) == TRACE_SQL_GROUP_IN)
+    
+    while (p < end) {
+        unsigned char c = (unsigned char)*p;
+        int token = TRACE_SQL_GROUP_OTHER;
+        
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f') {
+            space = 1;
+            p++;
+            continue;
+        }
+        if (c == '#' || (c == '-' && p + 1 < end && p[1] == '-')) {
+            while (p < end && *p != '\n') p++;
+            space = 1;
+            continue;
+        }
+        if (c == '/' && p + 1 < end && p[1] == '*') {
+            p += 2;
+            while (p + 1 < end && !(p[0] == '*' && p[1] == '/')) p++;
+            p = p + 1 < end ? p + 2 : end;
+            space = 1;
+            continue;
+        }
+        
+        if (space && n > 0) {
+            out[n++] = ' ';
+        }
+        space = 0;
+        
+        if (c == '\'' || c == '"') {
+            // 字符串：反斜杠转义和两个连续引号
+            p++;
+            while (p < end) {
+                if (*p == '\\' && p + 1 < end) {
+                    p += 2;
+                } else if (*p == (char)c) {
+                    if (p + 1 < end && p[1] == (char)c) {
+                        p += 2;
+                    } else {
+                        p++;
+                        break;
+                    }
+                } else {
+                    p++;
+                }
+            }
+            n = trace_sql_placeholder(out, n, TRACE_SQL_IN_LIST);
+        } else if (c == '`') {
+            // 标识符原样保留
+            const char *close = memchr(p + 1, '`', end - p - 1);
+            const char *stop = close ? close + 1 : end;
+            memcpy(out + n, p, stop - p);
+            n += stop - p;
+            p = stop;
+        } else if (c >= '0' && c <= '9') {
+            // 数字（含0x1F、1.5、1e-5）；标识符中的数字在下面的分支整体复制，不会走到这里
+            p++;
+            while (p < end && (trace_sql_ident_char((unsigned char)*p) || *p == '.'
+                               || ((*p == '-' || *p == '+') && (p[-1] == 'e' || p[-1] == 'E')))) {
+                p++;
+            }
+            n = trace_sql_placeholder(out, n, TRACE_SQL_IN_LIST);
+        } else if (trace_sql_ident_char(c)) {
+            size_t start = n;
+            do {
+                out[n++] = *p++;
+            } while (p < end && trace_sql_ident_char((unsigned char)*p));
+            token = trace_sql_keyword(out + start, n - start);
+            if (token == TRACE_SQL_GROUP_ROW) {
+                values_depth = depth;
+            } else if (depth == values_depth) {
+                values_depth = -1;
+            }
+            // IN (SELECT ...)：子查询不是值列表
+            if (TRACE_SQL_IN_LIST) {
+                groups[depth - 1] = TRACE_SQL_GROUP_OTHER;
+            }
+        } else if (c == '?') {
+            p++;
+            n = trace_sql_placeholder(out, n, TRACE_SQL_IN_LIST);
+        } else if (c == '(') {
+            int kind = keyword;
+            if (kind == TRACE_SQL_GROUP_OTHER && depth == values_depth) {
+                // VALUES (...), (...)：后续的行只跟在逗号之后
+                size_t m = n;
+                if (m && out[m - 1] == ' ') m--;
+                if (m && out[m - 1] == ',') {
+                    kind = TRACE_SQL_GROUP_ROW;
+                }
+            }
+            if (depth < TRACE_SQL_GROUP_MAX) {
+                groups[depth] = (unsigned char)kind;
+            }
+            depth++;
+            out[n++] = *p++;
+        } else if (c == ')') {
+            out[n++] = *p++;
+            if (depth > 0) {
+                if (TRACE_SQL_GROUP(depth) == TRACE_SQL_GROUP_ROW) {
+                    n = trace_sql_collapse_group(out, n);
+                }
+                depth--;
+            }
+        } else {
+            if (c != ',' && depth == values_depth) {
+                values_depth = -1;
+            }
+            out[n++] = *p++;
+        }
+        keyword = token;
+    }
+    
+#undef TRACE_SQL_IN_LIST
+#undef TRACE_SQL_GROUP
+    
+    if (n < len) {
+        result = zend_string_truncate(result, n, persistent);
+    }
+    ZSTR_VAL(result)[n] = '\0';
+    return result;
+}
+
+static void trace_sql_fingerprint_dtor(zval *zv)
+{
+    trace_sql_fingerprint_t *entry = Z_PTR_P(zv);
+    zend_string_release(entry->sql);
+    zend_string_release(entry->fingerprint);
+    pefree(entry, 1);
+}
+
+// 返回请求内存中的指纹；缓存满时整体清空重建
+static zend_string *trace_sql_fingerprint_cached(zend_string *sql)
+{
+    HashTable *cache = TRACE_G(db_fingerprints);
+    zend_ulong hash;
+    trace_sql_fingerprint_t *entry;
+    
+    if (ZSTR_LEN(sql) > TRACE_SQL_FINGERPRINT_MAX_SQL || TRACE_G(db_fingerprint_cache) <= 0) {
+        return trace_sql_fingerprint(ZSTR_VAL(sql), ZSTR_LEN(sql), 0);
+    }
+    
+    hash = zend_string_hash_val(sql);
+    if (cache) {
+        entry = zend_hash_index_find_ptr(cache, hash);
+        if (entry && zend_string_equals(entry->sql, sql)) {
+            return zend_string_init(ZSTR_VAL(entry->fingerprint), ZSTR_LEN(entry->fingerprint), 0);
+        }
+        if (zend_hash_num_elements(cache) >= (uint32_t)TRACE_G(db_fingerprint_cache)) {
+            zend_hash_clean(cache);
+        }
+    } else {
+        cache = pemalloc(sizeof(HashTable), 1);
+        zend_hash_init(cache, 64, NULL, trace_sql_fingerprint_dtor, 1);
+        TRACE_G(db_fingerprints) = cache;
+    }
+    
+    entry = pemalloc(sizeof(trace_sql_fingerprint_t), 1);
+    entry->sql = zend_string_init(ZSTR_VAL(sql), ZSTR_LEN(sql), 1);
+    entry->fingerprint = trace_sql_fingerprint(ZSTR_VAL(sql), ZSTR_LEN(sql), 1);
+    // 哈希冲突时新语句替换旧语句
+    zend_hash_index_update_ptr(cache, hash, entry);
+    return zend_string_init(ZSTR_VAL(entry->fingerprint), ZSTR_LEN(entry->fingerprint), 0);
+}
+
+// value的所有权转移给span，超出tag上限或内存预算时丢弃
+static void trace_db_set_tag(trace_span_t *span, const char *key, size_t key_len, zval *value)
+{
+    trace_span_set_tag_str(span, key, key_len, value);
+}
+
+// 调用对象的无参数方法（rowCount、errorInfo），有未处理的异常时不调用
+static int trace_db_call_method(zend_object *object, const char *name, size_t name_len, zval *retval)
+{
+    zend_function *fn = zend_hash_str_find_ptr(&object->ce->function_table, name, name_len);
+    ZVAL_UNDEF(retval);
+    if (!fn || EG(exception)) {
+        return FAILURE;
+    }
+    zend_call_known_instance_method_with_0_params(fn, object, retval);
+    return Z_ISUNDEF_P(retval) ? FAILURE : SUCCESS;
+}
+
+static zend_long trace_db_call_long(zend_function *fn, zend_object *object)
+{
+    zval arg, retval;
+    zend_long value = -1;
+    
+    if (!fn || EG(exception)) {
+        return -1;
+    }
+    ZVAL_OBJ(&arg, object);
+    zend_call_known_function(fn, NULL, NULL, &retval, 1, &arg, NULL);
+    if (Z_TYPE(retval) == IS_LONG) {
+        value = Z_LVAL(retval);
+    } else if (Z_TYPE(retval) == IS_STRING) {
+        // 超过PHP_INT_MAX的行数以字符串返回
+        value = ZEND_LONG_MAX;
+    }
+    zval_ptr_dtor(&retval);
+    return value;
+}
+
+static void trace_db_call_error(zend_function *errno_fn, zend_function *error_fn, zend_object *object, trace_span_t *span)
+{
+    zend_long code = trace_db_call_long(errno_fn, object);
+    zval arg, retval;
+    
+    if (code > 0) {
+        ZVAL_LONG(&retval, code);
+        trace_db_set_tag(span, "db.error_code", sizeof("db.error_code") - 1, &retval);
+    }
+    if (error_fn && !EG(exception)) {
+        ZVAL_OBJ(&arg, object);
+        zend_call_known_function(error_fn, NULL, NULL, &retval, 1, &arg, NULL);
+        if (Z_TYPE(retval) == IS_STRING && Z_STRLEN(retval) > 0) {
+            trace_db_set_tag(span, "db.error", sizeof("db.error") - 1, &retval);
+        } else {
+            zval_ptr_dtor(&retval);
+        }
+    }
+}
+
+// 结果为false时从PDO/PDOStatement::errorInfo()取 [SQLSTATE, 驱动错误码, 错误信息]
+static void trace_db_pdo_error(zend_object *object, trace_span_t *span)
+{
+    zval info, *value;
+    
+    if (trace_db_call_method(object, "errorinfo", sizeof("errorinfo") - 1, &info) != SUCCESS) {
+        return;
+    }
+    if (Z_TYPE(info) == IS_ARRAY) {
+        if ((value = zend_hash_index_find(Z_ARRVAL(info), 1)) != NULL && Z_TYPE_P(value) == IS_LONG) {
+            trace_db_set_tag(span, "db.error_code", sizeof("db.error_code") - 1, value);
+        }
+        if ((value = zend_hash_index_find(Z_ARRVAL(info), 2)) != NULL && Z_TYPE_P(value) == IS_STRING) {
+            Z_TRY_ADDREF_P(value);
+            trace_db_set_tag(span, "db.error", sizeof("db.error") - 1, value);
+        }
+        if ((value = zend_hash_index_find(Z_ARRVAL(info), 0)) != NULL && Z_TYPE_P(value) == IS_STRING) {
+            Z_TRY_ADDREF_P(value);
+            trace_db_set_tag(span, "db.sqlstate", sizeof("db.sqlstate") - 1, value);
+        }
+    }
+    zval_ptr_dtor(&info);
+}
+
+// 查询调用中抛出的异常（PDOException、mysqli_sql_exception）
+static void trace_db_exception_error(trace_span_t *span)
+{
+    zend_object *ex = EG(exception);
+    zval rv, *value;
+    
+    value = zend_read_property(zend_get_exception_base(ex), ex, "message", sizeof("message") - 1, 1, &rv);
+    if (Z_TYPE_P(value) == IS_STRING) {
+        Z_TRY_ADDREF_P(value);
+        trace_db_set_tag(span, "db.error", sizeof("db.error") - 1, value);
+    }
+    value = zend_read_property(zend_get_exception_base(ex), ex, "code", sizeof("code") - 1, 1, &rv);
+    if (Z_TYPE_P(value) == IS_LONG && Z_LVAL_P(value) != 0) {
+        trace_db_set_tag(span, "db.error_code", sizeof("db.error_code") - 1, value);
+    }
+}
+
+typedef enum {
+    TRACE_DB_PDO,
+    TRACE_DB_PDO_STMT,
+    TRACE_DB_MYSQLI,
+    TRACE_DB_MYSQLI_STMT,
+} trace_db_kind_t;
+
+static trace_handler_hook_t trace_db_hooks[TRACE_HOOK_DB_COUNT + 1];
+
+// 执行原处理器并记录span；conn为连接或语句对象
+static void trace_db_call(int hook, trace_db_kind_t kind, zend_object *conn, zend_string *sql, INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_span_t *span, *parent;
+    uint32_t generation;
+    zend_long rows = -1;
+    zval tag;
+    
+    if (!conn || !sql || !TRACE_G(db_enabled) || !trace_native_span_active()) {
+        trace_db_hooks[hook].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+        return;
+    }
+    
+    zend_string *name = trace_function_qualified_name(execute_data->func);
+    span = trace_create_span_ex(name, TRACE_G(current_span));
+    zend_string_release(name);
+    span->flags |= TRACE_SPAN_NATIVE;
+    
+    parent = TRACE_G(current_span);
+    generation = TRACE_G(span_generation);
+    TRACE_G(current_span) = span;
+    trace_db_hooks[hook].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (generation != TRACE_G(span_generation)) {
+        return;
+    }
+    TRACE_G(current_span) = parent;
+    trace_finish_span(span);
+    
+    ZVAL_STR(&tag, trace_sql_fingerprint_cached(sql));
+    TRACE_G(memory_used) += _ZSTR_STRUCT_SIZE(Z_STRLEN(tag));
+    trace_db_set_tag(span, "db.statement", sizeof("db.statement") - 1, &tag);
+    ZVAL_STRING(&tag, kind == TRACE_DB_PDO || kind == TRACE_DB_PDO_STMT ? "pdo" : "mysql");
+    trace_db_set_tag(span, "db.system", sizeof("db.system") - 1, &tag);
+    
+    if (EG(exception)) {
+        trace_db_exception_error(span);
+    } else if (Z_TYPE_P(return_value) == IS_FALSE) {
+        switch (kind) {
+            case TRACE_DB_PDO:
+            case TRACE_DB_PDO_STMT:
+                trace_db_pdo_error(conn, span);
+                break;
+            case TRACE_DB_MYSQLI:
+                trace_db_call_error(trace_mysqli_errno_fn, trace_mysqli_error_fn, conn, span);
+                break;
+            case TRACE_DB_MYSQLI_STMT:
+                trace_db_call_error(trace_mysqli_stmt_errno_fn, trace_mysqli_stmt_error_fn, conn, span);
+                break;
+        }
+    } else if (hook != TRACE_HOOK_PDO_PREPARE) {
+        // 行数：写操作为影响的行数，SELECT为结果行数（缓冲查询）
+        switch (kind) {
+            case TRACE_DB_PDO:
+                if (Z_TYPE_P(return_value) == IS_LONG) {
+                    rows = Z_LVAL_P(return_value);
+                } else if (Z_TYPE_P(return_value) == IS_OBJECT
+                           && trace_db_call_method(Z_OBJ_P(return_value), "rowcount", sizeof("rowcount") - 1, &tag) == SUCCESS) {
+                    rows = Z_TYPE(tag) == IS_LONG ? Z_LVAL(tag) : -1;
+                    zval_ptr_dtor(&tag);
+                }
+                break;
+            case TRACE_DB_PDO_STMT:
+                if (trace_db_call_method(conn, "rowcount", sizeof("rowcount") - 1, &tag) == SUCCESS) {
+                    rows = Z_TYPE(tag) == IS_LONG ? Z_LVAL(tag) : -1;
+                    zval_ptr_dtor(&tag);
+                }
+                break;
+            case TRACE_DB_MYSQLI:
+                rows = trace_db_call_long(trace_mysqli_affected_rows_fn, conn);
+                break;
+            case TRACE_DB_MYSQLI_STMT:
+                rows = trace_db_call_long(trace_mysqli_stmt_affected_rows_fn, conn);
+                break;
+        }
+        if (rows >= 0) {
+            ZVAL_LONG(&tag, rows);
+            trace_db_set_tag(span, "db.rows", sizeof("db.rows") - 1, &tag);
+        }
+    }
+    
+    if (EG(exception) || Z_TYPE_P(return_value) == IS_FALSE) {
+        trace_span_set_error(span);
+    }
+    
+    // database回调只用于补充：function(object $conn, string $sql, string $spanId): ?array，返回的数组合并为tags
+    if (!Z_ISUNDEF(TRACE_G(db_callback)) && !EG(exception)) {
+        zval args[3], result;
+        ZVAL_OBJ_COPY(&args[0], conn);
+        ZVAL_STR_COPY(&args[1], sql);
+        ZVAL_STR(&args[2], trace_span_id_str(span->span_id));
+        ZVAL_UNDEF(&result);
+        trace_call_user_callback(&TRACE_G(db_callback), 3, args, &result);
+        if (Z_TYPE(result) == IS_ARRAY) {
+            trace_span_merge_tags(span, &result, 1);
+        }
+        zval_ptr_dtor(&result);
+        zval_ptr_dtor(&args[0]);
+        zval_ptr_dtor(&args[1]);
+        zval_ptr_dtor(&args[2]);
+    }
+}
+
+// 第n个参数是字符串时返回
+static zend_always_inline zend_string *trace_string_arg(zend_execute_data *execute_data, uint32_t n)
+{
+    if (ZEND_CALL_NUM_ARGS(execute_data) < n) {
+        return NULL;
+    }
+    zval *arg = ZEND_CALL_ARG(execute_data, n);
+    ZVAL_DEREF(arg);
+    return Z_TYPE_P(arg) == IS_STRING ? Z_STR_P(arg) : NULL;
+}
+
+static zend_always_inline zend_object *trace_this(zend_execute_data *execute_data)
+{
+    return Z_TYPE(execute_data->This) == IS_OBJECT ? Z_OBJ(execute_data->This) : NULL;
+}
+
+static void trace_pdo_query_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_db_call(TRACE_HOOK_PDO_QUERY, TRACE_DB_PDO, trace_this(execute_data), trace_string_arg(execute_data, 1),
+                  INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+static void trace_pdo_exec_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_db_call(TRACE_HOOK_PDO_EXEC, TRACE_DB_PDO, trace_this(execute_data), trace_string_arg(execute_data, 1),
+                  INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+static void trace_pdo_prepare_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_db_call(TRACE_HOOK_PDO_PREPARE, TRACE_DB_PDO, trace_this(execute_data), trace_string_arg(execute_data, 1),
+                  INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+static void trace_pdo_stmt_execute_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zend_object *stmt = trace_this(execute_data);
+    zend_string *sql = NULL;
+    zval rv, *query;
+    
+    if (stmt && TRACE_G(db_enabled)) {
+        query = zend_read_property(stmt->ce, stmt, "queryString", sizeof("queryString") - 1, 1, &rv);
+        sql = Z_TYPE_P(query) == IS_STRING ? Z_STR_P(query) : NULL;
+    }
+    trace_db_call(TRACE_HOOK_PDO_STMT_EXECUTE, TRACE_DB_PDO_STMT, stmt, sql, INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+// mysqli_query($link, $sql) / $link->query($sql)
+static void trace_mysqli_query_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *link = trace_object_arg(execute_data, 1);
+    trace_db_call(TRACE_HOOK_MYSQLI_QUERY, TRACE_DB_MYSQLI, link ? Z_OBJ_P(link) : NULL, trace_string_arg(execute_data, 2),
+                  INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+static void trace_mysqli_query_method_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_db_call(TRACE_HOOK_MYSQLI_QUERY_METHOD, TRACE_DB_MYSQLI, trace_this(execute_data), trace_string_arg(execute_data, 1),
+                  INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+// 记录mysqli_stmt的SQL，mysqli_stmt_execute时使用
+static void trace_mysqli_stmt_remember(zend_object *stmt, zend_string *sql)
+{
+    if (!TRACE_G(enabled) || !TRACE_G(db_enabled)) {
+        return;
+    }
+    if (!TRACE_G(mysqli_stmt_sql)) {
+        ALLOC_HASHTABLE(TRACE_G(mysqli_stmt_sql));
+        zend_hash_init(TRACE_G(mysqli_stmt_sql), 8, NULL, ZVAL_PTR_DTOR, 0);
+    }
+    zval zv;
+    ZVAL_STR_COPY(&zv, sql);
+    zend_hash_index_update(TRACE_G(mysqli_stmt_sql), stmt->handle, &zv);
+}
+
+// 对象handle会被复用：新建的语句对象先忘掉同一handle上旧语句的SQL
+static void trace_mysqli_stmt_forget(zend_object *stmt)
+{
+    if (TRACE_G(mysqli_stmt_sql)) {
+        zend_hash_index_del(TRACE_G(mysqli_stmt_sql), stmt->handle);
+    }
+}
+
+static void trace_mysqli_stmt_init_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_db_hooks[TRACE_HOOK_MYSQLI_STMT_INIT].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (Z_TYPE_P(return_value) == IS_OBJECT) {
+        trace_mysqli_stmt_forget(Z_OBJ_P(return_value));
+    }
+}
+
+static void trace_mysqli_stmt_init_method_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_db_hooks[TRACE_HOOK_MYSQLI_STMT_INIT_METHOD].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (Z_TYPE_P(return_value) == IS_OBJECT) {
+        trace_mysqli_stmt_forget(Z_OBJ_P(return_value));
+    }
+}
+
+// new mysqli_stmt($link, $sql)：带SQL时同时prepare
+static void trace_mysqli_stmt_construct_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zend_object *stmt = trace_this(execute_data);
+    zend_string *sql = trace_string_arg(execute_data, 2);
+    
+    trace_db_hooks[TRACE_HOOK_MYSQLI_STMT_CONSTRUCT].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (!stmt) {
+        return;
+    }
+    trace_mysqli_stmt_forget(stmt);
+    if (sql && !EG(exception)) {
+        trace_mysqli_stmt_remember(stmt, sql);
+    }
+}
+
+static void trace_mysqli_prepare_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zend_string *sql = trace_string_arg(execute_data, 2);
+    
+    trace_db_hooks[TRACE_HOOK_MYSQLI_PREPARE].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (sql && Z_TYPE_P(return_value) == IS_OBJECT) {
+        trace_mysqli_stmt_remember(Z_OBJ_P(return_value), sql);
+    }
+}
+
+static void trace_mysqli_prepare_method_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zend_string *sql = trace_string_arg(execute_data, 1);
+    
+    trace_db_hooks[TRACE_HOOK_MYSQLI_PREPARE_METHOD].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (sql && Z_TYPE_P(return_value) == IS_OBJECT) {
+        trace_mysqli_stmt_remember(Z_OBJ_P(return_value), sql);
+    }
+}
+
+static void trace_mysqli_stmt_prepare_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *stmt = trace_object_arg(execute_data, 1);
+    zend_string *sql = trace_string_arg(execute_data, 2);
+    
+    trace_db_hooks[TRACE_HOOK_MYSQLI_STMT_PREPARE].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (stmt && sql && Z_TYPE_P(return_value) == IS_TRUE) {
+        trace_mysqli_stmt_remember(Z_OBJ_P(stmt), sql);
+    }
+}
+
+static void trace_mysqli_stmt_prepare_method_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zend_object *stmt = trace_this(execute_data);
+    zend_string *sql = trace_string_arg(execute_data, 1);
+    
+    trace_db_hooks[TRACE_HOOK_MYSQLI_STMT_PREPARE_METHOD].original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    if (stmt && sql && Z_TYPE_P(return_value) == IS_TRUE) {
+        trace_mysqli_stmt_remember(stmt, sql);
+    }
+}
+
+static zend_string *trace_mysqli_stmt_sql(zend_object *stmt)
+{
+    zval *sql;
+    if (!stmt || !TRACE_G(mysqli_stmt_sql)) {
+        return NULL;
+    }
+    sql = zend_hash_index_find(TRACE_G(mysqli_stmt_sql), stmt->handle);
+    return sql ? Z_STR_P(sql) : NULL;
+}
+
+static void trace_mysqli_stmt_execute_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *stmt = trace_object_arg(execute_data, 1);
+    zend_object *obj = stmt ? Z_OBJ_P(stmt) : NULL;
+    trace_db_call(TRACE_HOOK_MYSQLI_STMT_EXECUTE, TRACE_DB_MYSQLI_STMT, obj, trace_mysqli_stmt_sql(obj),
+                  INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+static void trace_mysqli_stmt_execute_method_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zend_object *obj = trace_this(execute_data);
+    trace_db_call(TRACE_HOOK_MYSQLI_STMT_EXECUTE_METHOD, TRACE_DB_MYSQLI_STMT, obj, trace_mysqli_stmt_sql(obj),
+                  INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+
+static trace_handler_hook_t trace_db_hooks[TRACE_HOOK_DB_COUNT + 1] = {
+    [TRACE_HOOK_PDO_QUERY]                    = { "pdo", "query", trace_pdo_query_handler, NULL },
+    [TRACE_HOOK_PDO_EXEC]                     = { "pdo", "exec", trace_pdo_exec_handler, NULL },
+    [TRACE_HOOK_PDO_PREPARE]                  = { "pdo", "prepare", trace_pdo_prepare_handler, NULL },
+    [TRACE_HOOK_PDO_STMT_EXECUTE]             = { "pdostatement", "execute", trace_pdo_stmt_execute_handler, NULL },
+    [TRACE_HOOK_MYSQLI_QUERY]                 = { NULL, "mysqli_query", trace_mysqli_query_handler, NULL },
+    [TRACE_HOOK_MYSQLI_QUERY_METHOD]          = { "mysqli", "query", trace_mysqli_query_method_handler, NULL },
+    [TRACE_HOOK_MYSQLI_PREPARE]               = { NULL, "mysqli_prepare", trace_mysqli_prepare_handler, NULL },
+    [TRACE_HOOK_MYSQLI_PREPARE_METHOD]        = { "mysqli", "prepare", trace_mysqli_prepare_method_handler, NULL },
+    [TRACE_HOOK_MYSQLI_STMT_PREPARE]          = { NULL, "mysqli_stmt_prepare", trace_mysqli_stmt_prepare_handler, NULL },
+    [TRACE_HOOK_MYSQLI_STMT_PREPARE_METHOD]   = { "mysqli_stmt", "prepare", trace_mysqli_stmt_prepare_method_handler, NULL },
+    [TRACE_HOOK_MYSQLI_STMT_EXECUTE]          = { NULL, "mysqli_stmt_execute", trace_mysqli_stmt_execute_handler, NULL },
+    [TRACE_HOOK_MYSQLI_STMT_EXECUTE_METHOD]   = { "mysqli_stmt", "execute", trace_mysqli_stmt_execute_method_handler, NULL },
+    [TRACE_HOOK_MYSQLI_STMT_INIT]             = { NULL, "mysqli_stmt_init", trace_mysqli_stmt_init_handler, NULL },
+    [TRACE_HOOK_MYSQLI_STMT_INIT_METHOD]      = { "mysqli", "stmt_init", trace_mysqli_stmt_init_method_handler, NULL },
+    [TRACE_HOOK_MYSQLI_STMT_CONSTRUCT]        = { "mysqli_stmt", "__construct", trace_mysqli_stmt_construct_handler, NULL },
+    { NULL, NULL, NULL, NULL }
+};
+
+static void trace_db_hooks_install(void)
+{
+    trace_mysqli_affected_rows_fn = zend_hash_str_find_ptr(CG(function_table), "mysqli_affected_rows", sizeof("mysqli_affected_rows") - 1);
+    trace_mysqli_errno_fn = zend_hash_str_find_ptr(CG(function_table), "mysqli_errno", sizeof("mysqli_errno") - 1);
+    trace_mysqli_error_fn = zend_hash_str_find_ptr(CG(function_table), "mysqli_error", sizeof("mysqli_error") - 1);
+    trace_mysqli_stmt_affected_rows_fn = zend_hash_str_find_ptr(CG(function_table), "mysqli_stmt_affected_rows", sizeof("mysqli_stmt_affected_rows") - 1);
+    trace_mysqli_stmt_errno_fn = zend_hash_str_find_ptr(CG(function_table), "mysqli_stmt_errno", sizeof("mysqli_stmt_errno") - 1);
+    trace_mysqli_stmt_error_fn = zend_hash_str_find_ptr(CG(function_table), "mysqli_stmt_error", sizeof("mysqli_stmt_error") - 1);
+    trace_handler_hooks_install(trace_db_hooks);
+}
+
+static void trace_db_free(void)
+{
+    if (TRACE_G(mysqli_stmt_sql)) {
+        zend_hash_destroy(TRACE_G(mysqli_stmt_sql));
+        FREE_HASHTABLE(TRACE_G(mysqli_stmt_sql));
+        TRACE_G(mysqli_stmt_sql) = NULL;
+    }
+}
+
+// 缓存（phpredis / memcached）
+// 命令本身通常只要几十微秒，走白名单+回调的开销比命令还大，所以单独走原生路径：
+// - 每条命令一个 "{系统} {命令}" span，tag记录key前缀，不记录key本身
+// - multi/pipeline 到 exec/discard 之间的命令合并为一个span，记录命令数
+// - mget/del 等多key命令一个span，记录key数
+// - 同一对象上连续执行的相同命令（key前缀相同）合并为一个span，记录次数和最小/最大耗时
+// 命令很多，共用一个处理器：安装时把命令信息写在函数的reserved槽中
+#define TRACE_CACHE_REDIS        0x01
+#define TRACE_CACHE_MEMCACHED    0x02
+#define TRACE_CACHE_READ         0x04  // 读命令，记录命中数
+#define TRACE_CACHE_MULTI        0x08  // 多key：第一个参数是key数组，或多个key参数
+#define TRACE_CACHE_ASSOC        0x10  // 多key：第一个参数是 key => value 数组
+#define TRACE_CACHE_BATCH_BEGIN  0x20
+#define TRACE_CACHE_BATCH_END    0x40
+
+#define TRACE_CACHE_KEY_PREFIX_MAX 64
+
+typedef struct _trace_cache_command {
+    const char *name;  // 小写方法名
+    uint32_t flags;
+} trace_cache_command_t;
+
+static const trace_cache_command_t trace_cache_commands[] = {
+    { "get",            TRACE_CACHE_REDIS | TRACE_CACHE_MEMCACHED | TRACE_CACHE_READ },
+    { "set",            TRACE_CACHE_REDIS | TRACE_CACHE_MEMCACHED },
+    { "setex",          TRACE_CACHE_REDIS },
+    { "psetex",         TRACE_CACHE_REDIS },
+    { "setnx",          TRACE_CACHE_REDIS },
+    { "incr",           TRACE_CACHE_REDIS },
+    { "incrby",         TRACE_CACHE_REDIS },
+    { "decr",           TRACE_CACHE_REDIS },
+    { "decrby",         TRACE_CACHE_REDIS },
+    { "expire",         TRACE_CACHE_REDIS },
+    { "pexpire",        TRACE_CACHE_REDIS },
+    { "ttl",            TRACE_CACHE_REDIS },
+    { "append",         TRACE_CACHE_REDIS | TRACE_CACHE_MEMCACHED },
+    { "hget",           TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "hset",           TRACE_CACHE_REDIS },
+    { "hsetnx",         TRACE_CACHE_REDIS },
+    { "hdel",           TRACE_CACHE_REDIS },
+    { "hexists",        TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "hincrby",        TRACE_CACHE_REDIS },
+    { "hgetall",        TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "hmget",          TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "hmset",          TRACE_CACHE_REDIS },
+    { "hlen",           TRACE_CACHE_REDIS },
+    { "lpush",          TRACE_CACHE_REDIS },
+    { "rpush",          TRACE_CACHE_REDIS },
+    { "lpop",           TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "rpop",           TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "llen",           TRACE_CACHE_REDIS },
+    { "lrange",         TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "sadd",           TRACE_CACHE_REDIS },
+    { "srem",           TRACE_CACHE_REDIS },
+    { "smembers",       TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "sismember",      TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "scard",          TRACE_CACHE_REDIS },
+    { "zadd",           TRACE_CACHE_REDIS },
+    { "zrem",           TRACE_CACHE_REDIS },
+    { "zscore",         TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "zincrby",        TRACE_CACHE_REDIS },
+    { "zcard",          TRACE_CACHE_REDIS },
+    { "zrange",         TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "zrevrange",      TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "zrangebyscore",  TRACE_CACHE_REDIS | TRACE_CACHE_READ },
+    { "mget",           TRACE_CACHE_REDIS | TRACE_CACHE_READ | TRACE_CACHE_MULTI },
+    { "mset",           TRACE_CACHE_REDIS | TRACE_CACHE_ASSOC },
+    { "del",            TRACE_CACHE_REDIS | TRACE_CACHE_MULTI },
+    { "unlink",         TRACE_CACHE_REDIS | TRACE_CACHE_MULTI },
+    { "exists",         TRACE_CACHE_REDIS | TRACE_CACHE_MULTI },
+    { "multi",          TRACE_CACHE_REDIS | TRACE_CACHE_BATCH_BEGIN },
+    { "pipeline",       TRACE_CACHE_REDIS | TRACE_CACHE_BATCH_BEGIN },
+    { "exec",           TRACE_CACHE_REDIS | TRACE_CACHE_BATCH_END },
+    { "discard",        TRACE_CACHE_REDIS | TRACE_CACHE_BATCH_END },
+    { "add",            TRACE_CACHE_MEMCACHED },
+    { "replace",        TRACE_CACHE_MEMCACHED },
+    { "delete",         TRACE_CACHE_MEMCACHED },
+    { "increment",      TRACE_CACHE_MEMCACHED },
+    { "decrement",      TRACE_CACHE_MEMCACHED },
+    { "touch",          TRACE_CACHE_MEMCACHED },
+    { "prepend",        TRACE_CACHE_MEMCACHED },
+    { "cas",            TRACE_CACHE_MEMCACHED },
+    { "getmulti",       TRACE_CACHE_MEMCACHED | TRACE_CACHE_READ | TRACE_CACHE_MULTI },
+    { "setmulti",       TRACE_CACHE_MEMCACHED | TRACE_CACHE_ASSOC },
+    { "deletemulti",    TRACE_CACHE_MEMCACHED | TRACE_CACHE_MULTI },
+};
+
+static const struct {
+    const char *class_name;
+    const char *system;
+    uint32_t flag;
+} trace_cache_classes[] = {
+    { "redis",        "redis",     TRACE_CACHE_REDIS },
+    { "rediscluster", "redis",     TRACE_CACHE_REDIS },
+    { "memcached",    "memcached", TRACE_CACHE_MEMCACHED },
+};
+
+typedef struct _trace_cache_hook {
+    trace_handler_hook_t hook;
+    uint32_t flags;
+    zend_string *span_name;  // "redis HGET" / "memcached getMulti"，永久驻留字符串
+} trace_cache_hook_t;
+
+static trace_cache_hook_t *trace_cache_hooks = NULL;
+static uint32_t trace_cache_hook_count = 0;
+static int trace_cache_resource = -1;  // zend_get_resource_handle()：reserved槽的下标
+
+#define TRACE_CACHE_HOOK(func) ((trace_cache_hook_t *)(func)->internal_function.reserved[trace_cache_resource])
+
+// key前缀：到最后一个':'为止；没有':'时到第一个数字为止（"session_123" → "session_"）
+static size_t trace_cache_key_prefix_len(zval *key)
+{
+    const char *str, *colon;
+    size_t len, i;
+    
+    if (Z_TYPE_P(key) != IS_STRING) {
+        return 0;
+    }
+    str = Z_STRVAL_P(key);
+    len = MIN(Z_STRLEN_P(key), TRACE_CACHE_KEY_PREFIX_MAX);
+    colon = zend_memrchr(str, ':', len);
+    if (colon) {
+        return colon - str + 1;
+    }
+    for (i = 0; i < len; i++) {
+        if (str[i] >= '0' && str[i] <= '9') {
+            break;
+        }
+    }
+    return i;
+}
+
+// 命令的第一个key和key数；key在数组的键中时写入tmp
+static zval *trace_cache_first_key(zend_execute_data *execute_data, uint32_t flags, uint32_t *count, zval *tmp)
+{
+    uint32_t argc = ZEND_CALL_NUM_ARGS(execute_data);
+    zval *arg, *key = NULL;
+    zend_string *str_key;
+    zend_ulong num_key;
+    
+    *count = 1;
+    if (argc == 0) {
+        return NULL;
+    }
+    arg = ZEND_CALL_ARG(execute_data, 1);
+    ZVAL_DEREF(arg);
+    if ((flags & (TRACE_CACHE_MULTI | TRACE_CACHE_ASSOC)) && Z_TYPE_P(arg) == IS_ARRAY) {
+        *count = zend_hash_num_elements(Z_ARRVAL_P(arg));
+        ZEND_HASH_FOREACH_KEY_VAL(Z_ARRVAL_P(arg), num_key, str_key, key) {
+            if (flags & TRACE_CACHE_ASSOC) {
+                if (str_key) {
+                    ZVAL_STR(tmp, str_key);
+                } else {
+                    ZVAL_LONG(tmp, (zend_long)num_key);
+                }
+                key = tmp;
+            }
+            break;
+        } ZEND_HASH_FOREACH_END();
+        if (key) {
+            ZVAL_DEREF(key);
+        }
+        return key;
+    }
+    if (flags & TRACE_CACHE_MULTI) {
+        *count = argc;
+    }
+    return arg;
+}
+
+static void trace_cache_set_long(trace_span_t *span, const char *key, size_t key_len, zend_long value)
+{
+    zval zv;
+    ZVAL_LONG(&zv, value);
+    trace_span_set_tag_str(span, key, key_len, &zv);
+}
+
+#define TRACE_CACHE_TAG_LONG(span, key, value) trace_cache_set_long(span, key, sizeof(key) - 1, (zend_long)(value))
+
+// 读命令是否命中：false/null/空数组视为未命中
+static zend_always_inline int trace_cache_hit(zval *return_value)
+{
+    return Z_TYPE_P(return_value) > IS_FALSE
+        && !(Z_TYPE_P(return_value) == IS_ARRAY && zend_hash_num_elements(Z_ARRVAL_P(return_value)) == 0);
+}
+
+static void trace_cache_last_clear(void)
+{
+    if (TRACE_G(cache_last).prefix) {
+        zend_string_release(TRACE_G(cache_last).prefix);
+    }
+    memset(&TRACE_G(cache_last), 0, sizeof(TRACE_G(cache_last)));
+}
+
+// 上一个命令span能否继续合并：之后没有创建过其他span，且对象、命令、key前缀都相同
+static int trace_cache_can_fold(trace_cache_hook_t *hook, zend_object *obj, zval *key)
+{
+    trace_cache_last_t *last = &TRACE_G(cache_last);
+    size_t prefix_len;
+    
+    if (!last->span || last->hook != (void *)hook || last->object != obj->handle
+        || last->generation != TRACE_G(span_generation) || last->span_count != TRACE_G(span_count)
+        || last->span->parent != TRACE_G(current_span)) {
+        return 0;
+    }
+    prefix_len = key ? trace_cache_key_prefix_len(key) : 0;
+    if (!last->prefix) {
+        return prefix_len == 0;
+    }
+    return prefix_len == ZSTR_LEN(last->prefix) && memcmp(Z_STRVAL_P(key), ZSTR_VAL(last->prefix), prefix_len) == 0;
+}
+
+static void trace_cache_fold(trace_cache_hook_t *hook, INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_cache_last_t *last = &TRACE_G(cache_last);
+    trace_span_t *span = last->span;
+    uint64_t start = trace_now_ns(), now, duration;
+    
+    hook->hook.original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    now = trace_now_ns();
+    duration = now - start;
+    
+    last->count++;
+    last->total_ns += duration;
+    if (duration < last->min_ns) {
+        last->min_ns = duration;
+    }
+    if (duration > last->max_ns) {
+        last->max_ns = duration;
+    }
+    if ((hook->flags & TRACE_CACHE_READ) && trace_cache_hit(return_value)) {
+        last->hits++;
+    }
+    
+    // 与聚合span相同：覆盖第一次到最后一次调用的时间范围，统计值写在tags中
+    span->end_ns = now;
+    span->flags |= TRACE_SPAN_FOLDED;
+    if (span->parent) {
+        span->parent->child_ns += duration;
+    }
+    TRACE_CACHE_TAG_LONG(span, "cache.count", last->count);
+    TRACE_CACHE_TAG_LONG(span, "cache.total_ns", last->total_ns);
+    TRACE_CACHE_TAG_LONG(span, "cache.min_ns", last->min_ns);
+    TRACE_CACHE_TAG_LONG(span, "cache.max_ns", last->max_ns);
+    if (hook->flags & TRACE_CACHE_READ) {
+        TRACE_CACHE_TAG_LONG(span, "cache.hits", last->hits);
+    }
+    if (EG(exception)) {
+        trace_span_set_error(span);
+    }
+}
+
+static void trace_cache_handler(INTERNAL_FUNCTION_PARAMETERS)
+{
+    trace_cache_hook_t *hook = TRACE_CACHE_HOOK(execute_data->func);
+    zend_object *obj = Z_TYPE(execute_data->This) == IS_OBJECT ? Z_OBJ(execute_data->This) : NULL;
+    trace_cache_batch_t *batch = &TRACE_G(cache_batch);
+    trace_span_t *span;
+    zval *key, tag, tmp;
+    uint32_t keys = 0;
+    
+    if (!obj || !TRACE_G(cache_enabled) || !TRACE_G(enabled) || !TRACE_G(sampled) || TRACE_G(metrics_mode)
+        || TRACE_G(in_trace_callback)) {
+        hook->hook.original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+        return;
+    }
+    
+    // multi/pipeline中：命令只计数，exec/discard时结束批量span
+    if (batch->span && batch->object == obj->handle && batch->generation == TRACE_G(span_generation)) {
+        if (hook->flags & TRACE_CACHE_BATCH_END) {
+            hook->hook.original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+            span = batch->span;
+            batch->span = NULL;
+            trace_finish_span(span);
+            TRACE_CACHE_TAG_LONG(span, "cache.commands", batch->commands);
+            TRACE_CACHE_TAG_LONG(span, "cache.keys", batch->keys);
+            if (EG(exception) || Z_TYPE_P(return_value) == IS_FALSE) {
+                trace_span_set_error(span);
+            }
+        } else {
+            if (!(hook->flags & TRACE_CACHE_BATCH_BEGIN)) {
+                trace_cache_first_key(execute_data, hook->flags, &keys, &tmp);
+                batch->commands++;
+                batch->keys += keys;
+            }
+            hook->hook.original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+        }
+        return;
+    }
+    
+    key = (hook->flags & (TRACE_CACHE_BATCH_BEGIN | TRACE_CACHE_BATCH_END)) ? NULL
+        : trace_cache_first_key(execute_data, hook->flags, &keys, &tmp);
+    if (trace_cache_can_fold(hook, obj, key)) {
+        trace_cache_fold(hook, INTERNAL_FUNCTION_PARAM_PASSTHRU);
+        return;
+    }
+    if (trace_budget_exhausted()) {
+        hook->hook.original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+        return;
+    }
+    
+    span = trace_create_span_ex(hook->span_name, TRACE_G(current_span));
+    span->flags |= TRACE_SPAN_NATIVE;
+    hook->hook.original(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+    
+    if (hook->flags & TRACE_CACHE_BATCH_BEGIN) {
+        // span在exec/discard时结束；没有成功进入批量模式时按普通命令结束
+        if (!EG(exception) && Z_TYPE_P(return_value) == IS_OBJECT) {
+            // 另一个对象上未结束的批量span到此为止
+            if (batch->span && batch->generation == TRACE_G(span_generation)) {
+                trace_finish_span(batch->span);
+            }
+            trace_cache_last_clear();
+            batch->span = span;
+            batch->object = obj->handle;
+            batch->generation = TRACE_G(span_generation);
+            batch->commands = 0;
+            batch->keys = 0;
+            return;
+        }
+        trace_finish_span(span);
+        return;
+    }
+    trace_finish_span(span);
+    
+    if (key) {
+        size_t prefix_len = trace_cache_key_prefix_len(key);
+        if (prefix_len > 0) {
+            ZVAL_STRINGL(&tag, Z_STRVAL_P(key), prefix_len);
+            TRACE_SPAN_SET_TAG(span, "cache.key_prefix", &tag);
+        }
+    }
+    if (hook->flags & (TRACE_CACHE_MULTI | TRACE_CACHE_ASSOC)) {
+        TRACE_CACHE_TAG_LONG(span, "cache.keys", keys);
+    }
+    if (EG(exception)) {
+        trace_span_set_error(span);
+    }
+    
+    // 记录下来，之后相同的命令合并到这个span
+    trace_cache_last_clear();
+    if (!(hook->flags & TRACE_CACHE_BATCH_END)) {
+        trace_cache_last_t *last = &TRACE_G(cache_last);
+        uint64_t duration = span->end_ns - span->start_ns;
+        last->span = span;
+        last->hook = hook;
+        last->object = obj->handle;
+        last->generation = TRACE_G(span_generation);
+        last->span_count = TRACE_G(span_count);
+        last->prefix = key && trace_cache_key_prefix_len(key) > 0
+            ? zend_string_init(Z_STRVAL_P(key), trace_cache_key_prefix_len(key), 0) : NULL;
+        last->count = 1;
+        last->total_ns = last->min_ns = last->max_ns = duration;
+        last->hits = (hook->flags & TRACE_CACHE_READ) && trace_cache_hit(return_value);
+        if (hook->flags & TRACE_CACHE_READ) {
+            TRACE_CACHE_TAG_LONG(span, "cache.hits", last->hits);
+        }
+    }
+}
+
+static void trace_cache_hooks_install(void)
+{
+    uint32_t i, j;
+    
+    trace_cache_resource = zend_get_resource_handle("trace");
+    if (trace_cache_resource < 0) {
+        return;
+    }
+    trace_cache_hooks = pecalloc(sizeof(trace_cache_classes) / sizeof(trace_cache_classes[0])
+                                 * sizeof(trace_cache_commands) / sizeof(trace_cache_commands[0]),
+                                 sizeof(trace_cache_hook_t), 1);
+    
+    for (i = 0; i < sizeof(trace_cache_classes) / sizeof(trace_cache_classes[0]); i++) {
+        if (!zend_hash_str_exists(CG(class_table), trace_cache_classes[i].class_name, strlen(trace_cache_classes[i].class_name))) {
+            continue;
+        }
+        for (j = 0; j < sizeof(trace_cache_commands) / sizeof(trace_cache_commands[0]); j++) {
+            const trace_cache_command_t *command = &trace_cache_commands[j];
+            trace_cache_hook_t *hook = &trace_cache_hooks[trace_cache_hook_count];
+            zend_function *func;
+            
+            if (!(command->flags & trace_cache_classes[i].flag)) {
+                continue;
+            }
+            hook->hook.class_name = trace_cache_classes[i].class_name;
+            hook->hook.function_name = command->name;
+            hook->hook.replacement = trace_cache_handler;
+            if ((func = trace_handler_hook_install(&hook->hook)) == NULL) {
+                continue;
+            }
+            
+            // redis命令名用大写，与redis-cli/慢日志一致
+            char name[64];
+            int len = snprintf(name, sizeof(name), "%s %s", trace_cache_classes[i].system,
+                               ZSTR_VAL(func->common.function_name));
+            if (trace_cache_classes[i].flag == TRACE_CACHE_REDIS) {
+                char *c;
+                for (c = name + strlen(trace_cache_classes[i].system) + 1; *c; c++) {
+                    if (*c >= 'a' && *c <= 'z') {
+                        *c -= 'a' - 'A';
+                    }
+                }
+            }
+            hook->span_name = zend_string_init_interned(name, MIN(len, (int)sizeof(name) - 1), 1);
+            hook->flags = command->flags;
+            func->internal_function.reserved[trace_cache_resource] = hook;
+            trace_cache_hook_count++;
+        }
+    }
+}
+
+static void trace_cache_hooks_restore(void)
+{
+    uint32_t i;
+    
+    for (i = 0; i < trace_cache_hook_count; i++) {
+        zend_function *func = trace_handler_hook_find(&trace_cache_hooks[i].hook);
+        if (func) {
+            func->internal_function.reserved[trace_cache_resource] = NULL;
+            func->internal_function.handler = trace_cache_hooks[i].hook.original;
+        }
+    }
+    if (trace_cache_hooks) {
+        pefree(trace_cache_hooks, 1);
+        trace_cache_hooks = NULL;
+    }
+    trace_cache_hook_count = 0;
+}
+
+static void trace_cache_free(void)
+{
+    trace_cache_last_clear();
+    TRACE_G(cache_batch).span = NULL;
+}
+
+// 函数执行钩子 (完整实现)
+void trace_execute_ex(zend_execute_data *execute_data)
+{
+    TRACE_G(stats).hook_calls++;
+    
+    // ⚠️ 重入保护：如果正在执行回调，直接调用原始函数，避免无限递归
+    if (TRACE_G(in_trace_callback)) {
+        original_zend_execute_ex(execute_data);
+        return;
+    }
+    
+    // 快速路径：检查是否需要跟踪
+    if (!trace_hook_active(TRACE_G(trace_whitelist))) {
+        original_zend_execute_ex(execute_data);
+        return;
+    }
+    
+    trace_func_decision_t *decision = trace_cached_decision(&TRACE_G(trace_decision_cache), execute_data, trace_should_trace_function);
+    if (!decision) {
+        original_zend_execute_ex(execute_data);
+        return;
+    }
+    
+    trace_span_t *span = trace_function_begin(execute_data, decision);
+    
+    // 调用原始函数
+    original_zend_execute_ex(execute_data);
+    
+    // 函数执行完成后处理
+    if (span) {
+        trace_function_end(span, execute_data->return_value);
+    }
+}
+
+// 调用原始内部函数执行器
+static zend_always_inline void trace_call_original_internal(zend_execute_data *execute_data, zval *return_value)
+{
+    if (original_zend_execute_internal) {
+        original_zend_execute_internal(execute_data, return_value);
+    } else {
+        execute_internal(execute_data, return_value);
+    }
+}
+
+// 内部函数执行钩子（处理扩展函数：mysql、redis、curl等）
+void trace_execute_internal(zend_execute_data *execute_data, zval *return_value)
+{
+    TRACE_G(stats).hook_calls++;
+    
+    // ⚠️ 重入保护
+    if (TRACE_G(in_trace_callback)) {
+        trace_call_original_internal(execute_data, return_value);
+        return;
+    }
+    
+    // 快速路径：检查是否需要跟踪
+    if (!trace_hook_active(TRACE_G(internal_trace_whitelist))) {
+        trace_call_original_internal(execute_data, return_value);
+        return;
+    }
+    
+    trace_func_decision_t *decision = trace_cached_decision(&TRACE_G(internal_trace_decision_cache), execute_data, trace_should_trace_internal_function);
+    if (!decision) {
+        trace_call_original_internal(execute_data, return_value);
+        return;
+    }
+    
+    trace_span_t *span = trace_function_begin(execute_data, decision);
+    
+    // 调用原始内部函数
+    trace_call_original_internal(execute_data, return_value);
+    
+    // 函数执行完成后处理
+    if (span) {
+        trace_function_end(span, return_value);
+    }
+}
+
+#if TRACE_HAVE_OBSERVER
+// Observer后端
+// 每个函数在请求内第一次调用时由 trace_observer_fcall_init() 决定是否挂载begin/end处理器：
+// 不在白名单中的函数不挂载，之后的调用完全没有额外开销，也不影响opcache JIT
+// 被跟踪调用的span记录在 observer_frames 栈中，end处理器按execute_data配对出栈
+
+// 判断函数当前是否应被跟踪（使用决策缓存）
+static trace_func_decision_t *trace_observer_should_trace(zend_execute_data *execute_data)
+{
+    if (execute_data->func->type == ZEND_USER_FUNCTION) {
+        return trace_cached_decision(&TRACE_G(trace_decision_cache), execute_data, trace_should_trace_function);
+    }
+    return trace_cached_decision(&TRACE_G(internal_trace_decision_cache), execute_data, trace_should_trace_internal_function);
+}
+
+static void trace_observer_begin(zend_execute_data *execute_data)
+{
+    TRACE_G(stats).hook_calls++;
+    
+    // 重入保护
+    if (TRACE_G(in_trace_callback)) {
+        return;
+    }
+    
+    // 快速路径
+    if (!trace_hook_active(execute_data->func->type == ZEND_USER_FUNCTION
+                           ? TRACE_G(trace_whitelist) : TRACE_G(internal_trace_whitelist))) {
+        return;
+    }
+    
+    // 白名单可能在处理器挂载之后被修改，这里再确认一次（命中决策缓存）
+    trace_func_decision_t *decision = trace_observer_should_trace(execute_data);
+    if (!decision) {
+        return;
+    }
+    
+    trace_span_t *span = trace_function_begin(execute_data, decision);
+    if (!span) {
+        return;
+    }
+    
+    if (TRACE_G(observer_frame_count) == TRACE_G(observer_frame_size)) {
+        TRACE_G(observer_frame_size) = TRACE_G(observer_frame_size) ? TRACE_G(observer_frame_size) * 2 : 32;
+        TRACE_G(observer_frames) = erealloc(TRACE_G(observer_frames),
+                                            sizeof(trace_observer_frame_t) * TRACE_G(observer_frame_size));
+    }
+    trace_observer_frame_t *frame = &TRACE_G(observer_frames)[TRACE_G(observer_frame_count)++];
+    frame->execute_data = execute_data;
+    frame->span = span;
+}
+
+static void trace_observer_end(zend_execute_data *execute_data, zval *return_value)
+{
+    // 只处理栈顶匹配的调用：回调内部的调用、未创建span的调用不会入栈
+    if (TRACE_G(observer_frame_count) == 0 ||
+        TRACE_G(observer_frames)[TRACE_G(observer_frame_count) - 1].execute_data != execute_data) {
+        return;
+    }
+    
+    trace_span_t *span = TRACE_G(observer_frames)[--TRACE_G(observer_frame_count)].span;
+    trace_function_end(span, return_value);
+}
+
+static zend_observer_fcall_handlers trace_observer_fcall_init(zend_execute_data *execute_data)
+{
+    zend_observer_fcall_handlers handlers = {NULL, NULL};
+    zend_function *func = execute_data->func;
+    
+    if (!TRACE_G(enabled) || !func) {
+        return handlers;
+    }
+    
+    // 只按白名单决定，与采样无关：CLI worker的run-time cache在整个进程内有效，
+    // 任务之间或未采样的任务中第一次调用的函数也必须挂载；未采样时begin处理器在快速路径返回
+    if (trace_observer_should_trace(execute_data)) {
+        handlers.begin = trace_observer_begin;
+        handlers.end = trace_observer_end;
+        return handlers;
+    }
+    
+#if PHP_VERSION_ID >= 80200
+    // 记录未挂载的函数：白名单之后被修改时可以补挂处理器
+    // 闭包和trampoline的zend_function可能随对象释放，不能记录
+    if (!(func->common.fn_flags & (ZEND_ACC_CLOSURE | ZEND_ACC_CALL_VIA_TRAMPOLINE))) {
+        if (!TRACE_G(observer_unobserved)) {
+            ALLOC_HASHTABLE(TRACE_G(observer_unobserved));
+            zend_hash_init(TRACE_G(observer_unobserved), 64, NULL, NULL, 0);
+        }
+        zend_hash_index_add_ptr(TRACE_G(observer_unobserved), (zend_ulong)(uintptr_t)func, func);
+    }
+#endif
+    
+    return handlers;
+}
+
+// 白名单变化后，为之前未挂载但现在命中的函数补挂处理器
+// function_type: ZEND_USER_FUNCTION 或 ZEND_INTERNAL_FUNCTION
+void trace_observer_refresh(zend_uchar function_type)
+{
+#if PHP_VERSION_ID >= 80200
+    if (!trace_use_observer || !TRACE_G(observer_unobserved)) {
+        return;
+    }
+    
+    zend_ulong key;
+    zend_function *func;
+    ZEND_HASH_FOREACH_NUM_KEY_PTR(TRACE_G(observer_unobserved), key, func) {
+        if (func->type != function_type) {
+            continue;
+        }
+        
+        // 决策函数只读取execute_data->func，这里构造一个临时帧
+        zend_execute_data fake_frame;
+        memset(&fake_frame, 0, sizeof(fake_frame));
+        fake_frame.func = func;
+        
+        if (trace_observer_should_trace(&fake_frame)) {
+            zend_observer_add_begin_handler(func, trace_observer_begin);
+            zend_observer_add_end_handler(func, trace_observer_end);
+            zend_hash_index_del(TRACE_G(observer_unobserved), key);
+        }
+    } ZEND_HASH_FOREACH_END();
+#endif
+}
+#endif
+
+// 序列化
+// NDJSON：每行一个span，每行都带trace_id，可以在任意行边界拆包
+#define TRACE_JSON_OPTIONS (PHP_JSON_UNESCAPED_SLASHES | PHP_JSON_UNESCAPED_UNICODE | PHP_JSON_INVALID_UTF8_SUBSTITUTE)
+
+// 追加16个十六进制字符，直接写入缓冲区
+static zend_always_inline void trace_smart_str_append_hex64(smart_str *buf, uint64_t value)
+{
+    trace_format_hex64(smart_str_extend(buf, 16), value);
+}
+
+static zend_always_inline void trace_json_append_string(smart_str *buf, zend_string *str)
+{
+    zval zv;
+    ZVAL_STR(&zv, str);
+    php_json_encode(buf, &zv, TRACE_JSON_OPTIONS);
+}
+
+// 单调时间换算为墙上时间（纳秒）
+static zend_always_inline uint64_t trace_ns_to_wall_ns(uint64_t ns)
+{
+    return TRACE_G(clock_wall_anchor_ns) + (ns - TRACE_G(clock_mono_anchor_ns));
+}
+
+// 序列化一个span为一行JSON（含结尾换行）
+void trace_serialize_span_json(smart_str *buf, trace_span_t *span)
+{
+    smart_str_appendl(buf, "{\"trace_id\":\"", sizeof("{\"trace_id\":\"") - 1);
+    trace_smart_str_append_hex64(buf, TRACE_G(trace_id_hi));
+    trace_smart_str_append_hex64(buf, TRACE_G(trace_id_lo));
+    smart_str_appendl(buf, "\",\"span_id\":\"", sizeof("\",\"span_id\":\"") - 1);
+    trace_smart_str_append_hex64(buf, span->span_id);
+    smart_str_appendl(buf, "\",\"parent_id\":", sizeof("\",\"parent_id\":") - 1);
+    if (span->parent_id) {
+        smart_str_appendc(buf, '"');
+        trace_smart_str_append_hex64(buf, span->parent_id);
+        smart_str_appendc(buf, '"');
+    } else {
+        smart_str_appendl(buf, "null", 4);
+    }
+    
+    smart_str_appendl(buf, ",\"name\":", sizeof(",\"name\":") - 1);
+    trace_json_append_string(buf, span->operation_name);
+    if (TRACE_G(service_name)) {
+        smart_str_appendl(buf, ",\"service\":", sizeof(",\"service\":") - 1);
+        trace_json_append_string(buf, TRACE_G(service_name));
+    }
+    
+    smart_str_appendl(buf, ",\"start_ns\":", sizeof(",\"start_ns\":") - 1);
+    smart_str_append_unsigned(buf, (zend_ulong)trace_ns_to_wall_ns(span->start_ns));
+    smart_str_appendl(buf, ",\"duration_ns\":", sizeof(",\"duration_ns\":") - 1);
+    smart_str_append_unsigned(buf, (zend_ulong)(span->end_ns ? span->end_ns - span->start_ns : 0));
+    smart_str_appendl(buf, ",\"self_ns\":", sizeof(",\"self_ns\":") - 1);
+    smart_str_append_unsigned(buf, (zend_ulong)(span->end_ns ? trace_span_self_ns(span, span->end_ns) : 0));
+    if (!span->end_ns) {
+        smart_str_appendl(buf, ",\"unfinished\":true", sizeof(",\"unfinished\":true") - 1);
+    }
+    
+    if (span->tags && zend_hash_num_elements(span->tags) > 0) {
+        zval tags;
+        ZVAL_ARR(&tags, span->tags);
+        smart_str_appendl(buf, ",\"tags\":", sizeof(",\"tags\":") - 1);
+        php_json_encode(buf, &tags, TRACE_JSON_OPTIONS | PHP_JSON_FORCE_OBJECT);
+    }
+    if (span->logs && zend_hash_num_elements(span->logs) > 0) {
+        zval logs;
+        ZVAL_ARR(&logs, span->logs);
+        smart_str_appendl(buf, ",\"logs\":", sizeof(",\"logs\":") - 1);
+        php_json_encode(buf, &logs, TRACE_JSON_OPTIONS);
+    }
+    
+    smart_str_appendl(buf, "}\n", 2);
+}
+
+// OTLP：直接从span结构流式写出ExportTraceServiceRequest，不构造中间zval
+// protobuf分两遍：第一遍计算每个span的长度，第二遍按长度前缀写出（缓冲区一次分配到位）
+// 下面的 trace_otlp_pb_* 函数在buf为NULL时只计算长度
+#define TRACE_PB_VARINT   0
+#define TRACE_PB_FIXED64  1
+#define TRACE_PB_LEN      2
+
+#define TRACE_OTLP_SCOPE_NAME   "php-trace-ext"
+#define TRACE_OTLP_KIND_INTERNAL 1
+#define TRACE_OTLP_KIND_SERVER   2
+#define TRACE_OTLP_STATUS_ERROR  2
+
+static zend_always_inline size_t trace_pb_varint(smart_str *buf, uint64_t value)
+{
+    size_t n = 1;
+    for (uint64_t v = value; v >= 0x80; v >>= 7) {
+        n++;
+    }
+    if (buf) {
+        unsigned char *p = (unsigned char *)smart_str_extend(buf, n);
+        while (value >= 0x80) {
+            *p++ = (unsigned char)(value | 0x80);
+            value >>= 7;
+        }
+        *p = (unsigned char)value;
+    }
+    return n;
+}
+
+static zend_always_inline size_t trace_pb_key(smart_str *buf, uint32_t field, int wire)
+{
+    return trace_pb_varint(buf, ((uint64_t)field << 3) | wire);
+}
+
+// 只写长度前缀（字段号 + 长度），返回前缀字节数
+static zend_always_inline size_t trace_pb_len(smart_str *buf, uint32_t field, size_t len)
+{
+    return trace_pb_key(buf, field, TRACE_PB_LEN) + trace_pb_varint(buf, len);
+}
+
+static zend_always_inline size_t trace_pb_bytes(smart_str *buf, uint32_t field, const char *data, size_t len)
+{
+    size_t n = trace_pb_len(buf, field, len);
+    if (buf) {
+        smart_str_appendl(buf, data, len);
+    }
+    return n + len;
+}
+
+static zend_always_inline size_t trace_pb_fixed64(smart_str *buf, uint32_t field, uint64_t value)
+{
+    size_t n = trace_pb_key(buf, field, TRACE_PB_FIXED64);
+    if (buf) {
+        unsigned char *p = (unsigned char *)smart_str_extend(buf, 8);
+        for (int i = 0; i < 8; i++) {
+            p[i] = (unsigned char)(value >> (i * 8));
+        }
+    }
+    return n + 8;
+}
+
+// 写入大端序的ID（与十六进制表示的顺序一致）
+static zend_always_inline void trace_pb_put_id64(unsigned char *p, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (unsigned char)value;
+        value >>= 8;
+    }
+}
+
+static size_t trace_pb_span_id(smart_str *buf, uint32_t field, uint64_t id)
+{
+    size_t n = trace_pb_len(buf, field, 8);
+    if (buf) {
+        trace_pb_put_id64((unsigned char *)smart_str_extend(buf, 8), id);
+    }
+    return n + 8;
+}
+
+static size_t trace_pb_trace_id(smart_str *buf, uint32_t field)
+{
+    size_t n = trace_pb_len(buf, field, 16);
+    if (buf) {
+        unsigned char *p = (unsigned char *)smart_str_extend(buf, 16);
+        trace_pb_put_id64(p, TRACE_G(trace_id_hi));
+        trace_pb_put_id64(p + 8, TRACE_G(trace_id_lo));
+    }
+    return n + 16;
+}
+
+// 数组、对象等非标量属性值转为JSON字符串
+static zend_string *trace_otlp_value_to_json(zval *value)
+{
+    smart_str json = {0};
+    php_json_encode(&json, value, TRACE_JSON_OPTIONS);
+    smart_str_0(&json);
+    return json.s ? json.s : ZSTR_EMPTY_ALLOC();
+}
+
+// AnyValue
+static size_t trace_otlp_pb_any_value(smart_str *buf, zval *value)
+{
+    ZVAL_DEREF(value);
+    switch (Z_TYPE_P(value)) {
+        case IS_STRING:
+            return trace_pb_bytes(buf, 1, Z_STRVAL_P(value), Z_STRLEN_P(value));
+        case IS_FALSE:
+        case IS_TRUE:
+            return trace_pb_key(buf, 2, TRACE_PB_VARINT) + trace_pb_varint(buf, Z_TYPE_P(value) == IS_TRUE);
+        case IS_LONG:
+            return trace_pb_key(buf, 3, TRACE_PB_VARINT) + trace_pb_varint(buf, (uint64_t)Z_LVAL_P(value));
+        case IS_DOUBLE: {
+            uint64_t bits;
+            double d = Z_DVAL_P(value);
+            memcpy(&bits, &d, sizeof(bits));
+            return trace_pb_fixed64(buf, 4, bits);
+        }
+        case IS_NULL:
+        case IS_UNDEF:
+            return 0;
+        default: {
+            zend_string *json = trace_otlp_value_to_json(value);
+            size_t n = trace_pb_bytes(buf, 1, ZSTR_VAL(json), ZSTR_LEN(json));
+            zend_string_release(json);
+            return n;
+        }
+    }
+}
+
+// KeyValue（作为field字段写出，含长度前缀）
+static size_t trace_otlp_pb_key_value(smart_str *buf, uint32_t field, const char *key, size_t key_len, zval *value)
+{
+    size_t value_size = trace_otlp_pb_any_value(NULL, value);
+    size_t body = trace_pb_bytes(NULL, 1, key, key_len) + trace_pb_len(NULL, 2, value_size) + value_size;
+    size_t n = trace_pb_len(buf, field, body);
+    if (buf) {
+        trace_pb_bytes(buf, 1, key, key_len);
+        trace_pb_len(buf, 2, value_size);
+        trace_otlp_pb_any_value(buf, value);
+    }
+    return n + body;
+}
+
+// 遍历属性表，数字键转为字符串
+#define TRACE_OTLP_FOREACH_ATTR(ht, key_ptr, key_len, value) do { \
+        zend_ulong _idx; \
+        zend_string *_key; \
+        char _num[MAX_LENGTH_OF_LONG + 1]; \
+        ZEND_HASH_FOREACH_KEY_VAL(ht, _idx, _key, value) { \
+            if (_key) { \
+                key_ptr = ZSTR_VAL(_key); \
+                key_len = ZSTR_LEN(_key); \
+            } else { \
+                key_len = snprintf(_num, sizeof(_num), ZEND_ULONG_FMT, _idx); \
+                key_ptr = _num; \
+            }
+
+#define TRACE_OTLP_FOREACH_ATTR_END() \
+        } ZEND_HASH_FOREACH_END(); \
+    } while (0)
+
+// 日志的时间戳（秒，浮点）
+static uint64_t trace_otlp_log_time(zval *log, trace_span_t *span)
+{
+    if (Z_TYPE_P(log) == IS_ARRAY) {
+        zval *ts = zend_hash_str_find(Z_ARRVAL_P(log), "timestamp", sizeof("timestamp") - 1);
+        if (ts && Z_TYPE_P(ts) == IS_DOUBLE && Z_DVAL_P(ts) > 0) {
+            return (uint64_t)(Z_DVAL_P(ts) * 1000000000.0);
+        }
+    }
+    return trace_ns_to_wall_ns(span->start_ns);
+}
+
+// Span.Event：每条日志一个名为log的事件，日志的字段（timestamp除外）作为属性
+static size_t trace_otlp_pb_event_body(smart_str *buf, zval *log, trace_span_t *span)
+{
+    size_t n = trace_pb_fixed64(buf, 1, trace_otlp_log_time(log, span));
+    n += trace_pb_bytes(buf, 2, "log", sizeof("log") - 1);
+    
+    if (Z_TYPE_P(log) == IS_ARRAY) {
+        const char *key;
+        size_t key_len;
+        zval *value;
+        TRACE_OTLP_FOREACH_ATTR(Z_ARRVAL_P(log), key, key_len, value) {
+            if (key_len == sizeof("timestamp") - 1 && memcmp(key, "timestamp", key_len) == 0) {
+                continue;
+            }
+            n += trace_otlp_pb_key_value(buf, 3, key, key_len, value);
+        } TRACE_OTLP_FOREACH_ATTR_END();
+    } else {
+        n += trace_otlp_pb_key_value(buf, 3, "message", sizeof("message") - 1, log);
+    }
+    return n;
+}
+
+static size_t trace_otlp_pb_span_body(smart_str *buf, trace_span_t *span)
+{
+    size_t n = trace_pb_trace_id(buf, 1);
+    n += trace_pb_span_id(buf, 2, span->span_id);
+    if (TRACE_G(tracestate)) {
+        n += trace_pb_bytes(buf, 3, ZSTR_VAL(TRACE_G(tracestate)), ZSTR_LEN(TRACE_G(tracestate)));
+    }
+    if (span->parent_id) {
+        n += trace_pb_span_id(buf, 4, span->parent_id);
+    }
+    n += trace_pb_bytes(buf, 5, ZSTR_VAL(span->operation_name), ZSTR_LEN(span->operation_name));
+    n += trace_pb_key(buf, 6, TRACE_PB_VARINT);
+    n += trace_pb_varint(buf, span == TRACE_G(root_span) ? TRACE_OTLP_KIND_SERVER : TRACE_OTLP_KIND_INTERNAL);
+    
+    // 未结束的span按0耗时导出，并带上trace.unfinished属性
+    uint64_t start = trace_ns_to_wall_ns(span->start_ns);
+    n += trace_pb_fixed64(buf, 7, start);
+    n += trace_pb_fixed64(buf, 8, span->end_ns ? trace_ns_to_wall_ns(span->end_ns) : start);
+    
+    if (span->tags) {
+        const char *key;
+        size_t key_len;
+        zval *value;
+        TRACE_OTLP_FOREACH_ATTR(span->tags, key, key_len, value) {
+            n += trace_otlp_pb_key_value(buf, 9, key, key_len, value);
+        } TRACE_OTLP_FOREACH_ATTR_END();
+    }
+    if (!span->end_ns) {
+        zval unfinished;
+        ZVAL_TRUE(&unfinished);
+        n += trace_otlp_pb_key_value(buf, 9, "trace.unfinished", sizeof("trace.unfinished") - 1, &unfinished);
+    }
+    
+    if (span->logs) {
+        zval *log;
+        ZEND_HASH_FOREACH_VAL(span->logs, log) {
+            size_t body = trace_otlp_pb_event_body(NULL, log, span);
+            n += trace_pb_len(buf, 11, body) + body;
+            if (buf) {
+                trace_otlp_pb_event_body(buf, log, span);
+            }
+        } ZEND_HASH_FOREACH_END();
+    }
+    
+    if (trace_span_has_error(span)) {
+        // Status { code = 3 }
+        size_t status = trace_pb_key(NULL, 3, TRACE_PB_VARINT) + trace_pb_varint(NULL, TRACE_OTLP_STATUS_ERROR);
+        n += trace_pb_len(buf, 15, status) + status;
+        trace_pb_key(buf, 3, TRACE_PB_VARINT);
+        trace_pb_varint(buf, TRACE_OTLP_STATUS_ERROR);
+    }
+    return n;
+}
+
+// Resource { attributes = [service.name] }
+static size_t trace_otlp_pb_resource_body(smart_str *buf)
+{
+    zval service;
+    if (TRACE_G(service_name)) {
+        ZVAL_STR(&service, TRACE_G(service_name));
+    } else {
+        ZVAL_STRINGL(&service, "unknown_service:php", sizeof("unknown_service:php") - 1);
+    }
+    size_t n = trace_otlp_pb_key_value(buf, 1, "service.name", sizeof("service.name") - 1, &service);
+    if (!TRACE_G(service_name)) {
+        zval_ptr_dtor_str(&service);
+    }
+    return n;
+}
+
+// InstrumentationScope { name, version }
+static size_t trace_otlp_pb_scope_body(smart_str *buf)
+{
+    return trace_pb_bytes(buf, 1, TRACE_OTLP_SCOPE_NAME, sizeof(TRACE_OTLP_SCOPE_NAME) - 1)
+         + trace_pb_bytes(buf, 2, PHP_TRACE_VERSION, sizeof(PHP_TRACE_VERSION) - 1);
+}
+
+void trace_serialize_otlp_proto(smart_str *buf)
+{
+    // 第一遍：每个span的长度
+    uint32_t count = TRACE_G(span_count);
+    size_t *span_sizes = count ? safe_emalloc(count, sizeof(size_t), 0) : NULL;
+    size_t spans_total = 0;
+    uint32_t i = 0;
+    trace_span_t *span;
+    
+    TRACE_FOREACH_SPAN(span) {
+        span_sizes[i] = trace_otlp_pb_span_body(NULL, span);
+        spans_total += trace_pb_len(NULL, 2, span_sizes[i]) + span_sizes[i];
+        i++;
+    } TRACE_FOREACH_SPAN_END();
+    
+    size_t scope_size = trace_otlp_pb_scope_body(NULL);
+    size_t scope_spans_size = trace_pb_len(NULL, 1, scope_size) + scope_size + spans_total;
+    size_t resource_size = trace_otlp_pb_resource_body(NULL);
+    size_t resource_spans_size = trace_pb_len(NULL, 1, resource_size) + resource_size
+                               + trace_pb_len(NULL, 2, scope_spans_size) + scope_spans_size;
+    
+    // 第二遍：按计算好的长度写出
+    smart_str_alloc(buf, trace_pb_len(NULL, 1, resource_spans_size) + resource_spans_size, 0);
+    
+    // ExportTraceServiceRequest.resource_spans
+    trace_pb_len(buf, 1, resource_spans_size);
+    // ResourceSpans.resource
+    trace_pb_len(buf, 1, resource_size);
+    trace_otlp_pb_resource_body(buf);
+    // ResourceSpans.scope_spans
+    trace_pb_len(buf, 2, scope_spans_size);
+    trace_pb_len(buf, 1, scope_size);
+    trace_otlp_pb_scope_body(buf);
+    
+    i = 0;
+    TRACE_FOREACH_SPAN(span) {
+        trace_pb_len(buf, 2, span_sizes[i]);
+        trace_otlp_pb_span_body(buf, span);
+        i++;
+    } TRACE_FOREACH_SPAN_END();
+    
+    if (span_sizes) {
+        efree(span_sizes);
+    }
+}
+
+// OTLP/JSON：ID为十六进制字符串，64位整数（时间戳、intValue）按proto3 JSON映射写成字符串
+static void trace_otlp_json_any_value(smart_str *buf, zval *value)
+{
+    ZVAL_DEREF(value);
+    switch (Z_TYPE_P(value)) {
+        case IS_STRING:
+            smart_str_appendl(buf, "{\"stringValue\":", sizeof("{\"stringValue\":") - 1);
+            trace_json_append_string(buf, Z_STR_P(value));
+            break;
+        case IS_FALSE:
+            smart_str_appendl(buf, "{\"boolValue\":false", sizeof("{\"boolValue\":false") - 1);
+            break;
+        case IS_TRUE:
+            smart_str_appendl(buf, "{\"boolValue\":true", sizeof("{\"boolValue\":true") - 1);
+            break;
+        case IS_LONG:
+            smart_str_appendl(buf, "{\"intValue\":\"", sizeof("{\"intValue\":\"") - 1);
+            smart_str_append_long(buf, Z_LVAL_P(value));
+            smart_str_appendc(buf, '"');
+            break;
+        case IS_DOUBLE: {
+            double d = Z_DVAL_P(value);
+            smart_str_appendl(buf, "{\"doubleValue\":", sizeof("{\"doubleValue\":") - 1);
+            if (zend_finite(d)) {
+                // %H与var_export相同：不受locale影响，serialize_precision=-1时输出最短的可还原表示
+                smart_str_append_printf(buf, "%.*H", (int)PG(serialize_precision), d);
+            } else if (zend_isnan(d)) {
+                smart_str_appendl(buf, "\"NaN\"", sizeof("\"NaN\"") - 1);
+            } else {
+                smart_str_appends(buf, d > 0 ? "\"Infinity\"" : "\"-Infinity\"");
+            }
+            break;
+        }
+        case IS_NULL:
+        case IS_UNDEF:
+            smart_str_appendc(buf, '{');
+            break;
+        default: {
+            zend_string *json = trace_otlp_value_to_json(value);
+            smart_str_appendl(buf, "{\"stringValue\":", sizeof("{\"stringValue\":") - 1);
+            trace_json_append_string(buf, json);
+            zend_string_release(json);
+            break;
+        }
+    }
+    smart_str_appendc(buf, '}');
+}
+
+static void trace_otlp_json_key_value(smart_str *buf, int first, const char *key, size_t key_len, zval *value)
+{
+    zval key_zv;
+    if (!first) {
+        smart_str_appendc(buf, ',');
+    }
+    smart_str_appendl(buf, "{\"key\":", sizeof("{\"key\":") - 1);
+    ZVAL_STRINGL_FAST(&key_zv, key, key_len);
+    php_json_encode(buf, &key_zv, TRACE_JSON_OPTIONS);
+    zval_ptr_dtor_str(&key_zv);
+    smart_str_appendl(buf, ",\"value\":", sizeof(",\"value\":") - 1);
+    trace_otlp_json_any_value(buf, value);
+    smart_str_appendc(buf, '}');
+}
+
+static zend_always_inline void trace_otlp_json_time(smart_str *buf, const char *name, size_t name_len, uint64_t ns)
+{
+    smart_str_appendl(buf, name, name_len);
+    smart_str_appendc(buf, '"');
+    smart_str_append_unsigned(buf, (zend_ulong)ns);
+    smart_str_appendc(buf, '"');
+}
+
+static void trace_otlp_json_span(smart_str *buf, trace_span_t *span)
+{
+    smart_str_appendl(buf, "{\"traceId\":\"", sizeof("{\"traceId\":\"") - 1);
+    trace_smart_str_append_hex64(buf, TRACE_G(trace_id_hi));
+    trace_smart_str_append_hex64(buf, TRACE_G(trace_id_lo));
+    smart_str_appendl(buf, "\",\"spanId\":\"", sizeof("\",\"spanId\":\"") - 1);
+    trace_smart_str_append_hex64(buf, span->span_id);
+    smart_str_appendc(buf, '"');
+    if (TRACE_G(tracestate)) {
+        smart_str_appendl(buf, ",\"traceState\":", sizeof(",\"traceState\":") - 1);
+        trace_json_append_string(buf, TRACE_G(tracestate));
+    }
+    if (span->parent_id) {
+        smart_str_appendl(buf, ",\"parentSpanId\":\"", sizeof(",\"parentSpanId\":\"") - 1);
+        trace_smart_str_append_hex64(buf, span->parent_id);
+        smart_str_appendc(buf, '"');
+    }
+    smart_str_appendl(buf, ",\"name\":", sizeof(",\"name\":") - 1);
+    trace_json_append_string(buf, span->operation_name);
+    smart_str_appendl(buf, ",\"kind\":", sizeof(",\"kind\":") - 1);
+    smart_str_append_long(buf, span == TRACE_G(root_span) ? TRACE_OTLP_KIND_SERVER : TRACE_OTLP_KIND_INTERNAL);
+    
+    uint64_t start = trace_ns_to_wall_ns(span->start_ns);
+    trace_otlp_json_time(buf, ",\"startTimeUnixNano\":", sizeof(",\"startTimeUnixNano\":") - 1, start);
+    trace_otlp_json_time(buf, ",\"endTimeUnixNano\":", sizeof(",\"endTimeUnixNano\":") - 1,
+                         span->end_ns ? trace_ns_to_wall_ns(span->end_ns) : start);
+    
+    smart_str_appendl(buf, ",\"attributes\":[", sizeof(",\"attributes\":[") - 1);
+    int first = 1;
+    if (span->tags) {
+        const char *key;
+        size_t key_len;
+        zval *value;
+        TRACE_OTLP_FOREACH_ATTR(span->tags, key, key_len, value) {
+            trace_otlp_json_key_value(buf, first, key, key_len, value);
+            first = 0;
+        } TRACE_OTLP_FOREACH_ATTR_END();
+    }
+    if (!span->end_ns) {
+        zval unfinished;
+        ZVAL_TRUE(&unfinished);
+        trace_otlp_json_key_value(buf, first, "trace.unfinished", sizeof("trace.unfinished") - 1, &unfinished);
+    }
+    smart_str_appendc(buf, ']');
+    
+    if (span->logs && zend_hash_num_elements(span->logs) > 0) {
+        zval *log;
+        int first_event = 1;
+        smart_str_appendl(buf, ",\"events\":[", sizeof(",\"events\":[") - 1);
+        ZEND_HASH_FOREACH_VAL(span->logs, log) {
+            if (!first_event) {
+                smart_str_appendc(buf, ',');
+            }
+            first_event = 0;
+            trace_otlp_json_time(buf, "{\"timeUnixNano\":", sizeof("{\"timeUnixNano\":") - 1, trace_otlp_log_time(log, span));
+            smart_str_appendl(buf, ",\"name\":\"log\",\"attributes\":[", sizeof(",\"name\":\"log\",\"attributes\":[") - 1);
+            if (Z_TYPE_P(log) == IS_ARRAY) {
+                const char *key;
+                size_t key_len;
+                zval *value;
+                first = 1;
+                TRACE_OTLP_FOREACH_ATTR(Z_ARRVAL_P(log), key, key_len, value) {
+                    if (key_len == sizeof("timestamp") - 1 && memcmp(key, "timestamp", key_len) == 0) {
+                        continue;
+                    }
+                    trace_otlp_json_key_value(buf, first, key, key_len, value);
+                    first = 0;
+                } TRACE_OTLP_FOREACH_ATTR_END();
+            } else {
+                trace_otlp_json_key_value(buf, 1, "message", sizeof("message") - 1, log);
+            }
+            smart_str_appendl(buf, "]}", 2);
+        } ZEND_HASH_FOREACH_END();
+        smart_str_appendc(buf, ']');
+    }
+    
+    if (trace_span_has_error(span)) {
+        smart_str_appendl(buf, ",\"status\":{\"code\":2}", sizeof(",\"status\":{\"code\":2}") - 1);
+    }
+    smart_str_appendc(buf, '}');
+}
+
+void trace_serialize_otlp_json(smart_str *buf)
+{
+    zval service;
+    if (TRACE_G(service_name)) {
+        ZVAL_STR(&service, TRACE_G(service_name));
+    } else {
+        ZVAL_STRINGL(&service, "unknown_service:php", sizeof("unknown_service:php") - 1);
+    }
+    smart_str_appendl(buf, "{\"resourceSpans\":[{\"resource\":{\"attributes\":[",
+                      sizeof("{\"resourceSpans\":[{\"resource\":{\"attributes\":[") - 1);
+    trace_otlp_json_key_value(buf, 1, "service.name", sizeof("service.name") - 1, &service);
+    if (!TRACE_G(service_name)) {
+        zval_ptr_dtor_str(&service);
+    }
+    smart_str_appends(buf, "]},\"scopeSpans\":[{\"scope\":{\"name\":\"" TRACE_OTLP_SCOPE_NAME
+                           "\",\"version\":\"" PHP_TRACE_VERSION "\"},\"spans\":[");
+    
+    int first = 1;
+    trace_span_t *span;
+    TRACE_FOREACH_SPAN(span) {
+        if (!first) {
+            smart_str_appendc(buf, ',');
+        }
+        first = 0;
+        trace_otlp_json_span(buf, span);
+    } TRACE_FOREACH_SPAN_END();
+    
+    smart_str_appendl(buf, "]}]}]}", sizeof("]}]}]}") - 1);
+}
+
+// 折叠栈（flamegraph.pl / speedscope 使用的 collapsed 格式）：每行 "根;...;span 自身耗时ns"
+// 相同调用路径合并，名称中的 ';' 换成 ','、换行换成空格
+static void trace_folded_append_name(smart_str *buf, zend_string *name)
+{
+    size_t i;
+    for (i = 0; i < ZSTR_LEN(name); i++) {
+        char c = ZSTR_VAL(name)[i];
+        if (c == ';') {
+            c = ',';
+        } else if (c == '\n' || c == '\r') {
+            c = ' ';
+        }
+        smart_str_appendc(buf, c);
+    }
+}
+
+// 相同调用路径的值累加
+static void trace_folded_add(HashTable *stacks, smart_str *key, zend_long value)
+{
+    zval *total;
+    
+    smart_str_0(key);
+    total = zend_hash_str_find(stacks, ZSTR_VAL(key->s), ZSTR_LEN(key->s));
+    if (total) {
+        Z_LVAL_P(total) += value;
+    } else {
+        zval zv;
+        ZVAL_LONG(&zv, value);
+        zend_hash_str_add_new(stacks, ZSTR_VAL(key->s), ZSTR_LEN(key->s), &zv);
+    }
+}
+
+static void trace_folded_write(smart_str *buf, HashTable *stacks)
+{
+    zend_string *stack;
+    zval *total;
+    
+    ZEND_HASH_FOREACH_STR_KEY_VAL(stacks, stack, total) {
+        smart_str_append(buf, stack);
+        smart_str_appendc(buf, ' ');
+        smart_str_append_long(buf, Z_LVAL_P(total));
+        smart_str_appendc(buf, '\n');
+    } ZEND_HASH_FOREACH_END();
+}
+
+void trace_serialize_folded(smart_str *buf)
+{
+    HashTable stacks;
+    trace_span_t **path = NULL;
+    uint32_t path_size = 0;
+    uint64_t now = trace_now_ns();
+    smart_str key = {0};
+    trace_span_t *span;
+    
+    zend_hash_init(&stacks, 64, NULL, NULL, 0);
+    
+    TRACE_FOREACH_SPAN(span) {
+        uint64_t self_ns = trace_span_self_ns(span, now);
+        uint32_t depth = 0;
+        trace_span_t *p;
+        
+        if (self_ns == 0) {
+            continue;
+        }
+        for (p = span; p; p = p->parent) {
+            if (depth == path_size) {
+                path_size = path_size ? path_size * 2 : 32;
+                path = erealloc(path, sizeof(trace_span_t *) * path_size);
+            }
+            path[depth++] = p;
+        }
+        
+        if (key.s) {
+            ZSTR_LEN(key.s) = 0;
+        }
+        while (depth-- > 0) {
+            trace_folded_append_name(&key, path[depth]->operation_name);
+            if (depth > 0) {
+                smart_str_appendc(&key, ';');
+            }
+        }
+        trace_folded_add(&stacks, &key, (zend_long)self_ns);
+    } TRACE_FOREACH_SPAN_END();
+    
+    trace_folded_write(buf, &stacks);
+    
+    smart_str_free(&key);
+    if (path) {
+        efree(path);
+    }
+    zend_hash_destroy(&stacks);
+}
+
+#if TRACE_HAVE_PROFILER
+// 采样分析器
+// 定时器到期时信号处理函数只设置标志并请求VM中断，调用栈在下一个安全点（zend_interrupt_function）采集，
+// 不依赖函数钩子，开销只与采样频率有关
+// 使用实时信号：SIGPROF被max_execution_time占用，SIGRTMIN被PHP 8.1+的执行超时定时器占用
+#define TRACE_PROFILER_SIGNAL    (SIGRTMIN + 4)
+#define TRACE_PROFILER_MAX_DEPTH 128  // 更深的栈只保留靠近叶子的部分
+
+static volatile sig_atomic_t trace_profiler_pending = 0;
+static void (*original_zend_interrupt_function)(zend_execute_data *execute_data) = NULL;
+static int trace_profiler_signal_installed = 0;
+static timer_t trace_profiler_timer;
+static clockid_t trace_profiler_timer_clock;
+static pid_t trace_profiler_timer_pid = 0;  // 定时器不随fork继承，按进程创建
+
+static void trace_profiler_signal_handler(int signo)
+{
+    (void)signo;
+    trace_profiler_pending = 1;
+#if PHP_VERSION_ID >= 80200
+    zend_atomic_bool_store_ex(&EG(vm_interrupt), true);
+#else
+    EG(vm_interrupt) = 1;
+#endif
+}
+
+// 帧ID：用户函数按opcodes区分（闭包对象释放后zend_function可能被复用），trampoline按名称
+static uint32_t trace_profiler_frame_id(zend_function *func)
+{
+    zend_string *name = NULL;
+    zval *found;
+    zval id;
+    
+    if (func->common.fn_flags & ZEND_ACC_CALL_VIA_TRAMPOLINE) {
+        name = trace_function_qualified_name(func);
+        found = zend_hash_find(TRACE_G(profiler_frame_ids), name);
+    } else {
+        zend_ulong key = func->type == ZEND_USER_FUNCTION
+                         ? (zend_ulong)(uintptr_t)func->op_array.opcodes : (zend_ulong)(uintptr_t)func;
+        found = zend_hash_index_find(TRACE_G(profiler_frame_ids), key);
+    }
+    if (found) {
+        if (name) {
+            zend_string_release(name);
+        }
+        return (uint32_t)Z_LVAL_P(found);
+    }
+    
+    if (TRACE_G(profiler_frame_count) == TRACE_G(profiler_frame_size)) {
+        TRACE_G(profiler_frame_size) = TRACE_G(profiler_frame_size) ? TRACE_G(profiler_frame_size) * 2 : 256;
+        TRACE_G(profiler_frames) = erealloc(TRACE_G(profiler_frames),
+                                            sizeof(zend_string *) * TRACE_G(profiler_frame_size));
+    }
+    ZVAL_LONG(&id, TRACE_G(profiler_frame_count));
+    if (name) {
+        zend_hash_add_new(TRACE_G(profiler_frame_ids), name, &id);
+    } else {
+        zend_ulong key = func->type == ZEND_USER_FUNCTION
+                         ? (zend_ulong)(uintptr_t)func->op_array.opcodes : (zend_ulong)(uintptr_t)func;
+        zend_hash_index_add_new(TRACE_G(profiler_frame_ids), key, &id);
+        name = trace_function_display_name(func);
+    }
+    TRACE_G(profiler_frames)[TRACE_G(profiler_frame_count)] = name;
+    return TRACE_G(profiler_frame_count)++;
+}
+
+static void trace_profiler_sample(zend_execute_data *execute_data)
+{
+    uint32_t ids[TRACE_PROFILER_MAX_DEPTH];
+    uint32_t depth = 0;
+    zend_execute_data *ex;
+    
+    for (ex = execute_data; ex && depth < TRACE_PROFILER_MAX_DEPTH; ex = ex->prev_execute_data) {
+        if (ex->func) {
+            ids[depth++] = trace_profiler_frame_id(ex->func);
+        }
+    }
+    if (depth == 0) {
+        return;
+    }
+    if (TRACE_G(profiler_size) - TRACE_G(profiler_used) < depth + 1) {
+        TRACE_G(profiler_dropped)++;
+        return;
+    }
+    
+    uint32_t *out = &TRACE_G(profiler_samples)[TRACE_G(profiler_used)];
+    out[0] = depth;
+    memcpy(out + 1, ids, sizeof(uint32_t) * depth);
+    TRACE_G(profiler_used) += depth + 1;
+    TRACE_G(profiler_sample_count)++;
+}
+
+static void trace_profiler_interrupt(zend_execute_data *execute_data)
+{
+    if (trace_profiler_pending) {
+        trace_profiler_pending = 0;
+        if (TRACE_G(profiler_samples)) {
+            trace_profiler_sample(EG(current_execute_data));
+        }
+    }
+    if (original_zend_interrupt_function) {
+        original_zend_interrupt_function(execute_data);
+    }
+}
+
+// RINIT时启动：分配样本缓冲区，按需安装信号处理函数和创建定时器
+static void trace_profiler_start(void)
+{
+    struct itimerspec its;
+    clockid_t clock;
+    
+    if (!TRACE_G(profiler) || TRACE_G(profiler_interval_us) <= 0) {
+        return;
+    }
+    
+    if (!trace_profiler_signal_installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = trace_profiler_signal_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(TRACE_PROFILER_SIGNAL, &sa, NULL) != 0) {
+            trace_debug_log("[PROFILER] 安装信号处理函数失败: %s", strerror(errno));
+            return;
+        }
+        trace_profiler_signal_installed = 1;
+    }
+    
+    // cpu：只在本线程占用CPU时计时，不会打断sleep等阻塞调用；wall：按墙上时间，能看到I/O等待
+    clock = (TRACE_G(profiler_clock) && strcmp(TRACE_G(profiler_clock), "wall") == 0)
+            ? CLOCK_MONOTONIC : CLOCK_THREAD_CPUTIME_ID;
+    if (trace_profiler_timer_pid != getpid() || trace_profiler_timer_clock != clock) {
+        struct sigevent sev;
+        if (trace_profiler_timer_pid == getpid()) {
+            timer_delete(trace_profiler_timer);
+            trace_profiler_timer_pid = 0;
+        }
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = TRACE_PROFILER_SIGNAL;
+        if (timer_create(clock, &sev, &trace_profiler_timer) != 0) {
+            trace_debug_log("[PROFILER] timer_create失败: %s", strerror(errno));
+            return;
+        }
+        trace_profiler_timer_pid = getpid();
+        trace_profiler_timer_clock = clock;
+    }
+    
+    TRACE_G(profiler_size) = TRACE_G(profiler_buffer) > 4096 ? (uint32_t)(MIN(TRACE_G(profiler_buffer), UINT32_MAX) / sizeof(uint32_t)) : 1024;
+    TRACE_G(profiler_samples) = emalloc(sizeof(uint32_t) * TRACE_G(profiler_size));
+    TRACE_G(profiler_used) = 0;
+    TRACE_G(profiler_sample_count) = 0;
+    TRACE_G(profiler_dropped) = 0;
+    ALLOC_HASHTABLE(TRACE_G(profiler_frame_ids));
+    zend_hash_init(TRACE_G(profiler_frame_ids), 256, NULL, NULL, 0);
+    
+    trace_profiler_pending = 0;
+    its.it_interval.tv_sec = TRACE_G(profiler_interval_us) / 1000000;
+    its.it_interval.tv_nsec = (TRACE_G(profiler_interval_us) % 1000000) * 1000;
+    its.it_value = its.it_interval;
+    if (timer_settime(trace_profiler_timer, 0, &its, NULL) != 0) {
+        trace_debug_log("[PROFILER] timer_settime失败: %s", strerror(errno));
+    }
+}
+
+// RSHUTDOWN时停止定时器，样本随请求释放
+static void trace_profiler_stop(void)
+{
+    if (!TRACE_G(profiler_samples)) {
+        return;
+    }
+    
+    if (trace_profiler_timer_pid == getpid()) {
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        timer_settime(trace_profiler_timer, 0, &its, NULL);
+    }
+    trace_profiler_pending = 0;
+    
+    if (TRACE_G(debug_enabled) && TRACE_G(profiler_dropped)) {
+        trace_debug_log("[PROFILER] %u 个样本，缓冲区满丢弃 %u 个", TRACE_G(profiler_sample_count), TRACE_G(profiler_dropped));
+    }
+    
+    uint32_t i;
+    for (i = 0; i < TRACE_G(profiler_frame_count); i++) {
+        zend_string_release(TRACE_G(profiler_frames)[i]);
+    }
+    if (TRACE_G(profiler_frames)) {
+        efree(TRACE_G(profiler_frames));
+        TRACE_G(profiler_frames) = NULL;
+    }
+    TRACE_G(profiler_frame_count) = 0;
+    TRACE_G(profiler_frame_size) = 0;
+    zend_hash_destroy(TRACE_G(profiler_frame_ids));
+    FREE_HASHTABLE(TRACE_G(profiler_frame_ids));
+    TRACE_G(profiler_frame_ids) = NULL;
+    efree(TRACE_G(profiler_samples));
+    TRACE_G(profiler_samples) = NULL;
+    TRACE_G(profiler_used) = 0;
+    TRACE_G(profiler_size) = 0;
+}
+
+// 本请求样本的折叠栈，每个样本按一个采样间隔计入（纳秒）
+static void trace_serialize_profile_folded(smart_str *buf)
+{
+    HashTable stacks;
+    smart_str key = {0};
+    zend_long weight = (zend_long)TRACE_G(profiler_interval_us) * 1000;
+    uint32_t pos = 0;
+    
+    zend_hash_init(&stacks, 64, NULL, NULL, 0);
+    
+    while (pos < TRACE_G(profiler_used)) {
+        uint32_t depth = TRACE_G(profiler_samples)[pos++];
+        uint32_t *ids = &TRACE_G(profiler_samples)[pos];
+        uint32_t i = depth;
+        
+        if (key.s) {
+            ZSTR_LEN(key.s) = 0;
+        }
+        while (i-- > 0) {
+            trace_folded_append_name(&key, TRACE_G(profiler_frames)[ids[i]]);
+            if (i > 0) {
+                smart_str_appendc(&key, ';');
+            }
+        }
+        trace_folded_add(&stacks, &key, weight);
+        pos += depth;
+    }
+    
+    trace_folded_write(buf, &stacks);
+    
+    smart_str_free(&key);
+    zend_hash_destroy(&stacks);
+}
+#endif
+
+// 导出器
+// 每个worker一个非阻塞的持久连接；写不进去（EAGAIN/ENOBUFS）或连接断开时直接丢弃并计数，绝不阻塞worker
+#define TRACE_EXPORTER_RETRY_NS    (1000ULL * 1000 * 1000)  // 连接失败后1秒内不再重试
+#define TRACE_EXPORTER_PENDING_MAX (1024 * 1024)            // 流式socket积压上限
+
+static void trace_exporter_close(void)
+{
+    if (TRACE_G(exporter_fd) >= 0) {
+        close(TRACE_G(exporter_fd));
+        TRACE_G(exporter_fd) = -1;
+    }
+    if (TRACE_G(exporter_pending)) {
+        free(TRACE_G(exporter_pending));
+        TRACE_G(exporter_pending) = NULL;
+    }
+    TRACE_G(exporter_pending_len) = 0;
+}
+
+// 建立到采集端的连接，成功返回fd
+static int trace_exporter_connect(const char *target)
+{
+    int fd = -1;
+    
+    if (strncmp(target, "udp://", sizeof("udp://") - 1) == 0) {
+        const char *hostport = target + sizeof("udp://") - 1;
+        const char *colon = strrchr(hostport, ':');
+        if (!colon || colon == hostport) {
+            return -1;
+        }
+        
+        char host[256];
+        size_t host_len = colon - hostport;
+        // 支持 [::1]:port 形式的IPv6地址
+        if (hostport[0] == '[' && host_len >= 2 && hostport[host_len - 1] == ']') {
+            hostport++;
+            host_len -= 2;
+        }
+        if (host_len >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, hostport, host_len);
+        host[host_len] = '\0';
+        
+        struct addrinfo hints, *res = NULL, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+            return -1;
+        }
+        for (ai = res; ai; ai = ai->ai_next) {
+            fd = socket(ai->ai_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        TRACE_G(exporter_socktype) = SOCK_DGRAM;
+        return fd;
+    }
+    
+    int socktype;
+    const char *path;
+    if (strncmp(target, "unixgram://", sizeof("unixgram://") - 1) == 0) {
+        socktype = SOCK_DGRAM;
+        path = target + sizeof("unixgram://") - 1;
+    } else if (strncmp(target, "unix://", sizeof("unix://") - 1) == 0) {
+        socktype = SOCK_STREAM;
+        path = target + sizeof("unix://") - 1;
+    } else {
+        return -1;
+    }
+    
+    struct sockaddr_un addr;
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, path_len);
+    
+    fd = socket(AF_UNIX, socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    // 本地socket的非阻塞connect要么立即完成，要么因backlog满返回EAGAIN，后者按失败处理
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    TRACE_G(exporter_socktype) = socktype;
+    return fd;
+}
+
+// 确保连接可用
+static int trace_exporter_ensure(void)
+{
+    pid_t pid = getpid();
+    
+    // fork继承的连接（例如MINIT之后master建立的）不能与父进程共用
+    if (TRACE_G(exporter_fd) >= 0 && TRACE_G(exporter_pid) != pid) {
+        trace_exporter_close();
+    }
+    if (TRACE_G(exporter_fd) >= 0) {
+        return 1;
+    }
+    
+    uint64_t now = trace_now_ns();
+    if (now < TRACE_G(exporter_retry_ns)) {
+        return 0;
+    }
+    
+    TRACE_G(exporter_fd) = trace_exporter_connect(TRACE_G(exporter));
+    TRACE_G(exporter_pid) = pid;
+    if (TRACE_G(exporter_fd) < 0) {
+        TRACE_G(exporter_retry_ns) = now + TRACE_EXPORTER_RETRY_NS;
+        trace_debug_log("[EXPORTER] 连接 %s 失败: %s", TRACE_G(exporter), strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// 发送失败时判断是否需要断开重连
+// EMSGSIZE：数据报超过内核上限（exporter_max_datagram 配置得比socket缓冲区大），只丢弃这一个包
+static void trace_exporter_handle_error(int err)
+{
+    if (err != EAGAIN && err != EWOULDBLOCK && err != ENOBUFS && err != EINTR && err != EMSGSIZE) {
+        trace_debug_log("[EXPORTER] 发送失败，断开连接: %s", strerror(err));
+        trace_exporter_close();
+        TRACE_G(exporter_retry_ns) = trace_now_ns() + TRACE_EXPORTER_RETRY_NS;
+    }
+}
+
+// 发送一个数据报，返回是否成功
+static int trace_exporter_send_datagram(const char *data, size_t len)
+{
+    ssize_t n = send(TRACE_G(exporter_fd), data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == (ssize_t)len) {
+        TRACE_G(exporter_sent_bytes) += len;
+        return 1;
+    }
+    if (n < 0) {
+        trace_exporter_handle_error(errno);
+    }
+    TRACE_G(exporter_dropped_bytes) += len;
+    return 0;
+}
+
+// 流式socket：先写积压的数据，再写本次数据，写不完的部分存入积压缓冲（超过上限则丢弃本次数据）
+static int trace_exporter_send_stream(const char *data, size_t len)
+{
+    int fd = TRACE_G(exporter_fd);
+    
+    while (TRACE_G(exporter_pending_len) > 0) {
+        ssize_t n = send(fd, TRACE_G(exporter_pending), TRACE_G(exporter_pending_len), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0) {
+                trace_exporter_handle_error(errno);
+                if (TRACE_G(exporter_fd) < 0) {
+                    TRACE_G(exporter_dropped_bytes) += len;
+                    return 0;
+                }
+            }
+            break;
+        }
+        TRACE_G(exporter_sent_bytes) += n;
+        TRACE_G(exporter_pending_len) -= n;
+        memmove(TRACE_G(exporter_pending), TRACE_G(exporter_pending) + n, TRACE_G(exporter_pending_len));
+    }
+    
+    size_t written = 0;
+    if (TRACE_G(exporter_pending_len) == 0) {
+        ssize_t n = send(fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            trace_exporter_handle_error(errno);
+            if (TRACE_G(exporter_fd) < 0) {
+                TRACE_G(exporter_dropped_bytes) += len;
+                return 0;
+            }
+        } else {
+            written = (size_t)n;
+            TRACE_G(exporter_sent_bytes) += written;
+        }
+    }
+    if (written == len) {
+        return 1;
+    }
+    
+    // 已经写出一部分时必须把剩余部分补齐，否则会破坏行边界
+    size_t remaining = len - written;
+    if (written == 0 && TRACE_G(exporter_pending_len) + remaining > TRACE_EXPORTER_PENDING_MAX) {
+        TRACE_G(exporter_dropped_bytes) += len;
+        return 0;
+    }
+    char *pending = realloc(TRACE_G(exporter_pending), TRACE_G(exporter_pending_len) + remaining);
+    if (!pending) {
+        // 无法保存剩余数据，只能断开连接，避免对端收到半行
+        trace_exporter_close();
+        TRACE_G(exporter_dropped_bytes) += remaining;
+        return 0;
+    }
+    memcpy(pending + TRACE_G(exporter_pending_len), data + written, remaining);
+    TRACE_G(exporter_pending) = pending;
+    TRACE_G(exporter_pending_len) += remaining;
+    return 1;
+}
+
+// ========== 共享内存环形缓冲 ==========
+// trace.exporter = shm://name 时，FPM master在MINIT中创建并映射共享内存，fork出的worker继承映射，
+// RSHUTDOWN时只把序列化好的trace拷进环里；由单独的消费进程（trace_ring_consume）批量取出再发给采集端。
+// 多生产者单消费者：生产者在预留锁内写好记录头（长度和pid）再推进write_pos，锁外拷贝数据，写完后置COMMITTED；
+// 消费者按顺序读取并清零已读区域，未提交的记录只在写入进程已经不存在时跳过。
+#ifdef HAVE_SHM_OPEN
+
+#define TRACE_RING_MAGIC        0x54524e47  // "TRNG"
+#define TRACE_RING_VERSION      2
+#define TRACE_RING_WRITING      0           // 已预留未写完（清零后的初始状态）
+#define TRACE_RING_COMMITTED    1
+#define TRACE_RING_PADDING      2           // 尾部放不下时的填充，消费者直接跳到环首
+#define TRACE_RING_ALIGN(n)     (((n) + 7) & ~(uint64_t)7)
+#define TRACE_RING_LOCK_SPINS   1000        // 预留锁最多自旋的次数，之后丢弃本次数据，从不阻塞
+
+// 头部256字节，读写位置各占一个cache line，避免生产者和消费者互相干扰
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;          // 数据区字节数（8的倍数）
+    uint32_t consumer_pid;      // 当前消费者，同一时间只允许一个
+    uint32_t reserve_pid;       // 预留锁的持有者（生产者pid），0表示空闲
+    char pad0[40];
+    uint64_t write_pos;         // 生产者预留位置，单调递增
+    char pad1[56];
+    uint64_t read_pos;          // 消费者读取位置，单调递增
+    char pad2[56];
+    uint64_t written_records;
+    uint64_t dropped_records;
+    uint64_t dropped_bytes;
+    uint64_t skipped_records;   // 消费者跳过的未提交记录
+    char pad3[32];
+} trace_ring_header_t;
+
+// 记录头在推进write_pos之前写好：消费者看到的记录总有长度和写入进程
+typedef struct {
+    uint32_t len;
+    uint32_t state;
+    uint32_t pid;               // 写入进程，消费者据此判断未提交的记录是否还会被提交
+    uint32_t reserved;
+} trace_ring_record_t;
+
+static trace_ring_header_t *trace_ring = NULL;
+static size_t trace_ring_map_size = 0;
+static pid_t trace_ring_owner_pid = 0;     // 创建者（FPM master），只有它在MSHUTDOWN时删除共享内存
+static ino_t trace_ring_ino = 0;           // 消费者附加的共享内存，FPM重启后重新附加
+static char trace_ring_name[NAME_MAX];
+
+#define TRACE_RING_DATA(ring) ((char *)(ring) + sizeof(trace_ring_header_t))
+
+// shm://name -> /name
+static int trace_ring_parse_name(const char *target, char *name, size_t size)
+{
+    if (!target || strncmp(target, "shm://", sizeof("shm://") - 1) != 0) {
         return 0;
     }
-    
-    // 如果没有设置白名单，不跟踪
-    if (Z_ISUNDEF(TRACE_G(trace_whitelist))) {
-        return 0;
+    target += sizeof("shm://") - 1;
+    while (*target == '/') {
+        target++;
     }
-    
-    // 如果白名单不是数组，不跟踪
-    if (Z_TYPE(TRACE_G(trace_whitelist)) != IS_ARRAY) {
+    if (!*target || strchr(target, '/') || strlen(target) + 2 > size) {
         return 0;
     }
+    snprintf(name, size, "/%s", target);
+    return 1;
+}
+
+static inline int trace_exporter_is_ring(void)
+{
+    return TRACE_G(exporter) && strncmp(TRACE_G(exporter), "shm://", sizeof("shm://") - 1) == 0;
+}
+
+// MINIT：创建并映射（fork之前调用，worker继承同一映射）
+static void trace_ring_create(const char *target, zend_long size)
+{
+    char name[NAME_MAX];
+    if (!trace_ring_parse_name(target, name, sizeof(name))) {
+        php_error_docref(NULL, E_WARNING, "trace.exporter: 无效的共享内存名称 %s", target);
+        return;
+    }
+    if (size < 65536) {
+        size = 65536;
+    }
+    uint64_t capacity = (uint64_t)size & ~(uint64_t)7;
+    size_t map_size = sizeof(trace_ring_header_t) + capacity;
     
-    // 获取函数信息
-    const char *func_name = execute_data->func->common.function_name ? 
-                           ZSTR_VAL(execute_data->func->common.function_name) : "";
-    const char *class_name = execute_data->func->common.scope ? 
-                            ZSTR_VAL(execute_data->func->common.scope->name) : "";
+    // 上一次运行遗留的环（包括其中未消费的数据）直接丢弃，旧的消费者会检测到inode变化重新附加
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        php_error_docref(NULL, E_WARNING, "trace: shm_open(%s) 失败: %s", name, strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, map_size) != 0) {
+        php_error_docref(NULL, E_WARNING, "trace: ftruncate(%s) 失败: %s", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return;
+    }
+    void *addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        php_error_docref(NULL, E_WARNING, "trace: mmap(%s) 失败: %s", name, strerror(errno));
+        shm_unlink(name);
+        return;
+    }
     
-    // 获取文件路径
-    const char *file_name = "";
-    if (execute_data->func->type == ZEND_INTERNAL_FUNCTION) {
-        // 内部函数：使用模块名
-        if (execute_data->func->internal_function.module) {
-            file_name = execute_data->func->internal_function.module->name;
-        }
-    } else if (execute_data->func->type == ZEND_USER_FUNCTION) {
-        // 用户函数：使用实际文件路径
-        if (execute_data->func->op_array.filename) {
-            file_name = ZSTR_VAL(execute_data->func->op_array.filename);
-        }
+    // ftruncate出来的内存已经清零，所有记录初始为WRITING
+    trace_ring = (trace_ring_header_t *)addr;
+    trace_ring->capacity = capacity;
+    trace_ring->version = TRACE_RING_VERSION;
+    __atomic_store_n(&trace_ring->magic, TRACE_RING_MAGIC, __ATOMIC_RELEASE);
+    trace_ring_map_size = map_size;
+    trace_ring_owner_pid = getpid();
+    strcpy(trace_ring_name, name);
+}
+
+static void trace_ring_detach(void)
+{
+    if (trace_ring) {
+        munmap(trace_ring, trace_ring_map_size);
+        trace_ring = NULL;
+        trace_ring_map_size = 0;
+        trace_ring_ino = 0;
     }
+}
 
-    // 如果类名称和函数名称都为空，不跟踪
-    if ((!class_name || class_name[0] == '\0') && (!func_name || func_name[0] == '\0')) {
-        return 0;
+// MSHUTDOWN：worker只解除映射，master额外删除共享内存
+static void trace_ring_destroy(void)
+{
+    if (trace_ring && trace_ring_owner_pid == getpid()) {
+        shm_unlink(trace_ring_name);
     }
-    
-    // 遍历白名单规则（OR关系，符合任意一个即可）
-    zval *rule;
-    ZEND_HASH_FOREACH_VAL(Z_ARR(TRACE_G(trace_whitelist)), rule) {
-        if (Z_TYPE_P(rule) != IS_ARRAY) {
-            continue;
-        }
-        
-        int matched = 1;  // 假设匹配，逐项检查（AND关系）
-        
-        // 检查 file_pattern
-        zval *file_patterns = zend_hash_str_find(Z_ARR_P(rule), "file_pattern", sizeof("file_pattern") - 1);
-        if (file_patterns) {
-            if (!trace_match_patterns(file_name, file_patterns)) {
-                matched = 0;
-            }
-        }
-        
-        // 检查 class_pattern
-        if (matched) {
-            zval *class_patterns = zend_hash_str_find(Z_ARR_P(rule), "class_pattern", sizeof("class_pattern") - 1);
-            if (class_patterns) {
-                if (!trace_match_patterns(class_name, class_patterns)) {
-                    matched = 0;
-                }
-            }
-        }
-        
-        // 检查 function_pattern
-        if (matched) {
-            zval *func_patterns = zend_hash_str_find(Z_ARR_P(rule), "function_pattern", sizeof("function_pattern") - 1);
-            if (func_patterns) {
-                if (!trace_match_patterns(func_name, func_patterns)) {
-                    matched = 0;
-                }
-            }
-        }
-        
-        // 如果所有条件都匹配，则跟踪此函数
-        if (matched) {
-            return 1;
-        }
-    } ZEND_HASH_FOREACH_END();
-    
-    // 白名单中没有匹配的规则，不跟踪
-    return 0;
+    trace_ring_detach();
 }
 
-// 判断是否应该跟踪内部函数（扩展函数：mysql、redis、curl等）
-int trace_should_trace_internal_function(zend_execute_data *execute_data)
+// 消费者附加到已存在的环，name与当前映射不同或共享内存被重建时重新附加
+static int trace_ring_attach(const char *name)
 {
-    if (!execute_data || !execute_data->func) {
-        return 0;
+    if (trace_ring && trace_ring_owner_pid) {
+        // 本进程（或其父进程）创建的环，映射一直有效
+        return strcmp(name, trace_ring_name) == 0;
     }
     
-    // 只处理内部函数
-    if (execute_data->func->type != ZEND_INTERNAL_FUNCTION) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        trace_ring_detach();
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        trace_ring_detach();
         return 0;
     }
+    if (trace_ring && st.st_ino == trace_ring_ino && strcmp(name, trace_ring_name) == 0) {
+        close(fd);
+        return 1;
+    }
+    trace_ring_detach();
     
-    // 获取模块名和函数名
-    const char *module_name = NULL;
-    if (execute_data->func->internal_function.module) {
-        module_name = execute_data->func->internal_function.module->name;
+    if ((size_t)st.st_size <= sizeof(trace_ring_header_t)) {
+        close(fd);
+        return 0;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return 0;
+    }
+    trace_ring_header_t *ring = (trace_ring_header_t *)addr;
+    if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != TRACE_RING_MAGIC
+        || ring->version != TRACE_RING_VERSION
+        || ring->capacity + sizeof(trace_ring_header_t) > (uint64_t)st.st_size) {
+        munmap(addr, st.st_size);
+        return 0;
     }
+    trace_ring = ring;
+    trace_ring_map_size = st.st_size;
+    trace_ring_ino = st.st_ino;
+    strcpy(trace_ring_name, name);
+    return 1;
+}
+
+// pid对应的进程是否已经不存在（同一PID namespace内才可靠；没有权限发信号时视为存在）
+static inline int trace_ring_pid_gone(uint32_t pid)
+{
+    return pid != 0 && kill((pid_t)pid, 0) != 0 && errno == ESRCH;
+}
+
+// 预留锁：只保护"检查空间、写记录头、推进write_pos"这几步，短暂自旋，拿不到就放弃
+// 持有者在锁内被杀死时由下一个生产者接管，这时write_pos要么还没推进，要么记录头已经完整
+static int trace_ring_reserve_lock(trace_ring_header_t *ring, uint32_t self)
+{
+    uint32_t owner;
+    int spins;
     
-    const char *func_name = execute_data->func->common.function_name ? 
-                           ZSTR_VAL(execute_data->func->common.function_name) : "";
-    const char *class_name = execute_data->func->common.scope ? 
-                            ZSTR_VAL(execute_data->func->common.scope->name) : "";
+    for (spins = 0; spins < TRACE_RING_LOCK_SPINS; spins++) {
+        owner = 0;
+        if (__atomic_compare_exchange_n(&ring->reserve_pid, &owner, self, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    owner = __atomic_load_n(&ring->reserve_pid, __ATOMIC_RELAXED);
+    return trace_ring_pid_gone(owner)
+        && __atomic_compare_exchange_n(&ring->reserve_pid, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// 生产者：预留空间并拷入一条记录，空间不足或预留锁被占用时丢弃并计数，从不等待
+static int trace_ring_write(const char *data, size_t len)
+{
+    trace_ring_header_t *ring = trace_ring;
+    uint64_t capacity = ring->capacity;
+    uint64_t need = TRACE_RING_ALIGN(sizeof(trace_ring_record_t) + len);
+    uint32_t self = (uint32_t)getpid();
+    uint64_t pos, offset, total;
     
-    // 没有模块名，跳过
-    if (!module_name) {
-        return 0;
+    if (len > UINT32_MAX || need > capacity || !trace_ring_reserve_lock(ring, self)) {
+        goto drop;
     }
     
-    // 如果没有设置内部函数白名单，不跟踪
-    if (Z_ISUNDEF(TRACE_G(internal_trace_whitelist))) {
-        return 0;
+    pos = __atomic_load_n(&ring->write_pos, __ATOMIC_RELAXED);
+    offset = pos % capacity;
+    total = need;
+    if (offset + need > capacity) {
+        total += capacity - offset;
+    }
+    if (pos + total - __atomic_load_n(&ring->read_pos, __ATOMIC_ACQUIRE) > capacity) {
+        __atomic_store_n(&ring->reserve_pid, 0, __ATOMIC_RELEASE);
+        goto drop;
     }
     
-    if (Z_TYPE(TRACE_G(internal_trace_whitelist)) != IS_ARRAY) {
-        return 0;
+    char *base = TRACE_RING_DATA(ring);
+    trace_ring_record_t *rec;
+    if (total != need) {
+        rec = (trace_ring_record_t *)(base + offset);
+        rec->len = (uint32_t)(capacity - offset - sizeof(trace_ring_record_t));
+        rec->state = TRACE_RING_PADDING;
+        offset = 0;
     }
+    rec = (trace_ring_record_t *)(base + offset);
+    rec->len = (uint32_t)len;
+    rec->pid = self;
+    // write_pos的release发布记录头，之后才释放锁
+    __atomic_store_n(&ring->write_pos, pos + total, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->reserve_pid, 0, __ATOMIC_RELEASE);
     
-    // 遍历内部函数白名单规则（OR关系）
-    zval *rule;
-    ZEND_HASH_FOREACH_VAL(Z_ARR(TRACE_G(internal_trace_whitelist)), rule) {
-        if (Z_TYPE_P(rule) != IS_ARRAY) {
-            continue;
+    memcpy(rec + 1, data, len);
+    __atomic_store_n(&rec->state, TRACE_RING_COMMITTED, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&ring->written_records, 1, __ATOMIC_RELAXED);
+    return 1;
+    
+drop:
+    __atomic_fetch_add(&ring->dropped_records, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ring->dropped_bytes, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// 消费者锁：记录持有者pid，持有者已退出时接管
+static int trace_ring_lock_consumer(void)
+{
+    uint32_t self = (uint32_t)getpid();
+    uint32_t owner = __atomic_load_n(&trace_ring->consumer_pid, __ATOMIC_ACQUIRE);
+    
+    while (owner != self) {
+        if (owner != 0 && !trace_ring_pid_gone(owner)) {
+            return 0;
         }
-        
-        int matched = 1;
-        
-        // 检查 module_pattern（对于内部函数，使用module而不是file）
-        zval *module_patterns = zend_hash_str_find(Z_ARR_P(rule), "module_pattern", sizeof("module_pattern") - 1);
-        if (module_patterns) {
-            if (!trace_match_patterns(module_name, module_patterns)) {
-                matched = 0;
-            }
+        if (__atomic_compare_exchange_n(&trace_ring->consumer_pid, &owner, self, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            break;
         }
+    }
+    return 1;
+}
+
+// 消费者：按顺序取出已提交的记录追加到out，直到没有数据或超过max_bytes，返回取出的记录数
+static zend_long trace_ring_read(smart_str *out, size_t max_bytes)
+{
+    trace_ring_header_t *ring = trace_ring;
+    uint64_t capacity = ring->capacity;
+    char *base = TRACE_RING_DATA(ring);
+    uint64_t read = ring->read_pos;
+    uint64_t write = __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE);
+    size_t out_len = 0;
+    zend_long records = 0;
+    
+    while (read < write) {
+        uint64_t offset = read % capacity;
+        trace_ring_record_t *rec = (trace_ring_record_t *)(base + offset);
+        uint32_t state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        uint64_t size;
         
-        // 检查 class_pattern
-        if (matched) {
-            zval *class_patterns = zend_hash_str_find(Z_ARR_P(rule), "class_pattern", sizeof("class_pattern") - 1);
-            if (class_patterns) {
-                if (!trace_match_patterns(class_name, class_patterns)) {
-                    matched = 0;
-                }
+        if (state == TRACE_RING_WRITING) {
+            // 生产者还在拷贝（可能只是被调度出去或暂停），只有它已经不存在时才按记录头的长度跳过；
+            // 跳过仍在写的记录会让它之后写进别人预留的空间
+            if (!trace_ring_pid_gone(rec->pid)) {
+                break;
             }
-        }
-        
-        // 检查 function_pattern
-        if (matched) {
-            zval *func_patterns = zend_hash_str_find(Z_ARR_P(rule), "function_pattern", sizeof("function_pattern") - 1);
-            if (func_patterns) {
-                if (!trace_match_patterns(func_name, func_patterns)) {
-                    matched = 0;
-                }
+            size = TRACE_RING_ALIGN(sizeof(trace_ring_record_t) + rec->len);
+            if (offset + size > capacity || read + size > write) {
+                break;
+            }
+            __atomic_fetch_add(&ring->skipped_records, 1, __ATOMIC_RELAXED);
+        } else if (state == TRACE_RING_PADDING) {
+            size = capacity - offset;
+        } else {
+            if (records > 0 && out_len + rec->len > max_bytes) {
+                break;
             }
+            smart_str_appendl(out, (const char *)(rec + 1), rec->len);
+            out_len += rec->len;
+            records++;
+            size = TRACE_RING_ALIGN(sizeof(trace_ring_record_t) + rec->len);
         }
         
-        if (matched) {
-            return 1;
-        }
-    } ZEND_HASH_FOREACH_END();
-    
+        // 清零后生产者才能复用这段空间（记录头的状态必须回到WRITING）
+        memset(rec, 0, size);
+        read += size;
+        __atomic_store_n(&ring->read_pos, read, __ATOMIC_RELEASE);
+    }
+    return records;
+}
+
+#else
+
+static inline int trace_exporter_is_ring(void)
+{
     return 0;
 }
 
-// 函数执行钩子 (完整实现)
-void trace_execute_ex(zend_execute_data *execute_data)
+#endif
+
+// 导出当前trace（RSHUTDOWN时调用，此时输出缓冲已经刷出）
+void trace_export_trace(void)
 {
-    trace_span_t *span = NULL;
-    zval callback_result;
-    ZVAL_UNDEF(&callback_result);
-    
-    // ⚠️ 重入保护：如果正在执行回调，直接调用原始函数，避免无限递归
-    if (TRACE_G(in_trace_callback)) {
-        original_zend_execute_ex(execute_data);
+    if (!TRACE_G(exporter) || !*TRACE_G(exporter) || TRACE_G(span_count) == 0) {
         return;
     }
     
-    // 快速路径：检查是否需要跟踪
-    if (!TRACE_G(enabled) || Z_ISUNDEF(TRACE_G(function_enter_callback))) {
-        original_zend_execute_ex(execute_data);
-        return;
-    }
+    smart_str buf = {0};
+    int ok = 1;
+    trace_span_t *span;
     
-    if (!trace_should_trace_function(execute_data)) {
-        original_zend_execute_ex(execute_data);
+#ifdef HAVE_SHM_OPEN
+    if (trace_exporter_is_ring()) {
+        // 共享内存模式：整个trace作为一条记录拷进环里，发送交给消费进程
+        if (!trace_ring_owner_pid) {
+            // CLI worker不创建环，附加到FPM master创建的环（FPM重启重建后重新附加）
+            char name[NAME_MAX];
+            if (!trace_ring_parse_name(TRACE_G(exporter), name, sizeof(name))) {
+                TRACE_G(exporter_dropped_traces)++;
+                return;
+            }
+            trace_ring_attach(name);
+        }
+        if (!trace_ring) {
+            TRACE_G(exporter_dropped_traces)++;
+            return;
+        }
+        TRACE_FOREACH_SPAN(span) {
+            trace_serialize_span_json(&buf, span);
+        } TRACE_FOREACH_SPAN_END();
+        size_t len = ZSTR_LEN(buf.s);
+        if (trace_ring_write(ZSTR_VAL(buf.s), len)) {
+            TRACE_G(exporter_sent_traces)++;
+            TRACE_G(exporter_sent_bytes) += len;
+        } else {
+            TRACE_G(exporter_dropped_traces)++;
+            TRACE_G(exporter_dropped_bytes) += len;
+        }
+        smart_str_free(&buf);
         return;
     }
+#endif
     
-    // 安全检查
-    if (!execute_data || !execute_data->func) {
-        original_zend_execute_ex(execute_data);
+    if (!trace_exporter_ensure()) {
+        TRACE_G(exporter_dropped_traces)++;
         return;
     }
     
-    // 获取调用方上下文（caller's context）
-    const char *caller_file = NULL;
-    int caller_line = 0;
-    if (execute_data->prev_execute_data) {
-        zend_execute_data *caller = execute_data->prev_execute_data;
-        if (caller->func && caller->func->type == ZEND_USER_FUNCTION) {
-            if (caller->func->op_array.filename) {
-                caller_file = ZSTR_VAL(caller->func->op_array.filename);
+    if (TRACE_G(exporter_socktype) == SOCK_DGRAM) {
+        // 按span边界拆成不超过 exporter_max_datagram 的数据报
+        size_t max_datagram = TRACE_G(exporter_max_datagram) > 0 ? (size_t)TRACE_G(exporter_max_datagram) : 65000;
+        // 一个数据报发送失败（背压或断开）后，剩余的span不再序列化
+        TRACE_FOREACH_SPAN(span) {
+            if (!ok) {
+                continue;
             }
-            if (caller->opline) {
-                caller_line = caller->opline->lineno;
+            size_t line_start = buf.s ? ZSTR_LEN(buf.s) : 0;
+            trace_serialize_span_json(&buf, span);
+            size_t total = ZSTR_LEN(buf.s);
+            if (total - line_start > max_datagram) {
+                // 单个span就超过上限：跳过这个span并计入丢弃，其余span照常发送
+                TRACE_G(exporter_dropped_bytes) += total - line_start;
+                ZSTR_LEN(buf.s) = line_start;
+                continue;
             }
+            if (total > max_datagram && line_start > 0) {
+                ok = trace_exporter_send_datagram(ZSTR_VAL(buf.s), line_start);
+                memmove(ZSTR_VAL(buf.s), ZSTR_VAL(buf.s) + line_start, total - line_start);
+                ZSTR_LEN(buf.s) = total - line_start;
+            }
+        } TRACE_FOREACH_SPAN_END();
+        if (ok && buf.s && ZSTR_LEN(buf.s) > 0) {
+            ok = trace_exporter_send_datagram(ZSTR_VAL(buf.s), ZSTR_LEN(buf.s));
         }
-    }
-    
-    // 准备回调参数：function, class, caller_file, caller_line, parent_span_id, args
-    zval args[6];
-    
-    // 函数名
-    if (execute_data->func->common.function_name) {
-        ZVAL_STR_COPY(&args[0], execute_data->func->common.function_name);
     } else {
-        ZVAL_STRING(&args[0], "anonymous");
+        TRACE_FOREACH_SPAN(span) {
+            trace_serialize_span_json(&buf, span);
+        } TRACE_FOREACH_SPAN_END();
+        ok = trace_exporter_send_stream(ZSTR_VAL(buf.s), ZSTR_LEN(buf.s));
     }
     
-    // 类名
-    if (execute_data->func->common.scope) {
-        ZVAL_STR_COPY(&args[1], execute_data->func->common.scope->name);
-    } else {
-        ZVAL_NULL(&args[1]);
-    }
+    smart_str_free(&buf);
     
-    // 调用方文件名
-    if (caller_file) {
-        ZVAL_STRING(&args[2], caller_file);
+    if (ok) {
+        TRACE_G(exporter_sent_traces)++;
     } else {
-        ZVAL_NULL(&args[2]);
+        TRACE_G(exporter_dropped_traces)++;
     }
-    
-    // 调用方行号
-    ZVAL_LONG(&args[3], caller_line);
-    
-    // 父Span ID
-    if (TRACE_G(current_span) && TRACE_G(current_span)->span_id) {
-        ZVAL_STR_COPY(&args[4], TRACE_G(current_span)->span_id);
-    } else {
-        ZVAL_NULL(&args[4]);
+}
+
+// TraceSpan / TraceSpanIterator：直接引用内部span，不复制tags/logs
+// trace_spans() 在创建迭代器时先按原生条件筛选，只保存命中span的指针；
+// TraceSpan的属性在getter中按需读取。spans被释放（请求结束、trace_reset()）后对象失效，getter返回null
+typedef struct _trace_span_object {
+    trace_span_t *span;
+    uint32_t generation;
+    zend_object std;
+} trace_span_object_t;
+
+typedef struct _trace_span_iterator_object {
+    trace_span_t **spans;
+    uint32_t count;
+    uint32_t position;
+    uint32_t generation;
+    zend_object std;
+} trace_span_iterator_object_t;
+
+// 筛选条件
+typedef struct {
+    uint64_t min_duration_ns;
+    zend_string *name_prefix;
+    zend_long max_depth;    // -1表示不限
+    zend_long slowest;      // >0时只保留耗时最长的N个，按耗时降序
+} trace_span_filter_t;
+
+static zend_always_inline trace_span_object_t *trace_span_obj_from(zend_object *obj)
+{
+    return (trace_span_object_t *)((char *)obj - XtOffsetOf(trace_span_object_t, std));
+}
+
+static zend_always_inline trace_span_iterator_object_t *trace_span_iterator_from(zend_object *obj)
+{
+    return (trace_span_iterator_object_t *)((char *)obj - XtOffsetOf(trace_span_iterator_object_t, std));
+}
+
+static uint32_t trace_span_depth(trace_span_t *span)
+{
+    uint32_t depth = 0;
+    while (span->parent) {
+        span = span->parent;
+        depth++;
     }
+    return depth;
+}
+
+static zend_object *trace_span_obj_create(zend_class_entry *ce)
+{
+    trace_span_object_t *obj = zend_object_alloc(sizeof(trace_span_object_t), ce);
     
-    // 函数参数数组
-    array_init(&args[5]);
-    uint32_t arg_count = ZEND_CALL_NUM_ARGS(execute_data);
-    if (arg_count > 0) {
-        zval *p = ZEND_CALL_ARG(execute_data, 1);
-        uint32_t i = 0; 
-        while (i < arg_count) {
-            zval arg_copy;
-            ZVAL_COPY(&arg_copy, p);
-            add_next_index_zval(&args[5], &arg_copy);
-            p++;
-            i++;
-        }
-    }
+    obj->span = NULL;
+    obj->generation = 0;
+    zend_object_std_init(&obj->std, ce);
+    obj->std.handlers = &trace_span_handlers;
     
-    // 调用用户回调
-    trace_call_user_callback(&TRACE_G(function_enter_callback), 6, args, &callback_result);
+    return &obj->std;
+}
+
+static zend_object *trace_span_iterator_create(zend_class_entry *ce)
+{
+    trace_span_iterator_object_t *iter = zend_object_alloc(sizeof(trace_span_iterator_object_t), ce);
     
-    // 根据回调返回值创建span
-    if (Z_TYPE(callback_result) == IS_ARRAY) {
-        zval *operation_name = zend_hash_str_find(Z_ARR(callback_result), "operation_name", sizeof("operation_name") - 1);
-        if (operation_name && Z_TYPE_P(operation_name) == IS_STRING && Z_STRLEN_P(operation_name) > 0) {
-            span = trace_create_span(Z_STRVAL_P(operation_name), TRACE_G(current_span));
-            if (span) {
-                TRACE_G(current_span) = span;
-                
-                // 处理callback返回的tags
-                zval *tags = zend_hash_str_find(Z_ARR(callback_result), "tags", sizeof("tags") - 1);
-                if (tags && Z_TYPE_P(tags) == IS_ARRAY) {
-                    zend_string *tag_key;
-                    zval *tag_val;
-                    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARR_P(tags), tag_key, tag_val) {
-                        if (tag_key && Z_TYPE_P(tag_val) == IS_STRING) {
-                            zval tag_copy;
-                            ZVAL_COPY(&tag_copy, tag_val);
-                            zend_hash_add(span->tags, tag_key, &tag_copy);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-                
-                // 处理callback返回的logs
-                zval *logs = zend_hash_str_find(Z_ARR(callback_result), "logs", sizeof("logs") - 1);
-                if (logs && Z_TYPE_P(logs) == IS_ARRAY && span->logs) {
-                    zval *log_item;
-                    ZEND_HASH_FOREACH_VAL(Z_ARR_P(logs), log_item) {
-                        if (Z_TYPE_P(log_item) == IS_ARRAY) {
-                            // 复制log条目并添加时间戳
-                            zval log_entry;
-                            array_init(&log_entry);
-                            
-                            zval *level = zend_hash_str_find(Z_ARR_P(log_item), "level", sizeof("level") - 1);
-                            if (level && Z_TYPE_P(level) == IS_STRING) {
-                                add_assoc_str(&log_entry, "level", zend_string_copy(Z_STR_P(level)));
-                            }
-                            
-                            zval *message = zend_hash_str_find(Z_ARR_P(log_item), "message", sizeof("message") - 1);
-                            if (message && Z_TYPE_P(message) == IS_STRING) {
-                                add_assoc_str(&log_entry, "message", zend_string_copy(Z_STR_P(message)));
-                            }
-                            
-                            add_assoc_double(&log_entry, "timestamp", trace_get_microtime());
-                            
-                            zend_hash_next_index_insert(span->logs, &log_entry);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-            }
-        }
-    }
+    iter->spans = NULL;
+    iter->count = 0;
+    iter->position = 0;
+    iter->generation = 0;
+    zend_object_std_init(&iter->std, ce);
+    iter->std.handlers = &trace_span_iterator_handlers;
     
-    // 清理回调参数
-    int i;
-    for (i = 0; i < 6; i++) {
-        zval_dtor(&args[i]);
+    return &iter->std;
+}
+
+static void trace_span_iterator_free(zend_object *object)
+{
+    trace_span_iterator_object_t *iter = trace_span_iterator_from(object);
+    if (iter->spans) {
+        efree(iter->spans);
     }
-    if (!Z_ISUNDEF(callback_result)) {
-        zval_dtor(&callback_result);
+    zend_object_std_dtor(object);
+}
+
+// 取对象引用的span，spans已被释放时返回NULL
+static zend_always_inline trace_span_t *trace_span_obj_current(zval *object)
+{
+    trace_span_object_t *obj = trace_span_obj_from(Z_OBJ_P(object));
+    if (obj->generation != TRACE_G(span_generation)) {
+        return NULL;
     }
+    return obj->span;
+}
+
+// slowest排序用：先算好耗时，避免比较时重复计算
+typedef struct {
+    uint64_t duration_ns;
+    trace_span_t *span;
+} trace_span_sort_entry_t;
+
+static int trace_span_sort_compare(const void *a, const void *b)
+{
+    uint64_t da = ((const trace_span_sort_entry_t *)a)->duration_ns;
+    uint64_t db = ((const trace_span_sort_entry_t *)b)->duration_ns;
+    return da < db ? 1 : (da > db ? -1 : 0);
+}
+
+static void trace_span_sort_swap(void *a, void *b)
+{
+    trace_span_sort_entry_t tmp = *(trace_span_sort_entry_t *)a;
+    *(trace_span_sort_entry_t *)a = *(trace_span_sort_entry_t *)b;
+    *(trace_span_sort_entry_t *)b = tmp;
+}
+
+// 解析筛选条件数组，未知的键给出警告
+static int trace_span_filter_parse(trace_span_filter_t *filter, HashTable *options)
+{
+    zend_string *key;
+    zval *value;
     
-    // 调用原始函数
-    original_zend_execute_ex(execute_data);
+    filter->min_duration_ns = 0;
+    filter->name_prefix = NULL;
+    filter->max_depth = -1;
+    filter->slowest = 0;
     
-    // 函数执行完成后处理
-    if (span) {
-        // 完成span
-        trace_finish_span(span);
-        
-        // 恢复父span
-        TRACE_G(current_span) = span->parent;
-        
-        // 调用exit回调
-        if (!Z_ISUNDEF(TRACE_G(function_exit_callback))) {
-            zval exit_args[3];
-            
-            // span_id
-            ZVAL_STR_COPY(&exit_args[0], span->span_id);
-            
-            // duration (执行时长)
-            ZVAL_DOUBLE(&exit_args[1], span->end_time - span->start_time);
-            
-            // 函数返回值
-            if (execute_data->return_value && !Z_ISUNDEF_P(execute_data->return_value)) {
-                ZVAL_COPY(&exit_args[2], execute_data->return_value);
-            } else {
-                ZVAL_NULL(&exit_args[2]);
-            }
-            
-            zval exit_result;
-            ZVAL_UNDEF(&exit_result);
-            trace_call_user_callback(&TRACE_G(function_exit_callback), 3, exit_args, &exit_result);
-            
-            // 处理exit回调返回的tags，合并到span
-            if (Z_TYPE(exit_result) == IS_ARRAY) {
-                zval *exit_tags = zend_hash_str_find(Z_ARR(exit_result), "tags", sizeof("tags") - 1);
-                if (exit_tags && Z_TYPE_P(exit_tags) == IS_ARRAY && span->tags) {
-                    zend_string *tag_key;
-                    zval *tag_val;
-                    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARR_P(exit_tags), tag_key, tag_val) {
-                        if (tag_key) {
-                            zval tag_copy;
-                            ZVAL_COPY(&tag_copy, tag_val);
-                            // 更新或添加tag
-                            zend_hash_update(span->tags, tag_key, &tag_copy);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-                
-                // 处理exit回调返回的logs，合并到span
-                zval *exit_logs = zend_hash_str_find(Z_ARR(exit_result), "logs", sizeof("logs") - 1);
-                if (exit_logs && Z_TYPE_P(exit_logs) == IS_ARRAY && span->logs) {
-                    zval *log_item;
-                    ZEND_HASH_FOREACH_VAL(Z_ARR_P(exit_logs), log_item) {
-                        if (Z_TYPE_P(log_item) == IS_ARRAY) {
-                            zval log_entry;
-                            array_init(&log_entry);
-                            
-                            zval *level = zend_hash_str_find(Z_ARR_P(log_item), "level", sizeof("level") - 1);
-                            if (level && Z_TYPE_P(level) == IS_STRING) {
-                                add_assoc_str(&log_entry, "level", zend_string_copy(Z_STR_P(level)));
-                            }
-                            
-                            zval *message = zend_hash_str_find(Z_ARR_P(log_item), "message", sizeof("message") - 1);
-                            if (message && Z_TYPE_P(message) == IS_STRING) {
-                                add_assoc_str(&log_entry, "message", zend_string_copy(Z_STR_P(message)));
-                            }
-                            
-                            add_assoc_double(&log_entry, "timestamp", trace_get_microtime());
-                            
-                            zend_hash_next_index_insert(span->logs, &log_entry);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
+    if (!options) {
+        return 1;
+    }
+    
+    ZEND_HASH_FOREACH_STR_KEY_VAL(options, key, value) {
+        if (!key) {
+            continue;
+        }
+        if (zend_string_equals_literal(key, "min_duration_ms")) {
+            double ms = zval_get_double(value);
+            filter->min_duration_ns = ms > 0 ? (uint64_t)(ms * 1000000.0) : 0;
+        } else if (zend_string_equals_literal(key, "name_prefix")) {
+            if (Z_TYPE_P(value) != IS_STRING) {
+                php_error_docref(NULL, E_WARNING, "name_prefix 必须是字符串");
+                return 0;
             }
+            filter->name_prefix = Z_STR_P(value);
+        } else if (zend_string_equals_literal(key, "max_depth")) {
+            filter->max_depth = zval_get_long(value);
+        } else if (zend_string_equals_literal(key, "slowest")) {
+            filter->slowest = zval_get_long(value);
+        } else {
+            php_error_docref(NULL, E_WARNING, "未知的筛选条件 %s", ZSTR_VAL(key));
+        }
+    } ZEND_HASH_FOREACH_END();
+    
+    return 1;
+}
 
-            // 清理
-            int j;
-            for (j = 0; j < 3; j++) {
-                zval_dtor(&exit_args[j]);
-            }
-            if (!Z_ISUNDEF(exit_result)) {
-                zval_dtor(&exit_result);
-            }
+static zend_always_inline int trace_span_filter_match(trace_span_filter_t *filter, trace_span_t *span, uint64_t now)
+{
+    if (filter->min_duration_ns && trace_span_duration_ns(span, now) < filter->min_duration_ns) {
+        return 0;
+    }
+    if (filter->name_prefix) {
+        size_t prefix_len = ZSTR_LEN(filter->name_prefix);
+        if (ZSTR_LEN(span->operation_name) < prefix_len
+            || memcmp(ZSTR_VAL(span->operation_name), ZSTR_VAL(filter->name_prefix), prefix_len) != 0) {
+            return 0;
         }
     }
+    if (filter->max_depth >= 0 && trace_span_depth(span) > (uint32_t)filter->max_depth) {
+        return 0;
+    }
+    return 1;
 }
 
-// 内部函数执行钩子（处理扩展函数：mysql、redis、curl等）
-void trace_execute_internal(zend_execute_data *execute_data, zval *return_value)
+// 按条件筛选当前trace的span，结果写入迭代器
+static void trace_span_iterator_fill(trace_span_iterator_object_t *iter, trace_span_filter_t *filter)
 {
-    trace_span_t *span = NULL;
-    zval callback_result;
-    ZVAL_UNDEF(&callback_result);
+    uint64_t now = trace_now_ns();
+    trace_span_t *span;
+    uint32_t count = 0;
     
-    // ⚠️ 重入保护
-    if (TRACE_G(in_trace_callback)) {
-        if (original_zend_execute_internal) {
-            original_zend_execute_internal(execute_data, return_value);
-        } else {
-            execute_internal(execute_data, return_value);
-        }
+    iter->generation = TRACE_G(span_generation);
+    if (TRACE_G(span_count) == 0) {
         return;
     }
     
-    // 快速路径：检查是否需要跟踪
-    if (!TRACE_G(enabled) || Z_ISUNDEF(TRACE_G(function_enter_callback))) {
-        if (original_zend_execute_internal) {
-            original_zend_execute_internal(execute_data, return_value);
-        } else {
-            execute_internal(execute_data, return_value);
+    iter->spans = safe_emalloc(TRACE_G(span_count), sizeof(trace_span_t *), 0);
+    TRACE_FOREACH_SPAN(span) {
+        if (trace_span_filter_match(filter, span, now)) {
+            iter->spans[count++] = span;
         }
-        return;
-    }
+    } TRACE_FOREACH_SPAN_END();
     
-    if (!trace_should_trace_internal_function(execute_data)) {
-        if (original_zend_execute_internal) {
-            original_zend_execute_internal(execute_data, return_value);
-        } else {
-            execute_internal(execute_data, return_value);
+    if (filter->slowest > 0 && count > 1) {
+        trace_span_sort_entry_t *entries = safe_emalloc(count, sizeof(trace_span_sort_entry_t), 0);
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            entries[i].span = iter->spans[i];
+            entries[i].duration_ns = trace_span_duration_ns(iter->spans[i], now);
         }
-        return;
-    }
-    
-    // 安全检查
-    if (!execute_data || !execute_data->func) {
-        if (original_zend_execute_internal) {
-            original_zend_execute_internal(execute_data, return_value);
-        } else {
-            execute_internal(execute_data, return_value);
+        zend_sort(entries, count, sizeof(trace_span_sort_entry_t),
+                  (compare_func_t)trace_span_sort_compare, (swap_func_t)trace_span_sort_swap);
+        if ((zend_ulong)filter->slowest < count) {
+            count = (uint32_t)filter->slowest;
         }
-        return;
-    }
-    
-    // 获取调用方上下文
-    const char *caller_file = NULL;
-    int caller_line = 0;
-    if (execute_data->prev_execute_data) {
-        zend_execute_data *caller = execute_data->prev_execute_data;
-        if (caller->func && caller->func->type == ZEND_USER_FUNCTION) {
-            if (caller->func->op_array.filename) {
-                caller_file = ZSTR_VAL(caller->func->op_array.filename);
-            }
-            if (caller->opline) {
-                caller_line = caller->opline->lineno;
-            }
+        for (i = 0; i < count; i++) {
+            iter->spans[i] = entries[i].span;
         }
+        efree(entries);
     }
-    
-    // 准备回调参数
-    zval args[6];
-    
-    // 函数名
-    if (execute_data->func->common.function_name) {
-        ZVAL_STR_COPY(&args[0], execute_data->func->common.function_name);
-    } else {
-        ZVAL_STRING(&args[0], "anonymous");
+    iter->count = count;
+}
+
+static void trace_span_obj_init(zval *dst, trace_span_t *span, uint32_t generation)
+{
+    object_init_ex(dst, trace_span_ce);
+    trace_span_object_t *obj = trace_span_obj_from(Z_OBJ_P(dst));
+    obj->span = span;
+    obj->generation = generation;
+}
+
+#define TRACE_SPAN_METHOD_PROLOGUE() \
+    ZEND_PARSE_PARAMETERS_NONE(); \
+    trace_span_t *span = trace_span_obj_current(ZEND_THIS); \
+    if (!span) { \
+        RETURN_NULL(); \
     }
-    
-    // 类名
-    if (execute_data->func->common.scope) {
-        ZVAL_STR_COPY(&args[1], execute_data->func->common.scope->name);
-    } else {
-        ZVAL_NULL(&args[1]);
+
+PHP_METHOD(TraceSpan, __construct)
+{
+}
+
+PHP_METHOD(TraceSpan, getSpanId)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    RETURN_STR(trace_span_id_str(span->span_id));
+}
+
+PHP_METHOD(TraceSpan, getParentId)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    if (!span->parent_id) {
+        RETURN_NULL();
     }
-    
-    // 调用方文件名
-    if (caller_file) {
-        ZVAL_STRING(&args[2], caller_file);
-    } else {
-        ZVAL_NULL(&args[2]);
+    RETURN_STR(trace_span_id_str(span->parent_id));
+}
+
+PHP_METHOD(TraceSpan, getName)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    RETURN_STR_COPY(span->operation_name);
+}
+
+PHP_METHOD(TraceSpan, getStartTime)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    RETURN_DOUBLE(trace_ns_to_wall(span->start_ns));
+}
+
+PHP_METHOD(TraceSpan, getEndTime)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    if (!span->end_ns) {
+        RETURN_NULL();
+    }
+    RETURN_DOUBLE(trace_ns_to_wall(span->end_ns));
+}
+
+PHP_METHOD(TraceSpan, getDurationNs)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    RETURN_LONG((zend_long)trace_span_duration_ns(span, trace_now_ns()));
+}
+
+PHP_METHOD(TraceSpan, getSelfDurationNs)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    RETURN_LONG((zend_long)trace_span_self_ns(span, trace_now_ns()));
+}
+
+PHP_METHOD(TraceSpan, getDepth)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    RETURN_LONG(trace_span_depth(span));
+}
+
+PHP_METHOD(TraceSpan, isFinished)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    RETURN_BOOL(span->end_ns != 0);
+}
+
+PHP_METHOD(TraceSpan, getTags)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    if (!span->tags) {
+        RETURN_EMPTY_ARRAY();
     }
+    // 写时复制：只增加引用计数
+    GC_ADDREF(span->tags);
+    RETURN_ARR(span->tags);
+}
+
+PHP_METHOD(TraceSpan, getTag)
+{
+    zend_string *key;
     
-    // 调用方行号
-    ZVAL_LONG(&args[3], caller_line);
+    ZEND_PARSE_PARAMETERS_START(1, 1)
+        Z_PARAM_STR(key)
+    ZEND_PARSE_PARAMETERS_END();
     
-    // 父Span ID
-    if (TRACE_G(current_span) && TRACE_G(current_span)->span_id) {
-        ZVAL_STR_COPY(&args[4], TRACE_G(current_span)->span_id);
-    } else {
-        ZVAL_NULL(&args[4]);
+    trace_span_t *span = trace_span_obj_current(ZEND_THIS);
+    if (!span || !span->tags) {
+        RETURN_NULL();
     }
-    
-    // 函数参数数组
-    array_init(&args[5]);
-    uint32_t arg_count = ZEND_CALL_NUM_ARGS(execute_data);
-    if (arg_count > 0) {
-        zval *p = ZEND_CALL_ARG(execute_data, 1);
-        uint32_t i = 0;
-        while (i < arg_count) {
-            zval arg_copy;
-            ZVAL_COPY(&arg_copy, p);
-            add_next_index_zval(&args[5], &arg_copy);
-            p++;
-            i++;
-        }
+    zval *value = zend_hash_find(span->tags, key);
+    if (!value) {
+        RETURN_NULL();
     }
-    
-    // 调用用户回调
-    trace_call_user_callback(&TRACE_G(function_enter_callback), 6, args, &callback_result);
-    
-    // 根据回调返回值创建span
-    if (Z_TYPE(callback_result) == IS_ARRAY) {
-        zval *operation_name = zend_hash_str_find(Z_ARR(callback_result), "operation_name", sizeof("operation_name") - 1);
-        if (operation_name && Z_TYPE_P(operation_name) == IS_STRING && Z_STRLEN_P(operation_name) > 0) {
-            span = trace_create_span(Z_STRVAL_P(operation_name), TRACE_G(current_span));
-            if (span) {
-                TRACE_G(current_span) = span;
-                
-                // 处理callback返回的tags
-                zval *tags = zend_hash_str_find(Z_ARR(callback_result), "tags", sizeof("tags") - 1);
-                if (tags && Z_TYPE_P(tags) == IS_ARRAY) {
-                    zend_string *tag_key;
-                    zval *tag_val;
-                    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARR_P(tags), tag_key, tag_val) {
-                        if (tag_key) {
-                            zval tag_copy;
-                            ZVAL_COPY(&tag_copy, tag_val);
-                            zend_hash_add(span->tags, tag_key, &tag_copy);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-                
-                // 处理callback返回的logs
-                zval *logs = zend_hash_str_find(Z_ARR(callback_result), "logs", sizeof("logs") - 1);
-                if (logs && Z_TYPE_P(logs) == IS_ARRAY && span->logs) {
-                    zval *log_item;
-                    ZEND_HASH_FOREACH_VAL(Z_ARR_P(logs), log_item) {
-                        if (Z_TYPE_P(log_item) == IS_ARRAY) {
-                            zval log_entry;
-                            array_init(&log_entry);
-                            
-                            zval *level = zend_hash_str_find(Z_ARR_P(log_item), "level", sizeof("level") - 1);
-                            if (level && Z_TYPE_P(level) == IS_STRING) {
-                                add_assoc_str(&log_entry, "level", zend_string_copy(Z_STR_P(level)));
-                            }
-                            
-                            zval *message = zend_hash_str_find(Z_ARR_P(log_item), "message", sizeof("message") - 1);
-                            if (message && Z_TYPE_P(message) == IS_STRING) {
-                                add_assoc_str(&log_entry, "message", zend_string_copy(Z_STR_P(message)));
-                            }
-                            
-                            add_assoc_double(&log_entry, "timestamp", trace_get_microtime());
-                            
-                            zend_hash_next_index_insert(span->logs, &log_entry);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-            }
-        }
+    RETURN_COPY(value);
+}
+
+PHP_METHOD(TraceSpan, getLogs)
+{
+    TRACE_SPAN_METHOD_PROLOGUE();
+    if (!span->logs) {
+        RETURN_EMPTY_ARRAY();
     }
-    
-    // 清理回调参数
-    int i;
-    for (i = 0; i < 6; i++) {
-        zval_dtor(&args[i]);
+    GC_ADDREF(span->logs);
+    RETURN_ARR(span->logs);
+}
+
+static const zend_function_entry trace_span_methods[] = {
+    PHP_ME(TraceSpan, __construct, arginfo_trace_frame_void, ZEND_ACC_PRIVATE)
+    PHP_ME(TraceSpan, getSpanId, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getParentId, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getName, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getStartTime, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getEndTime, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getDurationNs, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getSelfDurationNs, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getDepth, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, isFinished, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getTags, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getTag, arginfo_trace_span_get_tag, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpan, getLogs, arginfo_trace_frame_void, ZEND_ACC_PUBLIC)
+    PHP_FE_END
+};
+
+PHP_METHOD(TraceSpanIterator, __construct)
+{
+}
+
+PHP_METHOD(TraceSpanIterator, current)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    trace_span_iterator_object_t *iter = trace_span_iterator_from(Z_OBJ_P(ZEND_THIS));
+    if (iter->generation != TRACE_G(span_generation) || iter->position >= iter->count) {
+        RETURN_NULL();
     }
-    if (!Z_ISUNDEF(callback_result)) {
-        zval_dtor(&callback_result);
+    trace_span_obj_init(return_value, iter->spans[iter->position], iter->generation);
+}
+
+PHP_METHOD(TraceSpanIterator, key)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    trace_span_iterator_object_t *iter = trace_span_iterator_from(Z_OBJ_P(ZEND_THIS));
+    if (iter->generation != TRACE_G(span_generation) || iter->position >= iter->count) {
+        RETURN_NULL();
     }
-    
-    // 调用原始内部函数
-    if (original_zend_execute_internal) {
-        original_zend_execute_internal(execute_data, return_value);
-    } else {
-        execute_internal(execute_data, return_value);
+    RETURN_LONG(iter->position);
+}
+
+PHP_METHOD(TraceSpanIterator, next)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    trace_span_iterator_object_t *iter = trace_span_iterator_from(Z_OBJ_P(ZEND_THIS));
+    if (iter->position < iter->count) {
+        iter->position++;
     }
+}
+
+PHP_METHOD(TraceSpanIterator, rewind)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    trace_span_iterator_from(Z_OBJ_P(ZEND_THIS))->position = 0;
+}
+
+PHP_METHOD(TraceSpanIterator, valid)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    trace_span_iterator_object_t *iter = trace_span_iterator_from(Z_OBJ_P(ZEND_THIS));
+    RETURN_BOOL(iter->generation == TRACE_G(span_generation) && iter->position < iter->count);
+}
+
+PHP_METHOD(TraceSpanIterator, count)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    trace_span_iterator_object_t *iter = trace_span_iterator_from(Z_OBJ_P(ZEND_THIS));
+    RETURN_LONG(iter->generation == TRACE_G(span_generation) ? iter->count : 0);
+}
+
+static const zend_function_entry trace_span_iterator_methods[] = {
+    PHP_ME(TraceSpanIterator, __construct, arginfo_trace_frame_void, ZEND_ACC_PRIVATE)
+    PHP_ME(TraceSpanIterator, current, arginfo_trace_span_iterator_current, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpanIterator, key, arginfo_trace_span_iterator_key, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpanIterator, next, arginfo_trace_span_iterator_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpanIterator, rewind, arginfo_trace_span_iterator_void, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpanIterator, valid, arginfo_trace_span_iterator_valid, ZEND_ACC_PUBLIC)
+    PHP_ME(TraceSpanIterator, count, arginfo_trace_span_iterator_count, ZEND_ACC_PUBLIC)
+    PHP_FE_END
+};
+
+void trace_register_span_classes(void)
+{
+    zend_class_entry ce;
     
-    // 函数执行完成后处理
-    if (span) {
-        // 完成span
-        trace_finish_span(span);
-        
-        // 恢复父span
-        TRACE_G(current_span) = span->parent;
-        
-        // 调用exit回调
-        if (!Z_ISUNDEF(TRACE_G(function_exit_callback))) {
-            zval exit_args[3];
-            
-            // span_id
-            ZVAL_STR_COPY(&exit_args[0], span->span_id);
-            
-            // duration
-            ZVAL_DOUBLE(&exit_args[1], span->end_time - span->start_time);
-            
-            // 返回值
-            if (return_value && !Z_ISUNDEF_P(return_value)) {
-                ZVAL_COPY(&exit_args[2], return_value);
-            } else {
-                ZVAL_NULL(&exit_args[2]);
-            }
-            
-            zval exit_result;
-            ZVAL_UNDEF(&exit_result);
-            trace_call_user_callback(&TRACE_G(function_exit_callback), 3, exit_args, &exit_result);
-            
-            // 处理exit回调返回的tags
-            if (Z_TYPE(exit_result) == IS_ARRAY) {
-                zval *exit_tags = zend_hash_str_find(Z_ARR(exit_result), "tags", sizeof("tags") - 1);
-                if (exit_tags && Z_TYPE_P(exit_tags) == IS_ARRAY && span->tags) {
-                    zend_string *tag_key;
-                    zval *tag_val;
-                    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARR_P(exit_tags), tag_key, tag_val) {
-                        if (tag_key) {
-                            zval tag_copy;
-                            ZVAL_COPY(&tag_copy, tag_val);
-                            zend_hash_update(span->tags, tag_key, &tag_copy);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-                
-                // 处理exit回调返回的logs
-                zval *exit_logs = zend_hash_str_find(Z_ARR(exit_result), "logs", sizeof("logs") - 1);
-                if (exit_logs && Z_TYPE_P(exit_logs) == IS_ARRAY && span->logs) {
-                    zval *log_item;
-                    ZEND_HASH_FOREACH_VAL(Z_ARR_P(exit_logs), log_item) {
-                        if (Z_TYPE_P(log_item) == IS_ARRAY) {
-                            zval log_entry;
-                            array_init(&log_entry);
-                            
-                            zval *level = zend_hash_str_find(Z_ARR_P(log_item), "level", sizeof("level") - 1);
-                            if (level && Z_TYPE_P(level) == IS_STRING) {
-                                add_assoc_str(&log_entry, "level", zend_string_copy(Z_STR_P(level)));
-                            }
-                            
-                            zval *message = zend_hash_str_find(Z_ARR_P(log_item), "message", sizeof("message") - 1);
-                            if (message && Z_TYPE_P(message) == IS_STRING) {
-                                add_assoc_str(&log_entry, "message", zend_string_copy(Z_STR_P(message)));
-                            }
-                            
-                            add_assoc_double(&log_entry, "timestamp", trace_get_microtime());
-                            
-                            zend_hash_next_index_insert(span->logs, &log_entry);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-            }
-            
-            // 清理
-            int j;
-            for (j = 0; j < 3; j++) {
-                zval_dtor(&exit_args[j]);
-            }
-            if (!Z_ISUNDEF(exit_result)) {
-                zval_dtor(&exit_result);
-            }
-        }
-    }
+    INIT_CLASS_ENTRY(ce, "TraceSpan", trace_span_methods);
+    trace_span_ce = zend_register_internal_class(&ce);
+    trace_span_ce->ce_flags |= ZEND_ACC_FINAL | ZEND_ACC_NO_DYNAMIC_PROPERTIES;
+#if PHP_VERSION_ID >= 80100
+    trace_span_ce->ce_flags |= ZEND_ACC_NOT_SERIALIZABLE;
+#endif
+    trace_span_ce->create_object = trace_span_obj_create;
+    
+    memcpy(&trace_span_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    trace_span_handlers.offset = XtOffsetOf(trace_span_object_t, std);
+    trace_span_handlers.clone_obj = NULL;
+    
+    INIT_CLASS_ENTRY(ce, "TraceSpanIterator", trace_span_iterator_methods);
+    trace_span_iterator_ce = zend_register_internal_class(&ce);
+    trace_span_iterator_ce->ce_flags |= ZEND_ACC_FINAL | ZEND_ACC_NO_DYNAMIC_PROPERTIES;
+#if PHP_VERSION_ID >= 80100
+    trace_span_iterator_ce->ce_flags |= ZEND_ACC_NOT_SERIALIZABLE;
+#endif
+    trace_span_iterator_ce->create_object = trace_span_iterator_create;
+    zend_class_implements(trace_span_iterator_ce, 2, zend_ce_iterator, zend_ce_countable);
+    
+    memcpy(&trace_span_iterator_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+    trace_span_iterator_handlers.offset = XtOffsetOf(trace_span_iterator_object_t, std);
+    trace_span_iterator_handlers.free_obj = trace_span_iterator_free;
+    trace_span_iterator_handlers.clone_obj = NULL;
 }
 
 // PHP函数实现
 PHP_FUNCTION(trace_get_trace_id)
 {
-    if (TRACE_G(trace_id)) {
-        RETURN_STR_COPY(TRACE_G(trace_id));
+    zend_string *trace_id = trace_get_trace_id_str();
+    if (trace_id) {
+        RETURN_STR_COPY(trace_id);
     }
     RETURN_NULL();
 }
@@ -1039,6 +7113,11 @@ PHP_FUNCTION(trace_set_callback)
             zval_dtor(&TRACE_G(function_exit_callback));
         }
         ZVAL_COPY(&TRACE_G(function_exit_callback), callback);
+    } else if (strcmp(type, "frame_enter") == 0) {
+        if (!Z_ISUNDEF(TRACE_G(frame_enter_callback))) {
+            zval_dtor(&TRACE_G(frame_enter_callback));
+        }
+        ZVAL_COPY(&TRACE_G(frame_enter_callback), callback);
     } else if (strcmp(type, "curl") == 0) {
         if (!Z_ISUNDEF(TRACE_G(curl_callback))) {
             zval_dtor(&TRACE_G(curl_callback));
@@ -1053,120 +7132,279 @@ PHP_FUNCTION(trace_set_callback)
         RETURN_FALSE;
     }
     
-    RETURN_TRUE;
+    RETURN_TRUE;
+}
+
+PHP_FUNCTION(trace_get_current_span)
+{
+    if (TRACE_G(current_span)) {
+        array_init(return_value);
+        add_assoc_str(return_value, "span_id", trace_span_id_str(TRACE_G(current_span)->span_id));
+        add_assoc_str(return_value, "operation_name", zend_string_copy(TRACE_G(current_span)->operation_name));
+        add_assoc_double(return_value, "start_time", trace_ns_to_wall(TRACE_G(current_span)->start_ns));
+        if (TRACE_G(current_span)->parent_id) {
+            add_assoc_str(return_value, "parent_id", trace_span_id_str(TRACE_G(current_span)->parent_id));
+        } else {
+            add_assoc_null(return_value, "parent_id");
+        }
+        return;
+    }
+    RETURN_NULL();
+}
+
+PHP_FUNCTION(trace_add_log)
+{
+    char *level, *message;
+    size_t level_len, message_len;
+    
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "ss", &level, &level_len, &message, &message_len) == FAILURE) {
+        RETURN_FALSE;
+    }
+    
+    if (TRACE_G(current_span)) {
+        zval log_entry;
+        array_init(&log_entry);
+        add_assoc_string(&log_entry, "level", level);
+        add_assoc_string(&log_entry, "message", message);
+        add_assoc_double(&log_entry, "timestamp", trace_get_microtime());
+        
+        RETURN_BOOL(trace_span_add_log(TRACE_G(current_span), &log_entry));
+    }
+    
+    RETURN_FALSE;
+}
+
+PHP_FUNCTION(trace_get_spans)
+{
+    array_init(return_value);
+    
+    zend_string *trace_id = trace_get_trace_id_str();
+    if (trace_id) {
+        add_assoc_str(return_value, "trace_id", zend_string_copy(trace_id));
+    } else {
+        add_assoc_string(return_value, "trace_id", "");
+    }
+    
+    zval spans_array;
+    array_init(&spans_array);
+    
+    trace_span_t *span;
+    TRACE_FOREACH_SPAN(span) {
+        zval span_data;
+        array_init(&span_data);
+        
+        add_assoc_str(&span_data, "span_id", trace_span_id_str(span->span_id));
+        add_assoc_str(&span_data, "operation_name", zend_string_copy(span->operation_name));
+        uint64_t duration_ns = span->end_ns ? span->end_ns - span->start_ns : 0;
+        add_assoc_double(&span_data, "start_time", trace_ns_to_wall(span->start_ns));
+        add_assoc_double(&span_data, "end_time", span->end_ns ? trace_ns_to_wall(span->end_ns) : 0.0);
+        add_assoc_double(&span_data, "duration", (double)duration_ns / 1000000000.0);
+        add_assoc_long(&span_data, "duration_ns", (zend_long)duration_ns);
+        add_assoc_long(&span_data, "self_ns", span->end_ns ? (zend_long)trace_span_self_ns(span, span->end_ns) : 0);
+        
+        if (span->parent_id) {
+            add_assoc_str(&span_data, "parent_id", trace_span_id_str(span->parent_id));
+        } else {
+            add_assoc_null(&span_data, "parent_id");
+        }
+        
+        // 添加tags（span的tags中只有字符串键）
+        // 与span共享同一个数组，之后任何一方写入时才复制
+        zval tags_array;
+        if (span->tags) {
+            GC_ADDREF(span->tags);
+            ZVAL_ARR(&tags_array, span->tags);
+        } else {
+            array_init(&tags_array);
+        }
+        add_assoc_zval(&span_data, "tags", &tags_array);
+        
+        // 添加logs
+        zval logs_array;
+        if (span->logs) {
+            GC_ADDREF(span->logs);
+            ZVAL_ARR(&logs_array, span->logs);
+        } else {
+            array_init(&logs_array);
+        }
+        add_assoc_zval(&span_data, "logs", &logs_array);
+        
+        zend_hash_next_index_insert(Z_ARR(spans_array), &span_data);
+    } TRACE_FOREACH_SPAN_END();
+    
+    add_assoc_zval(return_value, "spans", &spans_array);
+}
+
+// 按条件遍历当前trace的span，筛选在创建任何zval之前完成
+PHP_FUNCTION(trace_spans)
+{
+    HashTable *filters = NULL;
+    trace_span_filter_t filter;
+    
+    ZEND_PARSE_PARAMETERS_START(0, 1)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_ARRAY_HT(filters)
+    ZEND_PARSE_PARAMETERS_END();
+    
+    if (!trace_span_filter_parse(&filter, filters)) {
+        RETURN_FALSE;
+    }
+    
+    object_init_ex(return_value, trace_span_iterator_ce);
+    trace_span_iterator_fill(trace_span_iterator_from(Z_OBJ_P(return_value)), &filter);
+}
+
+// 扩展自身的开销：本请求（到目前为止）和本worker（已结束的请求之和）
+PHP_FUNCTION(trace_get_stats)
+{
+    trace_stats_t current;
+    zval request, worker;
+    
+    ZEND_PARSE_PARAMETERS_NONE();
+    
+    trace_stats_current(&current);
+    trace_stats_to_array(&request, &current);
+    trace_stats_to_array(&worker, &TRACE_G(worker_stats));
+    add_assoc_long(&worker, "requests", (zend_long)TRACE_G(worker_requests));
+    add_assoc_long(&worker, "exporter_sent_traces", (zend_long)TRACE_G(exporter_sent_traces));
+    add_assoc_long(&worker, "exporter_sent_bytes", (zend_long)TRACE_G(exporter_sent_bytes));
+    add_assoc_long(&worker, "exporter_dropped_traces", (zend_long)TRACE_G(exporter_dropped_traces));
+    add_assoc_long(&worker, "exporter_dropped_bytes", (zend_long)TRACE_G(exporter_dropped_bytes));
+    
+    array_init(return_value);
+    add_assoc_zval(return_value, "request", &request);
+    add_assoc_zval(return_value, "worker", &worker);
 }
 
-PHP_FUNCTION(trace_get_current_span)
+// 指标模式下按函数聚合的统计：函数名 => [calls, inclusive_ns, exclusive_ns, min_ns, max_ns, 分位数...]
+// $with_histogram 为true时附带非空的直方图桶（桶下界ns => 次数）
+PHP_FUNCTION(trace_get_function_stats)
 {
-    if (TRACE_G(current_span)) {
-        array_init(return_value);
-        add_assoc_str(return_value, "span_id", zend_string_copy(TRACE_G(current_span)->span_id));
-        add_assoc_str(return_value, "operation_name", zend_string_copy(TRACE_G(current_span)->operation_name));
-        add_assoc_double(return_value, "start_time", TRACE_G(current_span)->start_time);
-        if (TRACE_G(current_span)->parent_id) {
-            add_assoc_str(return_value, "parent_id", zend_string_copy(TRACE_G(current_span)->parent_id));
-        } else {
-            add_assoc_null(return_value, "parent_id");
-        }
+    zend_bool with_histogram = 0;
+    trace_func_stats_t *stats;
+    
+    ZEND_PARSE_PARAMETERS_START(0, 1)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_BOOL(with_histogram)
+    ZEND_PARSE_PARAMETERS_END();
+    
+    array_init(return_value);
+    if (!TRACE_G(function_stats)) {
         return;
     }
-    RETURN_NULL();
+    
+    ZEND_HASH_FOREACH_PTR(TRACE_G(function_stats), stats) {
+        zval entry;
+        
+        if (stats->calls == 0) {
+            continue;
+        }
+        array_init(&entry);
+        add_assoc_long(&entry, "calls", (zend_long)stats->calls);
+        add_assoc_long(&entry, "inclusive_ns", (zend_long)stats->inclusive_ns);
+        add_assoc_long(&entry, "exclusive_ns", (zend_long)stats->exclusive_ns);
+        add_assoc_long(&entry, "min_ns", (zend_long)stats->min_ns);
+        add_assoc_long(&entry, "max_ns", (zend_long)stats->max_ns);
+        add_assoc_long(&entry, "inclusive_p50_ns", (zend_long)trace_hist_percentile(stats->inclusive_hist, stats->calls, 0.50, stats->min_ns, stats->max_ns));
+        add_assoc_long(&entry, "inclusive_p90_ns", (zend_long)trace_hist_percentile(stats->inclusive_hist, stats->calls, 0.90, stats->min_ns, stats->max_ns));
+        add_assoc_long(&entry, "inclusive_p99_ns", (zend_long)trace_hist_percentile(stats->inclusive_hist, stats->calls, 0.99, stats->min_ns, stats->max_ns));
+        add_assoc_long(&entry, "exclusive_p50_ns", (zend_long)trace_hist_percentile(stats->exclusive_hist, stats->calls, 0.50, 0, stats->max_ns));
+        add_assoc_long(&entry, "exclusive_p90_ns", (zend_long)trace_hist_percentile(stats->exclusive_hist, stats->calls, 0.90, 0, stats->max_ns));
+        add_assoc_long(&entry, "exclusive_p99_ns", (zend_long)trace_hist_percentile(stats->exclusive_hist, stats->calls, 0.99, 0, stats->max_ns));
+        
+        if (with_histogram) {
+            zval inclusive, exclusive;
+            uint32_t i;
+            array_init(&inclusive);
+            array_init(&exclusive);
+            for (i = 0; i < TRACE_HIST_BUCKETS; i++) {
+                if (stats->inclusive_hist[i]) {
+                    add_index_long(&inclusive, (zend_ulong)trace_hist_lower(i), stats->inclusive_hist[i]);
+                }
+                if (stats->exclusive_hist[i]) {
+                    add_index_long(&exclusive, (zend_ulong)trace_hist_lower(i), stats->exclusive_hist[i]);
+                }
+            }
+            add_assoc_zval(&entry, "inclusive_histogram", &inclusive);
+            add_assoc_zval(&entry, "exclusive_histogram", &exclusive);
+        }
+        
+        // 不同函数同名时（例如同一个方法名经由不同的trampoline）不合并，后出现的键名追加序号
+        if (zend_hash_exists(Z_ARR_P(return_value), stats->name)) {
+            zend_string *key = zend_strpprintf(0, "%s#%u", ZSTR_VAL(stats->name), zend_hash_num_elements(Z_ARR_P(return_value)));
+            zend_hash_update(Z_ARR_P(return_value), key, &entry);
+            zend_string_release(key);
+        } else {
+            zend_hash_update(Z_ARR_P(return_value), stats->name, &entry);
+        }
+    } ZEND_HASH_FOREACH_END();
 }
 
-PHP_FUNCTION(trace_add_log)
+// 采样分析器记录的本请求折叠栈；未开启时为空字符串
+PHP_FUNCTION(trace_profiler_folded)
 {
-    char *level, *message;
-    size_t level_len, message_len;
+    ZEND_PARSE_PARAMETERS_NONE();
     
-    if (zend_parse_parameters(ZEND_NUM_ARGS(), "ss", &level, &level_len, &message, &message_len) == FAILURE) {
-        RETURN_FALSE;
-    }
+#if TRACE_HAVE_PROFILER
+    smart_str buf = {0};
     
-    if (TRACE_G(current_span) && TRACE_G(current_span)->logs) {
-        zval log_entry;
-        array_init(&log_entry);
-        add_assoc_string(&log_entry, "level", level);
-        add_assoc_string(&log_entry, "message", message);
-        add_assoc_double(&log_entry, "timestamp", trace_get_microtime());
-        
-        zend_hash_next_index_insert(TRACE_G(current_span)->logs, &log_entry);
-        RETURN_TRUE;
+    if (TRACE_G(profiler_samples)) {
+        trace_serialize_profile_folded(&buf);
     }
-    
+    if (!buf.s) {
+        RETURN_EMPTY_STRING();
+    }
+    RETURN_STR(smart_str_extract(&buf));
+#else
+    php_error_docref(NULL, E_WARNING, "当前平台不支持采样分析器（需要Linux timer_create，非ZTS）");
     RETURN_FALSE;
+#endif
 }
 
-PHP_FUNCTION(trace_get_spans)
+// 当前trace的折叠栈，可直接交给flamegraph.pl / speedscope
+PHP_FUNCTION(trace_export_folded)
 {
-    array_init(return_value);
+    smart_str buf = {0};
     
-    if (TRACE_G(trace_id)) {
-        add_assoc_str(return_value, "trace_id", zend_string_copy(TRACE_G(trace_id)));
-    } else {
-        add_assoc_string(return_value, "trace_id", "");
+    ZEND_PARSE_PARAMETERS_NONE();
+    
+    trace_serialize_folded(&buf);
+    if (!buf.s) {
+        RETURN_EMPTY_STRING();
     }
+    RETURN_STR(smart_str_extract(&buf));
+}
+
+// 原生序列化当前trace：otlp-json、otlp-proto（ExportTraceServiceRequest），或与导出器相同的ndjson
+PHP_FUNCTION(trace_export)
+{
+    zend_string *format = NULL;
     
-    zval spans_array;
-    array_init(&spans_array);
+    ZEND_PARSE_PARAMETERS_START(0, 1)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_STR(format)
+    ZEND_PARSE_PARAMETERS_END();
     
-    if (TRACE_G(all_spans)) {
-        zval *span_zval;
-        ZEND_HASH_FOREACH_VAL(TRACE_G(all_spans), span_zval) {
-            trace_span_t *span = (trace_span_t*)Z_PTR_P(span_zval);
-            if (span) {
-                zval span_data;
-                array_init(&span_data);
-                
-                add_assoc_str(&span_data, "span_id", zend_string_copy(span->span_id));
-                add_assoc_str(&span_data, "operation_name", zend_string_copy(span->operation_name));
-                add_assoc_double(&span_data, "start_time", span->start_time);
-                add_assoc_double(&span_data, "end_time", span->end_time);
-                add_assoc_double(&span_data, "duration", span->end_time > 0 ? span->end_time - span->start_time : 0.0);
-                
-                if (span->parent_id) {
-                    add_assoc_str(&span_data, "parent_id", zend_string_copy(span->parent_id));
-                } else {
-                    add_assoc_null(&span_data, "parent_id");
-                }
-                
-                // 添加tags
-                zval tags_array;
-                array_init(&tags_array);
-                
-                if (span->tags) {
-                    zend_string *tag_key;
-                    zval *tag_val;
-                    ZEND_HASH_FOREACH_STR_KEY_VAL(span->tags, tag_key, tag_val) {
-                        if (tag_key) {
-                            zval tag_copy;
-                            ZVAL_COPY(&tag_copy, tag_val);
-                            zend_hash_add(Z_ARR(tags_array), tag_key, &tag_copy);
-                        }
-                    } ZEND_HASH_FOREACH_END();
-                }
-                
-                add_assoc_zval(&span_data, "tags", &tags_array);
-                
-                // 添加logs
-                zval logs_array;
-                array_init(&logs_array);
-                
-                if (span->logs) {
-                    zval *log_entry;
-                    ZEND_HASH_FOREACH_VAL(span->logs, log_entry) {
-                        zval log_copy;
-                        ZVAL_COPY(&log_copy, log_entry);
-                        zend_hash_next_index_insert(Z_ARR(logs_array), &log_copy);
-                    } ZEND_HASH_FOREACH_END();
-                }
-                
-                add_assoc_zval(&span_data, "logs", &logs_array);
-                zend_hash_next_index_insert(Z_ARR(spans_array), &span_data);
-            }
-        } ZEND_HASH_FOREACH_END();
+    smart_str buf = {0};
+    
+    if (!format || zend_string_equals_literal(format, "otlp-json")) {
+        trace_serialize_otlp_json(&buf);
+    } else if (zend_string_equals_literal(format, "otlp-proto")) {
+        trace_serialize_otlp_proto(&buf);
+    } else if (zend_string_equals_literal(format, "ndjson")) {
+        trace_span_t *span;
+        TRACE_FOREACH_SPAN(span) {
+            trace_serialize_span_json(&buf, span);
+        } TRACE_FOREACH_SPAN_END();
+    } else {
+        php_error_docref(NULL, E_WARNING, "不支持的格式 %s，可选 otlp-json、otlp-proto、ndjson", ZSTR_VAL(format));
+        RETURN_FALSE;
     }
     
-    add_assoc_zval(return_value, "spans", &spans_array);
+    if (!buf.s) {
+        RETURN_EMPTY_STRING();
+    }
+    RETURN_STR(smart_str_extract(&buf));
 }
 
 PHP_FUNCTION(trace_set_callback_whitelist)
@@ -1178,12 +7416,15 @@ PHP_FUNCTION(trace_set_callback_whitelist)
         RETURN_FALSE;
     }
     
-    // 存储白名单规则
-    if (!Z_ISUNDEF(TRACE_G(trace_whitelist))) {
-        zval_dtor(&TRACE_G(trace_whitelist));
-    }
+    // 编译并存储白名单规则
+    trace_whitelist_free(TRACE_G(trace_whitelist));
+    TRACE_G(trace_whitelist) = trace_whitelist_compile(rules, "file_pattern", sizeof("file_pattern") - 1);
     
-    ZVAL_COPY(&TRACE_G(trace_whitelist), rules);
+    // 规则变化，之前的决策全部失效
+    trace_clear_decision_cache(TRACE_G(trace_decision_cache));
+#if TRACE_HAVE_OBSERVER
+    trace_observer_refresh(ZEND_USER_FUNCTION);
+#endif
     
     RETURN_TRUE;
 }
@@ -1198,16 +7439,61 @@ PHP_FUNCTION(trace_set_internal_whitelist)
         RETURN_FALSE;
     }
     
-    // 存储内部函数白名单规则
-    if (!Z_ISUNDEF(TRACE_G(internal_trace_whitelist))) {
-        zval_dtor(&TRACE_G(internal_trace_whitelist));
-    }
+    // 编译并存储内部函数白名单规则
+    trace_whitelist_free(TRACE_G(internal_trace_whitelist));
+    TRACE_G(internal_trace_whitelist) = trace_whitelist_compile(rules, "module_pattern", sizeof("module_pattern") - 1);
     
-    ZVAL_COPY(&TRACE_G(internal_trace_whitelist), rules);
+    // 规则变化，之前的决策全部失效
+    trace_clear_decision_cache(TRACE_G(internal_trace_decision_cache));
+#if TRACE_HAVE_OBSERVER
+    trace_observer_refresh(ZEND_INTERNAL_FUNCTION);
+#endif
     
     RETURN_TRUE;
 }
 
+// trace生命周期
+// 一个请求默认就是一个trace；CLI常驻进程用 trace_reset() 或 trace_begin_job()/trace_end_job() 划分
+
+// 开始新的trace：头部采样，采样时创建根span
+static void trace_start_trace(zend_string *name, int upstream_sampled)
+{
+    TRACE_G(sampled) = trace_sample_decide(upstream_sampled);
+    TRACE_G(tail_roll) = -1.0;
+    if (TRACE_G(sampled)) {
+        TRACE_G(root_span) = trace_create_span_ex(name, NULL);
+        TRACE_G(root_span)->parent_id = TRACE_G(upstream_parent_id);
+        TRACE_G(current_span) = TRACE_G(root_span);
+    }
+}
+
+// 结束当前trace：结束根span，按尾部采样决定是否导出，返回是否保留
+// span由调用方随后释放
+static int trace_finish_trace(void)
+{
+    if (TRACE_G(root_span)) {
+        trace_finish_span(TRACE_G(root_span));
+    }
+    
+    if (TRACE_G(debug_enabled) && (TRACE_G(overflow_calls) || TRACE_G(dropped_tags) || TRACE_G(dropped_logs))) {
+        trace_debug_log("[BUDGET] 超出预算：%" PRIu64 " 次调用被聚合，丢弃 %" PRIu64 " 个tag、%" PRIu64 " 条log（约 %zu 字节）",
+                        TRACE_G(overflow_calls), TRACE_G(dropped_tags), TRACE_G(dropped_logs), TRACE_G(memory_used));
+    }
+    
+    // 尾部采样：丢弃的trace不导出，随span块一起释放
+    TRACE_G(tail_keep) = trace_tail_evaluate();
+    if (TRACE_G(tail_keep)) {
+        trace_export_trace();
+    } else if (TRACE_G(sampled)) {
+        // 大多数请求都在这里被丢弃，只在开启debug时记录
+        if (TRACE_G(debug_enabled)) {
+            trace_debug_log("[TAIL] 丢弃trace（%u个span）", TRACE_G(span_count));
+        }
+        TRACE_G(stats).spans_discarded += TRACE_G(span_count);
+    }
+    return TRACE_G(tail_keep);
+}
+
 // 重置trace（用于CLI模式）
 PHP_FUNCTION(trace_reset)
 {
@@ -1225,57 +7511,216 @@ PHP_FUNCTION(trace_reset)
             trace_finish_span(TRACE_G(root_span));
         }
         
-        // 清理spans
-        if (TRACE_G(all_spans)) {
-            zval *span_zval;
-            ZEND_HASH_FOREACH_VAL(TRACE_G(all_spans), span_zval) {
-                trace_span_t *span = (trace_span_t*)Z_PTR_P(span_zval);
-                if (span) {
-                    if (span->span_id) zend_string_release(span->span_id);
-                    if (span->parent_id) zend_string_release(span->parent_id);
-                    if (span->operation_name) zend_string_release(span->operation_name);
-                    if (span->tags) {
-                        zend_hash_destroy(span->tags);
-                        FREE_HASHTABLE(span->tags);
-                    }
-                    if (span->logs) {
-                        zend_hash_destroy(span->logs);
-                        FREE_HASHTABLE(span->logs);
-                    }
-                    efree(span);
-                }
-            } ZEND_HASH_FOREACH_END();
-            
-            zend_hash_destroy(TRACE_G(all_spans));
-            FREE_HASHTABLE(TRACE_G(all_spans));
-        }
-        
-        // 重新初始化
-        TRACE_G(current_span) = NULL;
-        TRACE_G(root_span) = NULL;
-        TRACE_G(span_counter) = 0;
-        
-        ALLOC_HASHTABLE(TRACE_G(all_spans));
-        zend_hash_init(TRACE_G(all_spans), 8, NULL, ZVAL_PTR_DTOR, 0);
+        // 清理spans，新trace不再属于上游的调用链
+        trace_spans_free();
+        trace_clear_trace_context();
+        TRACE_G(job_active) = 0;
         
-        // 设置TraceID
-        if (trace_id && trace_id_len > 0) {
-            if (TRACE_G(trace_id)) {
-                zend_string_release(TRACE_G(trace_id));
-            }
-            TRACE_G(trace_id) = zend_string_init(trace_id, trace_id_len, 0);
+        // 设置TraceID（须为十六进制，否则重新生成）
+        uint64_t hi, lo;
+        if (trace_id && trace_id_len > 0 && trace_parse_trace_id(trace_id, trace_id_len, &hi, &lo) == SUCCESS) {
+            trace_set_trace_id(hi, lo);
         } else {
+            if (trace_id && trace_id_len > 0) {
+                trace_debug_log("[WARN] trace_reset: 无效的TraceID %s，重新生成", trace_id);
+            }
             trace_generate_ids();
         }
         
-        // 创建新的根span
-        TRACE_G(root_span) = trace_create_span("http.request", NULL);
-        TRACE_G(current_span) = TRACE_G(root_span);
+        // 每个trace重新做头部采样
+        zend_string *name = zend_string_init("http.request", sizeof("http.request") - 1, 0);
+        trace_start_trace(name, TRACE_SAMPLE_UNKNOWN);
+        zend_string_release(name);
+    }
+    
+    RETURN_TRUE;
+}
+
+// 开始一个任务（队列消费者、常驻worker）：丢弃之前的trace，以任务名为根span开始新的trace
+// $traceparent/$tracestate 为任务携带的上游上下文（如消息头中的值），与HTTP请求头的处理相同
+PHP_FUNCTION(trace_begin_job)
+{
+    zend_string *name;
+    zend_string *traceparent = NULL;
+    zend_string *tracestate = NULL;
+    int upstream_sampled = TRACE_SAMPLE_UNKNOWN;
+    
+    ZEND_PARSE_PARAMETERS_START(1, 3)
+        Z_PARAM_STR(name)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_STR_OR_NULL(traceparent)
+        Z_PARAM_STR_OR_NULL(tracestate)
+    ZEND_PARSE_PARAMETERS_END();
+    
+    if (!TRACE_G(enabled)) {
+        RETURN_FALSE;
+    }
+    if (TRACE_G(job_active)) {
+        php_error_docref(NULL, E_WARNING, "Job already started, call trace_end_job() first");
+        RETURN_FALSE;
+    }
+    
+    // 任务之外的调用（请求开始时的trace或上一个任务之后）不导出
+    trace_spans_free();
+    trace_clear_trace_context();
+    
+    if (traceparent && ZSTR_LEN(traceparent) > 0) {
+        upstream_sampled = trace_apply_trace_context(ZSTR_VAL(traceparent), ZSTR_LEN(traceparent),
+                                                     tracestate ? ZSTR_VAL(tracestate) : NULL,
+                                                     tracestate ? ZSTR_LEN(tracestate) : 0);
+    }
+    if (upstream_sampled == TRACE_SAMPLE_UNKNOWN) {
+        trace_generate_ids();
     }
     
+    trace_start_trace(name, upstream_sampled);
+    TRACE_G(job_active) = 1;
     RETURN_TRUE;
 }
 
+// 结束任务：导出任务的trace（按尾部采样），span存储块放回复用池
+// $failed 为true时根span带 error 标记（trace.tail_keep_errors 据此保留）
+// 返回trace是否被保留导出
+PHP_FUNCTION(trace_end_job)
+{
+    zend_bool failed = 0;
+    int kept;
+    
+    ZEND_PARSE_PARAMETERS_START(0, 1)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_BOOL(failed)
+    ZEND_PARSE_PARAMETERS_END();
+    
+    if (!TRACE_G(job_active)) {
+        php_error_docref(NULL, E_WARNING, "No job started, call trace_begin_job() first");
+        RETURN_FALSE;
+    }
+    
+    if (failed && TRACE_G(root_span)) {
+        trace_span_set_error(TRACE_G(root_span));
+    }
+    kept = trace_finish_trace();
+    
+    trace_spans_free();
+    trace_clear_trace_context();
+    trace_cache_last_clear();
+    TRACE_G(job_active) = 0;
+    
+    // 每个任务按一个请求计入自身开销统计
+    trace_stats_add(&TRACE_G(worker_stats), &TRACE_G(stats));
+    TRACE_G(worker_requests)++;
+    memset(&TRACE_G(stats), 0, sizeof(trace_stats_t));
+    
+    // 任务之间不采样：钩子直接返回，不积累span；保留一个TraceID供日志关联
+    TRACE_G(sampled) = 0;
+    trace_generate_ids();
+    
+    RETURN_BOOL(kept);
+}
+
+// 向下游传递的W3C Trace Context请求头
+// $as_list 为true时返回 ["traceparent: ...", ...]，可直接用于 CURLOPT_HTTPHEADER
+PHP_FUNCTION(trace_get_propagation_headers)
+{
+    zend_bool as_list = 0;
+    
+    ZEND_PARSE_PARAMETERS_START(0, 1)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_BOOL(as_list)
+    ZEND_PARSE_PARAMETERS_END();
+    
+    array_init(return_value);
+    
+    if (!TRACE_G(enabled) || (!TRACE_G(trace_id_hi) && !TRACE_G(trace_id_lo))) {
+        return;
+    }
+    
+    // parent-id：当前span；未采样时沿用上游的parent-id，都没有时随机生成
+    uint64_t parent_id;
+    if (TRACE_G(current_span)) {
+        parent_id = TRACE_G(current_span)->span_id;
+    } else if (TRACE_G(upstream_parent_id)) {
+        parent_id = TRACE_G(upstream_parent_id);
+    } else {
+        parent_id = trace_random_id();
+    }
+    
+    // "traceparent: " + 55个字符
+    char buf[sizeof("traceparent: ") - 1 + TRACE_TRACEPARENT_LEN];
+    char *header = buf + sizeof("traceparent: ") - 1;
+    memcpy(buf, "traceparent: ", sizeof("traceparent: ") - 1);
+    trace_format_traceparent(header, parent_id);
+    
+    if (as_list) {
+        add_next_index_stringl(return_value, buf, sizeof(buf));
+        if (TRACE_G(tracestate)) {
+            zend_string *line = zend_string_concat2("tracestate: ", sizeof("tracestate: ") - 1,
+                                                    ZSTR_VAL(TRACE_G(tracestate)), ZSTR_LEN(TRACE_G(tracestate)));
+            add_next_index_str(return_value, line);
+        }
+    } else {
+        add_assoc_stringl(return_value, "traceparent", header, TRACE_TRACEPARENT_LEN);
+        if (TRACE_G(tracestate)) {
+            add_assoc_str(return_value, "tracestate", zend_string_copy(TRACE_G(tracestate)));
+        }
+    }
+}
+
+// 按尾部采样策略判断当前trace是否应该保留（可在shutdown函数中导出前调用）
+PHP_FUNCTION(trace_tail_sample)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    RETURN_BOOL(trace_tail_evaluate());
+}
+
+// 从共享内存环中取出已提交的trace（NDJSON），供单独的消费进程批量发给采集端
+PHP_FUNCTION(trace_ring_consume)
+{
+    zend_long max_bytes = 1048576;
+    zend_string *name = NULL;
+    
+    ZEND_PARSE_PARAMETERS_START(0, 2)
+        Z_PARAM_OPTIONAL
+        Z_PARAM_LONG(max_bytes)
+        Z_PARAM_STR_OR_NULL(name)
+    ZEND_PARSE_PARAMETERS_END();
+    
+#ifdef HAVE_SHM_OPEN
+    char shm_name[NAME_MAX];
+    const char *target = name ? ZSTR_VAL(name) : TRACE_G(exporter);
+    if (!trace_ring_parse_name(target, shm_name, sizeof(shm_name))) {
+        php_error_docref(NULL, E_WARNING, "需要 shm://name 形式的环名称");
+        RETURN_FALSE;
+    }
+    if (!trace_ring_attach(shm_name)) {
+        RETURN_FALSE;
+    }
+    if (!trace_ring_lock_consumer()) {
+        php_error_docref(NULL, E_WARNING, "环 %s 已有其他消费进程 (pid %u)", shm_name, trace_ring->consumer_pid);
+        RETURN_FALSE;
+    }
+    
+    smart_str out = {0};
+    trace_ring_read(&out, max_bytes > 0 ? (size_t)max_bytes : 1048576);
+    if (!out.s) {
+        RETURN_EMPTY_STRING();
+    }
+    RETURN_STR(smart_str_extract(&out));
+#else
+    (void)max_bytes;
+    (void)name;
+    php_error_docref(NULL, E_WARNING, "当前平台不支持共享内存导出");
+    RETURN_FALSE;
+#endif
+}
+
+// 当前请求是否被采样
+PHP_FUNCTION(trace_is_sampled)
+{
+    ZEND_PARSE_PARAMETERS_NONE();
+    RETURN_BOOL(TRACE_G(enabled) && TRACE_G(sampled));
+}
+
 // 向当前Span添加tag
 PHP_FUNCTION(trace_add_tag)
 {
@@ -1286,11 +7731,14 @@ PHP_FUNCTION(trace_add_tag)
         RETURN_FALSE;
     }
     
-    if (TRACE_G(current_span) && TRACE_G(current_span)->tags) {
+    if (TRACE_G(current_span)) {
         zval tag_value;
-        ZVAL_STRING(&tag_value, value);
-        zend_hash_str_update(TRACE_G(current_span)->tags, key, key_len, &tag_value);
-        RETURN_TRUE;
+        zend_string *tag_key = zend_string_init(key, key_len, 0);
+        ZVAL_STRINGL(&tag_value, value, value_len);
+        int added = trace_span_set_tag(TRACE_G(current_span), tag_key, &tag_value, 1);
+        zval_ptr_dtor_str(&tag_value);
+        zend_string_release(tag_key);
+        RETURN_BOOL(added);
     }
     
     RETURN_FALSE;
@@ -1307,14 +7755,54 @@ const zend_function_entry trace_functions[] = {
     PHP_FE(trace_set_callback_whitelist, arginfo_trace_set_callback_whitelist)
     PHP_FE(trace_set_internal_whitelist, arginfo_trace_set_callback_whitelist)
     PHP_FE(trace_reset, arginfo_trace_reset)
+    PHP_FE(trace_begin_job, arginfo_trace_begin_job)
+    PHP_FE(trace_end_job, arginfo_trace_end_job)
+    PHP_FE(trace_is_sampled, arginfo_trace_is_sampled)
+    PHP_FE(trace_get_propagation_headers, arginfo_trace_get_propagation_headers)
+    PHP_FE(trace_tail_sample, arginfo_trace_tail_sample)
+    PHP_FE(trace_ring_consume, arginfo_trace_ring_consume)
+    PHP_FE(trace_export, arginfo_trace_export)
+    PHP_FE(trace_export_folded, arginfo_trace_export_folded)
+    PHP_FE(trace_profiler_folded, arginfo_trace_profiler_folded)
+    PHP_FE(trace_spans, arginfo_trace_spans)
+    PHP_FE(trace_get_function_stats, arginfo_trace_get_function_stats)
+    PHP_FE(trace_get_stats, arginfo_trace_get_stats)
     PHP_FE_END
 };
 
 // INI配置
 PHP_INI_BEGIN()
     STD_PHP_INI_BOOLEAN("trace.enabled", "1", PHP_INI_ALL, OnUpdateBool, enabled, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.cli_enabled", "0", PHP_INI_SYSTEM, OnUpdateBool, cli_enabled, zend_trace_globals, trace_globals)
     STD_PHP_INI_BOOLEAN("trace.debug_enabled", "0", PHP_INI_ALL, OnUpdateBool, debug_enabled, zend_trace_globals, trace_globals)
     STD_PHP_INI_ENTRY("trace.debug_log_path", "/tmp/php_trace_debug.log", PHP_INI_ALL, OnUpdateString, debug_log_path, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.hook_mode", "observer", PHP_INI_SYSTEM, OnUpdateString, hook_mode, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.clock", "monotonic", PHP_INI_SYSTEM, OnUpdateString, clock_source, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.sample_rate", "1.0", PHP_INI_PERDIR, OnUpdateReal, sample_rate, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.rate_limit", "0", PHP_INI_SYSTEM, OnUpdateLong, rate_limit, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.sampling_honor_upstream", "1", PHP_INI_PERDIR, OnUpdateBool, sampling_honor_upstream, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.exporter", "", PHP_INI_SYSTEM, OnUpdateString, exporter, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.exporter_max_datagram", "65000", PHP_INI_SYSTEM, OnUpdateLong, exporter_max_datagram, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.ring_size", "16M", PHP_INI_SYSTEM, OnUpdateLong, ring_size, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.tail_sampling", "0", PHP_INI_PERDIR, OnUpdateBool, tail_sampling, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.tail_latency_ms", "0", PHP_INI_PERDIR, OnUpdateLong, tail_latency_ms, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.tail_keep_errors", "1", PHP_INI_PERDIR, OnUpdateBool, tail_keep_errors, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.tail_routes", "", PHP_INI_PERDIR, OnUpdateString, tail_routes, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.tail_base_rate", "0.05", PHP_INI_PERDIR, OnUpdateReal, tail_base_rate, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.max_spans", "10000", PHP_INI_PERDIR, OnUpdateLong, max_spans, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.max_tags_per_span", "64", PHP_INI_PERDIR, OnUpdateLong, max_tags_per_span, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.max_logs_per_span", "64", PHP_INI_PERDIR, OnUpdateLong, max_logs_per_span, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.max_memory", "16M", PHP_INI_PERDIR, OnUpdateLong, max_memory, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.mode", "spans", PHP_INI_PERDIR, OnUpdateString, mode, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.profiler", "0", PHP_INI_PERDIR, OnUpdateBool, profiler, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.profiler_interval_us", "10000", PHP_INI_PERDIR, OnUpdateLong, profiler_interval_us, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.profiler_clock", "cpu", PHP_INI_PERDIR, OnUpdateString, profiler_clock, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.profiler_buffer", "512K", PHP_INI_PERDIR, OnUpdateLong, profiler_buffer, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.curl", "1", PHP_INI_PERDIR, OnUpdateBool, curl_enabled, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.curl_propagate", "1", PHP_INI_PERDIR, OnUpdateBool, curl_propagate, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.db", "1", PHP_INI_PERDIR, OnUpdateBool, db_enabled, zend_trace_globals, trace_globals)
+    STD_PHP_INI_ENTRY("trace.db_fingerprint_cache", "4096", PHP_INI_SYSTEM, OnUpdateLong, db_fingerprint_cache, zend_trace_globals, trace_globals)
+    STD_PHP_INI_BOOLEAN("trace.cache", "1", PHP_INI_PERDIR, OnUpdateBool, cache_enabled, zend_trace_globals, trace_globals)
 PHP_INI_END()
 
 // 全局变量初始化
@@ -1323,42 +7811,194 @@ static void php_trace_init_globals(zend_trace_globals *trace_globals)
     trace_globals->enabled = 1;
     trace_globals->debug_enabled = 0;
     trace_globals->debug_log_path = NULL;
-    trace_globals->trace_id = NULL;
+    trace_globals->exporter = NULL;
+    trace_globals->exporter_max_datagram = 65000;
+    trace_globals->ring_size = 16 * 1024 * 1024;
+    trace_globals->exporter_fd = -1;
+    trace_globals->exporter_socktype = SOCK_DGRAM;
+    trace_globals->exporter_pid = 0;
+    trace_globals->exporter_retry_ns = 0;
+    trace_globals->exporter_pending = NULL;
+    trace_globals->exporter_pending_len = 0;
+    trace_globals->exporter_sent_traces = 0;
+    trace_globals->exporter_sent_bytes = 0;
+    trace_globals->exporter_dropped_traces = 0;
+    trace_globals->exporter_dropped_bytes = 0;
+    trace_globals->sampled = 0;
+    trace_globals->tail_sampling = 0;
+    trace_globals->tail_latency_ms = 0;
+    trace_globals->tail_keep_errors = 1;
+    trace_globals->tail_routes = NULL;
+    trace_globals->tail_base_rate = 0.05;
+    trace_globals->tail_roll = -1.0;
+    trace_globals->tail_keep = 0;
+    trace_globals->sampling_honor_upstream = 1;
+    trace_globals->upstream_parent_id = 0;
+    trace_globals->tracestate = NULL;
+    trace_globals->sample_rate = 1.0;
+    trace_globals->rate_limit = 0;
+    trace_globals->rate_tokens = 0.0;
+    trace_globals->rate_last_ns = 0;
+    trace_globals->trace_id_hi = 0;
+    trace_globals->trace_id_lo = 0;
+    trace_globals->trace_id_str = NULL;
+    trace_prng_seed(trace_globals->prng_state);
+    trace_globals->prng_pid = getpid();
     trace_globals->service_name = NULL;
     trace_globals->current_span = NULL;
     trace_globals->root_span = NULL;
-    trace_globals->all_spans = NULL;
-    trace_globals->span_counter = 0;
+    trace_globals->span_chunks = NULL;
+    trace_globals->span_chunks_tail = NULL;
+    trace_globals->span_count = 0;
+    trace_globals->span_generation = 0;
+    trace_globals->max_spans = 10000;
+    trace_globals->max_tags_per_span = 64;
+    trace_globals->max_logs_per_span = 64;
+    trace_globals->max_memory = 16 * 1024 * 1024;
+    trace_globals->memory_used = 0;
+    trace_globals->overflow_ops = NULL;
+    trace_globals->overflow_stack = NULL;
+    trace_globals->overflow_depth = 0;
+    trace_globals->overflow_size = 0;
+    trace_globals->overflow_calls = 0;
+    trace_globals->dropped_tags = 0;
+    trace_globals->dropped_logs = 0;
+    trace_globals->mode = NULL;
+    trace_globals->metrics_mode = 0;
+    trace_globals->function_stats = NULL;
+    trace_globals->metrics_stack = NULL;
+    trace_globals->metrics_depth = 0;
+    trace_globals->metrics_size = 0;
+    memset(&trace_globals->stats, 0, sizeof(trace_stats_t));
+    memset(&trace_globals->worker_stats, 0, sizeof(trace_stats_t));
+    trace_globals->worker_requests = 0;
+    trace_globals->profiler = 0;
+    trace_globals->profiler_interval_us = 10000;
+    trace_globals->profiler_clock = NULL;
+    trace_globals->profiler_buffer = 512 * 1024;
+    trace_globals->profiler_samples = NULL;
+    trace_globals->profiler_used = 0;
+    trace_globals->profiler_size = 0;
+    trace_globals->profiler_sample_count = 0;
+    trace_globals->profiler_dropped = 0;
+    trace_globals->profiler_frame_ids = NULL;
+    trace_globals->profiler_frames = NULL;
+    trace_globals->profiler_frame_count = 0;
+    trace_globals->profiler_frame_size = 0;
     trace_globals->in_trace_callback = 0;
     // 初始化请求级回调和白名单
     ZVAL_UNDEF(&trace_globals->function_enter_callback);
     ZVAL_UNDEF(&trace_globals->function_exit_callback);
+    ZVAL_UNDEF(&trace_globals->frame_enter_callback);
+    ZVAL_UNDEF(&trace_globals->frame_object);
     ZVAL_UNDEF(&trace_globals->curl_callback);
+    trace_globals->curl_handles = NULL;
+    trace_globals->curl_injecting = 0;
+    trace_globals->db_fingerprints = NULL;
+    trace_globals->mysqli_stmt_sql = NULL;
+    memset(&trace_globals->cache_last, 0, sizeof(trace_cache_last_t));
+    memset(&trace_globals->cache_batch, 0, sizeof(trace_cache_batch_t));
     ZVAL_UNDEF(&trace_globals->db_callback);
-    ZVAL_UNDEF(&trace_globals->trace_whitelist);
-    ZVAL_UNDEF(&trace_globals->internal_trace_whitelist);
+    trace_globals->trace_whitelist = NULL;
+    trace_globals->internal_trace_whitelist = NULL;
+    trace_globals->trace_decision_cache = NULL;
+    trace_globals->internal_trace_decision_cache = NULL;
+    trace_globals->hook_mode = NULL;
+    trace_globals->clock_source = NULL;
+    trace_globals->clock_wall_anchor_ns = 0;
+    trace_globals->clock_mono_anchor_ns = 0;
+    trace_globals->observer_frames = NULL;
+    trace_globals->observer_frame_count = 0;
+    trace_globals->observer_frame_size = 0;
+    trace_globals->observer_unobserved = NULL;
+    trace_globals->cli_enabled = 0;
+    trace_globals->job_active = 0;
+    trace_globals->span_chunk_pool = NULL;
+    trace_globals->span_chunk_pool_count = 0;
+    trace_globals->trampoline_decision.rule = NULL;
+    trace_globals->trampoline_decision.operation_name = NULL;
+}
+
+// 释放每个线程（ZTS）或进程的持久数据；NTS下ZEND_INIT_MODULE_GLOBALS不调用dtor，由MSHUTDOWN调用
+static void php_trace_shutdown_globals(zend_trace_globals *trace_globals)
+{
+    if (trace_globals->db_fingerprints) {
+        zend_hash_destroy(trace_globals->db_fingerprints);
+        pefree(trace_globals->db_fingerprints, 1);
+        trace_globals->db_fingerprints = NULL;
+    }
+    // 导出器连接和积压缓冲同样是每个线程一份；这里不能用TRACE_G，它只指向当前线程
+    if (trace_globals->exporter_fd >= 0) {
+        close(trace_globals->exporter_fd);
+        trace_globals->exporter_fd = -1;
+    }
+    if (trace_globals->exporter_pending) {
+        free(trace_globals->exporter_pending);
+        trace_globals->exporter_pending = NULL;
+    }
+    trace_globals->exporter_pending_len = 0;
 }
 
 // 模块初始化
 PHP_MINIT_FUNCTION(trace)
 {
-    ZEND_INIT_MODULE_GLOBALS(trace, php_trace_init_globals, NULL);
+    ZEND_INIT_MODULE_GLOBALS(trace, php_trace_init_globals, php_trace_shutdown_globals);
     REGISTER_INI_ENTRIES();
+    trace_register_frame_class();
+    trace_register_span_classes();
+    
+    if (TRACE_G(clock_source) && strcmp(TRACE_G(clock_source), "tsc") == 0) {
+        trace_clock_calibrate_tsc();
+    }
     
-    // 只在非CLI模式下启用函数调用钩子
+#if TRACE_HAVE_PROFILER
+    // 只在定时器触发时才会被调用，CLI下同样可用
+    original_zend_interrupt_function = zend_interrupt_function;
+    zend_interrupt_function = trace_profiler_interrupt;
+#endif
+    
+    // 原生埋点替换的是扩展函数本身，与钩子后端无关，CLI下同样安装
+    trace_curl_hooks_install();
+    trace_db_hooks_install();
+    trace_cache_hooks_install();
+    
+    // 默认只在非CLI模式下启用函数调用钩子；常驻的CLI进程（队列消费者、RoadRunner/Swoole worker）
+    // 设置 trace.cli_enabled = 1 后启用，用 trace_begin_job()/trace_end_job() 划分trace
     // 检查所有命令行相关的SAPI：cli, phpdbg, embed
     int is_cli = (strcmp(sapi_module.name, "cli") == 0 ||
                   strcmp(sapi_module.name, "phpdbg") == 0 ||
                   strcmp(sapi_module.name, "embed") == 0);
     
-    if (!is_cli) {
-        // Hook 用户函数（PHP代码）
-        original_zend_execute_ex = zend_execute_ex;
-        zend_execute_ex = trace_execute_ex;
-        
-        // Hook 内部函数（扩展函数：mysql、redis、curl等）
-        original_zend_execute_internal = zend_execute_internal;
-        zend_execute_internal = trace_execute_internal;
+#ifdef HAVE_SHM_OPEN
+    // 必须在FPM fork worker之前映射，worker继承同一块共享内存
+    // CLI进程（包括 trace.cli_enabled 的worker和消费进程）不创建：创建会替换FPM master的环，退出时还会删除它
+    if (!is_cli && trace_exporter_is_ring()) {
+        trace_ring_create(TRACE_G(exporter), TRACE_G(ring_size));
+    }
+#endif
+    
+    if (!is_cli || TRACE_G(cli_enabled)) {
+#if TRACE_HAVE_OBSERVER
+        // 默认使用Observer API：只为白名单命中的函数挂载处理器
+        if (!TRACE_G(hook_mode) || strcmp(TRACE_G(hook_mode), "execute_ex") != 0) {
+            trace_use_observer = 1;
+            zend_observer_fcall_register(trace_observer_fcall_init);
+#if PHP_VERSION_ID < 80200
+            // PHP 8.2之前Observer API不观察内部函数，内部函数仍通过zend_execute_internal跟踪
+            original_zend_execute_internal = zend_execute_internal;
+            zend_execute_internal = trace_execute_internal;
+#endif
+        } else
+#endif
+        {
+            // Hook 用户函数（PHP代码）
+            original_zend_execute_ex = zend_execute_ex;
+            zend_execute_ex = trace_execute_ex;
+            
+            // Hook 内部函数（扩展函数：mysql、redis、curl等）
+            original_zend_execute_internal = zend_execute_internal;
+            zend_execute_internal = trace_execute_internal;
+        }
     }
     
     return SUCCESS;
@@ -1375,6 +8015,23 @@ PHP_MSHUTDOWN_FUNCTION(trace)
         zend_execute_internal = original_zend_execute_internal;
     }
     
+    trace_handler_hooks_restore(trace_curl_hooks);
+    trace_handler_hooks_restore(trace_db_hooks);
+    trace_cache_hooks_restore();
+#ifndef ZTS
+    php_trace_shutdown_globals(&trace_globals);
+#endif
+#ifdef HAVE_SHM_OPEN
+    trace_ring_destroy();
+#endif
+#if TRACE_HAVE_PROFILER
+    zend_interrupt_function = original_zend_interrupt_function;
+    if (trace_profiler_timer_pid == getpid()) {
+        timer_delete(trace_profiler_timer);
+        trace_profiler_timer_pid = 0;
+    }
+#endif
+    
     UNREGISTER_INI_ENTRIES();
     return SUCCESS;
 }
@@ -1385,28 +8042,62 @@ PHP_RINIT_FUNCTION(trace)
     // 初始化回调和白名单（每个请求独立）
     ZVAL_UNDEF(&TRACE_G(function_enter_callback));
     ZVAL_UNDEF(&TRACE_G(function_exit_callback));
+    ZVAL_UNDEF(&TRACE_G(frame_enter_callback));
+    ZVAL_UNDEF(&TRACE_G(frame_object));
     ZVAL_UNDEF(&TRACE_G(curl_callback));
     ZVAL_UNDEF(&TRACE_G(db_callback));
-    ZVAL_UNDEF(&TRACE_G(trace_whitelist));
-    ZVAL_UNDEF(&TRACE_G(internal_trace_whitelist));
+    TRACE_G(trace_whitelist) = NULL;
+    TRACE_G(internal_trace_whitelist) = NULL;
+    TRACE_G(trace_decision_cache) = NULL;
+    TRACE_G(internal_trace_decision_cache) = NULL;
+    TRACE_G(observer_frames) = NULL;
+    TRACE_G(observer_frame_count) = 0;
+    TRACE_G(observer_frame_size) = 0;
+    TRACE_G(observer_unobserved) = NULL;
+    TRACE_G(job_active) = 0;
     TRACE_G(in_trace_callback) = 0;
+    TRACE_G(sampled) = 0;
+    TRACE_G(tail_roll) = -1.0;
+    TRACE_G(tail_keep) = 0;
+    TRACE_G(upstream_parent_id) = 0;
+    TRACE_G(tracestate) = NULL;
+    TRACE_G(metrics_mode) = TRACE_G(mode) && strcmp(TRACE_G(mode), "metrics") == 0;
+    memset(&TRACE_G(stats), 0, sizeof(trace_stats_t));
+    trace_clock_anchor();
+    
+    // fork出的子进程继承了父进程的PRNG状态，需要重新播种
+    if (TRACE_G(prng_pid) != getpid()) {
+        trace_prng_seed(TRACE_G(prng_state));
+        TRACE_G(prng_pid) = getpid();
+    }
     
     if (TRACE_G(enabled)) {
         TRACE_G(current_span) = NULL;
         TRACE_G(root_span) = NULL;
-        TRACE_G(span_counter) = 0;
+        TRACE_G(span_chunks) = NULL;
+        TRACE_G(span_chunks_tail) = NULL;
+        TRACE_G(span_count) = 0;
         
-        ALLOC_HASHTABLE(TRACE_G(all_spans));
-        zend_hash_init(TRACE_G(all_spans), 8, NULL, ZVAL_PTR_DTOR, 0);
-        
-        trace_generate_ids();
+        // 优先沿用上游的TraceID；未采样的请求同样有TraceID，用于日志关联
+        int upstream_sampled = trace_ingest_trace_context();
+        if (upstream_sampled == TRACE_SAMPLE_UNKNOWN) {
+            trace_generate_ids();
+        }
         
         if (!TRACE_G(service_name)) {
             TRACE_G(service_name) = zend_string_init("php-app", 7, 0);
         }
         
-        TRACE_G(root_span) = trace_create_span("http.request", NULL);
-        TRACE_G(current_span) = TRACE_G(root_span);
+        TRACE_G(sampled) = trace_sample_decide(upstream_sampled);
+        if (TRACE_G(sampled)) {
+            TRACE_G(root_span) = trace_create_span("http.request", NULL);
+            TRACE_G(root_span)->parent_id = TRACE_G(upstream_parent_id);
+            TRACE_G(current_span) = TRACE_G(root_span);
+        }
+        
+#if TRACE_HAVE_PROFILER
+        trace_profiler_start();
+#endif
     }
     
     return SUCCESS;
@@ -1415,43 +8106,32 @@ PHP_RINIT_FUNCTION(trace)
 // 请求关闭
 PHP_RSHUTDOWN_FUNCTION(trace)
 {
+#if TRACE_HAVE_PROFILER
+    // shutdown函数已经执行完，之后不再需要样本
+    trace_profiler_stop();
+#endif
+    
+    // 没有结束的任务和普通请求一样导出
     if (TRACE_G(enabled)) {
-        if (TRACE_G(root_span)) {
-            trace_finish_span(TRACE_G(root_span));
-        }
-        
-        if (TRACE_G(trace_id)) {
-            zend_string_release(TRACE_G(trace_id));
-            TRACE_G(trace_id) = NULL;
-        }
-        
-        if (TRACE_G(all_spans)) {
-            zval *span_zval;
-            ZEND_HASH_FOREACH_VAL(TRACE_G(all_spans), span_zval) {
-                trace_span_t *span = (trace_span_t*)Z_PTR_P(span_zval);
-                if (span) {
-                    if (span->span_id) zend_string_release(span->span_id);
-                    if (span->parent_id) zend_string_release(span->parent_id);
-                    if (span->operation_name) zend_string_release(span->operation_name);
-                    if (span->tags) {
-                        zend_hash_destroy(span->tags);
-                        FREE_HASHTABLE(span->tags);
-                    }
-                    if (span->logs) {
-                        zend_hash_destroy(span->logs);
-                        FREE_HASHTABLE(span->logs);
-                    }
-                    efree(span);
-                }
-            } ZEND_HASH_FOREACH_END();
-            
-            zend_hash_destroy(TRACE_G(all_spans));
-            FREE_HASHTABLE(TRACE_G(all_spans));
-            TRACE_G(all_spans) = NULL;
-        }
-        
-        TRACE_G(current_span) = NULL;
-        TRACE_G(root_span) = NULL;
+        trace_finish_trace();
+    }
+    
+    trace_set_trace_id(0, 0);
+    trace_clear_trace_context();
+    trace_spans_free();
+    trace_span_pool_free();
+    TRACE_G(job_active) = 0;
+    trace_metrics_free();
+    trace_curl_free();
+    trace_db_free();
+    trace_cache_free();
+    trace_stats_add(&TRACE_G(worker_stats), &TRACE_G(stats));
+    TRACE_G(worker_requests)++;
+    
+    // service_name在RINIT中按请求分配，请求结束后ZendMM会回收，不能留到下一个请求
+    if (TRACE_G(service_name)) {
+        zend_string_release(TRACE_G(service_name));
+        TRACE_G(service_name) = NULL;
     }
     
     // 清理回调和白名单（避免FPM进程复用时相互影响）
@@ -1463,6 +8143,14 @@ PHP_RSHUTDOWN_FUNCTION(trace)
         zval_dtor(&TRACE_G(function_exit_callback));
         ZVAL_UNDEF(&TRACE_G(function_exit_callback));
     }
+    if (!Z_ISUNDEF(TRACE_G(frame_enter_callback))) {
+        zval_dtor(&TRACE_G(frame_enter_callback));
+        ZVAL_UNDEF(&TRACE_G(frame_enter_callback));
+    }
+    if (!Z_ISUNDEF(TRACE_G(frame_object))) {
+        zval_ptr_dtor(&TRACE_G(frame_object));
+        ZVAL_UNDEF(&TRACE_G(frame_object));
+    }
     if (!Z_ISUNDEF(TRACE_G(curl_callback))) {
         zval_dtor(&TRACE_G(curl_callback));
         ZVAL_UNDEF(&TRACE_G(curl_callback));
@@ -1471,13 +8159,24 @@ PHP_RSHUTDOWN_FUNCTION(trace)
         zval_dtor(&TRACE_G(db_callback));
         ZVAL_UNDEF(&TRACE_G(db_callback));
     }
-    if (!Z_ISUNDEF(TRACE_G(trace_whitelist))) {
-        zval_dtor(&TRACE_G(trace_whitelist));
-        ZVAL_UNDEF(&TRACE_G(trace_whitelist));
+    trace_whitelist_free(TRACE_G(trace_whitelist));
+    TRACE_G(trace_whitelist) = NULL;
+    trace_whitelist_free(TRACE_G(internal_trace_whitelist));
+    TRACE_G(internal_trace_whitelist) = NULL;
+    trace_free_decision_cache(&TRACE_G(trace_decision_cache));
+    trace_free_decision_cache(&TRACE_G(internal_trace_decision_cache));
+    
+    // 清理Observer调用栈（exit/致命错误时可能有未出栈的记录）
+    if (TRACE_G(observer_frames)) {
+        efree(TRACE_G(observer_frames));
+        TRACE_G(observer_frames) = NULL;
     }
-    if (!Z_ISUNDEF(TRACE_G(internal_trace_whitelist))) {
-        zval_dtor(&TRACE_G(internal_trace_whitelist));
-        ZVAL_UNDEF(&TRACE_G(internal_trace_whitelist));
+    TRACE_G(observer_frame_count) = 0;
+    TRACE_G(observer_frame_size) = 0;
+    if (TRACE_G(observer_unobserved)) {
+        zend_hash_destroy(TRACE_G(observer_unobserved));
+        FREE_HASHTABLE(TRACE_G(observer_unobserved));
+        TRACE_G(observer_unobserved) = NULL;
     }
     
     return SUCCESS;
@@ -1490,13 +8189,82 @@ PHP_MINFO_FUNCTION(trace)
     php_info_print_table_header(2, "Trace Extension", "enabled");
     php_info_print_table_row(2, "Version", PHP_TRACE_VERSION);
     php_info_print_table_row(2, "Author", "ziyue.wen");
+    php_info_print_table_row(2, "Hook Mode", trace_use_observer ? "observer" : (original_zend_execute_ex ? "execute_ex" : "disabled (CLI)"));
+    php_info_print_table_row(2, "Clock", trace_clock_tsc ? "tsc" : "monotonic");
+    
+    char sampling_str[64];
+    snprintf(sampling_str, sizeof(sampling_str), "rate=%g, limit=" ZEND_LONG_FMT "/s", TRACE_G(sample_rate), TRACE_G(rate_limit));
+    php_info_print_table_row(2, "Sampling", sampling_str);
+    
+    char limits_str[128];
+    snprintf(limits_str, sizeof(limits_str), "spans=" ZEND_LONG_FMT ", tags=" ZEND_LONG_FMT ", logs=" ZEND_LONG_FMT ", memory=" ZEND_LONG_FMT,
+             TRACE_G(max_spans), TRACE_G(max_tags_per_span), TRACE_G(max_logs_per_span), TRACE_G(max_memory));
+    php_info_print_table_row(2, "Budget", limits_str);
+    php_info_print_table_row(2, "Mode", TRACE_G(mode) && *TRACE_G(mode) ? TRACE_G(mode) : "spans");
+#if TRACE_HAVE_PROFILER
+    if (TRACE_G(profiler)) {
+        char profiler_str[96];
+        snprintf(profiler_str, sizeof(profiler_str), "interval=" ZEND_LONG_FMT "us, clock=%s, buffer=" ZEND_LONG_FMT,
+                 TRACE_G(profiler_interval_us), TRACE_G(profiler_clock) && *TRACE_G(profiler_clock) ? TRACE_G(profiler_clock) : "cpu",
+                 TRACE_G(profiler_buffer));
+        php_info_print_table_row(2, "Profiler", profiler_str);
+    } else {
+        php_info_print_table_row(2, "Profiler", "disabled");
+    }
+#else
+    php_info_print_table_row(2, "Profiler", "unsupported");
+#endif
+    
+    php_info_print_table_row(2, "Native Hooks (curl)",
+        !trace_curl_hooks[TRACE_HOOK_CURL_EXEC].original ? "not loaded"
+        : (TRACE_G(curl_enabled) ? (TRACE_G(curl_propagate) ? "enabled, propagating" : "enabled") : "disabled"));
+    {
+        char db_str[128];
+        snprintf(db_str, sizeof(db_str), "%s%s%s, %u fingerprints cached",
+                 TRACE_G(db_enabled) ? "enabled" : "disabled",
+                 trace_db_hooks[TRACE_HOOK_PDO_QUERY].original ? ", pdo" : "",
+                 trace_db_hooks[TRACE_HOOK_MYSQLI_QUERY].original ? ", mysqli" : "",
+                 TRACE_G(db_fingerprints) ? zend_hash_num_elements(TRACE_G(db_fingerprints)) : 0);
+        php_info_print_table_row(2, "Native Hooks (db)", db_str);
+        snprintf(db_str, sizeof(db_str), "%s, %u methods", TRACE_G(cache_enabled) ? "enabled" : "disabled",
+                 trace_cache_hook_count);
+        php_info_print_table_row(2, "Native Hooks (cache)", db_str);
+    }
+    
+    if (TRACE_G(exporter) && *TRACE_G(exporter)) {
+        char exporter_str[128];
+        php_info_print_table_row(2, "Exporter", TRACE_G(exporter));
+        snprintf(exporter_str, sizeof(exporter_str), "%" PRIu64 " traces, %" PRIu64 " bytes",
+                 TRACE_G(exporter_sent_traces), TRACE_G(exporter_sent_bytes));
+        php_info_print_table_row(2, "Exporter Sent (worker)", exporter_str);
+        snprintf(exporter_str, sizeof(exporter_str), "%" PRIu64 " traces, %" PRIu64 " bytes",
+                 TRACE_G(exporter_dropped_traces), TRACE_G(exporter_dropped_bytes));
+        php_info_print_table_row(2, "Exporter Dropped (worker)", exporter_str);
+#ifdef HAVE_SHM_OPEN
+        if (trace_ring) {
+            uint64_t used = __atomic_load_n(&trace_ring->write_pos, __ATOMIC_RELAXED)
+                          - __atomic_load_n(&trace_ring->read_pos, __ATOMIC_RELAXED);
+            snprintf(exporter_str, sizeof(exporter_str), "%" PRIu64 " / %" PRIu64 " bytes used",
+                     used, trace_ring->capacity);
+            php_info_print_table_row(2, "Ring", exporter_str);
+            snprintf(exporter_str, sizeof(exporter_str), "%" PRIu64 " written, %" PRIu64 " dropped, %" PRIu64 " skipped",
+                     __atomic_load_n(&trace_ring->written_records, __ATOMIC_RELAXED),
+                     __atomic_load_n(&trace_ring->dropped_records, __ATOMIC_RELAXED),
+                     __atomic_load_n(&trace_ring->skipped_records, __ATOMIC_RELAXED));
+            php_info_print_table_row(2, "Ring Records (all workers)", exporter_str);
+        }
+#endif
+    } else {
+        php_info_print_table_row(2, "Exporter", "disabled");
+    }
     php_info_print_table_end();
     
     php_info_print_table_start();
     php_info_print_table_header(2, "Current Request", "Value");
     
-    if (TRACE_G(trace_id)) {
-        php_info_print_table_row(2, "Trace ID", ZSTR_VAL(TRACE_G(trace_id)));
+    zend_string *trace_id = trace_get_trace_id_str();
+    if (trace_id) {
+        php_info_print_table_row(2, "Trace ID", ZSTR_VAL(trace_id));
     } else {
         php_info_print_table_row(2, "Trace ID", "Not initialized");
     }
@@ -1507,27 +8275,52 @@ PHP_MINFO_FUNCTION(trace)
         php_info_print_table_row(2, "Service Name", "Not set");
     }
     
+    php_info_print_table_row(2, "Sampled", TRACE_G(sampled) ? "Yes" : "No");
+    
     char span_count_str[32];
-    if (TRACE_G(all_spans)) {
-        snprintf(span_count_str, sizeof(span_count_str), "%d", zend_hash_num_elements(TRACE_G(all_spans)));
-        php_info_print_table_row(2, "Total Spans", span_count_str);
-    } else {
-        php_info_print_table_row(2, "Total Spans", "0");
-    }
+    snprintf(span_count_str, sizeof(span_count_str), "%u", TRACE_G(span_count));
+    php_info_print_table_row(2, "Total Spans", span_count_str);
+    
+    char budget_str[128];
+    snprintf(budget_str, sizeof(budget_str), "%zu bytes, %" PRIu64 " overflowed calls, %" PRIu64 " tags / %" PRIu64 " logs dropped",
+             TRACE_G(memory_used), TRACE_G(overflow_calls), TRACE_G(dropped_tags), TRACE_G(dropped_logs));
+    php_info_print_table_row(2, "Budget Used", budget_str);
     
     if (TRACE_G(current_span)) {
         php_info_print_table_row(2, "Current Span", ZSTR_VAL(TRACE_G(current_span)->operation_name));
-        php_info_print_table_row(2, "Current Span ID", ZSTR_VAL(TRACE_G(current_span)->span_id));
+        char span_id_str[17];
+        trace_format_hex64(span_id_str, TRACE_G(current_span)->span_id);
+        span_id_str[16] = '\0';
+        php_info_print_table_row(2, "Current Span ID", span_id_str);
     } else {
         php_info_print_table_row(2, "Current Span", "None");
     }
     
     php_info_print_table_end();
     
+    // 扩展自身开销：本请求与本worker（phpinfo只能看到处理当前请求的worker）
+    trace_stats_t current;
+    char request_str[32], worker_str[32];
+    size_t i;
+    trace_stats_current(&current);
+    php_info_print_table_start();
+    php_info_print_table_header(3, "Self Overhead", "Request", "Worker");
+    snprintf(worker_str, sizeof(worker_str), "%" PRIu64, TRACE_G(worker_requests));
+    php_info_print_table_row(3, "requests", "-", worker_str);
+    for (i = 0; i < sizeof(trace_stats_fields) / sizeof(trace_stats_fields[0]); i++) {
+        snprintf(request_str, sizeof(request_str), "%" PRIu64,
+                 *(const uint64_t *)((const char *)&current + trace_stats_fields[i].offset));
+        snprintf(worker_str, sizeof(worker_str), "%" PRIu64,
+                 *(const uint64_t *)((const char *)&TRACE_G(worker_stats) + trace_stats_fields[i].offset));
+        php_info_print_table_row(3, trace_stats_fields[i].name, request_str, worker_str);
+    }
+    php_info_print_table_end();
+    
     php_info_print_table_start();
     php_info_print_table_header(2, "Callbacks", "Status");
     php_info_print_table_row(2, "function_enter", !Z_ISUNDEF(TRACE_G(function_enter_callback)) ? "Set" : "Not set");
     php_info_print_table_row(2, "function_exit", !Z_ISUNDEF(TRACE_G(function_exit_callback)) ? "Set" : "Not set");
+    php_info_print_table_row(2, "frame_enter", !Z_ISUNDEF(TRACE_G(frame_enter_callback)) ? "Set" : "Not set");
     php_info_print_table_row(2, "curl", !Z_ISUNDEF(TRACE_G(curl_callback)) ? "Set" : "Not set");
     php_info_print_table_row(2, "database", !Z_ISUNDEF(TRACE_G(db_callback)) ? "Set" : "Not set");
     php_info_print_table_end();
@@ -1535,9 +8328,9 @@ PHP_MINFO_FUNCTION(trace)
     php_info_print_table_start();
     php_info_print_table_header(2, "Whitelist (User Functions)", "Status");
     
-    if (!Z_ISUNDEF(TRACE_G(trace_whitelist)) && Z_TYPE(TRACE_G(trace_whitelist)) == IS_ARRAY) {
+    if (TRACE_G(trace_whitelist)) {
         char rule_count_str[32];
-        snprintf(rule_count_str, sizeof(rule_count_str), "%d rules", zend_hash_num_elements(Z_ARR(TRACE_G(trace_whitelist))));
+        snprintf(rule_count_str, sizeof(rule_count_str), "%u rules", TRACE_G(trace_whitelist)->rule_count);
         php_info_print_table_row(2, "Rules (file_pattern)", rule_count_str);
     } else {
         php_info_print_table_row(2, "Rules (file_pattern)", "Not set");
@@ -1548,9 +8341,9 @@ PHP_MINFO_FUNCTION(trace)
     php_info_print_table_start();
     php_info_print_table_header(2, "Whitelist (Internal Functions)", "Status");
     
-    if (!Z_ISUNDEF(TRACE_G(internal_trace_whitelist)) && Z_TYPE(TRACE_G(internal_trace_whitelist)) == IS_ARRAY) {
+    if (TRACE_G(internal_trace_whitelist)) {
         char rule_count_str[32];
-        snprintf(rule_count_str, sizeof(rule_count_str), "%d rules", zend_hash_num_elements(Z_ARR(TRACE_G(internal_trace_whitelist))));
+        snprintf(rule_count_str, sizeof(rule_count_str), "%u rules", TRACE_G(internal_trace_whitelist)->rule_count);
         php_info_print_table_row(2, "Rules (module_pattern)", rule_count_str);
     } else {
         php_info_print_table_row(2, "Rules (module_pattern)", "Not set");
@@ -1566,6 +8359,7 @@ PHP_MINFO_FUNCTION(trace)
     php_info_print_table_row(2, "Logs Support", "Yes");
     php_info_print_table_row(2, "Whitelist Rules", "15 types");
     php_info_print_table_row(2, "CLI Mode (trace_reset)", "Yes");
+    php_info_print_table_row(2, "CLI Workers (trace_begin_job)", TRACE_G(cli_enabled) ? "Enabled" : "Disabled (trace.cli_enabled)");
     php_info_print_table_row(2, "OpenTelemetry Format", "Yes");
     php_info_print_table_row(2, "Debug Logging", "Yes");
     php_info_print_table_end();
@@ -1573,9 +8367,21 @@ PHP_MINFO_FUNCTION(trace)
     DISPLAY_INI_ENTRIES();
 }
 
+// 模块依赖：curl等扩展需要先于本扩展初始化，MINIT时才能找到要替换的函数
+static const zend_module_dep trace_deps[] = {
+    ZEND_MOD_OPTIONAL("curl")
+    ZEND_MOD_OPTIONAL("pdo")
+    ZEND_MOD_OPTIONAL("mysqli")
+    ZEND_MOD_OPTIONAL("redis")
+    ZEND_MOD_OPTIONAL("memcached")
+    ZEND_MOD_END
+};
+
 // 模块入口
 zend_module_entry trace_module_entry = {
-    STANDARD_MODULE_HEADER,
+    STANDARD_MODULE_HEADER_EX,
+    NULL,
+    trace_deps,
     "trace",
     trace_functions,
     PHP_MINIT(trace),